@@ -25,6 +25,7 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -597,7 +598,7 @@ int smartcommandhandler(ata_device * device, smart_command_set command, int sele
          in.direction==ata_cmd_in::data_out ? " OUT\n":"\n"));
 
     ata_cmd_out out;
-    bool ok = device->ata_pass_through(in, out);
+    bool ok = device->ata_pass_through_timed(in, out);
 
     if (con->reportataioctl && out.out_regs.is_set())
       print_regs(" Output: ", out.out_regs);
@@ -1062,10 +1063,10 @@ bool ataReadExtSelfTestLog(ata_device * device, ata_smart_extselftestlog * log,
 }
 
 
-// Read GP Log page(s)
-bool ataReadLogExt(ata_device * device, unsigned char logaddr,
-                   unsigned char features, unsigned page,
-                   void * data, unsigned nsectors)
+// Issue one READ LOG EXT command, return false on error
+static bool read_log_ext_sectors(ata_device * device, unsigned char logaddr,
+                                 unsigned char features, unsigned page,
+                                 void * data, unsigned nsectors)
 {
   ata_cmd_in in;
   in.in_regs.command      = ATA_READ_LOG_EXT;
@@ -1074,21 +1075,46 @@ bool ataReadLogExt(ata_device * device, unsigned char logaddr,
   in.in_regs.lba_low      = logaddr;
   in.in_regs.lba_mid_16   = page;
 
-  if (!device->ata_pass_through(in)) { // TODO: Debug output
-    if (nsectors <= 1) {
-      pout("ATA_READ_LOG_EXT (addr=0x%02x:0x%02x, page=%u, n=%u) failed: %s\n",
-           logaddr, features, page, nsectors, device->get_errmsg());
-      return false;
+  return device->ata_pass_through(in); // TODO: Debug output
+}
+
+// Read GP Log page(s)
+bool ataReadLogExt(ata_device * device, unsigned char logaddr,
+                   unsigned char features, unsigned page,
+                   void * data, unsigned nsectors)
+{
+  // Start with largest transfer size known to work on this device
+  unsigned chunk = nsectors;
+  unsigned max_sectors = device->get_max_log_ext_sectors();
+  if (max_sectors && chunk > max_sectors)
+    chunk = max_sectors;
+
+  for (unsigned i = 0; i < nsectors; ) {
+    unsigned n = nsectors - i;
+    if (n > chunk)
+      n = chunk;
+
+    if (read_log_ext_sectors(device, logaddr, features, page + i,
+                             (char *)data + 512*i, n)) {
+      i += n;
+      continue;
     }
 
-    // Recurse to retry with single sectors,
-    // multi-sector reads may not be supported by ioctl.
-    for (unsigned i = 0; i < nsectors; i++) {
-      if (!ataReadLogExt(device, logaddr,
-                         features, page + i,
-                         (char *)data + 512*i, 1))
-        return false;
+    // Retry with first sector only, multi-sector reads may not be
+    // supported by ioctl or limited by the bridge.  If this also
+    // fails, the error is not related to the transfer size.
+    if (n <= 1 || !read_log_ext_sectors(device, logaddr, features, page + i,
+                                        (char *)data + 512*i, 1)) {
+      pout("ATA_READ_LOG_EXT (addr=0x%02x:0x%02x, page=%u, n=1) failed: %s\n",
+           logaddr, features, page + i, device->get_errmsg());
+      return false;
     }
+    i++;
+
+    // Continue and remember next smaller power of 2
+    for (chunk = 1; chunk * 2 < n; chunk *= 2)
+      ;
+    device->set_max_log_ext_sectors(chunk);
   }
 
   return true;
@@ -1811,46 +1837,83 @@ static ata_attr_raw_format get_default_raw_format(unsigned char id)
   }
 }
 
+// Get byte order of attribute raw value.
+static const char * get_attr_byteorder(const ata_vendor_attr_defs::entry & def)
+{
+  // Use default byteorder if not specified
+  if (*def.byteorder)
+    return def.byteorder;
+  switch (def.raw_format) {
+    case RAWFMT_RAW64:
+    case RAWFMT_HEX64:
+      return "543210wv";
+    case RAWFMT_RAW24_DIV_RAW32:
+    case RAWFMT_MSEC24_HOUR32:
+      return "r543210";
+    default:
+      return "543210";
+  }
+}
+
+// Get offset of byte order character in attribute, -1 for zero byte.
+static int get_attr_byte_offset(char c)
+{
+  switch (c) {
+    case '0': case '1': case '2': case '3': case '4': case '5':
+              return offsetof(ata_smart_attribute, raw) + (c - '0');
+    case 'r': return offsetof(ata_smart_attribute, reserv);
+    case 'v': return offsetof(ata_smart_attribute, current);
+    case 'w': return offsetof(ata_smart_attribute, worst);
+    default : return -1;
+  }
+}
+
 // Get attribute raw value.
 uint64_t ata_get_attr_raw_value(const ata_smart_attribute & attr,
                                 const ata_vendor_attr_defs & defs)
 {
-  const ata_vendor_attr_defs::entry & def = defs[attr.id];
-
-  // Use default byteorder if not specified
-  const char * byteorder = def.byteorder;
-  if (!*byteorder) {
-    switch (def.raw_format) {
-      case RAWFMT_RAW64:
-      case RAWFMT_HEX64:
-        byteorder = "543210wv"; break;
-      case RAWFMT_RAW24_DIV_RAW32:
-      case RAWFMT_MSEC24_HOUR32:
-        byteorder = "r543210"; break;
-      default:
-        byteorder = "543210"; break;
-    }
-  }
+  const char * byteorder = get_attr_byteorder(defs[attr.id]);
+  const unsigned char * p = (const unsigned char *)&attr;
 
   // Build 64-bit value from selected bytes
   uint64_t rawvalue = 0;
   for (int i = 0; byteorder[i]; i++) {
-    unsigned char b;
-    switch (byteorder[i]) {
-      case '0': b = attr.raw[0];  break;
-      case '1': b = attr.raw[1];  break;
-      case '2': b = attr.raw[2];  break;
-      case '3': b = attr.raw[3];  break;
-      case '4': b = attr.raw[4];  break;
-      case '5': b = attr.raw[5];  break;
-      case 'r': b = attr.reserv;  break;
-      case 'v': b = attr.current; break;
-      case 'w': b = attr.worst;   break;
-      default : b = 0;            break;
-    }
-    rawvalue <<= 8; rawvalue |= b;
+    int offset = get_attr_byte_offset(byteorder[i]);
+    rawvalue <<= 8;
+    if (offset >= 0)
+      rawvalue |= p[offset];
+  }
+
+  return rawvalue;
+}
+
+ata_attr_raw_decoder::ata_attr_raw_decoder()
+{
+  memset(m_size, 0, sizeof(m_size));
+  memset(m_offset, -1, sizeof(m_offset));
+}
+
+void ata_attr_raw_decoder::init(const ata_vendor_attr_defs & defs)
+{
+  for (int id = 0; id < 256; id++) {
+    const char * byteorder = get_attr_byteorder(defs[id]);
+    int i;
+    for (i = 0; i < 8 && byteorder[i]; i++)
+      m_offset[id][i] = get_attr_byte_offset(byteorder[i]);
+    m_size[id] = i;
   }
+}
 
+uint64_t ata_attr_raw_decoder::get_raw_value(const ata_smart_attribute & attr) const
+{
+  const unsigned char * p = (const unsigned char *)&attr;
+  const signed char * offset = m_offset[attr.id];
+  uint64_t rawvalue = 0;
+  for (int i = 0; i < m_size[attr.id]; i++) {
+    rawvalue <<= 8;
+    if (offset[i] >= 0)
+      rawvalue |= p[offset[i]];
+  }
   return rawvalue;
 }
 
@@ -2402,7 +2465,7 @@ static int ataGetSetSCTErrorRecoveryControltime(ata_device * device, unsigned ty
     in.out_needed.sector_count = in.out_needed.lba_low = true;
 
   ata_cmd_out out;
-  if (!device->ata_pass_through(in, out)) {
+  if (!device->ata_pass_through_timed(in, out)) {
     pout("Error Write SCT Error Recovery Control Command failed: %s\n", device->get_errmsg());
     return -1;
   }
@@ -845,6 +845,24 @@ ata_attr_state ata_get_attr_state(const ata_smart_attribute & attr,
 uint64_t ata_get_attr_raw_value(const ata_smart_attribute & attr,
                                 const ata_vendor_attr_defs & defs);
 
+// Attribute raw value decoder.  The byte order of each attribute
+// is resolved once into offsets for repeated decoding.
+class ata_attr_raw_decoder
+{
+public:
+  ata_attr_raw_decoder();
+
+  /// Resolve byte orders from attribute definitions.
+  void init(const ata_vendor_attr_defs & defs);
+
+  /// Get attribute raw value, same as ata_get_attr_raw_value().
+  uint64_t get_raw_value(const ata_smart_attribute & attr) const;
+
+private:
+  unsigned char m_size[256]; // Number of bytes
+  signed char m_offset[256][8]; // Offsets into attribute, -1 for zero byte
+};
+
 // Format attribute raw value.
 std::string ata_format_attr_raw_value(const ata_smart_attribute & attr,
                                       const ata_vendor_attr_defs & defs);
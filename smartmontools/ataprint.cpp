@@ -43,6 +43,7 @@
 #include "extern.h"
 #include "utility.h"
 #include "knowndrives.h"
+#include "json.h"
 
 const char * ataprint_cpp_cvsid = "$Id$"
                                   ATAPRINT_H_CVSID;
@@ -477,9 +478,20 @@ static bool PrintDriveInfo(const ata_identify_device * drive, bool fix_swapped_i
     pout("Serial Number:    %s\n", infofound(serial));
   pout("Firmware Version: %s\n", infofound(firm));
 
+  if (dbentry && *dbentry->modelfamily)
+    jglb["model_family"] = dbentry->modelfamily;
+  jglb["model_name"] = model;
+  if (!con->dont_print_serial)
+    jglb["serial_number"] = serial;
+  jglb["firmware_version"] = firm;
+
   char capacity[64];
-  if (determine_capacity(drive, capacity))
+  uint64_t capbytes = determine_capacity(drive, capacity);
+  if (capbytes) {
     pout("User Capacity:    %s bytes\n", capacity);
+    jglb["user_capacity"]["bytes"] = capbytes;
+  }
+  jglb["in_smartctl_database"] = !!dbentry;
   
   // See if drive is recognized
   pout("Device is:        %s\n", !dbentry ?
@@ -512,6 +524,10 @@ static bool PrintDriveInfo(const ata_identify_device * drive, bool fix_swapped_i
 
   pout("ATA Version is:   %s\n", infofound(majorstr.c_str()));
   pout("ATA Standard is:  %s\n", infofound(minorstr.c_str()));
+  if (version) {
+    jglb["ata_version"]["major"] = abs(version);
+    jglb["ata_version"]["string"] = minorstr;
+  }
 
   // print current time and date and timezone
   char timedatetz[DATEANDEPOCHLEN]; dateandtimezone(timedatetz);
@@ -575,6 +591,11 @@ static void PrintSmartOfflineStatus(const ata_smart_values * data)
     pout("\t\t\t\t\tAuto Offline Data Collection: Enabled.\n");
   else
     pout("\t\t\t\t\tAuto Offline Data Collection: Disabled.\n");
+
+  json & jo = jglb["ata_smart_data"]["offline_data_collection"];
+  jo["status"]["value"] = data->offline_data_collection_status;
+  jo["status"]["string"] = OfflineDataCollectionStatus(data->offline_data_collection_status);
+  jo["auto_enabled"] = !!(data->offline_data_collection_status & 0x80);
   
   return;
 }
@@ -832,6 +853,7 @@ static void PrintSmartAttribWithThres(const ata_smart_values * data,
     if (needheader) {
       if (!onlyfailed) {
         pout("SMART Attributes Data Structure revision number: %d\n",(int)data->revnumber);
+        jglb["ata_smart_attributes"]["revision"] = data->revnumber;
         pout("Vendor Specific SMART Attributes with Thresholds:\n");
       }
       pout("ID# ATTRIBUTE_NAME          FLAG     VALUE WORST THRESH TYPE      UPDATED  WHEN_FAILED RAW_VALUE\n");
@@ -864,6 +886,26 @@ static void PrintSmartAttribWithThres(const ata_smart_values * data,
           state == ATTRSTATE_FAILED_PAST ? "In_the_past" :
                                            "    -"        ),
          ata_format_attr_raw_value(attr, defs).c_str());
+
+    if (!onlyfailed) {
+      json & ja = jglb["ata_smart_attributes"]["table"];
+      json & jt = ja[ja.size()];
+      jt["id"] = attr.id;
+      jt["name"] = attrname;
+      if (state > ATTRSTATE_NO_NORMVAL)
+        jt["value"] = attr.current;
+      if (!(defs[attr.id].flags & ATTRFLAG_NO_WORSTVAL))
+        jt["worst"] = attr.worst;
+      if (state > ATTRSTATE_NO_THRESHOLD)
+        jt["thresh"] = threshold;
+      jt["when_failed"] = (state == ATTRSTATE_FAILED_NOW  ? "now" :
+                           state == ATTRSTATE_FAILED_PAST ? "past" : "");
+      jt["flags"]["value"] = attr.flags;
+      jt["flags"]["prefailure"] = !!ATTRIBUTE_FLAGS_PREFAILURE(attr.flags);
+      jt["flags"]["updated_online"] = !!ATTRIBUTE_FLAGS_ONLINE(attr.flags);
+      jt["raw"]["value"] = ata_get_attr_raw_value(attr, defs);
+      jt["raw"]["string"] = ata_format_attr_raw_value(attr, defs);
+    }
   }
   if (!needheader) pout("\n");
 }
@@ -890,6 +932,22 @@ static void PrintGeneralSmartValues(const ata_smart_values *data, const ata_iden
   pout("General SMART Values:\n");
   
   PrintSmartOfflineStatus(data); 
+
+  json & jd = jglb["ata_smart_data"];
+  if (isSupportSelfTest(data)) {
+    jd["self_test"]["status"]["value"] = data->self_test_exec_status;
+    if ((data->self_test_exec_status >> 4) == 15)
+      jd["self_test"]["status"]["remaining_percent"] = (data->self_test_exec_status & 0x0f) * 10;
+    jd["self_test"]["polling_minutes"]["short"] = data->short_test_completion_time;
+    jd["self_test"]["polling_minutes"]["extended"] = data->extend_test_completion_time;
+  }
+  if (isSupportConveyanceSelfTest(data))
+    jd["self_test"]["polling_minutes"]["conveyance"] = data->conveyance_test_completion_time;
+  jd["offline_data_collection"]["completion_seconds"] = data->total_time_to_complete_off_line;
+  jd["capabilities"]["values"][0] = data->offline_data_collection_capability;
+  jd["capabilities"]["values"][1] = data->smart_capability;
+  jd["capabilities"]["error_logging_supported"] = !!isSmartErrorLogCapable(data, drive);
+  jd["capabilities"]["gp_logging_supported"] = !!isGeneralPurposeLoggingCapable(drive);
   
   if (isSupportSelfTest(data)){
     PrintSmartSelfExecStatus(data, fix_firmwarebug);
@@ -1115,7 +1173,11 @@ static int PrintSmartErrorlog(const ata_smart_errorlog *data,
                               unsigned char fix_firmwarebug)
 {
   pout("SMART Error Log Version: %d\n", (int)data->revnumber);
-  
+
+  json & je = jglb["ata_smart_error_log"]["summary"];
+  je["revision"] = data->revnumber;
+  je["count"] = (data->error_log_pointer ? data->ata_error_count : 0);
+
   // if no errors logged, return
   if (!data->error_log_pointer){
     pout("No Errors Logged\n\n");
@@ -1176,6 +1238,13 @@ static int PrintSmartErrorlog(const ata_smart_errorlog *data,
       pout("Error %d occurred at disk power-on lifetime: %d hours (%d days + %d hours)\n",
              (int)(data->ata_error_count+k-4), (int)summary->timestamp, days, (int)(summary->timestamp-24*days));
       PRINT_OFF(con);
+
+      json & jt = je["table"][je["table"].size()];
+      jt["error_number"] = data->ata_error_count+k-4;
+      jt["lifetime_hours"] = summary->timestamp;
+      jt["state"] = msgstate;
+      jt["error_register"] = summary->error_register;
+      jt["status_register"] = summary->status;
       pout("  When the command that caused the error occurred, the device was %s.\n\n",msgstate);
       pout("  After command completion occurred, registers were:\n"
            "  ER ST SC SN CL CH DH\n"
@@ -1238,6 +1307,11 @@ static int PrintSmartExtErrorLog(const ata_smart_exterrlog * log,
   pout("SMART Extended Comprehensive Error Log Version: %u (%u sectors)\n",
        log->version, nsectors);
 
+  json & je = jglb["ata_smart_error_log"]["extended"];
+  je["revision"] = log->version;
+  je["sectors"] = nsectors;
+  je["count"] = log->device_error_count;
+
   if (!log->device_error_count) {
     pout("No Errors Logged\n\n");
     return 0;
@@ -1312,6 +1386,14 @@ static int PrintSmartExtErrorLog(const ata_smart_exterrlog * log,
          errnum, erridx, err.timestamp, err.timestamp / 24, err.timestamp % 24);
     PRINT_OFF(con);
 
+    json & jt = je["table"][je["table"].size()];
+    jt["error_number"] = errnum;
+    jt["log_index"] = erridx;
+    jt["lifetime_hours"] = err.timestamp;
+    jt["state"] = get_error_log_state_desc(err.state);
+    jt["error_register"] = err.error_register;
+    jt["status_register"] = err.status_register;
+
     pout("  When the command that caused the error occurred, the device was %s.\n\n",
       get_error_log_state_desc(err.state));
 
@@ -1383,6 +1465,33 @@ static int PrintSmartExtErrorLog(const ata_smart_exterrlog * log,
   return log->device_error_count;
 }
 
+// Add SMART Self-test Log entries to structured output, most recent first
+static void json_selftest_log(const ata_smart_selftestlog * data)
+{
+  json & js = jglb["ata_smart_self_test_log"]["standard"];
+  js["revision"] = data->revnumber;
+  json & jt = js["table"];
+  jt.clear();
+  jt.set_type(json::nt_array);
+  if (!data->mostrecenttest)
+    return;
+
+  for (int i = 20; i >= 0; i--) {
+    // log is a circular buffer
+    const ata_smart_selftestlog_struct * log
+      = data->selftest_struct + (i+data->mostrecenttest)%21;
+    if (!nonempty(log, sizeof(*log)))
+      continue;
+    json & je = jt[jt.size()];
+    je["type"] = log->selftestnumber;
+    je["status"]["value"] = log->selfteststatus;
+    je["status"]["passed"] = !(log->selfteststatus >> 4);
+    je["lifetime_hours"] = log->timestamp;
+    if ((log->selfteststatus >> 4) && log->lbafirstfailure < 0xffffffff)
+      je["lba"] = log->lbafirstfailure;
+  }
+}
+
 // Print SMART Extended Self-test Log (GP Log 0x07)
 static bool PrintSmartExtSelfTestLog(const ata_smart_extselftestlog * log,
                                      unsigned nsectors, unsigned max_entries)
@@ -1390,6 +1499,12 @@ static bool PrintSmartExtSelfTestLog(const ata_smart_extselftestlog * log,
   pout("SMART Extended Self-test Log Version: %u (%u sectors)\n",
        log->version, nsectors);
 
+  json & js = jglb["ata_smart_self_test_log"]["extended"];
+  js["revision"] = log->version;
+  js["sectors"] = nsectors;
+  json & jt = js["table"];
+  jt.set_type(json::nt_array);
+
   if (!log->log_desc_index){
     pout("No self-tests have been logged.  [To run self-tests, use: smartctl -t]\n\n");
     return true;
@@ -1429,6 +1544,14 @@ static bool PrintSmartExtSelfTestLog(const ata_smart_extselftestlog * log,
         | ((uint64_t)b[4] << 32)
         | ((uint64_t)b[5] << 40);
 
+    json & je = jt[jt.size()];
+    je["type"] = entry.self_test_type;
+    je["status"]["value"] = entry.self_test_status;
+    je["status"]["passed"] = !(entry.self_test_status >> 4);
+    je["lifetime_hours"] = entry.timestamp;
+    if ((entry.self_test_status >> 4) && lba48 < 0xffffffffffffULL)
+      je["lba"] = lba48;
+
     // Print entry
     ataPrintSmartSelfTestEntry(testnum++, entry.self_test_type,
       entry.self_test_status, entry.timestamp, lba48,
@@ -1638,6 +1761,16 @@ static int ataPrintSCTStatus(const ata_sct_status_response * sts)
     pout("Under/Over Temperature Limit Count:  %2u/%u\n",
       sts->under_limit_count, sts->over_limit_count);
   }
+
+  json & jt = jglb["temperature"];
+  if (sts->hda_temp != -128)
+    jt["current"] = sts->hda_temp;
+  if (sts->max_temp != -128)
+    jt["power_cycle_max"] = sts->max_temp;
+  if (sts->life_max_temp != -128)
+    jt["lifetime_max"] = sts->life_max_temp;
+  jglb["ata_sct_status"]["device_state"]["value"] = sts->device_state;
+  jglb["ata_sct_status"]["device_state"]["string"] = sct_device_state_msg(sts->device_state);
   return 0;
 }
 
@@ -1877,6 +2010,12 @@ int ataPrintMain (ata_device * device, const ata_print_options & options)
     }
   }
 
+  if (smart_supported >= 0) {
+    jglb["smart_support"]["available"] = !!smart_supported;
+    if (smart_supported && smart_enabled >= 0)
+      jglb["smart_support"]["enabled"] = !!smart_enabled;
+  }
+
   // Print remaining drive info
   if (options.drive_info) {
     // Print the (now possibly changed) power mode if available
@@ -2022,6 +2161,7 @@ int ataPrintMain (ata_device * device, const ata_print_options & options)
     case 0:
       // The case where the disk health is OK
       pout("SMART overall-health self-assessment test result: PASSED\n");
+      jglb["smart_status"]["passed"] = true;
       if (smart_thres_ok && find_failed_attr(&smartval, &smartthres, attribute_defs, 0)) {
         if (options.smart_vendor_attrib)
           pout("See vendor-specific Attribute list for marginal Attributes.\n\n");
@@ -2042,6 +2182,7 @@ int ataPrintMain (ata_device * device, const ata_print_options & options)
       pout("SMART overall-health self-assessment test result: FAILED!\n"
            "Drive failure expected in less than 24 hours. SAVE ALL DATA.\n");
       PRINT_OFF(con);
+      jglb["smart_status"]["passed"] = false;
       if (smart_thres_ok && find_failed_attr(&smartval, &smartthres, attribute_defs, 1)) {
         returnval|=FAILATTR;
         if (options.smart_vendor_attrib)
@@ -2075,6 +2216,7 @@ int ataPrintMain (ata_device * device, const ata_print_options & options)
         pout("SMART overall-health self-assessment test result: FAILED!\n"
              "Drive failure expected in less than 24 hours. SAVE ALL DATA.\n");
         PRINT_OFF(con);
+        jglb["smart_status"]["passed"] = false;
         returnval|=FAILATTR;
         returnval|=FAILSTATUS;
         if (options.smart_vendor_attrib)
@@ -2088,6 +2230,7 @@ int ataPrintMain (ata_device * device, const ata_print_options & options)
       else {
         pout("SMART overall-health self-assessment test result: PASSED\n");
         pout("Warning: This result is based on an Attribute check.\n");
+        jglb["smart_status"]["passed"] = true;
         if (find_failed_attr(&smartval, &smartthres, attribute_defs, 0)) {
           if (options.smart_vendor_attrib)
             pout("See vendor-specific Attribute list for marginal Attributes.\n\n");
@@ -2312,6 +2455,7 @@ int ataPrintMain (ata_device * device, const ata_print_options & options)
       failuretest(OPTIONAL_CMD, returnval|=FAILSMART);
     }
     else {
+      json_selftest_log(&smartselftest);
       PRINT_ON(con);
       if (ataPrintSmartSelfTestlog(&smartselftest, !con->printing_switchable, fix_firmwarebug))
 	returnval|=FAILLOG;
@@ -0,0 +1,582 @@
+/*
+ * attrlog.cpp
+ *
+ * Home page of code is: http://smartmontools.sourceforge.net
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+#include "int64.h"
+#include "attrlog.h"
+#include "utility.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#ifdef _WIN32
+#include <io.h> // unlink()
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+const char * attrlog_cpp_cvsid = "$Id$"
+  ATTRLOG_H_CVSID;
+
+// File layout (all numbers little endian):
+// Header:
+//   char magic[8] = "SMARTDAL", u32 version, u32 CRC of magic and version
+// Followed by blocks:
+//   u8 kind (bits 0-6) and bit 8 of attribute ID (bit 7),
+//   u8 bits 0-7 of attribute ID, u16 number of entries, u32 payload size,
+//   s64 time of first entry, s64 time of last entry,
+//   u32 CRC of previous fields and payload, u8 payload[payload size]
+// Payload:
+//   One column after the other (see get_columns() below), each column
+//   holds one varint per entry: Difference to previous value of column,
+//   zigzag encoded.  Previous value of first entry is time of first
+//   entry for the time column and 0 for all other columns.
+
+#define ATTRLOG_MAGIC       "SMARTDAL"
+#define ATTRLOG_VERSION     1
+#define ATTRLOG_HDRSIZE     16
+#define ATTRLOG_BLKHDRSIZE  28
+#define ATTRLOG_MAXENTRIES  256   // Max entries of compacted blocks
+#define ATTRLOG_MAXCOLS     7
+#define ATTRLOG_MAXVARINT   10    // Max bytes of 64-bit varint
+
+// Columns
+enum {
+  COL_TIME, COL_VAL_MIN, COL_VAL_MAX, COL_VAL_LAST,
+  COL_RAW_MIN, COL_RAW_MAX, COL_RAW_LAST
+};
+
+// Get columns stored for kind, return number of columns.
+static unsigned get_columns(attrlog_kind kind, const unsigned char * & cols)
+{
+  static const unsigned char raw_cols[] = {
+    COL_TIME, COL_VAL_LAST, COL_RAW_LAST
+  };
+  static const unsigned char rollup_cols[ATTRLOG_MAXCOLS] = {
+    COL_TIME, COL_VAL_MIN, COL_VAL_MAX, COL_VAL_LAST,
+    COL_RAW_MIN, COL_RAW_MAX, COL_RAW_LAST
+  };
+  if (kind == ATTRLOG_RAW) {
+    cols = raw_cols;
+    return sizeof(raw_cols);
+  }
+  cols = rollup_cols;
+  return sizeof(rollup_cols);
+}
+
+static uint64_t get_column(const attrlog_entry & e, int col)
+{
+  switch (col) {
+    case COL_TIME:     return (uint64_t)(int64_t)e.time;
+    case COL_VAL_MIN:  return e.val_min;
+    case COL_VAL_MAX:  return e.val_max;
+    case COL_VAL_LAST: return e.val_last;
+    case COL_RAW_MIN:  return e.raw_min;
+    case COL_RAW_MAX:  return e.raw_max;
+    default:           return e.raw_last;
+  }
+}
+
+static void set_column(attrlog_entry & e, int col, uint64_t v)
+{
+  switch (col) {
+    case COL_TIME:     e.time = (time_t)(int64_t)v; break;
+    case COL_VAL_MIN:  e.val_min = (unsigned char)v; break;
+    case COL_VAL_MAX:  e.val_max = (unsigned char)v; break;
+    case COL_VAL_LAST: e.val_last = (unsigned char)v; break;
+    case COL_RAW_MIN:  e.raw_min = v; break;
+    case COL_RAW_MAX:  e.raw_max = v; break;
+    default:           e.raw_last = v; break;
+  }
+}
+
+// Length of rollup interval in seconds, 0 for raw samples.
+static unsigned get_interval(attrlog_kind kind)
+{
+  switch (kind) {
+    case ATTRLOG_HOURLY: return 60*60;
+    case ATTRLOG_DAILY:  return 24*60*60;
+    default:             return 0;
+  }
+}
+
+const char * attrlog_kind_name(attrlog_kind kind)
+{
+  switch (kind) {
+    case ATTRLOG_RAW:    return "raw";
+    case ATTRLOG_HOURLY: return "hourly";
+    case ATTRLOG_DAILY:  return "daily";
+    default:             return "unknown";
+  }
+}
+
+static bool entry_time_less(const attrlog_entry & e1, const attrlog_entry & e2)
+{
+  return (e1.time < e2.time);
+}
+
+static void put_varint(std::vector<unsigned char> & buf, uint64_t v)
+{
+  while (v >= 0x80) {
+    buf.push_back((unsigned char)(v | 0x80));
+    v >>= 7;
+  }
+  buf.push_back((unsigned char)v);
+}
+
+static bool get_varint(const unsigned char * & p, const unsigned char * end, uint64_t & v)
+{
+  v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    unsigned char b = *p++;
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static void put_file_header(std::vector<unsigned char> & buf)
+{
+  unsigned char hdr[ATTRLOG_HDRSIZE];
+  memcpy(hdr, ATTRLOG_MAGIC, 8);
+  put_le_uint(hdr + 8, ATTRLOG_VERSION, 4);
+  put_le_uint(hdr + 12, calc_crc32(hdr, 12), 4);
+  buf.insert(buf.end(), hdr, hdr + sizeof(hdr));
+}
+
+// Append block with COUNT entries to BUF.
+static void put_block(std::vector<unsigned char> & buf, attrlog_kind kind,
+                      unsigned short id, const attrlog_entry * entries, unsigned count)
+{
+  unsigned start = buf.size();
+  buf.resize(start + ATTRLOG_BLKHDRSIZE);
+
+  const unsigned char * cols;
+  unsigned num_cols = get_columns(kind, cols);
+  for (unsigned c = 0; c < num_cols; c++) {
+    uint64_t prev = (cols[c] == COL_TIME ? get_column(entries[0], COL_TIME) : 0);
+    for (unsigned i = 0; i < count; i++) {
+      uint64_t v = get_column(entries[i], cols[c]);
+      uint64_t d = v - prev;
+      put_varint(buf, (d << 1) ^ (uint64_t)((int64_t)d >> 63));
+      prev = v;
+    }
+  }
+
+  unsigned size = buf.size() - start - ATTRLOG_BLKHDRSIZE;
+  unsigned char * hdr = &buf[start];
+  hdr[0] = (unsigned char)(kind | ((id >> 1) & 0x80));
+  hdr[1] = (unsigned char)id;
+  put_le_uint(hdr +  2, count, 2);
+  put_le_uint(hdr +  4, size, 4);
+  put_le_uint(hdr +  8, (int64_t)entries[0].time, 8);
+  put_le_uint(hdr + 16, (int64_t)entries[count-1].time, 8);
+  put_le_uint(hdr + 24, calc_crc32(hdr + ATTRLOG_BLKHDRSIZE, size, calc_crc32(hdr, 24)), 4);
+}
+
+// Decode block payload and append entries.
+static bool decode_block(const attrlog_block_info & info, const unsigned char * payload,
+                         attrlog_entry_vector & entries)
+{
+  unsigned start = entries.size();
+  attrlog_entry zero; memset(&zero, 0, sizeof(zero));
+  entries.resize(start + info.count, zero);
+
+  const unsigned char * p = payload, * end = payload + info.size;
+  const unsigned char * cols;
+  unsigned num_cols = get_columns(info.kind, cols);
+  for (unsigned c = 0; c < num_cols; c++) {
+    uint64_t prev = (cols[c] == COL_TIME ? (uint64_t)(int64_t)info.first : 0);
+    for (unsigned i = 0; i < info.count; i++) {
+      uint64_t z;
+      if (!get_varint(p, end, z)) {
+        entries.resize(start);
+        return false;
+      }
+      prev += (z >> 1) ^ (uint64_t)-(int64_t)(z & 1);
+      set_column(entries[start + i], cols[c], prev);
+    }
+  }
+  if (p != end) {
+    entries.resize(start);
+    return false;
+  }
+
+  if (info.kind == ATTRLOG_RAW) {
+    for (unsigned i = start; i < entries.size(); i++) {
+      attrlog_entry & e = entries[i];
+      e.val_min = e.val_max = e.val_last;
+      e.raw_min = e.raw_max = e.raw_last;
+    }
+  }
+  return true;
+}
+
+// Open log file and check header.  Return false if file does not
+// exist (errno == ENOENT) or on error.
+static bool open_attrlog(stdio_file & f, const char * path, long & filesize)
+{
+  if (!f.open(path, "rb")) {
+    if (errno != ENOENT)
+      pout("%s: Cannot open attribute log file: %s\n", path, strerror(errno));
+    return false;
+  }
+  unsigned char hdr[ATTRLOG_HDRSIZE];
+  if (!(   fseek(f, 0, SEEK_END) == 0 && (filesize = ftell(f)) >= 0
+        && fseek(f, 0, SEEK_SET) == 0 && fread(hdr, sizeof(hdr), 1, f) == 1
+        && !memcmp(hdr, ATTRLOG_MAGIC, 8) && get_le_uint(hdr + 8, 4) == ATTRLOG_VERSION
+        && get_le_uint(hdr + 12, 4) == calc_crc32(hdr, 12))) {
+    pout("%s: Invalid attribute log file header\n", path);
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
+// Read block headers until end of file or first invalid header.
+static void read_index(FILE * f, long filesize, attrlog_index & index)
+{
+  index.clear();
+  long offset = ATTRLOG_HDRSIZE;
+  while (offset + ATTRLOG_BLKHDRSIZE <= filesize) {
+    unsigned char hdr[ATTRLOG_BLKHDRSIZE];
+    if (!(fseek(f, offset, SEEK_SET) == 0 && fread(hdr, sizeof(hdr), 1, f) == 1))
+      break;
+    attrlog_block_info info;
+    info.kind   = (attrlog_kind)(hdr[0] & 0x7f);
+    info.id     = ((hdr[0] & 0x80) << 1) | hdr[1];
+    info.count  = (unsigned)get_le_uint(hdr + 2, 2);
+    info.size   = (unsigned)get_le_uint(hdr + 4, 4);
+    info.first  = (time_t)(int64_t)get_le_uint(hdr +  8, 8);
+    info.last   = (time_t)(int64_t)get_le_uint(hdr + 16, 8);
+    info.offset = offset + ATTRLOG_BLKHDRSIZE;
+    if (!(   info.kind < ATTRLOG_NUM_KINDS && info.count > 0
+          && info.size <= info.count * ATTRLOG_MAXCOLS * ATTRLOG_MAXVARINT
+          && info.first <= info.last && info.offset + (long)info.size <= filesize))
+      break; // Incomplete or garbage
+    index.push_back(info);
+    offset = info.offset + info.size;
+  }
+}
+
+// Read block payload, check CRC and append entries.
+static bool read_block(FILE * f, const attrlog_block_info & info,
+                       attrlog_entry_vector & entries)
+{
+  std::vector<unsigned char> buf(ATTRLOG_BLKHDRSIZE + info.size);
+  if (!(   fseek(f, info.offset - ATTRLOG_BLKHDRSIZE, SEEK_SET) == 0
+        && fread(&buf[0], buf.size(), 1, f) == 1))
+    return false;
+  if (get_le_uint(&buf[24], 4) != calc_crc32(&buf[ATTRLOG_BLKHDRSIZE], info.size,
+                                             calc_crc32(&buf[0], 24)))
+    return false;
+  return decode_block(info, &buf[ATTRLOG_BLKHDRSIZE], entries);
+}
+
+// Return end offset of the last block with valid CRC, 0 if the
+// file header is incomplete.
+static long find_valid_end(FILE * f, long filesize)
+{
+  if (filesize < ATTRLOG_HDRSIZE)
+    return 0;
+  attrlog_index index;
+  read_index(f, filesize, index);
+  while (!index.empty()) {
+    const attrlog_block_info & info = index.back();
+    attrlog_entry_vector entries;
+    if (read_block(f, info, entries))
+      return info.offset + info.size;
+    index.pop_back();
+  }
+  return ATTRLOG_HDRSIZE;
+}
+
+// End offset of valid data of each file after the last append or
+// compaction by this process.  If the file size still matches, the
+// file is not scanned again by find_valid_end().
+static std::map<std::string, long> valid_end_cache;
+
+// Truncate file to SIZE.
+static bool truncate_file(FILE * f, long size)
+{
+  if (fflush(f))
+    return false;
+#ifdef _WIN32
+  return !_chsize(fileno(f), size);
+#else
+  return !ftruncate(fileno(f), size);
+#endif
+}
+
+// Update ROLLUPS with raw samples starting at the last rollup interval.
+// Both vectors must be sorted by time.
+static void update_rollups(attrlog_entry_vector & rollups, const attrlog_entry_vector & raw,
+                           unsigned interval)
+{
+  attrlog_entry_vector::const_iterator it = raw.begin();
+  if (!rollups.empty())
+    it = std::lower_bound(raw.begin(), raw.end(), rollups.back(), entry_time_less);
+
+  for ( ; it != raw.end(); ++it) {
+    time_t start = it->time - it->time % interval;
+    if (rollups.empty() || rollups.back().time < start) {
+      attrlog_entry e = *it;
+      e.time = start;
+      rollups.push_back(e);
+      continue;
+    }
+    // Same interval, keep min/max of previous compaction
+    attrlog_entry & e = rollups.back();
+    e.val_min  = std::min(e.val_min, it->val_min);
+    e.val_max  = std::max(e.val_max, it->val_max);
+    e.val_last = it->val_last;
+    e.raw_min  = std::min(e.raw_min, it->raw_min);
+    e.raw_max  = std::max(e.raw_max, it->raw_max);
+    e.raw_last = it->raw_last;
+  }
+}
+
+bool attrlog_append(const char * path, time_t t,
+                    const attrlog_value * values, unsigned num_values)
+{
+  stdio_file f;
+  long filesize = -1;
+  if (!open_attrlog(f, path, filesize)) {
+    // Create new file, replace incomplete header
+    f.close();
+    if (!(   (errno == ENOENT || (0 <= filesize && filesize < ATTRLOG_HDRSIZE))
+          && f.open(path, "wb"))) {
+      pout("Cannot create attribute log file \"%s\"\n", path);
+      return false;
+    }
+    filesize = 0;
+  }
+  else {
+    // Reopen for update, remove partial or corrupt blocks left by
+    // an interrupted append.  Otherwise all blocks appended later
+    // would be unreachable.
+    f.close();
+    if (!f.open(path, "r+b")) {
+      pout("Cannot open attribute log file \"%s\": %s\n", path, strerror(errno));
+      return false;
+    }
+    std::map<std::string, long>::const_iterator it = valid_end_cache.find(path);
+    long end = (it != valid_end_cache.end() && it->second == filesize ?
+                filesize : find_valid_end(f, filesize));
+    if (end < filesize) {
+      pout("%s: Removing %ld bytes of incomplete data at end of attribute log\n",
+           path, filesize - end);
+      if (!truncate_file(f, end)) {
+        pout("%s: Cannot truncate attribute log file: %s\n", path, strerror(errno));
+        return false;
+      }
+    }
+    if (fseek(f, end, SEEK_SET)) {
+      pout("%s: Seek in attribute log file failed\n", path);
+      return false;
+    }
+    filesize = end;
+  }
+
+  std::vector<unsigned char> buf;
+  if (filesize == 0)
+    put_file_header(buf);
+
+  for (unsigned i = 0; i < num_values; i++) {
+    attrlog_entry e;
+    e.time = t;
+    e.val_min = e.val_max = e.val_last = values[i].val;
+    e.raw_min = e.raw_max = e.raw_last = values[i].raw;
+    put_block(buf, ATTRLOG_RAW, values[i].id, &e, 1);
+  }
+
+  // Write all blocks at once
+  valid_end_cache.erase(path);
+  if (!buf.empty() && fwrite(&buf[0], buf.size(), 1, f) != 1) {
+    pout("Write to attribute log file \"%s\" failed\n", path);
+    return false;
+  }
+  if (!f.close()) {
+    pout("Write to attribute log file \"%s\" failed\n", path);
+    return false;
+  }
+  valid_end_cache[path] = filesize + (long)buf.size();
+  return true;
+}
+
+// All entries of one attribute
+struct attrlog_series
+{
+  attrlog_entry_vector entries[ATTRLOG_NUM_KINDS];
+};
+
+bool attrlog_compact(const char * path, const attrlog_retention & retention,
+                     time_t now)
+{
+  // Read all valid blocks
+  std::map<unsigned short, attrlog_series> series;
+  {
+    stdio_file f;
+    long filesize = 0;
+    if (!open_attrlog(f, path, filesize))
+      return (errno == ENOENT);
+    attrlog_index index;
+    read_index(f, filesize, index);
+    for (unsigned i = 0; i < index.size(); i++) {
+      const attrlog_block_info & info = index[i];
+      read_block(f, info, series[info.id].entries[info.kind]);
+    }
+  }
+
+  // Update rollups, apply retention, encode
+  std::vector<unsigned char> buf;
+  put_file_header(buf);
+  for (std::map<unsigned short, attrlog_series>::iterator si = series.begin();
+       si != series.end(); ++si) {
+    attrlog_entry_vector * entries = si->second.entries;
+    for (int k = 0; k < ATTRLOG_NUM_KINDS; k++)
+      std::stable_sort(entries[k].begin(), entries[k].end(), entry_time_less);
+
+    for (int k = 0; k < ATTRLOG_NUM_KINDS; k++) {
+      attrlog_kind kind = (attrlog_kind)k;
+      unsigned interval = get_interval(kind);
+      if (interval)
+        update_rollups(entries[k], entries[ATTRLOG_RAW], interval);
+    }
+
+    for (int k = 0; k < ATTRLOG_NUM_KINDS; k++) {
+      attrlog_kind kind = (attrlog_kind)k;
+      attrlog_entry_vector & ev = entries[k];
+      if (retention.days[k]) {
+        // Keep intervals which end after the cutoff time
+        attrlog_entry cutoff;
+        cutoff.time = now - (time_t)retention.days[k] * 24*60*60 - get_interval(kind) + 1;
+        ev.erase(ev.begin(), std::lower_bound(ev.begin(), ev.end(), cutoff, entry_time_less));
+      }
+      for (unsigned i = 0; i < ev.size(); i += ATTRLOG_MAXENTRIES)
+        put_block(buf, kind, si->first, &ev[i],
+                  std::min((unsigned)ev.size() - i, (unsigned)ATTRLOG_MAXENTRIES));
+    }
+  }
+
+  // Write new file and replace old
+  std::string tmppath = path; tmppath += ".tmp";
+  stdio_file f(tmppath.c_str(), "wb");
+  if (!f) {
+    pout("Cannot create attribute log file \"%s\"\n", tmppath.c_str());
+    return false;
+  }
+  if (!(fwrite(&buf[0], buf.size(), 1, f) == 1 && f.close())) {
+    pout("Write to attribute log file \"%s\" failed\n", tmppath.c_str());
+    f.close();
+    unlink(tmppath.c_str());
+    return false;
+  }
+#ifdef _WIN32
+  unlink(path); // rename() does not replace existing file
+#endif
+  if (rename(tmppath.c_str(), path)) {
+    pout("Cannot rename \"%s\" to \"%s\": %s\n", tmppath.c_str(), path, strerror(errno));
+    unlink(tmppath.c_str());
+    valid_end_cache.erase(path);
+    return false;
+  }
+  valid_end_cache[path] = (long)buf.size();
+  return true;
+}
+
+bool attrlog_read_index(const char * path, attrlog_index & index)
+{
+  index.clear();
+  stdio_file f;
+  long filesize = 0;
+  if (!open_attrlog(f, path, filesize)) {
+    if (errno == ENOENT)
+      pout("%s: %s\n", path, strerror(errno));
+    return false;
+  }
+  read_index(f, filesize, index);
+  return true;
+}
+
+bool attrlog_query(const char * path, attrlog_kind kind, unsigned short id,
+                   time_t from, time_t to, attrlog_entry_vector & entries)
+{
+  entries.clear();
+  stdio_file f;
+  long filesize = 0;
+  if (!open_attrlog(f, path, filesize)) {
+    if (errno == ENOENT)
+      pout("%s: %s\n", path, strerror(errno));
+    return false;
+  }
+  attrlog_index index;
+  read_index(f, filesize, index);
+
+  // Include interval containing start time
+  unsigned interval = get_interval(kind);
+  if (interval)
+    from -= from % interval;
+
+  // Read matching blocks of requested kind, find last compacted rollup
+  bool have_rollups = false;
+  time_t rollups_end = 0;
+  unsigned i;
+  for (i = 0; i < index.size(); i++) {
+    const attrlog_block_info & info = index[i];
+    if (!(info.id == id && info.kind == kind))
+      continue;
+    if (!(to < info.first || info.last < from))
+      read_block(f, info, entries);
+    if (!have_rollups || rollups_end < info.last) {
+      have_rollups = true;
+      rollups_end = info.last;
+    }
+  }
+  std::stable_sort(entries.begin(), entries.end(), entry_time_less);
+
+  // Build rollups from raw samples not yet compacted
+  if (interval && !(have_rollups && to < rollups_end)) {
+    time_t raw_from = (have_rollups && rollups_end > from ? rollups_end : from);
+    attrlog_entry_vector raw;
+    for (i = 0; i < index.size(); i++) {
+      const attrlog_block_info & info = index[i];
+      if (!(info.id == id && info.kind == ATTRLOG_RAW))
+        continue;
+      if (!(to < info.first || info.last < raw_from))
+        read_block(f, info, raw);
+    }
+    std::stable_sort(raw.begin(), raw.end(), entry_time_less);
+    attrlog_entry e; e.time = raw_from;
+    raw.erase(raw.begin(), std::lower_bound(raw.begin(), raw.end(), e, entry_time_less));
+    update_rollups(entries, raw, interval);
+  }
+
+  // Remove entries outside of range
+  attrlog_entry e;
+  e.time = from;
+  entries.erase(entries.begin(), std::lower_bound(entries.begin(), entries.end(), e, entry_time_less));
+  e.time = to;
+  entries.erase(std::upper_bound(entries.begin(), entries.end(), e, entry_time_less), entries.end());
+  return true;
+}
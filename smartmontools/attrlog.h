@@ -0,0 +1,108 @@
+/*
+ * attrlog.h
+ *
+ * Home page of code is: http://smartmontools.sourceforge.net
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ATTRLOG_H
+#define ATTRLOG_H
+
+#define ATTRLOG_H_CVSID "$Id$"
+
+#include <time.h>
+#include <vector>
+
+// Columnar attribute log file.
+//
+// The file is a sequence of blocks.  Each block holds entries of one
+// attribute ID and one kind (raw samples, hourly or daily rollups).
+// The entries are stored column by column, each column delta and
+// varint encoded.  smartd appends one small block per attribute and
+// check cycle and periodically compacts the file: Blocks are merged,
+// rollups are updated from the raw samples and old entries are removed.
+// A reader only decodes the blocks whose ID and time range match.
+
+// Kind of log entries
+enum attrlog_kind {
+  ATTRLOG_RAW = 0,    // Raw samples
+  ATTRLOG_HOURLY,     // Hourly min/max/last
+  ATTRLOG_DAILY,      // Daily min/max/last
+  ATTRLOG_NUM_KINDS
+};
+
+// Attribute IDs 1-255 are ATA SMART attributes, IDs 256-511 are
+// other counters (e.g. SCSI error counters logged by smartd).
+#define ATTRLOG_MAX_ID  0x1ff
+
+// Attribute values of one sample
+struct attrlog_value
+{
+  unsigned short id;  // Attribute ID, 1 to ATTRLOG_MAX_ID
+  unsigned char val;  // Normalized value
+  uint64_t raw;       // Raw value
+};
+
+// Raw sample or rollup of an interval
+struct attrlog_entry
+{
+  time_t time;        // Time of sample or start of interval
+  unsigned char val_min, val_max, val_last;
+  uint64_t raw_min, raw_max, raw_last;
+};
+
+typedef std::vector<attrlog_entry> attrlog_entry_vector;
+
+// Block header info
+struct attrlog_block_info
+{
+  attrlog_kind kind;
+  unsigned short id;
+  unsigned count;     // Number of entries
+  time_t first, last; // Time of first and last entry
+  long offset;        // File offset of payload
+  unsigned size;      // Size of payload
+};
+
+typedef std::vector<attrlog_block_info> attrlog_index;
+
+// Retention time of each kind in days, 0 = unlimited
+struct attrlog_retention
+{
+  unsigned days[ATTRLOG_NUM_KINDS];
+
+  attrlog_retention()
+    { days[ATTRLOG_RAW] = 30; days[ATTRLOG_HOURLY] = 365; days[ATTRLOG_DAILY] = 0; }
+};
+
+// Return name of kind ("raw", "hourly", "daily").
+const char * attrlog_kind_name(attrlog_kind kind);
+
+// Append one raw sample of each attribute, create file if necessary.
+bool attrlog_append(const char * path, time_t t,
+                    const attrlog_value * values, unsigned num_values);
+
+// Rewrite file: Merge blocks, update rollups, remove entries older
+// than retention time, drop incomplete blocks.
+bool attrlog_compact(const char * path, const attrlog_retention & retention,
+                     time_t now);
+
+// Read all block headers, skip payloads.
+bool attrlog_read_index(const char * path, attrlog_index & index);
+
+// Read entries of one kind and attribute ID within [from, to].
+// Rollups include intervals not yet compacted.
+bool attrlog_query(const char * path, attrlog_kind kind, unsigned short id,
+                   time_t from, time_t to, attrlog_entry_vector & entries);
+
+#endif // ATTRLOG_H
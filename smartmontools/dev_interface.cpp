@@ -18,11 +18,13 @@
 #include "config.h"
 #include "int64.h"
 #include "atacmds.h"
+#include "atacmdnames.h"
 #include "scsicmds.h"
 #include "dev_interface.h"
 #include "dev_tunnelled.h"
 #include "utility.h"
 
+#include <errno.h>
 #include <stdexcept>
 
 const char * dev_interface_cpp_cvsid = "$Id$"
@@ -46,6 +48,8 @@ smart_device::smart_device(do_not_use_in_implementation_classes)
 
 smart_device::~smart_device() throw()
 {
+  for (unsigned i = 0; i < m_io_pool.size(); i++)
+    free_aligned(m_io_pool[i].data);
 }
 
 bool smart_device::set_err(int no, const char * msg, ...)
@@ -65,6 +69,122 @@ bool smart_device::set_err(int no)
   return false;
 }
 
+smart_device::io_buffer::io_buffer(smart_device * dev, unsigned size)
+: m_dev(dev), m_index(0), m_data(0), m_size(0)
+{
+  // Use smallest free buffer which fits, otherwise grow a free one
+  // or add a new one.  Sizes are rounded up to the alignment.
+  std::vector<io_pool_entry> & pool = dev->m_io_pool;
+  unsigned asize = (size + IO_BUFFER_ALIGN - 1) & ~(IO_BUFFER_ALIGN - 1);
+  if (!asize)
+    asize = IO_BUFFER_ALIGN;
+  int best = -1, any = -1;
+  for (unsigned i = 0; i < pool.size(); i++) {
+    if (pool[i].in_use)
+      continue;
+    any = i;
+    if (pool[i].size >= asize && (best < 0 || pool[i].size < pool[best].size))
+      best = i;
+  }
+  if (best < 0) {
+    void * p = malloc_aligned(asize, IO_BUFFER_ALIGN);
+    if (!p)
+      throw std::bad_alloc();
+    io_pool_entry e = { (unsigned char *)p, asize, false };
+    if (any >= 0) {
+      free_aligned(pool[any].data);
+      pool[any] = e;
+      best = any;
+    }
+    else {
+      pool.push_back(e);
+      best = pool.size() - 1;
+    }
+  }
+  pool[best].in_use = true;
+  m_index = best;
+  m_data = pool[best].data;
+  m_size = size;
+  memset(m_data, 0, size);
+}
+
+smart_device::io_buffer::~io_buffer()
+{
+  m_dev->m_io_pool[m_index].in_use = false;
+}
+
+smart_device::cmd_stats_entry::cmd_stats_entry()
+: count(0), errors(0), timeouts(0),
+  bytes(0), total_us(0), max_us(0)
+{
+  for (int i = 0; i < num_buckets; i++)
+    hist[i] = 0;
+}
+
+unsigned smart_device::cmd_stats_entry::bucket_limit(int i)
+{
+  // 100us, 1ms, 10ms, 100ms, 1s, 10s, more
+  static const unsigned limits[num_buckets] = {
+    100, 1000, 10000, 100000, 1000000, 10000000, 0
+  };
+  return (0 <= i && i < num_buckets ? limits[i] : 0);
+}
+
+void smart_device::record_cmd(unsigned key, bool ok, bool timeout,
+  unsigned bytes, unsigned usec)
+{
+  cmd_stats_entry & e = m_cmd_stats[key];
+  e.count++;
+  if (!ok) {
+    e.errors++;
+    if (timeout)
+      e.timeouts++;
+  }
+  else
+    e.bytes += bytes;
+  e.total_us += usec;
+  if (e.max_us < usec)
+    e.max_us = usec;
+  int i;
+  for (i = 0; i < cmd_stats_entry::num_buckets - 1; i++) {
+    if (usec < cmd_stats_entry::bucket_limit(i))
+      break;
+  }
+  e.hist[i]++;
+}
+
+std::string smart_device::get_cmd_name(unsigned key) const
+{
+  unsigned char opcode = (unsigned char)(key >> 8);
+  const char * name;
+  if (is_ata())
+    name = look_up_ata_command(opcode, (unsigned char)key);
+  else
+    name = scsi_get_opcode_name(opcode);
+  return (name ? name : "[unknown]");
+}
+
+// Return microseconds elapsed since start, 0 if clock was set backwards
+static unsigned get_timer_elapsed(uint64_t start)
+{
+  uint64_t now = get_timer_usec();
+  if (now < start)
+    return 0;
+  uint64_t usec = now - start;
+  return (usec < 0xffffffffU ? (unsigned)usec : 0xffffffffU);
+}
+
+// Return true if last error of device is a timeout
+static bool is_timeout_err(const smart_device * dev)
+{
+#ifdef ETIMEDOUT
+  return (dev->get_errno() == ETIMEDOUT);
+#else
+  (void)dev;
+  return false;
+#endif
+}
+
 smart_device * smart_device::autodetect_open()
 {
   open();
@@ -119,7 +239,22 @@ ata_cmd_out::ata_cmd_out()
 bool ata_device::ata_pass_through(const ata_cmd_in & in)
 {
   ata_cmd_out dummy;
-  return ata_pass_through(in, dummy);
+  return ata_pass_through_timed(in, dummy);
+}
+
+bool ata_device::ata_pass_through_timed(const ata_cmd_in & in, ata_cmd_out & out)
+{
+  uint64_t start = get_timer_usec();
+  bool ok = ata_pass_through(in, out);
+  unsigned usec = get_timer_elapsed(start);
+
+  // SMART commands are distinguished by FEATURES register
+  unsigned char command = in.in_regs.command;
+  unsigned key = (command << 8)
+               | (command == ATA_SMART_CMD ? (unsigned char)in.in_regs.features : 0);
+  record_cmd(key, ok, (!ok && is_timeout_err(this)),
+             (in.direction != ata_cmd_in::no_data ? in.size : 0), usec);
+  return ok;
 }
 
 bool ata_device::ata_cmd_is_ok(const ata_cmd_in & in,
@@ -166,6 +301,28 @@ bool ata_device::ata_identify_is_cached() const
 }
 
 
+/////////////////////////////////////////////////////////////////////////////
+// scsi_device
+
+bool scsi_device::scsi_pass_through_timed(scsi_cmnd_io * iop)
+{
+  uint64_t start = get_timer_usec();
+  bool ok = scsi_pass_through(iop);
+  unsigned usec = get_timer_elapsed(start);
+
+  unsigned bytes = 0;
+  if (ok && iop->dxfer_dir != DXFER_NONE) {
+    bytes = iop->dxfer_len;
+    if (0 < iop->resid && (unsigned)iop->resid <= bytes)
+      bytes -= iop->resid;
+  }
+  // CHECK CONDITION etc. also counts as error
+  record_cmd((unsigned)iop->cmnd[0] << 8, (ok && !iop->scsi_status),
+             (!ok && is_timeout_err(this)), bytes, usec);
+  return ok;
+}
+
+
 /////////////////////////////////////////////////////////////////////////////
 // tunnelled_device_base
 
@@ -230,7 +387,8 @@ std::string smart_interface::get_valid_dev_types_str()
 {
   // default
   std::string s =
-    "ata, scsi, sat[,N][+TYPE], usbcypress[,X], usbjmicron[,x][,N], usbsunplus";
+    "ata, scsi, sat[,N][+TYPE], usbcypress[,X], usbjmicron[,x][,N], usbsunplus, "
+    "record,FILE[+TYPE], replay,FILE";
   // append custom
   std::string s2 = get_valid_custom_dev_types_str();
   if (!s2.empty()) {
@@ -323,6 +481,40 @@ smart_device * smart_interface::get_smart_device(const char * name, const char *
     return satdev;
   }
 
+  else if (!strncmp(type, "record,", 7)) {
+    // Split "record,FILE+base..." -> ("FILE", "base...")
+    const char * file = type + 7;
+    unsigned filelen = strcspn(file, "+");
+    std::string filename(file, filelen);
+    const char * basetype = (file[filelen] ? file+filelen+1 : "");
+    if (filename.empty()) {
+      set_err(EINVAL, "Option '-d record,FILE' requires a file name");
+      return 0;
+    }
+    // Recurse to allocate base device, default is autodetection
+    smart_device_auto_ptr basedev( get_smart_device(name, basetype) );
+    if (!basedev) {
+      set_err(EINVAL, "Type 'record,...': %s", get_errmsg());
+      return 0;
+    }
+    // Attach recorder
+    smart_device * recdev = get_record_device(filename.c_str(), basedev.get());
+    if (!recdev)
+      return 0;
+    basedev.release();
+    return recdev;
+  }
+
+  else if (!strncmp(type, "replay,", 7)) {
+    if (!type[7]) {
+      set_err(EINVAL, "Option '-d replay,FILE' requires a file name");
+      return 0;
+    }
+    dev = get_replay_device(name, type + 7);
+    if (!dev)
+      return 0;
+  }
+
   else {
     set_err(EINVAL, "Unknown device type '%s'", type);
     return 0;
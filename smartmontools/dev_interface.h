@@ -21,6 +21,7 @@
 #define DEV_INTERFACE_H_CVSID "$Id$\n"
 
 #include <stdarg.h>
+#include <map>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -74,6 +75,27 @@ public:
     std::string msg; ///< Error message
   };
 
+  /// Latency statistics of one command opcode
+  struct cmd_stats_entry {
+    cmd_stats_entry();
+
+    /// Number of latency histogram buckets
+    enum { num_buckets = 7 };
+    /// Return upper latency limit of bucket in microseconds, 0 if none.
+    static unsigned bucket_limit(int i);
+
+    unsigned count;    ///< Number of commands
+    unsigned errors;   ///< Number of failed commands, including timeouts
+    unsigned timeouts; ///< Number of timed out commands
+    uint64_t bytes;    ///< Bytes transferred by successful commands
+    uint64_t total_us; ///< Sum of latencies in microseconds
+    unsigned max_us;   ///< Maximum latency in microseconds
+    unsigned hist[num_buckets]; ///< Latency histogram
+  };
+
+  /// Command statistics, key is (opcode << 8 | subcommand)
+  typedef std::map<unsigned, cmd_stats_entry> cmd_stats_map;
+
 // Construction
 protected:
   /// Constructor to init interface and device info.
@@ -172,6 +194,21 @@ public:
   /// Message is retrieved from interface's get_msg_for_errno(no).
   bool set_err(int no);
 
+  ///////////////////////////////////////////////
+  // Command statistics
+  // Recorded by ata_pass_through_timed() and scsi_pass_through_timed()
+
+  /// Get command statistics.
+  const cmd_stats_map & get_cmd_stats() const
+    { return m_cmd_stats; }
+
+  /// Clear command statistics.
+  void clear_cmd_stats()
+    { m_cmd_stats.clear(); }
+
+  /// Get name of command from key of command statistics.
+  std::string get_cmd_name(unsigned key) const;
+
 // Operations
 public:
   ///////////////////////////////////////////////
@@ -204,6 +241,40 @@ public:
   /// Default implementation does nothing.
   virtual void release(const smart_device * dev);
 
+  ///////////////////////////////////////////////
+  // I/O buffers
+
+  /// Page aligned buffer for command data, taken from a pool owned
+  /// by the device.  The buffer can be passed to the OS without
+  /// intermediate copies.  It returns to the pool on destruction and
+  /// is reused by later commands.  Not thread safe, a device must
+  /// only be used by one thread at a time.
+  class io_buffer
+  {
+  public:
+    /// Get zero filled buffer of at least 'size' bytes.
+    io_buffer(smart_device * dev, unsigned size);
+
+    ~io_buffer();
+
+    unsigned char * data()
+      { return m_data; }
+
+    unsigned size() const
+      { return m_size; }
+
+  private:
+    smart_device * m_dev;
+    unsigned m_index; ///< Index into pool
+    unsigned char * m_data;
+    unsigned m_size;
+
+    io_buffer(const io_buffer &);
+    void operator=(const io_buffer &);
+  };
+
+  friend class io_buffer;
+
 protected:
   /// Set dynamic downcast for ATA
   void this_is_ata(ata_device * ata);
@@ -213,6 +284,10 @@ protected:
   void this_is_scsi(scsi_device * scsi);
     // {see below;}
 
+  /// Add one command to statistics.
+  void record_cmd(unsigned key, bool ok, bool timeout,
+    unsigned bytes, unsigned usec);
+
   /// Get interface which produced this object.
   smart_interface * smi()
     { return m_intf; }
@@ -227,6 +302,15 @@ private:
   ata_device * m_ata_ptr;
   scsi_device * m_scsi_ptr;
   error_info m_err;
+  cmd_stats_map m_cmd_stats;
+
+  /// Entry of I/O buffer pool
+  struct io_pool_entry {
+    unsigned char * data;
+    unsigned size;
+    bool in_use;
+  };
+  std::vector<io_pool_entry> m_io_pool;
 
   // Prevent copy/assigment
   smart_device(const smart_device &);
@@ -504,13 +588,27 @@ public:
 
   /// ATA pass through without output registers.
   /// Return false on error.
-  /// Calls ata_pass_through(in, dummy), cannot be reimplemented.
+  /// Calls ata_pass_through_timed(in, dummy), cannot be reimplemented.
   bool ata_pass_through(const ata_cmd_in & in);
 
+  /// ATA pass through with command statistics.
+  /// Return false on error.
+  /// Calls ata_pass_through(in, out), cannot be reimplemented.
+  bool ata_pass_through_timed(const ata_cmd_in & in, ata_cmd_out & out);
+
   /// Return true if OS caches ATA identify sector.
   /// Default implementation returns false.
   virtual bool ata_identify_is_cached() const;
 
+  /// Return largest number of sectors known to work with
+  /// multi-sector READ LOG EXT, 0 if not yet known.
+  unsigned get_max_log_ext_sectors() const
+    { return m_max_log_ext_sectors; }
+
+  /// Set largest number of sectors for multi-sector READ LOG EXT.
+  void set_max_log_ext_sectors(unsigned nsectors)
+    { m_max_log_ext_sectors = nsectors; }
+
 protected:
   /// Check command input parameters.
   /// Calls set_err(...) accordingly.
@@ -521,8 +619,12 @@ protected:
 
   /// Default constructor, registers device as ATA.
   ata_device()
-    : smart_device(never_called)
+    : smart_device(never_called),
+      m_max_log_ext_sectors(0)
     { this_is_ata(this); }
+
+private:
+  unsigned m_max_log_ext_sectors;
 };
 
 
@@ -540,11 +642,32 @@ public:
   /// Returns false on error.
   virtual bool scsi_pass_through(scsi_cmnd_io * iop) = 0;
 
+  /// SCSI pass through with command statistics.
+  /// Returns false on error.
+  /// Calls scsi_pass_through(iop), cannot be reimplemented.
+  bool scsi_pass_through_timed(scsi_cmnd_io * iop);
+
+  /// Return cached LOG SENSE response length of log page
+  /// (subpage 0), 0 if not yet known.
+  int get_log_sense_len(int pagenum) const
+    { return m_log_sense_len[pagenum & 0x3f]; }
+
+  /// Set cached LOG SENSE response length of log page, 0 to forget.
+  void set_log_sense_len(int pagenum, int len)
+    { m_log_sense_len[pagenum & 0x3f] = (unsigned short)len; }
+
 protected:
   /// Default constructor, registers device as SCSI.
   scsi_device()
     : smart_device(never_called)
-    { this_is_scsi(this); }
+    {
+      this_is_scsi(this);
+      for (int i = 0; i < 64; i++)
+        m_log_sense_len[i] = 0;
+    }
+
+private:
+  unsigned short m_log_sense_len[64];
 };
 
 
@@ -841,6 +964,17 @@ public:
                                               int version = -1);
   //{ implemented in scsiata.cpp }
 
+  /// Return device which passes all commands to 'basedev' and
+  /// records the traffic in 'file'.  Takes ownership of 'basedev'.
+  /// Override only if platform needs special handling.
+  virtual smart_device * get_record_device(const char * file, smart_device * basedev);
+  //{ implemented in dev_record.cpp }
+
+  /// Return device 'name' which replays the traffic recorded in 'file'.
+  /// Override only if platform needs special handling.
+  virtual smart_device * get_replay_device(const char * name, const char * file);
+  //{ implemented in dev_record.cpp }
+
 protected:
   /// Set interface to use, must be called from init().
   static void set(smart_interface * intf)
@@ -0,0 +1,811 @@
+/*
+ * dev_record.cpp
+ *
+ * Home page of code is: http://smartmontools.sourceforge.net
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Devices to record ATA/SCSI pass-through traffic to a file ('-d record,FILE')
+// and to replay it later without the original hardware ('-d replay,FILE').
+//
+// Record file format (all numbers little endian):
+//
+// Header:
+//   8 bytes  "SMRECORD"
+//   1 byte   Format version (1)
+//   1 byte   Protocol: 'A' = ATA, 'S' = SCSI
+//   2 bytes  Reserved (0)
+//
+// Followed by one record per command:
+//   4 bytes  Length of request
+//   N bytes  Request
+//   4 bytes  Length of response
+//   M bytes  Response
+//
+// ATA request:
+//   1 byte   Direction (ata_cmd_in::no_data, data_in, data_out)
+//   1 byte   1 if 48-bit command
+//   7 bytes  Input registers: features, sector_count, lba_low, lba_mid,
+//            lba_high, device, command
+//   7 bytes  Previous input registers (48-bit)
+//   4 bytes  Size of data buffer
+//
+// SCSI request:
+//   1 byte   Direction (DXFER_NONE, DXFER_FROM_DEVICE, DXFER_TO_DEVICE)
+//   4 bytes  Size of data buffer
+//   1 byte   Length of CDB
+//   N bytes  CDB
+//
+// Response (both protocols):
+//   1 byte   1 if command succeeded
+//   4 bytes  Error number, 0 if succeeded
+//   2 bytes  Length of error message
+//   N bytes  Error message
+//
+// ATA response continued:
+//   2 bytes  Bit mask of output registers set (bit 0-6: recent, bit 8-14: previous)
+//   7 bytes  Output registers: error, sector_count, lba_low, lba_mid,
+//            lba_high, device, status
+//   7 bytes  Previous output registers (48-bit)
+//   4 bytes  Length of data read from device
+//   N bytes  Data
+//
+// SCSI response continued:
+//   1 byte   SCSI status
+//   4 bytes  Residual count (signed)
+//   1 byte   Length of sense data
+//   N bytes  Sense data
+//   4 bytes  Length of data read from device
+//   N bytes  Data
+//
+// Data written to the device is not recorded.  Replay searches the
+// records for the next matching request, starting after the last
+// match and wrapping around at the end of file.  Repeated runs over
+// the same commands (e.g. smartd check cycles) therefore return the
+// recorded responses in the original order.
+
+#include "config.h"
+#include "int64.h"
+#include "scsicmds.h"
+#include "utility.h"
+#include "dev_interface.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+const char * dev_record_cpp_cvsid = "$Id$";
+
+namespace dev_record { // no need to publish anything, name provided for Doxygen
+
+static const char record_magic[8] = { 'S','M','R','E','C','O','R','D' };
+const unsigned record_version = 1;
+const unsigned max_record_size = 16 * 1024 * 1024;
+
+/////////////////////////////////////////////////////////////////////////////
+// Encoding helpers
+
+static void put_u8(std::string & buf, unsigned val)
+{
+  buf += (char)(val & 0xff);
+}
+
+static void put_u16(std::string & buf, unsigned val)
+{
+  put_u8(buf, val); put_u8(buf, val >> 8);
+}
+
+static void put_u32(std::string & buf, unsigned val)
+{
+  put_u16(buf, val); put_u16(buf, val >> 16);
+}
+
+static void put_bytes(std::string & buf, const void * data, unsigned size)
+{
+  if (size)
+    buf.append((const char *)data, size);
+}
+
+static void put_in_regs(std::string & buf, const ata_in_regs & r)
+{
+  put_u8(buf, r.features);   put_u8(buf, r.sector_count);
+  put_u8(buf, r.lba_low);    put_u8(buf, r.lba_mid);
+  put_u8(buf, r.lba_high);   put_u8(buf, r.device);
+  put_u8(buf, r.command);
+}
+
+// Return bit mask of output registers set
+static unsigned get_out_mask(const ata_out_regs & r)
+{
+  return (  (r.error.is_set()        ? 0x01 : 0) | (r.sector_count.is_set() ? 0x02 : 0)
+          | (r.lba_low.is_set()      ? 0x04 : 0) | (r.lba_mid.is_set()      ? 0x08 : 0)
+          | (r.lba_high.is_set()     ? 0x10 : 0) | (r.device.is_set()       ? 0x20 : 0)
+          | (r.status.is_set()       ? 0x40 : 0));
+}
+
+static void put_out_regs(std::string & buf, const ata_out_regs & r)
+{
+  put_u8(buf, r.error);      put_u8(buf, r.sector_count);
+  put_u8(buf, r.lba_low);    put_u8(buf, r.lba_mid);
+  put_u8(buf, r.lba_high);   put_u8(buf, r.device);
+  put_u8(buf, r.status);
+}
+
+static void put_status(std::string & buf, bool ok, const smart_device::error_info & err)
+{
+  put_u8(buf, ok);
+  if (ok) {
+    put_u32(buf, 0); put_u16(buf, 0);
+  }
+  else {
+    unsigned len = (err.msg.size() < 0xffff ? err.msg.size() : 0xffff);
+    put_u32(buf, (unsigned)err.no); put_u16(buf, len);
+    put_bytes(buf, err.msg.data(), len);
+  }
+}
+
+/// Read numbers and data from a record, never reads past end of buffer.
+class record_reader
+{
+public:
+  explicit record_reader(const std::string & buf)
+    : m_buf(buf), m_pos(0), m_ok(true) { }
+
+  /// Return false if read past end of record.
+  bool ok() const
+    { return m_ok; }
+
+  unsigned get_u8()
+    {
+      if (m_pos >= m_buf.size()) {
+        m_ok = false; return 0;
+      }
+      return (unsigned char)m_buf[m_pos++];
+    }
+
+  unsigned get_u16()
+    { unsigned lo = get_u8(); return lo | (get_u8() << 8); }
+
+  unsigned get_u32()
+    { unsigned lo = get_u16(); return lo | (get_u16() << 16); }
+
+  /// Return pointer to next 'size' bytes, 0 if not available.
+  const unsigned char * get_bytes(unsigned size)
+    {
+      if (size > m_buf.size() - m_pos) {
+        m_ok = false; return 0;
+      }
+      const unsigned char * p = (const unsigned char *)m_buf.data() + m_pos;
+      m_pos += size;
+      return p;
+    }
+
+private:
+  const std::string & m_buf;
+  unsigned m_pos;
+  bool m_ok;
+};
+
+static void get_out_regs(record_reader & rd, ata_out_regs & r, unsigned mask)
+{
+  ata_register * regs[7] = {
+    &r.error, &r.sector_count, &r.lba_low, &r.lba_mid,
+    &r.lba_high, &r.device, &r.status
+  };
+  for (int i = 0; i < 7; i++) {
+    unsigned char val = rd.get_u8();
+    if (mask & (1 << i))
+      *regs[i] = val;
+  }
+}
+
+// Read status part of response, set error info if command failed.
+static bool get_status(record_reader & rd, smart_device::error_info & err)
+{
+  bool ok = !!rd.get_u8();
+  err.no = (int)rd.get_u32();
+  unsigned len = rd.get_u16();
+  const unsigned char * msg = rd.get_bytes(len);
+  err.msg.assign(msg ? (const char *)msg : "", msg ? len : 0);
+  return ok;
+}
+
+static std::string ata_request(const ata_cmd_in & in)
+{
+  std::string req;
+  put_u8(req, in.direction);
+  put_u8(req, in.in_regs.is_48bit_cmd());
+  put_in_regs(req, in.in_regs);
+  put_in_regs(req, in.in_regs.prev);
+  put_u32(req, (in.direction != ata_cmd_in::no_data ? in.size : 0));
+  return req;
+}
+
+static std::string scsi_request(const scsi_cmnd_io * iop)
+{
+  std::string req;
+  put_u8(req, iop->dxfer_dir);
+  put_u32(req, (iop->dxfer_dir != DXFER_NONE ? iop->dxfer_len : 0));
+  put_u8(req, iop->cmnd_len);
+  put_bytes(req, iop->cmnd, iop->cmnd_len);
+  return req;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// record_device_base
+
+/// Common functionality of recording devices.
+/// Owns the device which executes the commands.
+class record_device_base
+: virtual public /*implements*/ smart_device
+{
+protected:
+  record_device_base(const char * filename, smart_device * basedev);
+
+public:
+  virtual ~record_device_base() throw();
+
+  virtual bool is_open() const;
+
+  virtual bool open();
+
+  virtual bool close();
+
+  virtual smart_device * autodetect_open();
+
+  virtual bool owns(const smart_device * dev) const;
+
+  virtual void release(const smart_device * dev);
+
+protected:
+  /// Return device which executes the commands.
+  smart_device * get_base_dev()
+    { return m_basedev; }
+  const smart_device * get_base_dev() const
+    { return m_basedev; }
+
+  /// Append one record.
+  /// Return false on write error.
+  bool write_record(const std::string & req, const std::string & resp);
+
+private:
+  std::string m_filename;
+  smart_device * m_basedev;
+  FILE * m_file;
+
+  /// Create record file and write header if not yet done.
+  /// Return false on error.
+  bool create_file();
+};
+
+/// Return new recording device for 'basedev', 0 if neither ATA nor SCSI.
+static record_device_base * new_record_device(smart_interface * intf,
+  const char * filename, smart_device * basedev);
+
+record_device_base::record_device_base(const char * filename, smart_device * basedev)
+: smart_device(never_called),
+  m_filename(filename), m_basedev(basedev), m_file(0)
+{
+}
+
+record_device_base::~record_device_base() throw()
+{
+  if (m_file)
+    fclose(m_file);
+  delete m_basedev;
+}
+
+bool record_device_base::is_open() const
+{
+  return (m_basedev && m_basedev->is_open());
+}
+
+bool record_device_base::open()
+{
+  if (!m_basedev)
+    return set_err(ENOSYS);
+  if (!m_basedev->open())
+    return set_err(m_basedev->get_err());
+  if (!create_file()) {
+    m_basedev->close();
+    return false;
+  }
+  return true;
+}
+
+bool record_device_base::close()
+{
+  if (!m_basedev)
+    return true;
+  if (!m_basedev->close())
+    return set_err(m_basedev->get_err());
+  return true;
+}
+
+smart_device * record_device_base::autodetect_open()
+{
+  if (!m_basedev)
+    return (set_err(ENOSYS), this);
+
+  // Base device may be deleted or owned by the returned device
+  smart_device * basedev = m_basedev;
+  m_basedev = 0;
+  smart_device * newdev = basedev->autodetect_open();
+  if (newdev == basedev) {
+    m_basedev = basedev;
+    if (!basedev->is_open())
+      set_err(basedev->get_err());
+    else if (!create_file())
+      basedev->close();
+    return this;
+  }
+
+  // Base device type has changed, record at the level of the new device
+  record_device_base * recdev = new_record_device(smi(), m_filename.c_str(), newdev);
+  if (!recdev) {
+    m_basedev = newdev;
+    set_err(EINVAL, "%s: Unknown device protocol", newdev->get_info_name());
+    return this;
+  }
+  delete this;
+
+  if (!newdev->is_open())
+    recdev->set_err(newdev->get_err());
+  else if (!recdev->create_file())
+    newdev->close();
+  return recdev;
+}
+
+bool record_device_base::owns(const smart_device * dev) const
+{
+  return (m_basedev && m_basedev == dev);
+}
+
+void record_device_base::release(const smart_device * dev)
+{
+  if (m_basedev == dev)
+    m_basedev = 0;
+}
+
+bool record_device_base::create_file()
+{
+  if (m_file)
+    return true;
+  // Close and re-open keeps the file, a new device object starts a new recording
+  m_file = fopen(m_filename.c_str(), "wb");
+  if (!m_file)
+    return set_err(errno, "%s: %s", m_filename.c_str(), strerror(errno));
+  std::string hdr(record_magic, sizeof(record_magic));
+  put_u8(hdr, record_version);
+  put_u8(hdr, (is_ata() ? 'A' : 'S'));
+  put_u16(hdr, 0);
+  if (!(fwrite(hdr.data(), hdr.size(), 1, m_file) == 1 && !fflush(m_file))) {
+    int err = errno;
+    fclose(m_file); m_file = 0;
+    return set_err(err, "%s: %s", m_filename.c_str(), strerror(err));
+  }
+  return true;
+}
+
+bool record_device_base::write_record(const std::string & req, const std::string & resp)
+{
+  if (!m_file)
+    return set_err(EBADF, "%s: Record file not open", m_filename.c_str());
+  std::string rec;
+  put_u32(rec, req.size()); rec += req;
+  put_u32(rec, resp.size()); rec += resp;
+  // Flush each record, recording may end with a crash
+  if (!(fwrite(rec.data(), rec.size(), 1, m_file) == 1 && !fflush(m_file)))
+    return set_err(errno, "%s: %s", m_filename.c_str(), strerror(errno));
+  return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// record_ata_device
+
+/// Record ATA pass-through traffic of another ATA device.
+class record_ata_device
+: public /*implements*/ ata_device,
+  public record_device_base
+{
+public:
+  record_ata_device(smart_interface * intf, const char * filename, ata_device * atadev);
+
+  virtual ~record_ata_device() throw();
+
+  virtual bool ata_pass_through(const ata_cmd_in & in, ata_cmd_out & out);
+
+  virtual bool ata_identify_is_cached() const;
+};
+
+record_ata_device::record_ata_device(smart_interface * intf, const char * filename,
+  ata_device * atadev)
+: smart_device(intf, atadev->get_dev_name(),
+    strprintf("record,%s+%s", filename, atadev->get_dev_type()).c_str(),
+    atadev->get_req_type()),
+  record_device_base(filename, atadev)
+{
+  set_info().info_name = atadev->get_info_name();
+}
+
+record_ata_device::~record_ata_device() throw()
+{
+}
+
+bool record_ata_device::ata_pass_through(const ata_cmd_in & in, ata_cmd_out & out)
+{
+  std::string req = ata_request(in);
+
+  ata_device * atadev = get_base_dev()->to_ata();
+  bool ok = atadev->ata_pass_through(in, out);
+  if (!ok)
+    set_err(atadev->get_err());
+
+  std::string resp;
+  put_status(resp, ok, get_err());
+  put_u16(resp, get_out_mask(out.out_regs) | (get_out_mask(out.out_regs.prev) << 8));
+  put_out_regs(resp, out.out_regs);
+  put_out_regs(resp, out.out_regs.prev);
+  unsigned datalen = (ok && in.direction == ata_cmd_in::data_in ? in.size : 0);
+  put_u32(resp, datalen);
+  put_bytes(resp, in.buffer, datalen);
+
+  if (!write_record(req, resp))
+    return false;
+  return ok;
+}
+
+bool record_ata_device::ata_identify_is_cached() const
+{
+  return get_base_dev()->to_ata()->ata_identify_is_cached();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// record_scsi_device
+
+/// Record SCSI pass-through traffic of another SCSI device.
+class record_scsi_device
+: public /*implements*/ scsi_device,
+  public record_device_base
+{
+public:
+  record_scsi_device(smart_interface * intf, const char * filename, scsi_device * scsidev);
+
+  virtual ~record_scsi_device() throw();
+
+  virtual bool scsi_pass_through(scsi_cmnd_io * iop);
+};
+
+record_scsi_device::record_scsi_device(smart_interface * intf, const char * filename,
+  scsi_device * scsidev)
+: smart_device(intf, scsidev->get_dev_name(),
+    strprintf("record,%s+%s", filename, scsidev->get_dev_type()).c_str(),
+    scsidev->get_req_type()),
+  record_device_base(filename, scsidev)
+{
+  set_info().info_name = scsidev->get_info_name();
+}
+
+record_scsi_device::~record_scsi_device() throw()
+{
+}
+
+bool record_scsi_device::scsi_pass_through(scsi_cmnd_io * iop)
+{
+  std::string req = scsi_request(iop);
+
+  scsi_device * scsidev = get_base_dev()->to_scsi();
+  bool ok = scsidev->scsi_pass_through(iop);
+  if (!ok)
+    set_err(scsidev->get_err());
+
+  std::string resp;
+  put_status(resp, ok, get_err());
+  put_u8(resp, iop->scsi_status);
+  put_u32(resp, (unsigned)iop->resid);
+  unsigned senselen = (iop->sensep ? iop->resp_sense_len : 0);
+  if (senselen > iop->max_sense_len)
+    senselen = iop->max_sense_len;
+  if (senselen > 0xff)
+    senselen = 0xff;
+  put_u8(resp, senselen);
+  put_bytes(resp, iop->sensep, senselen);
+  unsigned datalen = 0;
+  if (ok && iop->dxfer_dir == DXFER_FROM_DEVICE) {
+    datalen = iop->dxfer_len;
+    if (0 < iop->resid && (unsigned)iop->resid < datalen)
+      datalen -= iop->resid;
+  }
+  put_u32(resp, datalen);
+  put_bytes(resp, iop->dxferp, datalen);
+
+  if (!write_record(req, resp))
+    return false;
+  return ok;
+}
+
+
+static record_device_base * new_record_device(smart_interface * intf,
+  const char * filename, smart_device * basedev)
+{
+  if (basedev->is_ata())
+    return new record_ata_device(intf, filename, basedev->to_ata());
+  if (basedev->is_scsi())
+    return new record_scsi_device(intf, filename, basedev->to_scsi());
+  return 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// replay_device_base
+
+/// List of recorded (request, response) pairs.
+typedef std::vector< std::pair<std::string, std::string> > record_list;
+
+/// Common functionality of replaying devices.
+class replay_device_base
+: virtual public /*implements*/ smart_device
+{
+protected:
+  replay_device_base(const char * filename, record_list & records);
+
+public:
+  virtual ~replay_device_base() throw();
+
+  virtual bool is_open() const;
+
+  virtual bool open();
+
+  virtual bool close();
+
+protected:
+  /// Return response of next record matching 'req', 0 if not found.
+  const std::string * find_response(const std::string & req);
+
+private:
+  std::string m_filename;
+  record_list m_records;
+  unsigned m_next;
+  bool m_is_open;
+};
+
+replay_device_base::replay_device_base(const char * filename, record_list & records)
+: smart_device(never_called),
+  m_filename(filename), m_next(0), m_is_open(false)
+{
+  m_records.swap(records);
+}
+
+replay_device_base::~replay_device_base() throw()
+{
+}
+
+bool replay_device_base::is_open() const
+{
+  return m_is_open;
+}
+
+bool replay_device_base::open()
+{
+  m_is_open = true;
+  return true;
+}
+
+bool replay_device_base::close()
+{
+  m_is_open = false;
+  return true;
+}
+
+const std::string * replay_device_base::find_response(const std::string & req)
+{
+  unsigned n = m_records.size();
+  for (unsigned i = 0; i < n; i++) {
+    unsigned j = (m_next + i) % n;
+    if (m_records[j].first == req) {
+      m_next = j + 1;
+      return &m_records[j].second;
+    }
+  }
+  set_err(EIO, "%s: Command not recorded", m_filename.c_str());
+  return 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// replay_ata_device
+
+/// Replay recorded ATA pass-through traffic.
+class replay_ata_device
+: public /*implements*/ ata_device,
+  public replay_device_base
+{
+public:
+  replay_ata_device(smart_interface * intf, const char * dev_name,
+    const char * filename, record_list & records);
+
+  virtual ~replay_ata_device() throw();
+
+  virtual bool ata_pass_through(const ata_cmd_in & in, ata_cmd_out & out);
+};
+
+replay_ata_device::replay_ata_device(smart_interface * intf, const char * dev_name,
+  const char * filename, record_list & records)
+: smart_device(intf, dev_name, strprintf("replay,%s", filename).c_str(), ""),
+  replay_device_base(filename, records)
+{
+}
+
+replay_ata_device::~replay_ata_device() throw()
+{
+}
+
+bool replay_ata_device::ata_pass_through(const ata_cmd_in & in, ata_cmd_out & out)
+{
+  const std::string * resp = find_response(ata_request(in));
+  if (!resp)
+    return false;
+
+  record_reader rd(*resp);
+  error_info err;
+  bool ok = get_status(rd, err);
+  unsigned mask = rd.get_u16();
+  get_out_regs(rd, out.out_regs, mask);
+  get_out_regs(rd, out.out_regs.prev, mask >> 8);
+  unsigned datalen = rd.get_u32();
+  const unsigned char * data = rd.get_bytes(datalen);
+  if (!rd.ok())
+    return set_err(EIO, "Corrupt ATA record");
+  if (data && in.direction == ata_cmd_in::data_in)
+    memcpy(in.buffer, data, (datalen < in.size ? datalen : in.size));
+
+  if (!ok)
+    return set_err(err);
+  return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// replay_scsi_device
+
+/// Replay recorded SCSI pass-through traffic.
+class replay_scsi_device
+: public /*implements*/ scsi_device,
+  public replay_device_base
+{
+public:
+  replay_scsi_device(smart_interface * intf, const char * dev_name,
+    const char * filename, record_list & records);
+
+  virtual ~replay_scsi_device() throw();
+
+  virtual bool scsi_pass_through(scsi_cmnd_io * iop);
+};
+
+replay_scsi_device::replay_scsi_device(smart_interface * intf, const char * dev_name,
+  const char * filename, record_list & records)
+: smart_device(intf, dev_name, strprintf("replay,%s", filename).c_str(), ""),
+  replay_device_base(filename, records)
+{
+}
+
+replay_scsi_device::~replay_scsi_device() throw()
+{
+}
+
+bool replay_scsi_device::scsi_pass_through(scsi_cmnd_io * iop)
+{
+  const std::string * resp = find_response(scsi_request(iop));
+  if (!resp)
+    return false;
+
+  record_reader rd(*resp);
+  error_info err;
+  bool ok = get_status(rd, err);
+  unsigned char status = rd.get_u8();
+  int resid = (int)rd.get_u32();
+  unsigned senselen = rd.get_u8();
+  const unsigned char * sense = rd.get_bytes(senselen);
+  unsigned datalen = rd.get_u32();
+  const unsigned char * data = rd.get_bytes(datalen);
+  if (!rd.ok())
+    return set_err(EIO, "Corrupt SCSI record");
+
+  iop->scsi_status = status;
+  iop->resid = resid;
+  iop->resp_sense_len = 0;
+  if (iop->sensep && senselen) {
+    iop->resp_sense_len = (senselen < iop->max_sense_len ? senselen : iop->max_sense_len);
+    memcpy(iop->sensep, sense, iop->resp_sense_len);
+  }
+  if (data && iop->dxfer_dir == DXFER_FROM_DEVICE)
+    memcpy(iop->dxferp, data, (datalen < iop->dxfer_len ? datalen : iop->dxfer_len));
+
+  if (!ok)
+    return set_err(err);
+  return true;
+}
+
+
+// Read 4 byte little endian number, return false on EOF
+static bool read_u32(FILE * f, unsigned & val)
+{
+  unsigned char b[4];
+  if (fread(b, sizeof(b), 1, f) != 1)
+    return false;
+  val = b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned)b[3] << 24);
+  return true;
+}
+
+// Read 'size' bytes into 'buf', return false on EOF
+static bool read_string(FILE * f, std::string & buf, unsigned size)
+{
+  if (size > max_record_size)
+    return false;
+  buf.resize(size);
+  return (!size || fread(&buf[0], size, 1, f) == 1);
+}
+
+} // namespace
+
+using namespace dev_record;
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Device factories
+
+smart_device * smart_interface::get_record_device(const char * file, smart_device * basedev)
+{
+  smart_device * recdev = new_record_device(this, file, basedev);
+  if (!recdev)
+    set_err(EINVAL, "Type 'record,...': Device type '%s' is neither ATA nor SCSI",
+            basedev->get_dev_type());
+  return recdev;
+}
+
+smart_device * smart_interface::get_replay_device(const char * name, const char * file)
+{
+  stdio_file f(file, "rb");
+  if (!f) {
+    set_err(errno, "%s: %s", file, strerror(errno));
+    return 0;
+  }
+
+  unsigned char hdr[12];
+  if (!(   fread(hdr, sizeof(hdr), 1, f) == 1
+        && !memcmp(hdr, record_magic, sizeof(record_magic))
+        && hdr[8] == record_version && (hdr[9] == 'A' || hdr[9] == 'S'))) {
+    set_err(EINVAL, "%s: Not a record file of this version", file);
+    return 0;
+  }
+
+  // Read all records, a truncated last record is ignored
+  record_list records;
+  for (;;) {
+    unsigned reqlen, resplen;
+    std::string req, resp;
+    if (!(   read_u32(f, reqlen) && read_string(f, req, reqlen)
+          && read_u32(f, resplen) && read_string(f, resp, resplen)))
+      break;
+    records.push_back(std::make_pair(req, resp));
+  }
+
+  if (hdr[9] == 'A')
+    return new replay_ata_device(this, name, file, records);
+  return new replay_scsi_device(this, name, file, records);
+}
@@ -0,0 +1,265 @@
+/*
+ * json.cpp
+ *
+ * Home page of code is: http://smartmontools.sourceforge.net
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+#include "int64.h"
+#include "json.h"
+#include "utility.h"
+
+const char * json_cpp_cvsid = "$Id$"
+  JSON_H_CVSID;
+
+json::json()
+: m_type(nt_null), m_uval(0)
+{
+}
+
+json::~json()
+{
+  clear();
+}
+
+void json::clear()
+{
+  for (unsigned i = 0; i < m_children.size(); i++)
+    delete m_children[i];
+  m_children.clear();
+  m_keys.clear();
+  m_sval.erase();
+  m_uval = 0;
+  m_type = nt_null;
+}
+
+// Change type, drop children if node was object or array before
+void json::set_type(node_type type)
+{
+  if (m_type == type)
+    return;
+  clear();
+  m_type = type;
+}
+
+json & json::operator[](const char * key)
+{
+  set_type(nt_object);
+  for (unsigned i = 0; i < m_keys.size(); i++) {
+    if (m_keys[i] == key)
+      return *m_children[i];
+  }
+  m_keys.push_back(key);
+  m_children.push_back(new json);
+  return *m_children.back();
+}
+
+json & json::operator[](unsigned index)
+{
+  set_type(nt_array);
+  while (m_children.size() <= index)
+    m_children.push_back(new json);
+  return *m_children[index];
+}
+
+json & json::operator=(bool value)
+{
+  set_type(nt_bool);
+  m_uval = value;
+  return *this;
+}
+
+json & json::operator=(int value)
+{
+  return operator=((int64_t)value);
+}
+
+json & json::operator=(unsigned value)
+{
+  return operator=((uint64_t)value);
+}
+
+json & json::operator=(int64_t value)
+{
+  set_type(nt_int);
+  m_uval = (uint64_t)value;
+  return *this;
+}
+
+json & json::operator=(uint64_t value)
+{
+  set_type(nt_uint);
+  m_uval = value;
+  return *this;
+}
+
+json & json::operator=(const char * value)
+{
+  set_type(nt_string);
+  m_sval = value;
+  return *this;
+}
+
+json & json::operator=(const std::string & value)
+{
+  return operator=(value.c_str());
+}
+
+// Append string with JSON escapes, non-ASCII bytes are taken as Latin-1
+static void format_string(std::string & out, const std::string & s)
+{
+  out += '"';
+  for (unsigned i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    switch (c) {
+      case '"':  out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if (c < 0x20 || c >= 0x7f)
+          out += strprintf("\\u%04x", c);
+        else
+          out += (char)c;
+    }
+  }
+  out += '"';
+}
+
+static void format_indent(std::string & out, bool pretty, int level)
+{
+  if (!pretty)
+    return;
+  out += '\n';
+  out.append(2 * level, ' ');
+}
+
+void json::format_value(std::string & out, bool pretty, int level) const
+{
+  switch (m_type) {
+    case nt_null:
+      out += "null";
+      break;
+    case nt_bool:
+      out += (m_uval ? "true" : "false");
+      break;
+    case nt_int:
+      out += strprintf("%"PRId64, (int64_t)m_uval);
+      break;
+    case nt_uint:
+      out += strprintf("%"PRIu64, m_uval);
+      break;
+    case nt_string:
+      format_string(out, m_sval);
+      break;
+    case nt_object:
+    case nt_array:
+      out += (m_type == nt_object ? '{' : '[');
+      for (unsigned i = 0; i < m_children.size(); i++) {
+        if (i)
+          out += ',';
+        format_indent(out, pretty, level + 1);
+        if (m_type == nt_object) {
+          format_string(out, m_keys[i]);
+          out += (pretty ? ": " : ":");
+        }
+        m_children[i]->format_value(out, pretty, level + 1);
+      }
+      if (!m_children.empty())
+        format_indent(out, pretty, level);
+      out += (m_type == nt_object ? '}' : ']');
+      break;
+  }
+}
+
+void json::format(std::string & out, bool pretty) const
+{
+  format_value(out, pretty, 0);
+  out += '\n';
+}
+
+void json::print(FILE * f, bool pretty) const
+{
+  std::string out;
+  format(out, pretty);
+  fputs(out.c_str(), f);
+}
+
+// Append CBOR head: major type and argument in shortest form
+static void cbor_head(std::string & out, unsigned char major, uint64_t arg)
+{
+  major <<= 5;
+  if (arg < 24)
+    out += (char)(major | arg);
+  else {
+    int n = (arg <= 0xff ? 1 : arg <= 0xffff ? 2 : arg <= 0xffffffffU ? 4 : 8);
+    out += (char)(major | (n == 1 ? 24 : n == 2 ? 25 : n == 4 ? 26 : 27));
+    for (int i = n - 1; i >= 0; i--)
+      out += (char)(arg >> (8 * i));
+  }
+}
+
+// Append CBOR text string, non-ASCII bytes are taken as Latin-1
+static void cbor_string(std::string & out, const std::string & s)
+{
+  std::string u;
+  for (unsigned i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if (c < 0x80)
+      u += (char)c;
+    else {
+      u += (char)(0xc0 | (c >> 6));
+      u += (char)(0x80 | (c & 0x3f));
+    }
+  }
+  cbor_head(out, 3, u.size());
+  out += u;
+}
+
+void json::encode_cbor(std::string & out) const
+{
+  switch (m_type) {
+    case nt_null:
+      out += (char)0xf6;
+      break;
+    case nt_bool:
+      out += (char)(m_uval ? 0xf5 : 0xf4);
+      break;
+    case nt_int:
+      if ((int64_t)m_uval < 0)
+        cbor_head(out, 1, ~m_uval); // -1 - value
+      else
+        cbor_head(out, 0, m_uval);
+      break;
+    case nt_uint:
+      cbor_head(out, 0, m_uval);
+      break;
+    case nt_string:
+      cbor_string(out, m_sval);
+      break;
+    case nt_object:
+      cbor_head(out, 5, m_children.size());
+      for (unsigned i = 0; i < m_children.size(); i++) {
+        cbor_string(out, m_keys[i]);
+        m_children[i]->encode_cbor(out);
+      }
+      break;
+    case nt_array:
+      cbor_head(out, 4, m_children.size());
+      for (unsigned i = 0; i < m_children.size(); i++)
+        m_children[i]->encode_cbor(out);
+      break;
+  }
+}
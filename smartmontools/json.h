@@ -0,0 +1,109 @@
+/*
+ * json.h
+ *
+ * Home page of code is: http://smartmontools.sourceforge.net
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (for example COPYING); If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef JSON_H
+#define JSON_H
+
+#define JSON_H_CVSID "$Id$"
+
+#include "int64.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Tree of JSON values for structured output.
+//
+// Nodes are created on first access and get their type from the first
+// assignment or subscript:
+//   j["ata_smart_attributes"]["table"][i]["id"] = id;
+// Object members keep insertion order.  The tree is printed as JSON
+// text or encoded as CBOR (RFC 7049), a compact binary form with the
+// same data model.
+
+class json
+{
+public:
+  enum node_type {
+    nt_null, nt_bool, nt_int, nt_uint, nt_string, nt_object, nt_array
+  };
+
+  json();
+  ~json();
+
+  /// Return type of node.
+  node_type get_type() const
+    { return m_type; }
+
+  /// Set type of node, drop value and children if type changes.
+  /// Use to create empty objects or arrays.
+  void set_type(node_type type);
+
+  /// Return true if node was not yet set.
+  bool is_null() const
+    { return (m_type == nt_null); }
+
+  /// Get object member, create if missing.  Node becomes an object.
+  json & operator[](const char * key);
+  json & operator[](const std::string & key)
+    { return operator[](key.c_str()); }
+
+  /// Get array element, create if missing.  Node becomes an array.
+  json & operator[](unsigned index);
+  json & operator[](int index)
+    { return operator[]((unsigned)index); }
+
+  /// Return number of object members or array elements.
+  unsigned size() const
+    { return m_children.size(); }
+
+  /// Set value.
+  json & operator=(bool value);
+  json & operator=(int value);
+  json & operator=(unsigned value);
+  json & operator=(int64_t value);
+  json & operator=(uint64_t value);
+  json & operator=(const char * value);
+  json & operator=(const std::string & value);
+
+  /// Remove all children and value.
+  void clear();
+
+  /// Print as JSON text, indented if 'pretty' is set.
+  void print(FILE * f, bool pretty) const;
+
+  /// Append JSON text to 'out'.
+  void format(std::string & out, bool pretty) const;
+
+  /// Append CBOR encoding to 'out'.
+  void encode_cbor(std::string & out) const;
+
+private:
+  node_type m_type;
+  uint64_t m_uval;              // nt_bool, nt_int (two's complement), nt_uint
+  std::string m_sval;           // nt_string
+  std::vector<std::string> m_keys; // nt_object
+  std::vector<json *> m_children;  // nt_object, nt_array
+
+  void format_value(std::string & out, bool pretty, int level) const;
+
+  // Prevent copy/assigment
+  json(const json &);
+  void operator=(const json &);
+};
+
+#endif // JSON_H
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include "atacmds.h"
 #include "extern.h"
+#include "json.h"
 #include "knowndrives.h"
 #include "utility.h"
 
@@ -33,7 +34,12 @@
 #include <io.h> // access()
 #endif
 
+#include <algorithm>
+#include <bitset>
+#include <ctype.h>
+#include <deque>
 #include <stdexcept>
+#include <time.h>
 
 const char * knowndrives_cpp_cvsid = "$Id$"
                                      KNOWNDRIVES_H_CVSID;
@@ -54,9 +60,283 @@ const drive_settings builtin_knowndrives[] = {
 };
 
 
+// Return true if modelfamily string describes entry for USB ID
+static bool is_usb_modelfamily(const char * modelfamily)
+{
+  return !strncmp(modelfamily, "USB:", 4);
+}
+
+// Return true if entry for USB ID
+static inline bool is_usb_entry(const drive_settings * dbentry)
+{
+  return is_usb_modelfamily(dbentry->modelfamily);
+}
+
+// Compile regular expression, print message on failure.
+static bool compile(regular_expression & regex, const char *pattern)
+{
+  if (!regex.compile(pattern, REG_EXTENDED)) {
+    pout("Internal error: unable to compile regular expression \"%s\": %s\n"
+         "Please inform smartmontools developers at " PACKAGE_BUGREPORT "\n",
+      pattern, regex.get_errmsg());
+    return false;
+  }
+  return true;
+}
+
+// Compile & match a regular expression.
+static bool match(const char * pattern, const char * str)
+{
+  regular_expression regex;
+  if (!compile(regex, pattern))
+    return false;
+  return regex.full_match(str);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Lookup index support
+
+// Set of possible first chars of a string.
+typedef std::bitset<256> first_char_set;
+
+static bool get_first_chars_alt(const char * & p, first_char_set & first, bool & ok);
+
+// Get possible first chars of a single ERE atom and advance 'p'.
+// Returns true if the atom may match the empty string.
+static bool get_first_chars_atom(const char * & p, first_char_set & first, bool & ok)
+{
+  switch (*p) {
+    case '(':
+      {
+        ++p;
+        bool nullable = get_first_chars_alt(p, first, ok);
+        if (*p != ')') {
+          ok = false; return true;
+        }
+        ++p;
+        return nullable;
+      }
+
+    case '[':
+      {
+        ++p;
+        bool neg = (*p == '^');
+        if (neg)
+          ++p;
+        first_char_set chars;
+        if (*p == ']') {
+          chars.set(']'); ++p;
+        }
+        while (*p && *p != ']') {
+          if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            // [:class:], [.coll.], [=equiv=]: Assume any char
+            const char * e = p + 2;
+            while (*e && !(*e == p[1] && e[1] == ']'))
+              e++;
+            if (!*e) {
+              ok = false; return true;
+            }
+            chars.set(); p = e + 2;
+            continue;
+          }
+          unsigned char c1 = *p++;
+          if (*p == '-' && p[1] && p[1] != ']') {
+            // Range, also add other case of letters to be safe
+            // in case of locale dependent collation order
+            unsigned char c2 = p[1]; p += 2;
+            for (unsigned c = c1; c <= c2; c++) {
+              chars.set(c);
+              if (isalpha(c))
+                chars.set(toupper(c)), chars.set(tolower(c));
+            }
+          }
+          else
+            chars.set(c1);
+        }
+        if (!*p) {
+          ok = false; return true;
+        }
+        ++p;
+        if (neg)
+          chars.flip();
+        first |= chars;
+        return false;
+      }
+
+    case '.':
+      ++p; first.set();
+      return false;
+
+    case '^': case '$':
+      ++p;
+      return true;
+
+    case '\\':
+      if (!p[1]) {
+        ok = false; return true;
+      }
+      first.set((unsigned char)p[1]); p += 2;
+      return false;
+
+    case '*': case '+': case '?': case '{': case '|': case ')': case 0:
+      ok = false;
+      return true;
+
+    default:
+      first.set((unsigned char)*p++);
+      return false;
+  }
+}
+
+// Get possible first chars of a sequence of ERE atoms, stop at '|' or ')'.
+// Returns true if the sequence may match the empty string.
+static bool get_first_chars_seq(const char * & p, first_char_set & first, bool & ok)
+{
+  bool nullable = true;
+  while (ok && *p && *p != '|' && *p != ')') {
+    first_char_set atom;
+    bool atom_nullable = get_first_chars_atom(p, atom, ok);
+    // Quantifiers
+    for (;;) {
+      if (*p == '*' || *p == '?')
+        atom_nullable = true;
+      else if (*p == '{') {
+        if (p[1] == '0' || p[1] == ',')
+          atom_nullable = true;
+        const char * e = strchr(p, '}');
+        if (!e) {
+          ok = false; return true;
+        }
+        p = e;
+      }
+      else if (*p != '+')
+        break;
+      ++p;
+    }
+    // Atoms contribute until the first non-optional one
+    if (nullable) {
+      first |= atom;
+      nullable = atom_nullable;
+    }
+  }
+  return nullable;
+}
+
+// Get possible first chars of alternatives "SEQ|SEQ|...".
+// Returns true if any alternative may match the empty string.
+static bool get_first_chars_alt(const char * & p, first_char_set & first, bool & ok)
+{
+  bool nullable = get_first_chars_seq(p, first, ok);
+  while (ok && *p == '|') {
+    ++p;
+    if (get_first_chars_seq(p, first, ok))
+      nullable = true;
+  }
+  return nullable;
+}
+
+// Get set of possible first chars of strings fully matching the
+// extended regular expression 'pattern'.  Char 0 is included if the
+// empty string may match.  Result is conservative: All chars are
+// included if the pattern could not be analyzed.
+static void get_first_chars(const char * pattern, first_char_set & first)
+{
+  const char * p = pattern; bool ok = true;
+  bool nullable = get_first_chars_alt(p, first, ok);
+  if (!ok || *p) {
+    first.set(); return;
+  }
+  if (nullable)
+    first.set(0);
+}
+
+// Return true if extended regular expression 'pattern' contains
+// alternatives outside of any '(...)' group.
+static bool has_toplevel_alternative(const char * pattern)
+{
+  int level = 0;
+  for (const char * p = pattern; *p; p++) {
+    switch (*p) {
+      case '\\':
+        if (!p[1])
+          return true;
+        p++;
+        break;
+      case '[':
+        // Skip bracket expression
+        p++;
+        if (*p == '^')
+          p++;
+        if (*p == ']')
+          p++;
+        while (*p && *p != ']') {
+          if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            char t = p[1];
+            for (p += 2; *p && !(*p == t && p[1] == ']'); p++)
+              ;
+            if (!*p)
+              return true;
+            p++;
+          }
+          p++;
+        }
+        if (!*p)
+          return true;
+        break;
+      case '(':
+        level++;
+        break;
+      case ')':
+        level--;
+        break;
+      case '|':
+        if (level <= 0)
+          return true;
+        break;
+    }
+  }
+  return false;
+}
+
+// Get literal prefix of all strings fully matching the extended
+// regular expression 'pattern'.  Returns empty string if unknown.
+static std::string get_literal_prefix(const char * pattern)
+{
+  std::string prefix;
+  if (has_toplevel_alternative(pattern))
+    return prefix;
+  const char * p = pattern;
+  if (*p == '^')
+    p++;
+  for (;;) {
+    char c; int n;
+    if (*p == '\\' && p[1] && !isalnum((unsigned char)p[1])) {
+      c = p[1]; n = 2;
+    }
+    else if (*p && !strchr("\\^$.[]()|*+?{}", *p)) {
+      c = *p; n = 1;
+    }
+    else
+      break;
+    // Stop before optional char
+    if (p[n] == '*' || p[n] == '?' || p[n] == '{')
+      break;
+    prefix += c;
+    if (p[n] == '+')
+      break;
+    p += n;
+  }
+  return prefix;
+}
+
+
 /// Drive database class. Stores custom entries read from file.
 /// Provides transparent access to concatenation of custom and
 /// default table.
+/// Regular expressions are compiled once when entries are added.
+/// An index of possible first chars of the model string and a literal
+/// model prefix are used to select the entries to match.
 class drive_database
 {
 public:
@@ -79,8 +359,21 @@ public:
   void push_back(const drive_settings & src);
 
   /// Append builtin table.
-  void append(const drive_settings * builtin_tab, unsigned builtin_size)
-    { m_builtin_tab = builtin_tab; m_builtin_size = builtin_size; }
+  void append(const drive_settings * builtin_tab, unsigned builtin_size);
+
+  /// Entry types for find().
+  enum entry_type { ANY_ENTRY, DRIVE_ENTRY, USB_ENTRY };
+
+  /// Find first entry of given type with index >= start whose model
+  /// regular expression matches 'model' and whose firmware regular
+  /// expression (if any) matches 'firmware' (if not null).
+  /// Returns size() if not found.
+  unsigned find(const char * model, const char * firmware,
+                entry_type type, unsigned start = 0) const;
+
+  /// Return true if firmware regular expression of entry i is set
+  /// and matches 'firmware'.
+  bool match_firmware(unsigned i, const char * firmware) const;
 
 private:
   const drive_settings * m_builtin_tab;
@@ -89,8 +382,37 @@ private:
   std::vector<drive_settings> m_custom_tab;
   std::vector<char *> m_custom_strings;
 
+  // Compiled regular expressions and model prefix of an entry.
+  // (std::deque is used because copying a regular_expression
+  // recompiles the pattern)
+  struct entry_regex
+  {
+    regular_expression model, firmware;
+    std::string model_prefix;
+    bool usb;
+    bool valid;
+
+    entry_regex() : usb(false), valid(false) { }
+  };
+
+  std::deque<entry_regex> m_custom_regex;
+  std::deque<entry_regex> m_builtin_regex;
+
+  // Indexes of entries which may match a model string starting
+  // with a given char, in table order.
+  std::vector<unsigned> m_custom_index[256];
+  std::vector<unsigned> m_builtin_index[256];
+
+  const entry_regex & get_regex(unsigned i) const
+    { return (i < m_custom_regex.size() ? m_custom_regex[i]
+              : m_builtin_regex[i - m_custom_regex.size()]); }
+
   const char * copy_string(const char * str);
 
+  static void add_entry(const drive_settings & entry, bool builtin, unsigned i,
+                        std::deque<entry_regex> & regex,
+                        std::vector<unsigned> * index);
+
   drive_database(const drive_database &);
   void operator=(const drive_database &);
 };
@@ -112,6 +434,39 @@ const drive_settings & drive_database::operator[](unsigned i)
           : m_builtin_tab[i - m_custom_tab.size()] );
 }
 
+// Compile regular expressions of entry i and add it to index.
+void drive_database::add_entry(const drive_settings & entry, bool builtin, unsigned i,
+                               std::deque<entry_regex> & regex,
+                               std::vector<unsigned> * index)
+{
+  regex.push_back(entry_regex());
+  entry_regex & r = regex.back();
+  r.usb = is_usb_entry(&entry);
+
+  // Errors in custom entries are already reported by the parser
+  if (builtin) {
+    if (!compile(r.model, entry.modelregexp))
+      return;
+    if (*entry.firmwareregexp && !compile(r.firmware, entry.firmwareregexp))
+      return;
+  }
+  else {
+    if (!r.model.compile(entry.modelregexp, REG_EXTENDED))
+      return;
+    if (*entry.firmwareregexp && !r.firmware.compile(entry.firmwareregexp, REG_EXTENDED))
+      return;
+  }
+  r.model_prefix = get_literal_prefix(entry.modelregexp);
+  r.valid = true;
+
+  first_char_set first;
+  get_first_chars(entry.modelregexp, first);
+  for (unsigned c = 0; c < 256; c++) {
+    if (first[c])
+      index[c].push_back(i);
+  }
+}
+
 void drive_database::push_back(const drive_settings & src)
 {
   drive_settings dest;
@@ -121,6 +476,57 @@ void drive_database::push_back(const drive_settings & src)
   dest.warningmsg     = copy_string(src.warningmsg);
   dest.presets        = copy_string(src.presets);
   m_custom_tab.push_back(dest);
+  add_entry(dest, false, m_custom_tab.size() - 1, m_custom_regex, m_custom_index);
+}
+
+void drive_database::append(const drive_settings * builtin_tab, unsigned builtin_size)
+{
+  m_builtin_tab = builtin_tab; m_builtin_size = builtin_size;
+  m_builtin_regex.clear();
+  for (unsigned c = 0; c < 256; c++)
+    m_builtin_index[c].clear();
+  for (unsigned i = 0; i < builtin_size; i++)
+    add_entry(builtin_tab[i], true, i, m_builtin_regex, m_builtin_index);
+}
+
+unsigned drive_database::find(const char * model, const char * firmware,
+                              entry_type type, unsigned start /* = 0 */) const
+{
+  unsigned char c = (unsigned char)*model;
+  unsigned num_custom = m_custom_tab.size();
+
+  // Search custom entries first, then builtin entries
+  for (int k = 0; k < 2; k++) {
+    const std::vector<unsigned> & index = (!k ? m_custom_index[c] : m_builtin_index[c]);
+    const std::deque<entry_regex> & regex = (!k ? m_custom_regex : m_builtin_regex);
+    unsigned base = (!k ? 0 : num_custom);
+
+    std::vector<unsigned>::const_iterator it = std::lower_bound(
+      index.begin(), index.end(), (start > base ? start - base : 0));
+    for ( ; it != index.end(); ++it) {
+      const entry_regex & r = regex[*it];
+      if (   (type == DRIVE_ENTRY && r.usb)
+          || (type == USB_ENTRY && !r.usb))
+        continue;
+      // Check literal prefix before running the regex
+      if (   !r.model_prefix.empty()
+          && strncmp(model, r.model_prefix.c_str(), r.model_prefix.size()))
+        continue;
+      if (!r.model.full_match(model))
+        continue;
+      // Model matches, now check firmware. "" matches always.
+      if (firmware && !r.firmware.empty() && !r.firmware.full_match(firmware))
+        continue;
+      return base + *it;
+    }
+  }
+  return size();
+}
+
+bool drive_database::match_firmware(unsigned i, const char * firmware) const
+{
+  const entry_regex & r = get_regex(i);
+  return (r.valid && !r.firmware.empty() && r.firmware.full_match(firmware));
 }
 
 const char * drive_database::copy_string(const char * src)
@@ -140,39 +546,6 @@ const char * drive_database::copy_string(const char * src)
 static drive_database knowndrives;
 
 
-// Return true if modelfamily string describes entry for USB ID
-static bool is_usb_modelfamily(const char * modelfamily)
-{
-  return !strncmp(modelfamily, "USB:", 4);
-}
-
-// Return true if entry for USB ID
-static inline bool is_usb_entry(const drive_settings * dbentry)
-{
-  return is_usb_modelfamily(dbentry->modelfamily);
-}
-
-// Compile regular expression, print message on failure.
-static bool compile(regular_expression & regex, const char *pattern)
-{
-  if (!regex.compile(pattern, REG_EXTENDED)) {
-    pout("Internal error: unable to compile regular expression \"%s\": %s\n"
-         "Please inform smartmontools developers at " PACKAGE_BUGREPORT "\n",
-      pattern, regex.get_errmsg());
-    return false;
-  }
-  return true;
-}
-
-// Compile & match a regular expression.
-static bool match(const char * pattern, const char * str)
-{
-  regular_expression regex;
-  if (!compile(regex, pattern))
-    return false;
-  return regex.full_match(str);
-}
-
 // Searches knowndrives[] for a drive with the given model number and firmware
 // string.  If either the drive's model or firmware strings are not set by the
 // manufacturer then values of NULL may be used.  Returns the entry of the
@@ -184,26 +557,13 @@ const drive_settings * lookup_drive(const char * model, const char * firmware)
   if (!firmware)
     firmware = "";
 
-  for (unsigned i = 0; i < knowndrives.size(); i++) {
-    // Skip USB entries
-    if (is_usb_entry(&knowndrives[i]))
-      continue;
+  // Find first matching entry, skip USB entries
+  unsigned i = knowndrives.find(model, firmware, drive_database::DRIVE_ENTRY);
+  if (i >= knowndrives.size())
+    return 0; // Not found
 
-    // Check whether model matches the regular expression in knowndrives[i].
-    if (!match(knowndrives[i].modelregexp, model))
-      continue;
-
-    // Model matches, now check firmware. "" matches always.
-    if (!(  !*knowndrives[i].firmwareregexp
-          || match(knowndrives[i].firmwareregexp, firmware)))
-      continue;
-
-    // Found
-    return &knowndrives[i];
-  }
-
-  // Not found
-  return 0;
+  // Found
+  return &knowndrives[i];
 }
 
 
@@ -290,17 +650,12 @@ int lookup_usb_device(int vendor_id, int product_id, int bcd_device,
 
   int found = 0;
   bool bcd_match = false;
-  for (unsigned i = 0; i < knowndrives.size(); i++) {
+  // Find entries with matching USB vendor:product ID, skip drive entries
+  for (unsigned i = knowndrives.find(usb_id_str, 0, drive_database::USB_ENTRY);
+       i < knowndrives.size();
+       i = knowndrives.find(usb_id_str, 0, drive_database::USB_ENTRY, i+1)) {
     const drive_settings & dbentry = knowndrives[i];
 
-    // Skip drive entries
-    if (!is_usb_entry(&dbentry))
-      continue;
-
-    // Check whether USB vendor:product ID matches
-    if (!match(dbentry.modelregexp, usb_id_str))
-      continue;
-
     // Parse '-d type'
     usb_dev_info d;
     if (!parse_usb_type(dbentry.presets, d.usb_type))
@@ -309,8 +664,7 @@ int lookup_usb_device(int vendor_id, int product_id, int bcd_device,
 
     // If two entries with same vendor:product ID have different
     // types, use bcd_device (if provided by OS) to select entry.
-    bool bm = (   *bcd_dev_str && *dbentry.firmwareregexp
-               && match(dbentry.firmwareregexp, bcd_dev_str));
+    bool bm = (*bcd_dev_str && knowndrives.match_firmware(i, bcd_dev_str));
 
     if (found == 0 || bm > bcd_match) {
       info = d; found = 1;
@@ -454,12 +808,9 @@ int showmatchingpresets(const char *model, const char *firmware)
   int cnt = 0;
   const char * firmwaremsg = (firmware ? firmware : "(any)");
 
-  for (unsigned i = 0; i < knowndrives.size(); i++) {
-    if (!match(knowndrives[i].modelregexp, model))
-      continue;
-    if (   firmware && *knowndrives[i].firmwareregexp
-        && !match(knowndrives[i].firmwareregexp, firmware))
-        continue;
+  for (unsigned i = knowndrives.find(model, firmware, drive_database::ANY_ENTRY);
+       i < knowndrives.size();
+       i = knowndrives.find(model, firmware, drive_database::ANY_ENTRY, i+1)) {
     // Found
     if (++cnt == 1)
       pout("Drive found in smartmontools Database.  Drive identity strings:\n"
@@ -867,3 +1218,194 @@ bool read_default_drive_databases()
 
   return true;
 }
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Drive database lookup benchmark
+
+// Model and firmware strings used for the benchmark.
+// Last entries do not match and require a full table search.
+static const char * const benchmark_drives[][2] = {
+  { "SAMSUNG HD103SJ"          , "1AJ10001" },
+  { "ST3500418AS"              , "CC38"     },
+  { "WDC WD10EADS-00L5B1"      , "01.01A01" },
+  { "Hitachi HDS721010CLA332"  , "JP4OA3MA" },
+  { "FUJITSU MHV2080BH"        , "00850028" },
+  { "INTEL SSDSA2M080G2GC"     , "2CV102HD" },
+  { "TOSHIBA MK2552GSX"        , "LV010A"   },
+  { "Maxtor 6Y080M0"           , "YAR511W0" },
+  { "IC35L060AVV207-0"         , "V22OA66A" },
+  { "ST31000340AS"             , "SD15"     },
+  { "Unknown Drive Model 1234" , "1.00"     },
+  { ""                         , ""         },
+};
+
+// Return CPU time in seconds.
+static double cpu_seconds()
+{
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+// Lookup without index as done by older versions:
+// Regular expressions are compiled for each match.
+static unsigned lookup_drive_unindexed(drive_database & db,
+                                       const char * model, const char * firmware)
+{
+  for (unsigned i = 0; i < db.size(); i++) {
+    if (is_usb_entry(&db[i]))
+      continue;
+    if (!match(db[i].modelregexp, model))
+      continue;
+    if (!(!*db[i].firmwareregexp || match(db[i].firmwareregexp, firmware)))
+      continue;
+    return i;
+  }
+  return db.size();
+}
+
+// Append drive database entry in drivedb.h syntax.
+static void format_db_entry(std::string & out, const drive_settings & entry)
+{
+  const char * values[5] = {
+    entry.modelfamily, entry.modelregexp, entry.firmwareregexp,
+    entry.warningmsg, entry.presets
+  };
+  out += "{ ";
+  for (int i = 0; i < 5; i++) {
+    out += '"';
+    for (const char * p = values[i]; *p; p++) {
+      switch (*p) {
+        case '"': case '\\': out += '\\'; out += *p; break;
+        case '\n': out += "\\n"; break;
+        default: out += *p;
+      }
+    }
+    out += (i < 4 ? "\",\n  " : "\"\n},\n");
+  }
+}
+
+// Add benchmark result to JSON array.
+static void json_bench_result(json & jout, const char * name, uint64_t count, double secs)
+{
+  json & j = jout[jout.size()];
+  j["name"] = name;
+  j["iterations"] = count;
+  j["total_usec"] = (uint64_t)(secs * 1000000);
+  j["nsec_per_iteration"] = (uint64_t)(secs * 1000000000 / (count ? count : 1));
+}
+
+// Run benchmark of drive database parsing and lookups with builtin table.
+// Results are also added to 'jout' if specified.
+// Returns #lookups with different results from unindexed lookup.
+int benchmark_drive_database(json * jout /* = 0 */)
+{
+  const unsigned num_drives = sizeof(benchmark_drives)/sizeof(benchmark_drives[0]);
+  const unsigned builtin_size = sizeof(builtin_knowndrives)/sizeof(builtin_knowndrives[0]);
+  const double min_secs = 1.0;
+
+  // Compile regular expressions and build index
+  double t0 = cpu_seconds();
+  drive_database db;
+  db.append(builtin_knowndrives, builtin_size);
+  double load_secs = cpu_seconds() - t0;
+
+  pout("Drive database benchmark: %u builtin entries, %u model strings\n\n",
+       builtin_size, num_drives);
+
+  // Compare results of both methods
+  int errcnt = 0;
+  for (unsigned d = 0; d < num_drives; d++) {
+    const char * model = benchmark_drives[d][0], * firmware = benchmark_drives[d][1];
+    unsigned i1 = db.find(model, firmware, drive_database::DRIVE_ENTRY);
+    unsigned i2 = lookup_drive_unindexed(db, model, firmware);
+    pout("%-*s %-8s -> %s\n", MODEL_STRING_LENGTH, (*model ? model : "\"\""), firmware,
+         (i1 < db.size() ? db[i1].modelfamily : "(not found)"));
+    if (i1 != i2) {
+      pout("Error: indexed lookup returned entry %u, unindexed lookup returned entry %u\n",
+           i1, i2);
+      errcnt++;
+    }
+  }
+
+  // Parse builtin table in drivedb.h syntax from a temporary file
+  uint64_t parse_cnt = 0;
+  double parse_secs = 0;
+  FILE * f = tmpfile();
+  if (f) {
+    std::string text;
+    for (unsigned i = 0; i < builtin_size; i++)
+      format_db_entry(text, builtin_knowndrives[i]);
+    fwrite(text.data(), text.size(), 1, f);
+    t0 = cpu_seconds();
+    do {
+      rewind(f);
+      drive_database parsed_db;
+      if (!parse_drive_database(parse_ptr(f), parsed_db, "[benchmark]") || parsed_db.size() != builtin_size) {
+        pout("Error: parsing builtin table returned %u of %u entries\n", parsed_db.size(), builtin_size);
+        errcnt++;
+        break;
+      }
+      parse_cnt++;
+    } while ((parse_secs = cpu_seconds() - t0) < min_secs);
+    fclose(f);
+  }
+
+  // Indexed lookups
+  uint64_t idx_cnt = 0;
+  double idx_secs;
+  t0 = cpu_seconds();
+  do {
+    for (unsigned d = 0; d < num_drives; d++, idx_cnt++)
+      db.find(benchmark_drives[d][0], benchmark_drives[d][1], drive_database::DRIVE_ENTRY);
+  } while ((idx_secs = cpu_seconds() - t0) < min_secs);
+
+  // Unindexed lookups
+  uint64_t old_cnt = 0;
+  double old_secs;
+  t0 = cpu_seconds();
+  do {
+    for (unsigned d = 0; d < num_drives; d++, old_cnt++)
+      lookup_drive_unindexed(db, benchmark_drives[d][0], benchmark_drives[d][1]);
+  } while ((old_secs = cpu_seconds() - t0) < min_secs);
+
+  // Lookups in the database in use, may include drivedb.h files
+  uint64_t cur_cnt = 0;
+  double cur_secs;
+  t0 = cpu_seconds();
+  do {
+    for (unsigned d = 0; d < num_drives; d++, cur_cnt++)
+      lookup_drive(benchmark_drives[d][0], benchmark_drives[d][1]);
+  } while ((cur_secs = cpu_seconds() - t0) < min_secs);
+
+  double idx_rate = idx_cnt / idx_secs, old_rate = old_cnt / old_secs;
+  pout("\nCompile and index time: %10.3f ms\n", load_secs * 1000);
+  if (parse_cnt)
+    pout("Parse time:             %10.3f ms (%"PRIu64" in %.2f s)\n",
+         parse_secs * 1000 / parse_cnt, parse_cnt, parse_secs);
+  pout("Indexed lookups:        %10.0f lookups/sec (%"PRIu64" in %.2f s)\n",
+       idx_rate, idx_cnt, idx_secs);
+  pout("Unindexed lookups:      %10.0f lookups/sec (%"PRIu64" in %.2f s)\n",
+       old_rate, old_cnt, old_secs);
+  pout("Speedup:                %10.1f\n", idx_rate / old_rate);
+  pout("lookup_drive():         %10.0f lookups/sec (%u entries in use)\n",
+       cur_cnt / cur_secs, knowndrives.size());
+
+  if (jout) {
+    json & j = *jout;
+    j["builtin_entries"] = builtin_size;
+    j["entries_in_use"] = knowndrives.size();
+    j["differences"] = errcnt;
+    json & jres = j["results"];
+    json_bench_result(jres, "drive_database_append", 1, load_secs);
+    if (parse_cnt)
+      json_bench_result(jres, "parse_drive_database", parse_cnt, parse_secs);
+    json_bench_result(jres, "drive_database_find", idx_cnt, idx_secs);
+    json_bench_result(jres, "drive_database_find_unindexed", old_cnt, old_secs);
+    json_bench_result(jres, "lookup_drive", cur_cnt, cur_secs);
+  }
+
+  if (errcnt)
+    pout("\nFound %d different lookup result(s).\n"
+         "Please inform smartmontools developers at " PACKAGE_BUGREPORT "\n", errcnt);
+  return errcnt;
+}
@@ -59,6 +59,13 @@ int showallpresets();
 // Returns # matching entries.
 int showmatchingpresets(const char *model, const char *firmware);
 
+class json;
+
+// Runs benchmark of drive database parsing and lookups with builtin
+// table.  Results are also added to '*jout' if specified.
+// Returns #lookups with different results from unindexed lookup.
+int benchmark_drive_database(json * jout = 0);
+
 // Sets preset vendor attribute options in opts by finding the entry
 // (if any) for the given drive in knowndrives[].  Values that have
 // already been set in opts will not be changed.  Also sets options in
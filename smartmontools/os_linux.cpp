@@ -49,6 +49,8 @@
 
 #include "config.h"
 
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <glob.h>
@@ -71,6 +73,9 @@
 #include <selinux/selinux.h>
 #endif
 
+#include <algorithm>
+#include <map>
+
 #include "int64.h"
 #include "atacmds.h"
 #include "extern.h"
@@ -110,7 +115,8 @@ public:
   explicit linux_smart_device(int flags, int retry_flags = -1)
     : smart_device(never_called),
       m_fd(-1),
-      m_flags(flags), m_retry_flags(retry_flags)
+      m_flags(flags), m_retry_flags(retry_flags),
+      m_shared(false), m_shared_fd(-1)
       { }
 
   virtual ~linux_smart_device() throw();
@@ -126,16 +132,122 @@ protected:
   int get_fd() const
     { return m_fd; }
 
+  /// Share filedesc with all devices using the same controller node.
+  /// The node is kept open until the device object is destroyed.
+  void set_shared_fd()
+    { m_shared = true; }
+
 private:
   int m_fd; ///< filedesc, -1 if not open.
   int m_flags; ///< Flags for ::open()
   int m_retry_flags; ///< Flags to retry ::open(), -1 if no retry
+  bool m_shared; ///< True if filedesc is shared
+  int m_shared_fd; ///< Shared filedesc, -1 if not yet acquired
+};
+
+
+/////////////////////////////////////////////////////////////////////////////
+/// Registry of controller nodes shared by RAID pass-through devices.
+/// All '-d TYPE,N' devices behind the same controller use one open
+/// handle, which is closed if the last device releases it.
+
+class shared_handles
+{
+public:
+  /// Open node or increment reference count if already open.
+  /// Return filedesc or -1 on error (errno is set).
+  static int acquire(const char * path, int flags, int retry_flags = -1);
+
+  /// Decrement reference count, close node if unused.
+  static void release(int fd);
+
+private:
+  struct entry
+  {
+    std::string path;
+    int flags;
+    int fd;
+    int refcnt;
+  };
+
+  static std::vector<entry> s_entries;
+  static thread_mutex s_mutex;
 };
 
+std::vector<shared_handles::entry> shared_handles::s_entries;
+thread_mutex shared_handles::s_mutex;
+
+// Serializes the once per process setup of 3ware and MegaRAID
+// controller device nodes.
+static thread_mutex node_setup_mutex;
+
+// Open device node, set FD_CLOEXEC.
+static int open_node(const char * path, int flags, int retry_flags)
+{
+  int fd = ::open(path, flags);
+
+  if (fd < 0 && errno == EROFS && retry_flags != -1)
+    // Retry
+    fd = ::open(path, retry_flags);
+
+  if (fd >= 0) {
+    // sets FD_CLOEXEC on the opened device file descriptor.  The
+    // descriptor is otherwise leaked to other applications (mail
+    // sender) which may be considered a security risk and may result
+    // in AVC messages on SELinux-enabled systems.
+    if (-1 == fcntl(fd, F_SETFD, FD_CLOEXEC))
+      // TODO: Provide an error printing routine in class smart_interface
+      pout("fcntl(set  FD_CLOEXEC) failed, errno=%d [%s]\n", errno, strerror(errno));
+  }
+
+  return fd;
+}
+
+int shared_handles::acquire(const char * path, int flags, int retry_flags /* = -1 */)
+{
+  s_mutex.lock();
+  for (unsigned i = 0; i < s_entries.size(); i++) {
+    entry & e = s_entries[i];
+    if (e.path == path && e.flags == flags) {
+      e.refcnt++;
+      int fd = e.fd;
+      s_mutex.unlock();
+      return fd;
+    }
+  }
+
+  int fd = open_node(path, flags, retry_flags);
+  if (fd >= 0) {
+    entry e;
+    e.path = path; e.flags = flags;
+    e.fd = fd; e.refcnt = 1;
+    s_entries.push_back(e);
+  }
+  s_mutex.unlock();
+  return fd;
+}
+
+void shared_handles::release(int fd)
+{
+  s_mutex.lock();
+  for (unsigned i = 0; i < s_entries.size(); i++) {
+    if (s_entries[i].fd != fd)
+      continue;
+    if (--s_entries[i].refcnt <= 0) {
+      ::close(fd);
+      s_entries.erase(s_entries.begin() + i);
+    }
+    break;
+  }
+  s_mutex.unlock();
+}
+
 
 linux_smart_device::~linux_smart_device() throw()
 {
-  if (m_fd >= 0)
+  if (m_shared_fd >= 0)
+    shared_handles::release(m_shared_fd);
+  else if (m_fd >= 0)
     ::close(m_fd);
 }
 
@@ -146,11 +258,13 @@ bool linux_smart_device::is_open() const
 
 bool linux_smart_device::open()
 {
-  m_fd = ::open(get_dev_name(), m_flags);
-
-  if (m_fd < 0 && errno == EROFS && m_retry_flags != -1)
-    // Retry
-    m_fd = ::open(get_dev_name(), m_retry_flags);
+  if (m_shared) {
+    if (m_shared_fd < 0)
+      m_shared_fd = shared_handles::acquire(get_dev_name(), m_flags, m_retry_flags);
+    m_fd = m_shared_fd;
+  }
+  else
+    m_fd = open_node(get_dev_name(), m_flags, m_retry_flags);
 
   if (m_fd < 0) {
     if (errno == EBUSY && (m_flags & O_EXCL))
@@ -162,16 +276,6 @@ bool linux_smart_device::open()
     return set_err((errno==ENOENT || errno==ENOTDIR) ? ENODEV : errno);
   }
 
-  if (m_fd >= 0) {
-    // sets FD_CLOEXEC on the opened device file descriptor.  The
-    // descriptor is otherwise leaked to other applications (mail
-    // sender) which may be considered a security risk and may result
-    // in AVC messages on SELinux-enabled systems.
-    if (-1 == fcntl(m_fd, F_SETFD, FD_CLOEXEC))
-      // TODO: Provide an error printing routine in class smart_interface
-      pout("fcntl(set  FD_CLOEXEC) failed, errno=%d [%s]\n", errno, strerror(errno));
-  }
-
   return true;
 }
 
@@ -179,6 +283,9 @@ bool linux_smart_device::open()
 bool linux_smart_device::close()
 {
   int fd = m_fd; m_fd = -1;
+  if (m_shared)
+    // Keep shared node open
+    return true;
   if (::close(fd) < 0)
     return set_err(errno);
   return true;
@@ -909,7 +1016,7 @@ linux_megaraid_device::linux_megaraid_device(smart_interface *intf,
 linux_megaraid_device::~linux_megaraid_device() throw()
 {
   if (m_fd >= 0)
-    ::close(m_fd);
+    shared_handles::release(m_fd);
 }
 
 smart_device * linux_megaraid_device::autodetect_open()
@@ -965,43 +1072,57 @@ bool linux_megaraid_device::open()
   if (!linux_smart_device::open())
     return false;
 
-  /* Get device HBA */
-  struct sg_scsi_id sgid;
-  if (ioctl(get_fd(), SG_GET_SCSI_ID, &sgid) == 0) {
-    m_hba = sgid.host_no;
+  /* Get device HBA, keep it if known */
+  if (!pt_cmd) {
+    struct sg_scsi_id sgid;
+    if (ioctl(get_fd(), SG_GET_SCSI_ID, &sgid) == 0) {
+      m_hba = sgid.host_no;
+    }
+    else if (ioctl(get_fd(), SCSI_IOCTL_GET_BUS_NUMBER, &m_hba) != 0) {
+      int err = errno;
+      linux_smart_device::close();
+      return set_err(err, "can't get bus number");
+    }
   }
-  else if (ioctl(get_fd(), SCSI_IOCTL_GET_BUS_NUMBER, &m_hba) != 0) {
-    int err = errno;
-    linux_smart_device::close();
-    return set_err(err, "can't get bus number");
-  }
-
-  /* Perform mknod of device ioctl node */
-  fp = fopen("/proc/devices", "r");
-  while (fgets(line, sizeof(line), fp) != NULL) {
-  	n1=0;
-  	if (sscanf(line, "%d megaraid_sas_ioctl%n", &mjr, &n1) == 1 && n1 == 22) {
-	   n1=mknod("/dev/megaraid_sas_ioctl_node", S_IFCHR, makedev(mjr, 0));
-	   if(report > 0)
-	     printf("Creating /dev/megaraid_sas_ioctl_node = %d\n", n1 >= 0 ? 0 : errno);
-	   if (n1 >= 0 || errno == EEXIST)
-	      break;
-	}
-	else if (sscanf(line, "%d megadev%n", &mjr, &n1) == 1 && n1 == 11) {
-	   n1=mknod("/dev/megadev0", S_IFCHR, makedev(mjr, 0));
-	   if(report > 0)
-	     printf("Creating /dev/megadev0 = %d\n", n1 >= 0 ? 0 : errno);
-	   if (n1 >= 0 || errno == EEXIST)
-	      break;
-	}
+
+  /* Ioctl node is shared by all devices and kept open until destruction */
+  if (m_fd >= 0)
+    return true;
+
+  /* Perform mknod of device ioctl node, once per process */
+  static bool nodes_created = false;
+  node_setup_mutex.lock();
+  if (!nodes_created && (fp = fopen("/proc/devices", "r")) != NULL) {
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      n1=0;
+      if (sscanf(line, "%d megaraid_sas_ioctl%n", &mjr, &n1) == 1 && n1 == 22) {
+        n1=mknod("/dev/megaraid_sas_ioctl_node", S_IFCHR, makedev(mjr, 0));
+        if(report > 0)
+          printf("Creating /dev/megaraid_sas_ioctl_node = %d\n", n1 >= 0 ? 0 : errno);
+        if (n1 >= 0 || errno == EEXIST) {
+          nodes_created = true;
+          break;
+        }
+      }
+      else if (sscanf(line, "%d megadev%n", &mjr, &n1) == 1 && n1 == 11) {
+        n1=mknod("/dev/megadev0", S_IFCHR, makedev(mjr, 0));
+        if(report > 0)
+          printf("Creating /dev/megadev0 = %d\n", n1 >= 0 ? 0 : errno);
+        if (n1 >= 0 || errno == EEXIST) {
+          nodes_created = true;
+          break;
+        }
+      }
+    }
+    fclose(fp);
   }
-  fclose(fp);
+  node_setup_mutex.unlock();
 
   /* Open Device IOCTL node */
-  if ((m_fd = ::open("/dev/megaraid_sas_ioctl_node", O_RDWR)) >= 0) {
+  if ((m_fd = shared_handles::acquire("/dev/megaraid_sas_ioctl_node", O_RDWR)) >= 0) {
     pt_cmd = &linux_megaraid_device::megasas_cmd;
   }
-  else if ((m_fd = ::open("/dev/megadev0", O_RDWR)) >= 0) {
+  else if ((m_fd = shared_handles::acquire("/dev/megadev0", O_RDWR)) >= 0) {
     pt_cmd = &linux_megaraid_device::megadev_cmd;
   }
   else {
@@ -1015,9 +1136,7 @@ bool linux_megaraid_device::open()
 
 bool linux_megaraid_device::close()
 {
-  if (m_fd >= 0)
-    ::close(m_fd);
-  m_fd = -1; m_hba = 0; pt_cmd = 0;
+  // Keep shared ioctl node and HBA number for next open()
   return linux_smart_device::close();
 }
 
@@ -1194,6 +1313,7 @@ linux_cciss_device::linux_cciss_device(smart_interface * intf,
   m_disknum(disknum)
 {
   set_info().info_name = strprintf("%s [cciss_disk_%02d]", dev_name, disknum);
+  set_shared_fd();
 }
 
 bool linux_cciss_device::scsi_pass_through(scsi_cmnd_io * iop)
@@ -1240,6 +1360,7 @@ linux_escalade_device::linux_escalade_device(smart_interface * intf, const char
   m_escalade_type(escalade_type), m_disknum(disknum)
 {
   set_info().info_name = strprintf("%s [3ware_disk_%02d]", dev_name, disknum);
+  set_shared_fd();
 }
 
 /* This function will setup and fix device nodes for a 3ware controller. */
@@ -1402,8 +1523,18 @@ bool linux_escalade_device::open()
     const char * driver = (m_escalade_type == AMCC_3WARE_9700_CHAR ? "3w-sas"  :
                            m_escalade_type == AMCC_3WARE_9000_CHAR ? "3w-9xxx" :
                                                                      "3w-xxxx"  );
-    if (setup_3ware_nodes(node, driver))
-      return set_err((errno ? errno : ENXIO), "setup_3ware_nodes(\"%s\", \"%s\") failed", node, driver);
+    // Node setup is done once per process
+    static std::vector<std::string> setup_done;
+    node_setup_mutex.lock();
+    bool done = (std::find(setup_done.begin(), setup_done.end(), node) != setup_done.end());
+    if (!done) {
+      if (setup_3ware_nodes(node, driver)) {
+        node_setup_mutex.unlock();
+        return set_err((errno ? errno : ENXIO), "setup_3ware_nodes(\"%s\", \"%s\") failed", node, driver);
+      }
+      setup_done.push_back(node);
+    }
+    node_setup_mutex.unlock();
   }
   // Continue with default open
   return linux_smart_device::open();
@@ -2827,6 +2958,9 @@ private:
   bool get_dev_list(smart_device_list & devlist, const char * pattern,
     bool scan_ata, bool scan_scsi, const char * req_type, bool autodetect);
 
+  bool get_dev_list_sysfs(smart_device_list & devlist,
+    bool scan_ata, bool scan_scsi, const char * req_type, bool autodetect);
+
   smart_device * missing_option(const char * opt);
 };
 
@@ -2870,14 +3004,7 @@ bool linux_smart_interface::get_dev_list(smart_device_list & devlist,
     return false;
   }
 
-  // did we find too many paths?
-  const int max_pathc = 32;
   int n = (int)globbuf.gl_pathc;
-  if (n > max_pathc) {
-    pout("glob(3) found %d > MAX=%d devices matching pattern %s: ignoring %d paths\n",
-         n, max_pathc, pattern, n - max_pathc);
-    n = max_pathc;
-  }
 
   // now step through the list returned by glob.  If not a link, copy
   // to list.  If it is a link, evaluate it and see if the path ends
@@ -2938,6 +3065,238 @@ bool linux_smart_interface::get_dev_list(smart_device_list & devlist,
   return true;
 }
 
+// Read first line of a sysfs attribute, strip trailing white space.
+static bool read_sysfs_line(const std::string & path, std::string & line)
+{
+  FILE * f = fopen(path.c_str(), "r");
+  if (!f)
+    return false;
+  char buf[256];
+  bool ok = !!fgets(buf, sizeof(buf), f);
+  fclose(f);
+  if (!ok)
+    return false;
+  int len = strlen(buf);
+  while (len > 0 && isspace((unsigned char)buf[len-1]))
+    len--;
+  line.assign(buf, len);
+  return !line.empty();
+}
+
+// Read binary sysfs attribute, return number of bytes read.
+static int read_sysfs_bin(const std::string & path, unsigned char * buf, int size)
+{
+  FILE * f = fopen(path.c_str(), "rb");
+  if (!f)
+    return 0;
+  int len = (int)fread(buf, 1, size, f);
+  fclose(f);
+  return len;
+}
+
+// Return first NAA or EUI-64 designator of the logical unit from
+// VPD page 0x83 as hex string.  Other designator types (T10 vendor ID,
+// vendor specific, ...) are not unique enough, cheap USB bridges often
+// report the same value for different disks.
+static std::string get_vpd_pg83_lun_id(const unsigned char * page, int len)
+{
+  if (len < 4 || page[1] != 0x83)
+    return "";
+  int end = std::min(len, 4 + (page[2] << 8 | page[3]));
+  for (int i = 4; i + 4 <= end; i += 4 + page[i+3]) {
+    const unsigned char * d = page + i;
+    int dlen = d[3];
+    if (i + 4 + dlen > end)
+      break;
+    int assoc = (d[1] >> 4) & 0x3, type = d[1] & 0xf;
+    if (!(assoc == 0 && (type == 2 || type == 3) && dlen >= 8))
+      continue;
+    std::string id = (type == 3 ? "naa." : "eui.");
+    bool nonzero = false;
+    for (int k = 0; k < dlen; k++) {
+      id += strprintf("%02x", d[4+k]);
+      if (d[4+k])
+        nonzero = true;
+    }
+    if (nonzero)
+      return id;
+  }
+  return "";
+}
+
+// Return true if NAME is "sdX", "sdXY", ...
+static bool is_sd_name(const char * name)
+{
+  if (!(name[0] == 's' && name[1] == 'd' && name[2]))
+    return false;
+  for (int i = 2; name[i]; i++) {
+    if (!('a' <= name[i] && name[i] <= 'z'))
+      return false;
+  }
+  return true;
+}
+
+// Sort "sdz" before "sdaa"
+static bool dev_name_less(const std::string & n1, const std::string & n2)
+{
+  if (n1.size() != n2.size())
+    return (n1.size() < n2.size());
+  return (n1 < n2);
+}
+
+// Return identifier of the logical unit of "sdX": NAA or EUI-64 WWID or
+// VPD page 0x83 designator from sysfs, or UUID of a dm-multipath device
+// holding "sdX".  Return empty string if unknown or not unique.
+static std::string get_sd_lun_id(const char * name)
+{
+  std::string id;
+  std::string devdir = strprintf("/sys/block/%s/device/", name);
+  if (read_sysfs_line(devdir + "wwid", id)) {
+    if (!strncmp(id.c_str(), "naa.", 4) || !strncmp(id.c_str(), "eui.", 4))
+      return id;
+  }
+  else {
+    unsigned char page[256];
+    int len = read_sysfs_bin(devdir + "vpd_pg83", page, sizeof(page));
+    id = get_vpd_pg83_lun_id(page, len);
+    if (!id.empty())
+      return id;
+  }
+
+  std::string holders = strprintf("/sys/block/%s/holders", name);
+  DIR * dir = opendir(holders.c_str());
+  if (!dir)
+    return "";
+  const struct dirent * de;
+  id.clear();
+  while ((de = readdir(dir))) {
+    if (strncmp(de->d_name, "dm-", 3))
+      continue;
+    if (   read_sysfs_line(strprintf("/sys/block/%s/dm/uuid", de->d_name), id)
+        && !strncmp(id.c_str(), "mpath-", 6))
+      break;
+    id.clear();
+  }
+  closedir(dir);
+  return id;
+}
+
+// Return sysfs device path of "sdX", empty string if unknown.
+static std::string get_sd_sysfs_path(const char * name)
+{
+  char linkbuf[1024];
+  int len = readlink(strprintf("/sys/block/%s", name).c_str(), linkbuf, sizeof(linkbuf)-1);
+  if (len <= 0)
+    return "";
+  linkbuf[len] = 0;
+  return linkbuf;
+}
+
+// Return true if "sdX" devices with sysfs paths P1 and P2 may be paths
+// to the same logical unit.  This is not the case for the same path and
+// for USB devices.
+static bool may_be_multipath(const std::string & p1, const std::string & p2)
+{
+  if (p1.empty() || p2.empty() || p1 == p2)
+    return false;
+  if (p1.find("/usb") != std::string::npos || p2.find("/usb") != std::string::npos)
+    return false;
+  return true;
+}
+
+// Use sysfs to look for "hdX" devices in /sys/block and "sdX" devices
+// in /sys/class/scsi_device.  Devices are added in name order, devices
+// with the same logical unit identifier (multipath) are added once.
+// Returns false if sysfs is not available.
+bool linux_smart_interface::get_dev_list_sysfs(smart_device_list & devlist,
+  bool scan_ata, bool scan_scsi, const char * req_type, bool autodetect)
+{
+  DIR * dir = opendir("/sys/block");
+  if (!dir)
+    return false;
+
+  std::vector<std::string> ata_names, scsi_names;
+  const struct dirent * de;
+  while ((de = readdir(dir))) {
+    const char * name = de->d_name;
+    if (scan_ata && name[0] == 'h' && name[1] == 'd' && 'a' <= name[2] && name[2] <= 't' && !name[3])
+      ata_names.push_back(name);
+  }
+  closedir(dir);
+
+  if (scan_scsi && (dir = opendir("/sys/class/scsi_device"))) {
+    while ((de = readdir(dir))) {
+      if (de->d_name[0] == '.')
+        continue;
+      // Block device is "H:C:T:L/device/block/sdX" or
+      // "H:C:T:L/device/block:sdX" on older kernels
+      std::string devdir = strprintf("/sys/class/scsi_device/%s/device", de->d_name);
+      DIR * bdir = opendir((devdir + "/block").c_str());
+      bool old_layout = false;
+      if (!bdir) {
+        bdir = opendir(devdir.c_str());
+        old_layout = true;
+      }
+      if (!bdir)
+        continue;
+      const struct dirent * bde;
+      while ((bde = readdir(bdir))) {
+        const char * name = bde->d_name;
+        if (old_layout) {
+          if (strncmp(name, "block:", 6))
+            continue;
+          name += 6;
+        }
+        if (is_sd_name(name))
+          scsi_names.push_back(name);
+      }
+      closedir(bdir);
+    }
+    closedir(dir);
+  }
+
+  std::sort(ata_names.begin(), ata_names.end(), dev_name_less);
+  std::sort(scsi_names.begin(), scsi_names.end(), dev_name_less);
+
+  unsigned i;
+  for (i = 0; i < ata_names.size(); i++) {
+    std::string name = "/dev/" + ata_names[i];
+    devlist.push_back(new linux_ata_device(this, name.c_str(), req_type));
+  }
+
+  // LUN id -> first device name and sysfs path
+  std::map<std::string, std::pair<std::string, std::string> > luns;
+  for (i = 0; i < scsi_names.size(); i++) {
+    const char * sdname = scsi_names[i].c_str();
+    std::string id = get_sd_lun_id(sdname);
+    if (!id.empty()) {
+      std::string path = get_sd_sysfs_path(sdname);
+      std::map<std::string, std::pair<std::string, std::string> >::const_iterator
+        it = luns.find(id);
+      if (it != luns.end()) {
+        if (may_be_multipath(it->second.second, path)) {
+          pout("/dev/%s: same logical unit as /dev/%s (multipath), ignored\n",
+               sdname, it->second.first.c_str());
+          continue;
+        }
+      }
+      else
+        luns[id] = std::make_pair(std::string(sdname), path);
+    }
+
+    std::string name = "/dev/" + scsi_names[i];
+    smart_device * dev;
+    if (autodetect)
+      dev = autodetect_smart_device(name.c_str());
+    else
+      dev = new linux_scsi_device(this, name.c_str(), req_type, true /*scanning*/);
+    if (dev) // autodetect_smart_device() may return nullptr.
+      devlist.push_back(dev);
+  }
+
+  return true;
+}
+
 bool linux_smart_interface::scan_smart_devices(smart_device_list & devlist,
   const char * type, const char * pattern /*= 0*/)
 {
@@ -2955,13 +3314,19 @@ bool linux_smart_interface::scan_smart_devices(smart_device_list & devlist,
   if (!(scan_ata || scan_scsi))
     return true;
 
+  // Try USB autodetection if no type specifed
+  bool autodetect = !*type;
+
+  // Prefer sysfs, it has no limit of number of devices
+  if (get_dev_list_sysfs(devlist, scan_ata, scan_scsi, type, autodetect))
+    return true;
+
   if (scan_ata)
     get_dev_list(devlist, "/dev/hd[a-t]", true, false, type, false);
   if (scan_scsi) {
-    bool autodetect = !*type; // Try USB autodetection if no type specifed
     get_dev_list(devlist, "/dev/sd[a-z]", false, true, type, autodetect);
-    // Support up to 104 devices
-    get_dev_list(devlist, "/dev/sd[a-c][a-z]", false, true, type, autodetect);
+    // Support up to 702 devices
+    get_dev_list(devlist, "/dev/sd[a-z][a-z]", false, true, type, autodetect);
   }
 
   // if we found traditional links, we are done
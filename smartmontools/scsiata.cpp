@@ -434,16 +434,14 @@ bool sat_device::ata_pass_through(const ata_cmd_in & in, ata_cmd_out & out)
 
 static bool has_sat_pass_through(ata_device * dev, bool packet_interface = false)
 {
-    /* Note:  malloc() ensures the read buffer lands on a single
-       page.  This avoids some bugs seen on LSI controlers under
-       FreeBSD */
-    char *data = (char *)malloc(512);
+    /* Note:  A page aligned buffer ensures the read buffer lands on
+       a single page.  This avoids some bugs seen on LSI controlers
+       under FreeBSD */
+    ata_device::io_buffer data(dev, 512);
     ata_cmd_in in;
     in.in_regs.command = (packet_interface ? ATA_IDENTIFY_PACKET_DEVICE : ATA_IDENTIFY_DEVICE);
-    in.set_data_in(data, 1);
-    bool ret = dev->ata_pass_through(in);
-    free(data);
-    return ret;
+    in.set_data_in(data.data(), 1);
+    return dev->ata_pass_through(in);
 }
 
 /////////////////////////////////////////////////////////////////////////////
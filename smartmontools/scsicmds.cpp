@@ -251,7 +251,10 @@ const char * scsiErrString(int scsiErr)
    first to deduce the response length, then send the same command again
    requesting the deduced response length. This protects certain fragile 
    HBAs. The twin fetch technique should not be used with the TapeAlert
-   log page since it clears its state flags after each fetch. */
+   log page since it clears its state flags after each fetch.
+   The response length reported by the device is cached, later calls for
+   the same page (subpage 0) do a single fetch of this length, limited
+   to bufLen. */
 int scsiLogSense(scsi_device * device, int pagenum, int subpagenum, UINT8 *pBuf,
                  int bufLen, int known_resp_len)
 {
@@ -259,13 +262,22 @@ int scsiLogSense(scsi_device * device, int pagenum, int subpagenum, UINT8 *pBuf,
     struct scsi_sense_disect sinfo;
     UINT8 cdb[10];
     UINT8 sense[32];
-    int pageLen;
+    int pageLen, respLen, cachedLen = 0;
     int status, res;
 
     if (known_resp_len > bufLen)
         return -EIO;
     if (known_resp_len > 0)
         pageLen = known_resp_len;
+    else if ((0 == subpagenum) &&
+             ((cachedLen = device->get_log_sense_len(pagenum)) > 0)) {
+        pageLen = cachedLen;
+        /* some SCSI HBA don't like "odd" length transfers */
+        if (pageLen % 2)
+            pageLen += 1;
+        if (pageLen > bufLen)
+            pageLen = bufLen;
+    }
     else {
         /* Starting twin fetch strategy: first fetch to find respone length */
         pageLen = 4;
@@ -290,7 +302,7 @@ int scsiLogSense(scsi_device * device, int pagenum, int subpagenum, UINT8 *pBuf,
         io_hdr.max_sense_len = sizeof(sense);
         io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-        if (!device->scsi_pass_through(&io_hdr))
+        if (!device->scsi_pass_through_timed(&io_hdr))
           return -device->get_errno();
         scsi_do_sense_disect(&io_hdr, &sinfo);
         if ((res = scsiSimpleSenseFilter(&sinfo)))
@@ -317,6 +329,7 @@ int scsiLogSense(scsi_device * device, int pagenum, int subpagenum, UINT8 *pBuf,
     io_hdr.dxferp = pBuf;
     cdb[0] = LOG_SENSE;
     cdb[2] = 0x40 | (pagenum & 0x3f);  /* Page control (PC)==1 */
+    cdb[3] = subpagenum;
     cdb[7] = (pageLen >> 8) & 0xff;
     cdb[8] = pageLen & 0xff;
     io_hdr.cmnd = cdb;
@@ -325,7 +338,11 @@ int scsiLogSense(scsi_device * device, int pagenum, int subpagenum, UINT8 *pBuf,
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (cachedLen > 0) {
+        /* forget cached length on error, next call does twin fetch */
+        device->set_log_sense_len(pagenum, 0);
+    }
+    if (!device->scsi_pass_through_timed(&io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     status = scsiSimpleSenseFilter(&sinfo);
@@ -336,6 +353,13 @@ int scsiLogSense(scsi_device * device, int pagenum, int subpagenum, UINT8 *pBuf,
         return SIMPLE_ERR_BAD_RESP;
     if (0 == ((pBuf[2] << 8) + pBuf[3]))
         return SIMPLE_ERR_BAD_RESP;
+    respLen = (pBuf[2] << 8) + pBuf[3] + 4;
+    /* page may have grown since its length was cached, fetch again */
+    if ((cachedLen > 0) && (pageLen < bufLen) && (respLen > pageLen))
+        return scsiLogSense(device, pagenum, subpagenum, pBuf, bufLen, 0);
+    /* cache length reported by device, not the (clamped) request length */
+    if ((known_resp_len <= 0) && (0 == subpagenum))
+        device->set_log_sense_len(pagenum, (respLen > 0xffff ? 0xffff : respLen));
     return 0;
 }
 
@@ -369,7 +393,7 @@ int scsiLogSelect(scsi_device * device, int pcr, int sp, int pc, int pagenum,
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!device->scsi_pass_through_timed(&io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     return scsiSimpleSenseFilter(&sinfo);
@@ -405,12 +429,12 @@ int scsiModeSense(scsi_device * device, int pagenum, int subpagenum, int pc,
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!device->scsi_pass_through_timed(&io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     status = scsiSimpleSenseFilter(&sinfo);
     if (SIMPLE_ERR_TRY_AGAIN == status) {
-        if (!device->scsi_pass_through(&io_hdr))
+        if (!device->scsi_pass_through_timed(&io_hdr))
           return -device->get_errno();
         scsi_do_sense_disect(&io_hdr, &sinfo);
         status = scsiSimpleSenseFilter(&sinfo);
@@ -465,7 +489,7 @@ int scsiModeSelect(scsi_device * device, int sp, UINT8 *pBuf, int bufLen)
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!device->scsi_pass_through_timed(&io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     return scsiSimpleSenseFilter(&sinfo);
@@ -500,12 +524,12 @@ int scsiModeSense10(scsi_device * device, int pagenum, int subpagenum, int pc,
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!device->scsi_pass_through_timed(&io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     status = scsiSimpleSenseFilter(&sinfo);
     if (SIMPLE_ERR_TRY_AGAIN == status) {
-        if (!device->scsi_pass_through(&io_hdr))
+        if (!device->scsi_pass_through_timed(&io_hdr))
           return -device->get_errno();
         scsi_do_sense_disect(&io_hdr, &sinfo);
         status = scsiSimpleSenseFilter(&sinfo);
@@ -561,7 +585,7 @@ int scsiModeSelect10(scsi_device * device, int sp, UINT8 *pBuf, int bufLen)
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!device->scsi_pass_through_timed(&io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     return scsiSimpleSenseFilter(&sinfo);
@@ -592,7 +616,7 @@ int scsiStdInquiry(scsi_device * device, UINT8 *pBuf, int bufLen)
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!device->scsi_pass_through_timed(&io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     return scsiSimpleSenseFilter(&sinfo);
@@ -629,7 +653,7 @@ int scsiInquiryVpd(scsi_device * device, int vpd_page, UINT8 *pBuf, int bufLen)
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!device->scsi_pass_through_timed(&io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     if ((res = scsiSimpleSenseFilter(&sinfo)))
@@ -669,7 +693,7 @@ int scsiRequestSense(scsi_device * device, struct scsi_sense_disect * sense_info
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!device->scsi_pass_through_timed(&io_hdr))
       return -device->get_errno();
     if (sense_info) {
         ecode = buff[0] & 0x7f;
@@ -719,7 +743,7 @@ int scsiSendDiagnostic(scsi_device * device, int functioncode, UINT8 *pBuf, int
     /* worst case is an extended foreground self test on a big disk */
     io_hdr.timeout = SCSI_TIMEOUT_SELF_TEST;
     
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!device->scsi_pass_through_timed(&io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     return scsiSimpleSenseFilter(&sinfo);
@@ -752,7 +776,7 @@ int scsiReceiveDiagnostic(scsi_device * device, int pcv, int pagenum, UINT8 *pBu
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!device->scsi_pass_through_timed(&io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     return scsiSimpleSenseFilter(&sinfo);
@@ -777,7 +801,7 @@ static int _testunitready(scsi_device * device, struct scsi_sense_disect * sinfo
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!device->scsi_pass_through_timed(&io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, sinfo);
     return 0;
@@ -831,7 +855,7 @@ int scsiReadDefect10(scsi_device * device, int req_plist, int req_glist, int dl_
     io_hdr.max_sense_len = sizeof(sense);
     io_hdr.timeout = SCSI_TIMEOUT_DEFAULT;
 
-    if (!device->scsi_pass_through(&io_hdr))
+    if (!device->scsi_pass_through_timed(&io_hdr))
       return -device->get_errno();
     scsi_do_sense_disect(&io_hdr, &sinfo);
     return scsiSimpleSenseFilter(&sinfo);
@@ -1048,12 +1072,12 @@ int scsiSetExceptionControlAndWarning(scsi_device * device, int enabled,
 
 int scsiGetTemp(scsi_device * device, UINT8 *currenttemp, UINT8 *triptemp)
 {
-    UINT8 tBuf[252];
+    scsi_device::io_buffer buf(device, 252);
+    UINT8 * tBuf = buf.data();
     int err;
 
-    memset(tBuf, 0, sizeof(tBuf));
     if ((err = scsiLogSense(device, TEMPERATURE_LPAGE, 0, tBuf,
-                            sizeof(tBuf), 0))) {
+                            buf.size(), 0))) {
         *currenttemp = 0;
         *triptemp = 0;
         pout("Log Sense for temperature failed [%s]\n", scsiErrString(err));
@@ -1072,7 +1096,8 @@ int scsiCheckIE(scsi_device * device, int hasIELogPage, int hasTempLogPage,
                 UINT8 *asc, UINT8 *ascq, UINT8 *currenttemp,
                 UINT8 *triptemp)
 {
-    UINT8 tBuf[252];
+    scsi_device::io_buffer buf(device, 252);
+    UINT8 * tBuf = buf.data();
     struct scsi_sense_disect sense_info;
     int err;
     int temperatureSet = 0;
@@ -1083,11 +1108,10 @@ int scsiCheckIE(scsi_device * device, int hasIELogPage, int hasTempLogPage,
     *ascq = 0;
     *currenttemp = 0;
     *triptemp = 0;
-    memset(tBuf,0,sizeof(tBuf)); // need to clear stack space of junk
     memset(&sense_info, 0, sizeof(sense_info));
     if (hasIELogPage) {
         if ((err = scsiLogSense(device, IE_LPAGE, 0, tBuf,
-                                sizeof(tBuf), 0))) {
+                                buf.size(), 0))) {
             pout("Log Sense failed, IE page [%s]\n", scsiErrString(err));
             return err;
         }
@@ -1900,7 +1924,8 @@ int scsiCountFailedSelfTests(scsi_device * fd, int noisy)
 {
     int num, k, n, err, res, fails, fail_hour;
     UINT8 * ucp;
-    unsigned char resp[LOG_RESP_SELF_TEST_LEN];
+    scsi_device::io_buffer buf(fd, LOG_RESP_SELF_TEST_LEN);
+    unsigned char * resp = buf.data();
 
     if ((err = scsiLogSense(fd, SELFTEST_RESULTS_LPAGE, 0, resp,
                             LOG_RESP_SELF_TEST_LEN, 0))) {
@@ -1949,7 +1974,8 @@ int scsiSelfTestInProgress(scsi_device * fd, int * inProgress)
 {
     int num;
     UINT8 * ucp;
-    unsigned char resp[LOG_RESP_SELF_TEST_LEN];
+    scsi_device::io_buffer buf(fd, LOG_RESP_SELF_TEST_LEN);
+    unsigned char * resp = buf.data();
 
     if (scsiLogSense(fd, SELFTEST_RESULTS_LPAGE, 0, resp,
                      LOG_RESP_SELF_TEST_LEN, 0))
@@ -1968,6 +1994,67 @@ int scsiSelfTestInProgress(scsi_device * fd, int * inProgress)
     return 0;
 }
 
+/* Returns the number of elements in the grown defect list. Only the
+   defect list header is fetched. Returns a negative value if the list
+   could not be read, the device returned another list or the defect
+   list format is unknown. See SBC-3 section 5.7 (READ DEFECT DATA). */
+int scsiCountGrownDefects(scsi_device * device)
+{
+    int div;
+    scsi_device::io_buffer buf(device, 4);
+    UINT8 * resp = buf.data();
+
+    if (scsiReadDefect10(device, 0 /* req_plist */, 1 /* req_glist */,
+                         4 /* bytes from index */, resp, buf.size()))
+        return -1;
+    if (0x8 != (resp[1] & 0x18))
+        return -1;      /* asked for grown list but didn't get it */
+    switch (resp[1] & 0x7) {
+        case 0:     /* short block */
+            div = 4;
+            break;
+        case 3:     /* long block */
+        case 4:     /* bytes from index */
+        case 5:     /* physical sector */
+            div = 8;
+            break;
+        default:
+            return -1;
+    }
+    return ((resp[2] << 8) + resp[3]) / div;
+}
+
+/* Returns the number of medium scan result entries (parameter codes
+   0x1 to 0x800) in the Background scan results log page, or a negative
+   value if this page could not be read. See SBC-3 section 6.2.2 . */
+int scsiCountBackgroundScanResults(scsi_device * device)
+{
+    int num, pc, pl, count;
+    UINT8 * ucp;
+
+    /* status parameter and up to 2048 result parameters */
+    const int resp_len = 4 + 16 + 2048 * 24;
+    scsi_device::io_buffer buf(device, resp_len);
+    UINT8 * resp = buf.data();
+    if (scsiLogSense(device, BACKGROUND_RESULTS_LPAGE, 0, resp, resp_len, 0) ||
+        (resp[0] & 0x3f) != BACKGROUND_RESULTS_LPAGE)
+        return -1;
+    num = (resp[2] << 8) + resp[3];
+    if (num > resp_len - 4)
+        num = resp_len - 4;
+    count = 0;
+    ucp = resp + 4;
+    while (num > 3) {
+        pc = (ucp[0] << 8) | ucp[1];
+        pl = ucp[3] + 4;
+        if (pc >= 0x1 && pc <= 0x800)
+            count++;
+        num -= pl;
+        ucp += pl;
+    }
+    return count;
+}
+
 /* Returns a negative value if failed to fetch Contol mode page or it was
    malformed. Returns 0 if GLTSD bit is zero and returns 1 if the GLTSD
    bit is set. Examines default mode page when current==0 else examines
@@ -344,6 +344,8 @@ int scsiFetchExtendedSelfTestTime(scsi_device * device, int * durationSec,
                                   int modese_len);
 int scsiCountFailedSelfTests(scsi_device * device, int noisy);
 int scsiSelfTestInProgress(scsi_device * device, int * inProgress);
+int scsiCountGrownDefects(scsi_device * device);
+int scsiCountBackgroundScanResults(scsi_device * device);
 int scsiFetchControlGLTSD(scsi_device * device, int modese_len, int current);
 int scsiSetControlGLTSD(scsi_device * device, int enabled, int modese_len);
 int scsiFetchTransportProtocol(scsi_device * device, int modese_len);
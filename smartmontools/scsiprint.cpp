@@ -40,6 +40,7 @@
 #include "scsiprint.h"
 #include "smartctl.h"
 #include "utility.h"
+#include "json.h"
 
 #define GBUF_SIZE 65535
 
@@ -84,6 +85,13 @@ static void scsiGetSupportedLogPages(scsi_device * device)
 {
     int i, err;
 
+    /* Forget pages of previous device (smartctl --batch without fork) */
+    gSmartLPage = gTempLPage = gSelfTestLPage = gStartStopLPage = 0;
+    gReadECounterLPage = gWriteECounterLPage = gVerifyECounterLPage = 0;
+    gNonMediumELPage = gLastNErrorLPage = gBackgroundResultsLPage = 0;
+    gProtocolSpecificLPage = gTapeAlertsLPage = 0;
+    gSeagateCacheLPage = gSeagateFactoryLPage = 0;
+
     if ((err = scsiLogSense(device, SUPPORTED_LPAGES, 0, gBuf,
                             LOG_RESP_LEN, 0))) {
         if (con->reportscsiioctl > 0)
@@ -143,6 +151,24 @@ static void scsiGetSupportedLogPages(scsi_device * device)
     }
 }
 
+// Add temperatures to structured output, 0 and 255 mean unknown
+static void json_temp(UINT8 temp, UINT8 trip)
+{
+    if (temp && 255 != temp)
+        jglb["temperature"]["current"] = temp;
+    if (trip)
+        jglb["temperature"]["drive_trip"] = trip;
+}
+
+// Strip trailing blanks of INQUIRY fields and fixed width table
+// strings for structured output
+static std::string json_trim(const char * s)
+{
+    std::string r(s);
+    r.erase(r.find_last_not_of(' ') + 1);
+    return r;
+}
+
 /* Returns 0 if ok, -1 if can't check IE, -2 if can check and bad
    (or at least something to report). */
 static int scsiGetSmartData(scsi_device * device, bool attribs)
@@ -170,6 +196,14 @@ static int scsiGetSmartData(scsi_device * device, bool attribs)
         PRINT_OFF(con);
     } else if (gIecMPage)
         pout("SMART Health Status: OK\n");
+    if (cp || gIecMPage) {
+        jglb["smart_status"]["passed"] = !cp;
+        if (cp) {
+            jglb["smart_status"]["scsi"]["asc"] = asc;
+            jglb["smart_status"]["scsi"]["ascq"] = ascq;
+            jglb["smart_status"]["scsi"]["ie_string"] = cp;
+        }
+    }
 
     if (attribs && !gTempLPage) {
         if (currenttemp || triptemp)
@@ -182,6 +216,7 @@ static int scsiGetSmartData(scsi_device * device, bool attribs)
         }
         if (triptemp)
             pout("Drive Trip Temperature:        %d C\n", triptemp);
+        json_temp(currenttemp, triptemp);
     }
     return err;
 }
@@ -289,8 +324,10 @@ static void scsiGetStartStopData(scsi_device * device)
         case 4:
             if (extra > 7) {
                 u = (ucp[4] << 24) | (ucp[5] << 16) | (ucp[6] << 8) | ucp[7];
-                if (0xffffffff != u)
+                if (0xffffffff != u) {
                     pout("Accumulated start-stop cycles:  %u\n", u);
+                    jglb["scsi_start_stop_cycle_counter"]["accumulated_start_stop_cycles"] = u;
+                }
             }
             break;
         case 5:
@@ -353,14 +390,17 @@ static void scsiPrintGrownDefectListLen(scsi_device * device)
             break;
     }
     dl_len = (gBuf[2] << 8) + gBuf[3];
-    if (0 == dl_len)
+    if (0 == dl_len) {
         pout("Elements in grown defect list: 0\n");
-    else {
+        jglb["scsi_grown_defect_list"] = 0;
+    } else {
         if (0 == div)
             pout("Grown defect list length=%d bytes [unknown "
                  "number of elements]\n", dl_len);
-        else
+        else {
             pout("Elements in grown defect list: %d\n", dl_len / div);
+            jglb["scsi_grown_defect_list"] = dl_len / div;
+        }
     }
 }
 
@@ -581,6 +621,16 @@ static void scsiPrintErrorCounterLog(scsi_device * device)
                  ecp->counter[2], ecp->counter[3], ecp->counter[4]);
             processed_gb = uint64_to_double(ecp->counter[5]) / 1000000000.0;
             pout("   %12.3f    %8"PRIu64"\n", processed_gb, ecp->counter[6]);
+
+            static const char * const jnames[3] = {"read", "write", "verify"};
+            json & je = jglb["scsi_error_counter_log"][jnames[k]];
+            je["errors_corrected_by_eccfast"] = ecp->counter[0];
+            je["errors_corrected_by_eccdelayed"] = ecp->counter[1];
+            je["errors_corrected_by_rereads_rewrites"] = ecp->counter[2];
+            je["total_errors_corrected"] = ecp->counter[3];
+            je["correction_algorithm_invocations"] = ecp->counter[4];
+            je["bytes_processed"] = ecp->counter[5];
+            je["total_uncorrected_errors"] = ecp->counter[6];
         }
     }
     else 
@@ -588,14 +638,22 @@ static void scsiPrintErrorCounterLog(scsi_device * device)
     if (gNonMediumELPage && (0 == scsiLogSense(device,
                 NON_MEDIUM_ERROR_LPAGE, 0, gBuf, LOG_RESP_LEN, 0))) {
         scsiDecodeNonMediumErrPage(gBuf, &nme);
-        if (nme.gotPC0)
+        if (nme.gotPC0) {
             pout("\nNon-medium error count: %8"PRIu64"\n", nme.counterPC0);
-        if (nme.gotTFE_H)
+            jglb["scsi_error_counter_log"]["non_medium"]["count"] = nme.counterPC0;
+        }
+        if (nme.gotTFE_H) {
             pout("Track following error count [Hitachi]: %8"PRIu64"\n",
                  nme.counterTFE_H);
-        if (nme.gotPE_H)
+            jglb["scsi_error_counter_log"]["non_medium"]["track_following_errors"] =
+                nme.counterTFE_H;
+        }
+        if (nme.gotPE_H) {
             pout("Positioning error count [Hitachi]: %8"PRIu64"\n",
                  nme.counterPE_H);
+            jglb["scsi_error_counter_log"]["non_medium"]["positioning_errors"] =
+                nme.counterPE_H;
+        }
     }
     if (gLastNErrorLPage && (0 == scsiLogSense(device,
                 LAST_N_ERROR_LPAGE, 0, gBuf, LOG_RESP_LONG_LEN, 0))) {
@@ -707,6 +765,8 @@ static int scsiPrintSelfTest(scsi_device * device)
         PRINT_OFF(con);
         return FAILSMART;
     }
+    json & jt = jglb["scsi_self_test_log"]["table"];
+    jt.set_type(json::nt_array);
     // loop through the twenty possible entries
     for (k = 0, ucp = gBuf + 4; k < 20; ++k, ucp += 20 ) {
         int i;
@@ -732,6 +792,10 @@ static int scsiPrintSelfTest(scsi_device * device)
         // print parameter code (test number) & self-test code text
         pout("#%2d  %s", (ucp[0] << 8) | ucp[1], 
             self_test_code[(ucp[4] >> 5) & 0x7]);
+        json & je = jt[jt.size()];
+        je["number"] = (ucp[0] << 8) | ucp[1];
+        je["code"]["value"] = (ucp[4] >> 5) & 0x7;
+        je["code"]["string"] = json_trim(self_test_code[(ucp[4] >> 5) & 0x7]);
 
         // check the self-test result nibble, using the self-test results
         // field table from T10/1416-D (SPC-3) Rev. 23, section 7.2.10:
@@ -766,6 +830,8 @@ static int scsiPrintSelfTest(scsi_device * device)
             break;
         }
         pout("  %s", self_test_result[res]);
+        je["result"]["value"] = res;
+        je["result"]["string"] = json_trim(self_test_result[res]);
 
         // self-test number identifies test that failed and consists
         // of either the number of the segment that failed during
@@ -773,17 +839,20 @@ static int scsiPrintSelfTest(scsi_device * device)
         // number of the segment in which the test was run, using a
         // vendor-specific method of putting both numbers into a
         // single byte.
-        if (ucp[5])
+        if (ucp[5]) {
             pout(" %3d",  (int)ucp[5]);
-        else
+            je["failed_segment"] = ucp[5];
+        } else
             pout("   -");
 
         // print time that the self-test was completed
         if (n==0 && res==0xf)
         // self-test in progress
             pout("     NOW");
-        else   
+        else {
             pout("   %5d", n);
+            je["lifetime_hours"] = n;
+        }
           
         // construct 8-byte integer address of first failure
         for (i = 0; i < 8; i++) {
@@ -798,14 +867,18 @@ static int scsiPrintSelfTest(scsi_device * device)
             snprintf(buff, sizeof(buff), "%"PRIu64, ull);
             // snprintf(buff, sizeof(buff), "0x%"PRIx64, ull);
             pout("%18s", buff);
+            je["lba_first_failure"] = ull;
         } else
             pout("                 -");
 
         // if sense key nonzero, then print it, along with
         // additional sense code and additional sense code qualifier
-        if (ucp[16] & 0xf)
+        if (ucp[16] & 0xf) {
             pout(" [0x%x 0x%x 0x%x]\n", ucp[16] & 0xf, ucp[17], ucp[18]);
-        else
+            je["sense_key"] = ucp[16] & 0xf;
+            je["asc"] = ucp[17];
+            je["ascq"] = ucp[18];
+        } else
             pout(" [-   -    -]\n");
     }
 
@@ -1369,8 +1442,12 @@ static int scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool
         
     memset(revision, 0, sizeof(revision));
     strncpy(revision, (char *)&gBuf[32], 4);
-    if (all && (0 != strncmp(manufacturer, "ATA", 3)))
+    if (all && (0 != strncmp(manufacturer, "ATA", 3))) {
         pout("Device: %s %s Version: %s\n", manufacturer, product, revision);
+        jglb["vendor"] = json_trim(manufacturer);
+        jglb["product"] = json_trim(product);
+        jglb["revision"] = json_trim(revision);
+    }
 
     if (!*device->get_req_type()/*no type requested*/ &&
                (0 == strncmp(manufacturer, "ATA", 3))) {
@@ -1401,6 +1478,7 @@ static int scsiGetDriveInfo(scsi_device * device, UINT8 * peripheral_type, bool
             len = gBuf[3];
             gBuf[4 + len] = '\0';
             pout("Serial number: %s\n", &gBuf[4]);
+            jglb["serial_number"] = (const char *)&gBuf[4];
         }
         else if (con->reportscsiioctl > 0) {
             PRINT_ON(con);
@@ -1567,6 +1645,7 @@ static void scsiPrintTemp(scsi_device * device)
     }
     if (trip)
         pout("Drive Trip Temperature:        %d C\n", trip);
+    json_temp(temp, trip);
 }
 
 /* Main entry point used by smartctl command. Return 0 for success */
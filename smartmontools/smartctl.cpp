@@ -41,15 +41,22 @@
 #include <sys/param.h>
 #endif
 
+#ifndef _WIN32
+#include <sys/select.h>
+#include <sys/wait.h>
+#endif
+
 #if defined(__QNXNTO__) 
 #include <new> // TODO: Why is this include necessary on QNX ?
 #endif
 
 #include "int64.h"
 #include "atacmds.h"
+#include "attrlog.h"
 #include "dev_interface.h"
 #include "ataprint.h"
 #include "extern.h"
+#include "json.h"
 #include "knowndrives.h"
 #include "scsicmds.h"
 #include "scsiprint.h"
@@ -77,7 +84,8 @@ static std::string getvalidarglist(char opt);
 
 /*  void prints help information for command syntax */
 void Usage (void){
-  printf("Usage: smartctl [options] device\n\n");
+  printf("Usage: smartctl [options] device\n"
+         "       smartctl [options] --batch[=N] [device ...]\n\n");
   printf(
 "============================================ SHOW INFORMATION OPTIONS =====\n\n"
 "  -h, --help, --usage\n"
@@ -94,6 +102,10 @@ void Usage (void){
 "         Scan for devices\n\n"
 "  --scan-open\n"
 "         Scan for devices and try to open each device\n\n"
+"  --attrlog=list, --attrlog=TYPE,ID[,START[,END]]\n"
+"         Show blocks or entries of smartd attribute log file (see man page)\n\n"
+"  --batch[=N]\n"
+"         Query all given (or scanned) devices, up to N (4) in parallel\n\n"
   );
   printf(
 "================================== SMARTCTL RUN-TIME BEHAVIOR OPTIONS =====\n\n"
@@ -107,6 +119,10 @@ void Usage (void){
 "         Set action on bad checksum to one of: warn, exit, ignore\n\n"
 "  -r TYPE, --report=TYPE\n"
 "         Report transactions (see man page)\n\n"
+"  --cmdstats\n"
+"         Print latency, error and transfer statistics of device commands\n\n"
+"  --json[=compact|cbor]\n"
+"         Print results as JSON instead of text (cbor: binary encoding)\n\n"
 "  -n MODE, --nocheck=MODE                                             (ATA)\n"
 "         No check if: never, sleep, standby, idle (see man page)\n\n",
   getvalidarglist('d').c_str()); // TODO: Use this function also for other options ?
@@ -139,7 +155,7 @@ void Usage (void){
 "        Use firmware bug workaround: none, samsung, samsung2,\n"
 "                                     samsung3, swapid\n\n"
 "  -P TYPE, --presets=TYPE                                             (ATA)\n"
-"        Drive-specific presets: use, ignore, show, showall\n\n"
+"        Drive-specific presets: use, ignore, show, showall, benchmark\n\n"
 "  -B [+]FILE, --drivedb=[+]FILE                                       (ATA)\n"
 "        Read and replace [add] drive database from FILE\n"
 "        [default is +%s",
@@ -192,7 +208,7 @@ static std::string getvalidarglist(char opt)
            "sasphy[,reset], sataphy[,reset], gplog,N[,RANGE], smartlog,N[,RANGE], "
 	   "xerror[,N][,error], xselftest[,N][,selftest]";
   case 'P':
-    return "use, ignore, show, showall";
+    return "use, ignore, show, showall, benchmark";
   case 't':
     return "offline, short, long, conveyance, vendor,N, select,M-N, "
            "pending,N, afterselect,[on|off], scttempint,N[,p]";
@@ -232,8 +248,42 @@ enum checksum_err_mode_t {
 
 static checksum_err_mode_t checksum_err_mode = CHECKSUM_ERR_WARN;
 
+// Print command statistics after all other output (--cmdstats)
+static bool show_cmd_stats = false;
+
+// Structured output format (--json)
+enum json_mode_t {
+  JSON_OFF, JSON_PRETTY, JSON_COMPACT, JSON_CBOR
+};
+
+static json_mode_t json_mode = JSON_OFF;
+
+// Set after option parsing if text output is replaced by JSON
+static bool json_active = false;
+
+// Structured output tree
+json jglb;
+
+// Number of parallel device queries if multiple devices are given (--batch)
+static int batch_jobs = 0;
+
 static void scan_devices(const char * type, bool with_open, const char * pattern);
 
+// Arguments of '--attrlog'
+struct attrlog_args
+{
+  bool list;            // Show blocks
+  attrlog_kind kind;    // Entries to show
+  unsigned short id;    // Attribute ID
+  time_t from, to;      // Time range
+
+  attrlog_args()
+    : list(false), kind(ATTRLOG_RAW), id(0), from(0), to(0) { }
+};
+
+static bool parse_attrlog_args(const char * s, attrlog_args & args);
+static bool print_attrlog(const attrlog_args & args, const char * path);
+
 /*      Takes command options and sets features to be run */    
 const char * parse_options(int argc, char** argv,
                            ata_print_options & ataopts,
@@ -242,7 +292,8 @@ const char * parse_options(int argc, char** argv,
   // Please update getvalidarglist() if you edit shortopts
   const char *shortopts = "h?Vq:d:T:b:r:s:o:S:HcAl:iaxv:P:t:CXF:n:B:";
   // Please update getvalidarglist() if you edit longopts
-  enum { opt_scan = 1000, opt_scan_open = 1001 };
+  enum { opt_scan = 1000, opt_scan_open = 1001, opt_attrlog = 1002,
+         opt_cmdstats = 1003, opt_json = 1004, opt_batch = 1005 };
   struct option longopts[] = {
     { "help",            no_argument,       0, 'h' },
     { "usage",           no_argument,       0, 'h' },
@@ -274,6 +325,10 @@ const char * parse_options(int argc, char** argv,
     { "drivedb",         required_argument, 0, 'B' },
     { "scan",            no_argument,       0, opt_scan      },
     { "scan-open",       no_argument,       0, opt_scan_open },
+    { "attrlog",         required_argument, 0, opt_attrlog   },
+    { "cmdstats",        no_argument,       0, opt_cmdstats  },
+    { "json",            optional_argument, 0, opt_json      },
+    { "batch",           optional_argument, 0, opt_batch     },
     { 0,                 0,                 0, 0   }
   };
 
@@ -285,6 +340,8 @@ const char * parse_options(int argc, char** argv,
   const char * type = 0; // set to -d optarg
   bool no_defaultdb = false; // set true on '-B FILE'
   int scan = 0; // set by --scan, --scan-open
+  bool attrlog = false; // set by --attrlog
+  attrlog_args attrlog_query;
   bool badarg = false, captive = false;
   int testcnt = 0; // number of self-tests requested
 
@@ -588,6 +645,12 @@ const char * parse_options(int argc, char** argv,
         if (showallpresets())
           EXIT(FAILCMD); // report regexp syntax error
         EXIT(0);
+      } else if (!strcmp(optarg, "benchmark")) {
+        if (!no_defaultdb && !read_default_drive_databases())
+          EXIT(FAILCMD);
+        if (benchmark_drive_database())
+          EXIT(FAILCMD); // report different lookup results
+        EXIT(0);
       } else {
         badarg = true;
       }
@@ -720,6 +783,52 @@ const char * parse_options(int argc, char** argv,
       scan = optchar;
       break;
 
+    case opt_attrlog:
+      if (!parse_attrlog_args(optarg, attrlog_query)) {
+        printslogan();
+        pout("=======> INVALID ARGUMENT TO --attrlog: %s\n", optarg);
+        pout("=======> VALID ARGUMENTS ARE: list, raw|hourly|daily,ID[,START[,END]] <=======\n");
+        UsageSummary();
+        EXIT(FAILCMD);
+      }
+      attrlog = true;
+      break;
+
+    case opt_cmdstats:
+      show_cmd_stats = true;
+      break;
+
+    case opt_json:
+      if (!optarg)
+        json_mode = JSON_PRETTY;
+      else if (!strcmp(optarg, "compact"))
+        json_mode = JSON_COMPACT;
+      else if (!strcmp(optarg, "cbor"))
+        json_mode = JSON_CBOR;
+      else {
+        printslogan();
+        pout("=======> INVALID ARGUMENT TO --json: %s\n", optarg);
+        pout("=======> VALID ARGUMENTS ARE: compact, cbor <=======\n");
+        UsageSummary();
+        EXIT(FAILCMD);
+      }
+      break;
+
+    case opt_batch:
+      batch_jobs = 4;
+      if (optarg) {
+        char * end = 0;
+        batch_jobs = strtol(optarg, &end, 10);
+        if (!(*optarg && !*end && 1 <= batch_jobs && batch_jobs <= 64)) {
+          printslogan();
+          pout("=======> INVALID ARGUMENT TO --batch: %s\n", optarg);
+          pout("=======> VALID ARGUMENTS ARE: 1-64 <=======\n");
+          UsageSummary();
+          EXIT(FAILCMD);
+        }
+      }
+      break;
+
     case '?':
     default:
       con->dont_print = false;
@@ -778,6 +887,17 @@ const char * parse_options(int argc, char** argv,
     EXIT(0);
   }
 
+  // Special handling of --attrlog
+  if (attrlog) {
+    if (argc - optind != 1) {
+      printslogan();
+      pout("ERROR: smartctl --attrlog requires an attribute log file as the final command-line argument.\n\n");
+      UsageSummary();
+      EXIT(FAILCMD);
+    }
+    EXIT(print_attrlog(attrlog_query, argv[optind]) ? 0 : FAILCMD);
+  }
+
   // At this point we have processed all command-line options.  If the
   // print output is switchable, then start with the print output
   // turned off
@@ -829,18 +949,22 @@ const char * parse_options(int argc, char** argv,
     }
 
   // From here on, normal operations...
+  // Text output is suppressed in JSON mode, including the banner
+  json_active = (json_mode != JSON_OFF);
   printslogan();
   
   // Warn if the user has provided no device name
-  if (argc-optind<1){
+  if (argc-optind<1 && !batch_jobs){
+    jglb["smartctl"]["error"] = "no device name";
     pout("ERROR: smartctl requires a device name as the final command-line argument.\n\n");
     UsageSummary();
     EXIT(FAILCMD);
   }
   
   // Warn if the user has provided more than one device name
-  if (argc-optind>1){
+  if (argc-optind>1 && !batch_jobs){
     int i;
+    jglb["smartctl"]["error"] = "more than one device name";
     pout("ERROR: smartctl takes ONE device name as the final command-line argument.\n");
     pout("You have provided %d device names:\n",argc-optind);
     for (i=0; i<argc-optind; i++)
@@ -868,7 +992,7 @@ void pout(const char *fmt, ...){
   
   // initialize variable argument list 
   va_start(ap,fmt);
-  if (con->dont_print){
+  if (con->dont_print || json_active){
     va_end(ap);
     return;
   }
@@ -944,33 +1068,211 @@ void scan_devices(const char * type, bool with_open, const char * pattern)
   }
 }
 
-// Main program without exception handling
-int main_worker(int argc, char **argv)
+// Parse time "YYYY-MM-DD[ HH:MM[:SS]]" or "YYYY-MM-DD[THH:MM[:SS]]" (UTC).
+static bool parse_attrlog_time(const char * s, time_t & t)
 {
-  // Throw if CPU endianess does not match compile time test.
-  check_endianness();
+  int year = 0, mon = 0, day = 0, hour = 0, min = 0, sec = 0;
+  int n1 = -1, n2 = -1, n3 = -1;
+  sscanf(s, "%d-%d-%d%n%*[ T]%d:%d%n:%d%n", &year, &mon, &day, &n1,
+         &hour, &min, &n2, &sec, &n3);
+  int len = (n3 > 0 ? n3 : n2 > 0 ? n2 : n1);
+  if (!(   len == (int)strlen(s) && 1970 <= year && 1 <= mon && mon <= 12
+        && 1 <= day && day <= 31 && hour <= 23 && min <= 59 && sec <= 59))
+    return false;
+
+  // Days since 1970-01-01 of proleptic Gregorian calendar
+  int y = year - (mon <= 2), m = (mon + 9) % 12;
+  long days = 365L*y + y/4 - y/100 + y/400 + (153*m + 2)/5 + day - 1 - 719468L;
+  t = (time_t)(((days * 24 + hour) * 60 + min) * 60 + sec);
+  return true;
+}
 
-  // Initialize interface
-  smart_interface::init();
-  if (!smi())
-    return 1;
+// Parse argument of '--attrlog': list, raw|hourly|daily,ID[,START[,END]]
+static bool parse_attrlog_args(const char * s, attrlog_args & args)
+{
+  if (!strcmp(s, "list")) {
+    args.list = true;
+    return true;
+  }
 
-  // define control block for external functions
-  smartmonctrl control;
-  con=&control;
+  std::vector<std::string> fields;
+  for (const char * p = s; ; p++) {
+    const char * q = strchr(p, ',');
+    fields.push_back(std::string(p, (q ? q - p : strlen(p))));
+    if (!q)
+      break;
+    p = q;
+  }
+  if (!(2 <= fields.size() && fields.size() <= 4))
+    return false;
+
+  if (fields[0] == "raw")
+    args.kind = ATTRLOG_RAW;
+  else if (fields[0] == "hourly")
+    args.kind = ATTRLOG_HOURLY;
+  else if (fields[0] == "daily")
+    args.kind = ATTRLOG_DAILY;
+  else
+    return false;
+
+  int id = -1, n = -1;
+  sscanf(fields[1].c_str(), "%d%n", &id, &n);
+  if (!(n == (int)fields[1].size() && 1 <= id && id <= ATTRLOG_MAX_ID))
+    return false;
+  args.id = (unsigned short)id;
+
+  args.from = 0;
+  if (fields.size() > 2 && !fields[2].empty() && !parse_attrlog_time(fields[2].c_str(), args.from))
+    return false;
+  args.to = time(0) + 24*60*60;
+  if (fields.size() > 3 && !fields[3].empty() && !parse_attrlog_time(fields[3].c_str(), args.to))
+    return false;
+  return (args.from <= args.to);
+}
 
-  // Parse input arguments
-  ata_print_options ataopts;
-  scsi_print_options scsiopts;
-  const char * type = parse_options(argc, argv, ataopts, scsiopts);
+// Format time as "YYYY-MM-DD HH:MM:SS" (UTC)
+static std::string format_attrlog_time(time_t t)
+{
+  struct tm * tms = gmtime(&t);
+  if (!tms)
+    return "?";
+  return strprintf("%d-%02d-%02d %02d:%02d:%02d",
+                   1900+tms->tm_year, 1+tms->tm_mon, tms->tm_mday,
+                   tms->tm_hour, tms->tm_min, tms->tm_sec);
+}
 
-  // '-d test' -> Report result of autodetection
-  bool print_type_only = (type && !strcmp(type, "test"));
-  if (print_type_only)
-    type = 0;
+// Show blocks or entries of attribute log file
+// smartctl --attrlog=list|TYPE,ID[,START[,END]] FILE
+static bool print_attrlog(const attrlog_args & args, const char * path)
+{
+  if (args.list) {
+    attrlog_index index;
+    if (!attrlog_read_index(path, index))
+      return false;
+
+    // Summarize blocks of each attribute ID and kind
+    struct summary {
+      unsigned blocks, entries, bytes;
+      time_t first, last;
+    } sum[ATTRLOG_MAX_ID+1][ATTRLOG_NUM_KINDS];
+    memset(sum, 0, sizeof(sum));
+    unsigned i;
+    for (i = 0; i < index.size(); i++) {
+      const attrlog_block_info & info = index[i];
+      summary & s = sum[info.id][info.kind];
+      if (!s.blocks || info.first < s.first)
+        s.first = info.first;
+      if (!s.blocks || info.last > s.last)
+        s.last = info.last;
+      s.blocks++;
+      s.entries += info.count;
+      s.bytes += info.size;
+    }
 
-  const char * name = argv[argc-1];
+    pout("ID# TYPE    BLOCKS ENTRIES   BYTES FIRST (UTC)         LAST (UTC)\n");
+    for (i = 0; i <= ATTRLOG_MAX_ID; i++) {
+      for (int k = 0; k < ATTRLOG_NUM_KINDS; k++) {
+        const summary & s = sum[i][k];
+        if (!s.blocks)
+          continue;
+        pout("%3u %-6s %7u %7u %7u %s %s\n", i, attrlog_kind_name((attrlog_kind)k),
+             s.blocks, s.entries, s.bytes, format_attrlog_time(s.first).c_str(),
+             format_attrlog_time(s.last).c_str());
+      }
+    }
+    return true;
+  }
+
+  attrlog_entry_vector entries;
+  if (!attrlog_query(path, args.kind, args.id, args.from, args.to, entries))
+    return false;
+
+  if (args.kind == ATTRLOG_RAW) {
+    pout("TIME (UTC)          VALUE RAW_VALUE\n");
+    for (unsigned i = 0; i < entries.size(); i++) {
+      const attrlog_entry & e = entries[i];
+      pout("%s   %3d %"PRIu64"\n", format_attrlog_time(e.time).c_str(),
+           e.val_last, e.raw_last);
+    }
+  }
+  else {
+    pout("START (UTC)          MIN MAX LAST      RAW_MIN      RAW_MAX     RAW_LAST\n");
+    for (unsigned i = 0; i < entries.size(); i++) {
+      const attrlog_entry & e = entries[i];
+      pout("%s  %3d %3d  %3d %12"PRIu64" %12"PRIu64" %12"PRIu64"\n",
+           format_attrlog_time(e.time).c_str(), e.val_min, e.val_max, e.val_last,
+           e.raw_min, e.raw_max, e.raw_last);
+    }
+  }
+  return true;
+}
+
+// Print command statistics of device (--cmdstats)
+static void print_cmd_stats(const smart_device * dev)
+{
+  typedef smart_device::cmd_stats_entry entry;
+  const smart_device::cmd_stats_map & stats = dev->get_cmd_stats();
+
+  pout("=== START OF COMMAND STATISTICS SECTION ===\n");
+  if (stats.empty()) {
+    pout("No commands issued\n\n");
+    return;
+  }
+
+  pout("Opcode   Count Errors Tmouts      Bytes Avg[ms] Max[ms]");
+  for (int i = 0; i < entry::num_buckets; i++) {
+    // Last bucket has no upper limit
+    unsigned lim = entry::bucket_limit(i);
+    bool last = !lim;
+    if (last)
+      lim = entry::bucket_limit(i-1);
+    std::string label = (last ? ">=" : "<");
+    if (lim >= 1000000)
+      label += strprintf("%us", lim / 1000000);
+    else if (lim >= 1000)
+      label += strprintf("%u", lim / 1000);
+    else
+      label += strprintf("%.1f", lim / 1000.0);
+    pout(" %6s", label.c_str());
+  }
+  pout("  Command\n");
+
+  for (smart_device::cmd_stats_map::const_iterator it = stats.begin();
+       it != stats.end(); ++it) {
+    const entry & e = it->second;
+    std::string opcode = strprintf("%02x", it->first >> 8);
+    if (it->first & 0xff)
+      opcode += strprintf("/%02x", it->first & 0xff);
+    pout("%-6s %7u %6u %6u %10"PRIu64" %7.2f %7.2f", opcode.c_str(),
+         e.count, e.errors, e.timeouts, e.bytes,
+         (e.count ? e.total_us / 1000.0 / e.count : 0.0), e.max_us / 1000.0);
+    for (int i = 0; i < entry::num_buckets; i++)
+      pout(" %6u", e.hist[i]);
+    pout("  %s\n", dev->get_cmd_name(it->first).c_str());
+  }
+  pout("Latency histogram limits in milliseconds (s: seconds)\n\n");
+}
+
+// Print structured output tree (--json)
+static void print_json(int status)
+{
+  jglb["smartctl"]["exit_status"] = status;
+  if (json_mode == JSON_CBOR) {
+    std::string out;
+    jglb.encode_cbor(out);
+    fwrite(out.data(), 1, out.size(), stdout);
+  }
+  else
+    jglb.print(stdout, (json_mode == JSON_PRETTY));
+  fflush(stdout);
+}
 
+// Open device and run the requested ATA or SCSI functions,
+// return smartctl exit status
+static int query_device(const char * name, const char * type, bool print_type_only,
+                        const ata_print_options & ataopts,
+                        const scsi_print_options & scsiopts)
+{
   smart_device_auto_ptr dev;
   if (!strcmp(name,"-")) {
     // Parse "smartctl -r ataioctl,2 ..." output from stdin
@@ -1013,8 +1315,13 @@ int main_worker(int argc, char **argv)
       pout("%s: Device open changed type from '%s' to '%s'\n",
         dev->get_info_name(), oldinfo.dev_type.c_str(), dev->get_dev_type());
   }
+  jglb["device"]["name"] = dev->get_info_name();
+  jglb["device"]["type"] = dev->get_dev_type();
+  jglb["device"]["protocol"] = (dev->is_ata() ? "ATA" : dev->is_scsi() ? "SCSI" : "");
+
   if (!dev->is_open()) {
     pout("Smartctl open device: %s failed: %s\n", dev->get_info_name(), dev->get_errmsg());
+    jglb["smartctl"]["error"] = strprintf("open device failed: %s", dev->get_errmsg());
     return FAILDEV;
   }
 
@@ -1031,10 +1338,275 @@ int main_worker(int argc, char **argv)
     // we should never fall into this branch!
     pout("%s: Neither ATA nor SCSI device\n", dev->get_info_name());
 
+  if (show_cmd_stats)
+    print_cmd_stats(dev.get());
+
   dev->close();
   return retval;
 }
 
+// Device of a '--batch' run
+struct batch_device
+{
+  std::string name;     // Device name
+  std::string type;     // Device type, empty for autodetection
+  std::string output;   // Output collected from worker
+  int status;           // smartctl exit status, -1 if not finished
+#ifndef _WIN32
+  pid_t pid;            // Worker process
+  int fd;               // Read end of output pipe, -1 if closed
+#endif
+
+  batch_device(const char * name_, const char * type_)
+    : name(name_), type(type_ ? type_ : ""), status(-1)
+#ifndef _WIN32
+    , pid(-1), fd(-1)
+#endif
+    { }
+};
+
+// Query device of batch, EXIT() is also caught here
+static int batch_query_one(const batch_device & bd, bool print_type_only,
+                           const ata_print_options & ataopts,
+                           const scsi_print_options & scsiopts)
+{
+  int status;
+  try {
+    status = query_device(bd.name.c_str(), (!bd.type.empty() ? bd.type.c_str() : 0),
+                          print_type_only, ataopts, scsiopts);
+  }
+  catch (int ex) {
+    status = ex;
+  }
+  if (json_active) {
+    print_json(status);
+    jglb.clear();
+  }
+  return status;
+}
+
+// Return structured output of a device which could not be queried
+static std::string batch_json_error(const batch_device & bd, const char * msg)
+{
+  json j;
+  j["device"]["name"] = bd.name;
+  j["smartctl"]["error"] = msg;
+  j["smartctl"]["exit_status"] = FAILCMD;
+  std::string out;
+  if (json_mode == JSON_CBOR)
+    j.encode_cbor(out);
+  else
+    j.format(out, (json_mode == JSON_PRETTY));
+  return out;
+}
+
+// With '--json', the objects of all devices are printed as elements
+// of one JSON array (CBOR indefinite length array).
+static void batch_print_begin()
+{
+  if (json_mode == JSON_CBOR)
+    putchar(0x9f);
+  else if (json_active)
+    printf("[\n");
+}
+
+static void batch_print_separator(bool first)
+{
+  if (json_active && json_mode != JSON_CBOR && !first)
+    printf(",\n");
+}
+
+static void batch_print_end()
+{
+  if (json_mode == JSON_CBOR)
+    putchar(0xff);
+  else if (json_active)
+    printf("]\n");
+  fflush(stdout);
+}
+
+// Print output of finished device, devices are printed in command line order
+static void batch_print(const batch_device & bd, bool first)
+{
+  if (!json_active)
+    printf("=== DEVICE %s ===\n", bd.name.c_str());
+  batch_print_separator(first);
+  fwrite(bd.output.data(), 1, bd.output.size(), stdout);
+  fflush(stdout);
+}
+
+// Query all devices with up to 'batch_jobs' worker processes.
+// The drive database and interface are set up once before the workers
+// are forked, each worker runs a single device.
+static int batch_query(std::vector<batch_device> & devs, bool print_type_only,
+                       const ata_print_options & ataopts,
+                       const scsi_print_options & scsiopts)
+{
+  int retval = 0;
+  batch_print_begin();
+#ifndef _WIN32
+  fflush(stdout);
+  unsigned next_start = 0, next_print = 0;
+  int running = 0;
+
+  while (next_print < devs.size()) {
+    // Start workers
+    while (running < batch_jobs && next_start < devs.size()) {
+      batch_device & bd = devs[next_start++];
+      int fds[2];
+      if (pipe(fds) < 0) {
+        std::string msg = strprintf("pipe(): %s", strerror(errno));
+        bd.output = (json_active ? batch_json_error(bd, msg.c_str()) : "Smartctl: " + msg + "\n");
+        bd.status = FAILCMD;
+        continue;
+      }
+      bd.pid = fork();
+      if (bd.pid < 0) {
+        std::string msg = strprintf("fork(): %s", strerror(errno));
+        bd.output = (json_active ? batch_json_error(bd, msg.c_str()) : "Smartctl: " + msg + "\n");
+        bd.status = FAILCMD;
+        close(fds[0]); close(fds[1]);
+        continue;
+      }
+      if (!bd.pid) {
+        // Worker: send stdout to pipe
+        close(fds[0]);
+        dup2(fds[1], 1);
+        close(fds[1]);
+        int status = FAILCMD;
+        try {
+          status = batch_query_one(bd, print_type_only, ataopts, scsiopts);
+        }
+        catch (const std::exception & ex) {
+          if (json_active) {
+            jglb["smartctl"]["error"] = strprintf("Exception: %s", ex.what());
+            print_json(status);
+          }
+          else
+            printf("Smartctl: Exception: %s\n", ex.what());
+        }
+        fflush(stdout);
+        _exit(status);
+      }
+      close(fds[1]);
+      bd.fd = fds[0];
+      running++;
+    }
+
+    // Wait for output of running workers
+    fd_set rfds; FD_ZERO(&rfds);
+    int maxfd = -1;
+    for (unsigned i = next_print; i < next_start; i++) {
+      if (devs[i].fd >= 0) {
+        FD_SET(devs[i].fd, &rfds);
+        if (maxfd < devs[i].fd)
+          maxfd = devs[i].fd;
+      }
+    }
+    if (maxfd >= 0 && select(maxfd+1, &rfds, 0, 0, 0) < 0) {
+      if (errno == EINTR)
+        continue;
+      pout("Smartctl: select(): %s\n", strerror(errno));
+      retval |= FAILCMD;
+      break;
+    }
+
+    for (unsigned i = next_print; i < next_start; i++) {
+      batch_device & bd = devs[i];
+      if (!(bd.fd >= 0 && FD_ISSET(bd.fd, &rfds)))
+        continue;
+      char buf[4096];
+      int n = read(bd.fd, buf, sizeof(buf));
+      if (n > 0) {
+        bd.output.append(buf, n);
+        continue;
+      }
+      if (n < 0 && errno == EINTR)
+        continue;
+      // EOF: collect exit status of worker
+      close(bd.fd); bd.fd = -1;
+      int st = 0;
+      while (waitpid(bd.pid, &st, 0) < 0 && errno == EINTR)
+        ;
+      bd.status = (WIFEXITED(st) ? WEXITSTATUS(st) : FAILCMD);
+      if (json_active && !WIFEXITED(st))
+        bd.output = batch_json_error(bd, "worker process terminated");
+      running--;
+    }
+
+    // Print finished devices in order
+    while (next_print < devs.size() && devs[next_print].status >= 0) {
+      batch_print(devs[next_print], !next_print);
+      retval |= devs[next_print].status;
+      next_print++;
+    }
+  }
+
+#else // _WIN32
+  // No fork(), query devices one after another
+  for (unsigned i = 0; i < devs.size(); i++) {
+    if (!json_active)
+      printf("=== DEVICE %s ===\n", devs[i].name.c_str());
+    batch_print_separator(!i);
+    retval |= batch_query_one(devs[i], print_type_only, ataopts, scsiopts);
+  }
+#endif
+  batch_print_end();
+  return retval;
+}
+
+// Main program without exception handling
+int main_worker(int argc, char **argv)
+{
+  // Throw if CPU endianess does not match compile time test.
+  check_endianness();
+
+  // Initialize interface
+  smart_interface::init();
+  if (!smi())
+    return 1;
+
+  // define control block for external functions
+  smartmonctrl control;
+  con=&control;
+
+  // Parse input arguments
+  ata_print_options ataopts;
+  scsi_print_options scsiopts;
+  const char * type = parse_options(argc, argv, ataopts, scsiopts);
+
+  // '-d test' -> Report result of autodetection
+  bool print_type_only = (type && !strcmp(type, "test"));
+  if (print_type_only)
+    type = 0;
+
+  // Query multiple devices (--batch)
+  if (batch_jobs) {
+    std::vector<batch_device> devs;
+    if (optind < argc) {
+      for (int i = optind; i < argc; i++)
+        devs.push_back(batch_device(argv[i], type));
+    }
+    else {
+      // No device names, use result of device scan
+      smart_device_list devlist;
+      con->dont_print = !(con->reportataioctl || con->reportscsiioctl);
+      bool ok = smi()->scan_smart_devices(devlist, type, 0);
+      con->dont_print = false;
+      if (!ok) {
+        pout("scan_smart_devices: %s\n", smi()->get_errmsg());
+        return FAILCMD;
+      }
+      for (unsigned i = 0; i < devlist.size(); i++)
+        devs.push_back(batch_device(devlist.at(i)->get_dev_name(),
+                                    devlist.at(i)->get_dev_type()));
+    }
+    return batch_query(devs, print_type_only, ataopts, scsiopts);
+  }
+
+  return query_device(argv[argc-1], type, print_type_only, ataopts, scsiopts);
+}
+
 
 // Main program
 int main(int argc, char **argv)
@@ -1058,6 +1630,9 @@ int main(int argc, char **argv)
     printf("Smartctl: Exception: %s\n", ex.what());
     status = FAILCMD;
   }
+
+  if (json_active && !batch_jobs)
+    print_json(status);
   return status;
 }
 
@@ -68,6 +68,10 @@
 #define OPTIONAL_CMD 1
 #define MANDATORY_CMD 2
 
+// Structured output tree (--json), filled by the print functions
+class json;
+extern json jglb;
+
 // Moved to C++ interface
 //void print_smartctl_examples();
 
@@ -44,7 +44,9 @@
 #include <stdexcept>
 #include <string>
 #include <vector>
+#include <deque>
 #include <algorithm> // std::replace()
+#include <map>
 
 // see which system files to conditionally include
 #include "config.h"
@@ -52,6 +54,9 @@
 // conditionally included files
 #ifndef _WIN32
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #endif
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -59,6 +64,9 @@
 #ifdef HAVE_NETDB_H
 #include <netdb.h>
 #endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #ifdef _WIN32
 #ifdef _MSC_VER
@@ -84,9 +92,11 @@ extern "C" int __stdcall FreeConsole(void);
 // locally included files
 #include "int64.h"
 #include "atacmds.h"
+#include "attrlog.h"
 #include "dev_interface.h"
 #include "extern.h"
 #include "knowndrives.h"
+#include "json.h"
 #include "scsicmds.h"
 #include "utility.h"
 
@@ -161,6 +171,12 @@ static std::string state_path_prefix
 #endif
                                     ;
 
+// command-line: path of binary state store, empty if none.
+static std::string state_store_path;
+
+// command-line: path of capability cache, empty if none.
+static std::string capcache_path;
+
 // command-line: path prefix of attribute log file, empty if no logs.
 static std::string attrlog_path_prefix
 #ifdef SMARTMONTOOLS_ATTRIBUTELOG
@@ -168,6 +184,10 @@ static std::string attrlog_path_prefix
 #endif
                                     ;
 
+// command-line: use columnar attribute log format, retention times.
+static bool attrlog_columnar = false;
+static attrlog_retention attrlog_keep;
+
 // configuration file name
 static const char * configfile;
 // configuration file "name" if read from stdin
@@ -181,6 +201,14 @@ static int quit=0;
 // command-line; this is the default syslog(3) log facility to use.
 static int facility=LOG_DAEMON;
 
+// command-line: log to 'file:PATH' or 'socket:PATH' instead of syslog
+static std::string log_target;
+
+#ifndef _WIN32
+// command-line: path of query socket
+static std::string query_socket_path;
+#endif
+
 #ifndef _WIN32
 // command-line: fork into background?
 static bool do_fork=true;
@@ -191,16 +219,23 @@ static bool do_fork=true;
 static bool enable_capabilities = false;
 #endif
 
+// command-line: max number of devices checked in parallel
+static unsigned max_check_jobs = 1;
+// command-line: max number of parallel checks per controller, 0 if no limit
+static unsigned max_check_jobs_per_ctrl = 0;
+
+// command-line: max number of devices kept open between checks
+static unsigned keepopen_max = 0;
+
 // used for control of printing, passing arguments to atacmds.c
 smartmonctrl *con=NULL;
 
 // set to one if we catch a USR1 (check devices now)
 volatile int caughtsigUSR1=0;
 
-#ifdef _WIN32
-// set to one if we catch a USR2 (toggle debug mode)
+// set to one if we catch a USR2 (Windows: toggle debug mode,
+// otherwise log command statistics)
 volatile int caughtsigUSR2=0;
-#endif
 
 // set to one if we catch a HUP (reload config file). In debug mode,
 // set to two, if we catch INT (also reload config file).
@@ -252,6 +287,9 @@ struct dev_config
   int lineno;                             // Line number of entry in file
   std::string name;                       // Device name
   std::string dev_type;                   // Device type argument from -d directive, empty if none
+  std::string directives;                 // Directives from smartd.conf, used to detect changes on reload
+  std::string regname, regtype;           // Device name and type from smartd.conf before registration
+  std::string state_key;                  // "MODEL-SERIAL.TYPE", empty if no persistence
   std::string state_file;                 // Path of the persistent state file, empty if none
   std::string attrlog_file;               // Path of the persistent attrlog file, empty if none
   bool smartcheck;                        // Check SMART status
@@ -259,7 +297,7 @@ struct dev_config
   bool prefail;                           // Track changes in Prefail Attributes
   bool usage;                             // Track changes in Usage Attributes
   bool selftest;                          // Monitor number of selftest errors
-  bool errorlog;                          // Monitor number of ATA errors
+  bool errorlog;                          // Monitor number of ATA errors (SCSI: error counters)
   bool xerrorlog;                         // Monitor number of ATA errors (Extended Comprehensive error log)
   bool permissive;                        // Ignore failed SMART commands
   char autosave;                          // 1=disable, 2=enable Autosave Attributes
@@ -271,6 +309,8 @@ struct dev_config
   char powermode;                         // skip check, if disk in idle or standby mode
   bool powerquiet;                        // skip powermode 'skipping checks' message
   int powerskipmax;                       // how many times can be check skipped
+  int checktime;                          // Check interval in seconds, 0 = use '-i' option
+  int checktime_min, checktime_max;       // Range of adaptive check interval, 0 = not adaptive, -1 = default
   unsigned char tempdiff;                 // Track Temperature changes >= this limit
   unsigned char tempinfo, tempcrit;       // Track Temperatures >= these limits as LOG_INFO, LOG_CRIT+mail
   regular_expression test_regex;          // Regex for scheduled testing
@@ -290,6 +330,7 @@ struct dev_config
   attribute_flags monitor_attr_flags;     // MONITOR_* flags for each attribute
 
   ata_vendor_attr_defs attribute_defs;    // -v options
+  ata_attr_raw_decoder attribute_decoder; // Byte orders from attribute_defs
 
   dev_config();
 };
@@ -313,6 +354,8 @@ dev_config::dev_config()
   powermode(0),
   powerquiet(false),
   powerskipmax(0),
+  checktime(0),
+  checktime_min(0), checktime_max(0),
   tempdiff(0),
   tempinfo(0), tempcrit(0),
   emailfreq(0),
@@ -330,6 +373,35 @@ const int SMARTD_NMAIL = 13;
 const int MAILTYPE_TEST = 0;
 // TODO: Add const or enum for all mail types.
 
+// SCSI error counters tracked with '-l error',
+// index into persistent_dev_state::scsi_counters[].
+enum {
+  SCSI_CNT_GROWN_DEFECTS = 0,             // Elements in grown defect list
+  SCSI_CNT_READ_UNC,                      // Total uncorrected read errors
+  SCSI_CNT_WRITE_UNC,                     // Total uncorrected write errors
+  SCSI_CNT_VERIFY_UNC,                    // Total uncorrected verify errors
+  SCSI_CNT_BMS_RESULTS,                   // Background medium scan results
+  SCSI_NUM_COUNTERS
+};
+
+// Attribute log ID of SCSI_CNT_* counter, outside of ATA attribute IDs.
+#define SCSI_CNT_ATTRLOG_ID(i)  (0x100 + (i))
+
+struct scsi_counter_info {
+  const char * name;                      // Name in state file and attribute log
+  const char * desc;                      // Description for log and mail messages
+  int lpage;                              // Log page, 0 if none
+  int mailtype;                           // Type of warning mail
+};
+
+static const scsi_counter_info scsi_counters_info[SCSI_NUM_COUNTERS] = {
+  {"grown-defects",           "Grown defect list length",       0,                          11},
+  {"read-uncorrected",        "Uncorrected read error count",   READ_ERROR_COUNTER_LPAGE,    4},
+  {"write-uncorrected",       "Uncorrected write error count",  WRITE_ERROR_COUNTER_LPAGE,   4},
+  {"verify-uncorrected",      "Uncorrected verify error count", VERIFY_ERROR_COUNTER_LPAGE,  4},
+  {"background-scan-results", "Background scan results count",  BACKGROUND_RESULTS_LPAGE,   11}
+};
+
 struct mailinfo {
   int logged;// number of times an email has been sent
   time_t firstsent;// time first email was sent, as defined by time(2)
@@ -365,6 +437,9 @@ struct persistent_dev_state
   };
   ata_attribute ata_attributes[NUMBER_ATA_SMART_ATTRIBUTES];
 
+  // SCSI ONLY
+  int64_t scsi_counters[SCSI_NUM_COUNTERS]; // Last values of SCSI_CNT_*, -1 = unknown
+
   persistent_dev_state();
 };
 
@@ -375,6 +450,8 @@ persistent_dev_state::persistent_dev_state()
   scheduled_test_next_check(0),
   ataerrorcount(0)
 {
+  for (int i = 0; i < SCSI_NUM_COUNTERS; i++)
+    scsi_counters[i] = -1;
 }
 
 /// Non-persistent state data for a device.
@@ -394,18 +471,36 @@ struct temp_dev_state
   bool powermodefail;                     // true if power mode check failed
   int powerskipcnt;                       // Number of checks skipped due to idle or standby mode
 
+  time_t next_check;                      // Time of next check, 0 = check now
+  int cur_checktime;                      // Current check interval, 0 = not yet scheduled
+  bool degrading;                         // Signs of degradation found during last check
+  time_t last_check;                      // Time of last check, 0 = not yet checked
+  bool checked;                           // Checked in last pass of CheckDevicesOnce()
+  signed char smart_status;               // Last SMART health: 1 = passed, 0 = failed, -1 = unknown
+
   // SCSI ONLY
   unsigned char SmartPageSupported;       // has log sense IE page (0x2f)
   unsigned char TempPageSupported;        // has log sense temperature page (0xd)
   unsigned char SuppressReport;           // minimize nuisance reports
   unsigned char modese_len;               // mode sense/select cmd len: 0 (don't
                                           // know yet) 6 or 10
+  unsigned char scsi_counters_supported;  // Bitmask of readable SCSI_CNT_* counters
+  unsigned char scsi_counter_next;        // SCSI_CNT_* counter to read in next check
 
   // ATA ONLY
   uint64_t num_sectors;                   // Number of sectors (for selective self-test only)
   ata_smart_values smartval;              // SMART data
   ata_smart_thresholds_pvt smartthres;    // SMART thresholds
 
+  time_t attrlog_compacted;               // Time of last attribute log compaction
+  int selflog_exec_status;                // Self-test execution status at last
+                                          // Self-Test Log read, -1 = read next time
+  time_t selflog_read_time;               // Time of last Self-Test Log read
+  std::string keepopen_id;                // Identity of device kept open ('-k N')
+  int errlog_count;                       // Summary Error Log count at last read, -1 = unknown
+  int xerrlog_count;                      // Ext. Comprehensive Error Log count and
+  int xerrlog_index;                      // index at last read, -1 = unknown
+
   temp_dev_state();
 };
 
@@ -420,11 +515,25 @@ temp_dev_state::temp_dev_state()
   tempmin_delay(0),
   powermodefail(false),
   powerskipcnt(0),
+  next_check(0),
+  cur_checktime(0),
+  degrading(false),
+  last_check(0),
+  checked(false),
+  smart_status(-1),
   SmartPageSupported(false),
   TempPageSupported(false),
   SuppressReport(false),
   modese_len(0),
-  num_sectors(0)
+  scsi_counters_supported(0),
+  scsi_counter_next(0),
+  num_sectors(0),
+  attrlog_compacted(0),
+  selflog_exec_status(-1),
+  selflog_read_time(0),
+  errlog_count(-1),
+  xerrlog_count(-1),
+  xerrlog_index(-1)
 {
   memset(&smartval, 0, sizeof(smartval));
   memset(&smartthres, 0, sizeof(smartthres));
@@ -514,14 +623,15 @@ static bool parse_dev_state_line(const char * line, persistent_dev_state & state
        "|(raw)" // (20)
        ")" // 16)
       ")" // 14)
+     "|(scsi-counter\\.([a-z-]+))" // (21 (22)
      ")" // 1)
-     " *= *([0-9]+)[ \n]*$", // (21)
+     " *= *([0-9]+)[ \n]*$", // (23)
     REG_EXTENDED
   );
   if (regex.empty())
     throw std::logic_error("parse_dev_state_line: invalid regex");
 
-  const int nmatch = 1+21;
+  const int nmatch = 1+23;
   regmatch_t match[nmatch];
   if (!regex.execute(line, nmatch, match))
     return false;
@@ -573,6 +683,15 @@ static bool parse_dev_state_line(const char * line, persistent_dev_state & state
     else
       return false;
   }
+  else if (match[m+=5+2].rm_so >= 0) {
+    std::string name(line+match[m].rm_so, match[m].rm_eo-match[m].rm_so);
+    int i;
+    for (i = 0; i < SCSI_NUM_COUNTERS && name != scsi_counters_info[i].name; i++)
+      ;
+    if (i >= SCSI_NUM_COUNTERS)
+      return false;
+    state.scsi_counters[i] = (int64_t)val;
+  }
   else
     return false;
   return true;
@@ -675,6 +794,14 @@ static bool write_dev_state(const char * path, const persistent_dev_state & stat
     write_dev_state_line(f, "ata-smart-attribute", i, "raw", pa.raw);
   }
 
+  // SCSI ONLY
+  for (i = 0; i < SCSI_NUM_COUNTERS; i++) {
+    // Write 0 values, missing entries are unknown
+    if (state.scsi_counters[i] >= 0)
+      fprintf(f, "scsi-counter.%s = %"PRId64"\n", scsi_counters_info[i].name,
+              state.scsi_counters[i]);
+  }
+
   return true;
 }
 
@@ -687,262 +814,1090 @@ static bool write_dev_attrlog(const char * path, const persistent_dev_state & st
     return false;
   }
 
-  // ATA ONLY
   time_t now = time(0);
   struct tm * tms = gmtime(&now);
   fprintf(f, "%d-%02d-%02d %02d:%02d:%02d;",
              1900+tms->tm_year, 1+tms->tm_mon, tms->tm_mday,
              tms->tm_hour, tms->tm_min, tms->tm_sec);
+  // ATA ONLY
   for (int i = 0; i < NUMBER_ATA_SMART_ATTRIBUTES; i++) {
     const persistent_dev_state::ata_attribute & pa = state.ata_attributes[i];
     if (!pa.id)
       continue;
     fprintf(f, "\t%d;%d;%"PRIu64";", pa.id, pa.val, pa.raw);
   }
+  // SCSI ONLY
+  for (int i = 0; i < SCSI_NUM_COUNTERS; i++) {
+    if (state.scsi_counters[i] < 0)
+      continue;
+    fprintf(f, "\t%d;%d;%"PRId64";", SCSI_CNT_ATTRLOG_ID(i), 0, state.scsi_counters[i]);
+  }
   fprintf(f, "\n");
 
   return true;
 }
 
-// Write all state files. If write_always is false, don't write
-// unless must_write is set.
-static void write_all_dev_states(const dev_config_vector & configs,
-                                 dev_state_vector & states,
-                                 bool write_always = true)
+/////////////////////////////////////////////////////////////////////////////
+// Binary state store
+
+// Single memory mapped file for the persistent state of all devices.
+// Each device has a slot with two copies of its state record.  An update
+// overwrites the older copy, so a crash during the update leaves the
+// other copy intact.  A copy is valid if its CRC matches, the valid copy
+// with the highest sequence number is current.
+//
+// File layout (all numbers little endian):
+// Header at offset 0:
+//   char magic[8] = "SMARTDST", u32 version, u32 slot size, u32 number
+//   of slots, u32 CRC of previous fields
+// Slot N at offset STORE_HDRSIZE + N * slot size:
+//   char key[STORE_KEYLEN], NUL padded, "MODEL-SERIAL.TYPE"
+//   2 copies of: u64 sequence number, u32 data length, u32 CRC of
+//   sequence number, length and data, u8 data[STORE_DATALEN]
+// Records written before the SCSI counters were added lack the trailing
+// u32 scsi_counters[SCSI_NUM_COUNTERS] and are still accepted.
+
+#define STORE_MAGIC      "SMARTDST"
+#define STORE_VERSION    1
+#define STORE_HDRSIZE    4096
+#define STORE_KEYLEN     96
+#define STORE_COPYHDR    16
+#define STORE_DATALEN    640
+#define STORE_COPYSIZE   (STORE_COPYHDR + STORE_DATALEN)
+#define STORE_SLOTSIZE   (STORE_KEYLEN + 2 * STORE_COPYSIZE)
+#define STORE_MINSLOTS   32
+
+// Convert persistent state to binary record, return length.
+static unsigned pack_dev_state(const persistent_dev_state & state, unsigned char * buf)
 {
-  for (unsigned i = 0; i < states.size(); i++) {
-    const dev_config & cfg = configs.at(i);
-    if (cfg.state_file.empty())
-      continue;
-    dev_state & state = states[i];
-    if (!write_always && !state.must_write)
-      continue;
-    if (!write_dev_state(cfg.state_file.c_str(), state))
+  unsigned char * p = buf;
+  put_le_uint(p, state.tempmin, 1); p += 1;
+  put_le_uint(p, state.tempmax, 1); p += 1;
+  put_le_uint(p, state.selflogcount, 1); p += 1;
+  put_le_uint(p, state.selfloghour, 2); p += 2;
+  put_le_uint(p, (int64_t)state.scheduled_test_next_check, 8); p += 8;
+  int i;
+  for (i = 0; i < SMARTD_NMAIL; i++) {
+    const mailinfo & mi = state.maillog[i];
+    if (i == MAILTYPE_TEST) { // Don't suppress test mails
+      memset(p, 0, 20); p += 20;
       continue;
-    state.must_write = false;
-    if (write_always || debugmode)
-      PrintOut(LOG_INFO, "Device: %s, state written to %s\n",
-               cfg.name.c_str(), cfg.state_file.c_str());
+    }
+    put_le_uint(p, mi.logged, 4); p += 4;
+    put_le_uint(p, (int64_t)mi.firstsent, 8); p += 8;
+    put_le_uint(p, (int64_t)mi.lastsent, 8); p += 8;
   }
+  put_le_uint(p, state.ataerrorcount, 4); p += 4;
+  for (i = 0; i < NUMBER_ATA_SMART_ATTRIBUTES; i++) {
+    const persistent_dev_state::ata_attribute & pa = state.ata_attributes[i];
+    put_le_uint(p, pa.id, 1); p += 1;
+    put_le_uint(p, pa.val, 1); p += 1;
+    put_le_uint(p, pa.worst, 1); p += 1;
+    put_le_uint(p, pa.raw, 8); p += 8;
+  }
+  for (i = 0; i < SCSI_NUM_COUNTERS; i++) {
+    // Saturated at 0xfffffffe, 0xffffffff = unknown
+    int64_t cnt = state.scsi_counters[i];
+    if (cnt < 0)
+      cnt = 0xffffffff;
+    else if (cnt > 0xfffffffe)
+      cnt = 0xfffffffe;
+    put_le_uint(p, cnt, 4); p += 4;
+  }
+  return p - buf;
 }
 
-// Write to all attrlog files
-static void write_all_dev_attrlogs(const dev_config_vector & configs,
-                                   dev_state_vector & states)
+// Convert binary record to persistent state, return false on error.
+static bool unpack_dev_state(const unsigned char * buf, unsigned len,
+                             persistent_dev_state & state)
 {
-  for (unsigned i = 0; i < states.size(); i++) {
-    const dev_config & cfg = configs.at(i);
-    if (cfg.attrlog_file.empty())
-      continue;
-    dev_state & state = states[i];
-    write_dev_attrlog(cfg.attrlog_file.c_str(), state);
-  }
-}
+  persistent_dev_state new_state;
+  unsigned char tmp[STORE_DATALEN];
+  unsigned full_len = pack_dev_state(new_state, tmp);
+  bool has_scsi_counters = (len == full_len);
+  if (!(has_scsi_counters || len == full_len - 4 * SCSI_NUM_COUNTERS))
+    return false;
 
-// remove the PID file
-void RemovePidFile(){
-  if (!pid_file.empty()) {
-    if (unlink(pid_file.c_str()))
-      PrintOut(LOG_CRIT,"Can't unlink PID file %s (%s).\n", 
-               pid_file.c_str(), strerror(errno));
-    pid_file.clear();
+  const unsigned char * p = buf;
+  new_state.tempmin = (unsigned char)get_le_uint(p, 1); p += 1;
+  new_state.tempmax = (unsigned char)get_le_uint(p, 1); p += 1;
+  new_state.selflogcount = (unsigned char)get_le_uint(p, 1); p += 1;
+  new_state.selfloghour = (unsigned short)get_le_uint(p, 2); p += 2;
+  new_state.scheduled_test_next_check = (time_t)(int64_t)get_le_uint(p, 8); p += 8;
+  int i;
+  for (i = 0; i < SMARTD_NMAIL; i++) {
+    mailinfo & mi = new_state.maillog[i];
+    mi.logged = (int)get_le_uint(p, 4); p += 4;
+    mi.firstsent = (time_t)(int64_t)get_le_uint(p, 8); p += 8;
+    mi.lastsent = (time_t)(int64_t)get_le_uint(p, 8); p += 8;
   }
-  return;
+  new_state.ataerrorcount = (int)get_le_uint(p, 4); p += 4;
+  for (i = 0; i < NUMBER_ATA_SMART_ATTRIBUTES; i++) {
+    persistent_dev_state::ata_attribute & pa = new_state.ata_attributes[i];
+    pa.id = (unsigned char)get_le_uint(p, 1); p += 1;
+    pa.val = (unsigned char)get_le_uint(p, 1); p += 1;
+    pa.worst = (unsigned char)get_le_uint(p, 1); p += 1;
+    pa.raw = get_le_uint(p, 8); p += 8;
+  }
+  for (i = 0; has_scsi_counters && i < SCSI_NUM_COUNTERS; i++) {
+    unsigned cnt = (unsigned)get_le_uint(p, 4); p += 4;
+    new_state.scsi_counters[i] = (cnt == 0xffffffffU ? -1 : (int64_t)cnt);
+  }
+
+  state = new_state;
+  return true;
 }
 
-extern "C" { // signal handlers require C-linkage
+/// Memory mapped binary state store.
+class dev_state_store
+{
+public:
+  dev_state_store();
 
-//  Note if we catch a SIGUSR1
-void USR1handler(int sig){
-  if (SIGUSR1==sig)
-    caughtsigUSR1=1;
-  return;
-}
+  ~dev_state_store();
 
-#ifdef _WIN32
-//  Note if we catch a SIGUSR2
-void USR2handler(int sig){
-  if (SIGUSR2==sig)
-    caughtsigUSR2=1;
-  return;
-}
-#endif
+  /// Open or create store file, return false on error.
+  bool open(const char * path);
 
-// Note if we catch a HUP (or INT in debug mode)
-void HUPhandler(int sig){
-  if (sig==SIGHUP)
-    caughtsigHUP=1;
-  else
-    caughtsigHUP=2;
-  return;
-}
+  /// Write pending changes and close store.
+  void close();
 
-// signal handler for TERM, QUIT, and INT (if not in debug mode)
-void sighandler(int sig){
-  if (!caughtsigEXIT)
-    caughtsigEXIT=sig;
-  return;
-}
+  bool is_open() const
+    { return !!m_map; }
 
-} // extern "C"
+  const char * get_path() const
+    { return m_path.c_str(); }
 
-// Cleanup, print Goodbye message and remove pidfile
-static int Goodbye(int status)
-{
-  // delete PID file, if one was created
-  RemovePidFile();
+  /// Read state of device 'key', return false if not found.
+  bool read(const char * key, persistent_dev_state & state) const;
 
-  // if we are exiting because of a code bug, tell user
-  if (status==EXIT_BADCODE)
-        PrintOut(LOG_CRIT, "Please inform " PACKAGE_BUGREPORT ", including output of smartd -V.\n");
+  /// Write state of device 'key', add new slot if necessary.
+  /// Return false on error.
+  bool write(const char * key, const persistent_dev_state & state);
 
-  // and this should be the final output from smartd before it exits
-  PrintOut(status?LOG_CRIT:LOG_INFO, "smartd is exiting (exit status %d)\n", status);
+  /// Write changed pages to disk.
+  bool flush();
 
-  return status;
+private:
+  std::string m_path;
+  int m_fd;
+  unsigned char * m_map;
+  unsigned m_size;
+  unsigned m_num_slots;
+  std::map<std::string, unsigned> m_slots; // key -> slot index
+  std::vector<bool> m_dirty;              // slot changed since last flush()
+
+  unsigned char * get_slot(unsigned i) const
+    { return m_map + STORE_HDRSIZE + i * STORE_SLOTSIZE; }
+
+  // Return index of current copy, -1 if none, set sequence number.
+  static int get_current_copy(const unsigned char * slot, uint64_t & seq);
+
+  bool map_file(unsigned num_slots, bool create);
+  void unmap_file();
+  void write_header();
+
+  dev_state_store(const dev_state_store &);
+  void operator=(const dev_state_store &);
+};
+
+dev_state_store::dev_state_store()
+: m_fd(-1), m_map(0), m_size(0), m_num_slots(0)
+{
 }
 
-#define ENVLENGTH 1024
+dev_state_store::~dev_state_store()
+{
+  close();
+}
 
-// a replacement for setenv() which is not available on all platforms.
-// Note that the string passed to putenv must not be freed or made
-// invalid, since a pointer to it is kept by putenv(). This means that
-// it must either be a static buffer or allocated off the heap. The
-// string can be freed if the environment variable is redefined or
-// deleted via another call to putenv(). So we keep these on the stack
-// as long as the popen() call is underway.
-int exportenv(char* stackspace, const char *name, const char *value){
-  snprintf(stackspace,ENVLENGTH, "%s=%s", name, value);
-  return putenv(stackspace);
+int dev_state_store::get_current_copy(const unsigned char * slot, uint64_t & seq)
+{
+  int cur = -1; seq = 0;
+  for (int c = 0; c < 2; c++) {
+    const unsigned char * cp = slot + STORE_KEYLEN + c * STORE_COPYSIZE;
+    uint64_t s = get_le_uint(cp, 8);
+    unsigned len = (unsigned)get_le_uint(cp + 8, 4);
+    if (!s || len > STORE_DATALEN)
+      continue;
+    if ((unsigned)get_le_uint(cp + 12, 4) != calc_crc32(cp + 16, len, calc_crc32(cp, 12)))
+      continue;
+    if (cur < 0 || s > seq) {
+      cur = c; seq = s;
+    }
+  }
+  return cur;
 }
 
-char* dnsdomain(const char* hostname) {
-  char *p = NULL;
-#ifdef HAVE_GETADDRINFO
-  static char canon_name[NI_MAXHOST];
-  struct addrinfo *info = NULL;
-  struct addrinfo hints;
-  int err;
+#ifdef HAVE_MMAP
 
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_flags = AI_CANONNAME;
-  if ((err = getaddrinfo(hostname, NULL, &hints, &info)) || (!info)) {
-    PrintOut(LOG_CRIT, "Error retrieving getaddrinfo(%s): %s\n", hostname, gai_strerror(err));
-    return NULL;
-  }
-  if (info->ai_canonname) {
-    strncpy(canon_name, info->ai_canonname, sizeof(canon_name));
-    canon_name[NI_MAXHOST - 1] = '\0';
-    p = canon_name;
-    if ((p = strchr(canon_name, '.')))
-      p++;
+void dev_state_store::write_header()
+{
+  memcpy(m_map, STORE_MAGIC, 8);
+  put_le_uint(m_map +  8, STORE_VERSION, 4);
+  put_le_uint(m_map + 12, STORE_SLOTSIZE, 4);
+  put_le_uint(m_map + 16, m_num_slots, 4);
+  put_le_uint(m_map + 20, calc_crc32(m_map, 20), 4);
+}
+
+bool dev_state_store::map_file(unsigned num_slots, bool create)
+{
+  unsigned size = STORE_HDRSIZE + num_slots * STORE_SLOTSIZE;
+  if (create && ftruncate(m_fd, size)) {
+    pout("%s: cannot resize state store: %s\n", m_path.c_str(), strerror(errno));
+    return false;
   }
-  freeaddrinfo(info);
-#elif HAVE_GETHOSTBYNAME
-  struct hostent *hp;
-  if ((hp = gethostbyname(hostname))) {
-    // Does this work if gethostbyname() returns an IPv6 name in
-    // colon/dot notation?  [BA]
-    if ((p = strchr(hp->h_name, '.')))
-      p++; // skip "."
+  void * p = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, m_fd, 0);
+  if (p == MAP_FAILED) {
+    pout("%s: cannot map state store: %s\n", m_path.c_str(), strerror(errno));
+    return false;
   }
-#else
-  ARGUSED(hostname);
-#endif
-  return p;
+  m_map = (unsigned char *)p;
+  m_size = size;
+  m_num_slots = num_slots;
+  m_dirty.resize(num_slots, false);
+  return true;
 }
 
-#define EBUFLEN 1024
-
-static void MailWarning(const dev_config & cfg, dev_state & state, int which, const char *fmt, ...)
-                        __attribute__ ((format (printf, 4, 5)));
-
-// If either address or executable path is non-null then send and log
-// a warning email, or execute executable
-static void MailWarning(const dev_config & cfg, dev_state & state, int which, const char *fmt, ...){
-  char command[2048], message[256], hostname[256], domainname[256], additional[256],fullmessage[1024];
-  char original[256], further[256], nisdomain[256], subject[256],dates[DATEANDEPOCHLEN];
-  char environ_strings[11][ENVLENGTH];
-  time_t epoch;
-  va_list ap;
-  const int day=24*3600;
-  int days=0;
-  const char * const whichfail[]={
-    "EmailTest",                  // 0
-    "Health",                     // 1
-    "Usage",                      // 2
-    "SelfTest",                   // 3
-    "ErrorCount",                 // 4
-    "FailedHealthCheck",          // 5
-    "FailedReadSmartData",        // 6
-    "FailedReadSmartErrorLog",    // 7
-    "FailedReadSmartSelfTestLog", // 8
-    "FailedOpenDevice",           // 9
-    "CurrentPendingSector",       // 10
-    "OfflineUncorrectableSector", // 11
-    "Temperature"                 // 12
-  };
-  
-  const char *unknown="[Unknown]";
+void dev_state_store::unmap_file()
+{
+  if (m_map) {
+    munmap(m_map, m_size);
+    m_map = 0; m_size = 0;
+  }
+}
 
-  // See if user wants us to send mail
-  if (cfg.emailaddress.empty() && cfg.emailcmdline.empty())
-    return;
+bool dev_state_store::open(const char * path)
+{
+  close();
+  m_path = path;
+  m_fd = ::open(path, O_RDWR|O_CREAT, 0644);
+  if (m_fd < 0) {
+    pout("%s: cannot open state store: %s\n", path, strerror(errno));
+    return false;
+  }
 
-  std::string address = cfg.emailaddress;
-  const char * executable = cfg.emailcmdline.c_str();
+  struct stat st;
+  if (fstat(m_fd, &st)) {
+    pout("%s: cannot stat state store: %s\n", path, strerror(errno));
+    close();
+    return false;
+  }
 
-  // which type of mail are we sending?
-  mailinfo * mail=(state.maillog)+which;
+  if (st.st_size == 0) {
+    // New file
+    if (!map_file(STORE_MINSLOTS, true)) {
+      close();
+      return false;
+    }
+    write_header();
+    if (!flush()) {
+      close();
+      return false;
+    }
+    return true;
+  }
 
-  // checks for sanity
-  if (cfg.emailfreq<1 || cfg.emailfreq>3) {
-    PrintOut(LOG_CRIT,"internal error in MailWarning(): cfg.mailwarn->emailfreq=%d\n",cfg.emailfreq);
-    return;
+  // Check header
+  unsigned char hdr[24];
+  unsigned num_slots = 0;
+  if (!(   st.st_size >= STORE_HDRSIZE
+        && pread(m_fd, hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr)
+        && !memcmp(hdr, STORE_MAGIC, 8)
+        && get_le_uint(hdr +  8, 4) == STORE_VERSION
+        && get_le_uint(hdr + 12, 4) == STORE_SLOTSIZE
+        && get_le_uint(hdr + 20, 4) == calc_crc32(hdr, 20)
+        && st.st_size >= (off_t)STORE_HDRSIZE
+                       + (off_t)(num_slots = (unsigned)get_le_uint(hdr + 16, 4)) * STORE_SLOTSIZE)) {
+    // Don't refuse to start after a torn write, keep the old file for inspection
+    std::string badpath = m_path + ".corrupt";
+    PrintOut(LOG_CRIT, "%s: format error in state store, renamed to %s, creating new store\n",
+             path, badpath.c_str());
+    close();
+    if (rename(path, badpath.c_str())) {
+      pout("%s: cannot rename state store: %s\n", path, strerror(errno));
+      return false;
+    }
+    return open(path);
   }
-  if (which<0 || which>=SMARTD_NMAIL || sizeof(whichfail)!=SMARTD_NMAIL*sizeof(char *)) {
-    PrintOut(LOG_CRIT,"Contact " PACKAGE_BUGREPORT "; internal error in MailWarning(): which=%d, size=%d\n",
-             which, (int)sizeof(whichfail));
-    return;
+  if (!map_file(num_slots, false)) {
+    close();
+    return false;
   }
-  
-  // Return if a single warning mail has been sent.
-  if ((cfg.emailfreq==1) && mail->logged)
-    return;
 
-  // Return if this is an email test and one has already been sent.
-  if (which == 0 && mail->logged)
-    return;
-  
-  // To decide if to send mail, we need to know what time it is.
-  epoch=time(NULL);
+  // Index slots with valid keys and records
+  for (unsigned i = 0; i < m_num_slots; i++) {
+    const unsigned char * slot = get_slot(i);
+    if (!slot[0] || slot[STORE_KEYLEN-1])
+      continue;
+    uint64_t seq;
+    if (get_current_copy(slot, seq) < 0)
+      continue;
+    m_slots.insert(std::make_pair(std::string((const char *)slot), i));
+  }
+  return true;
+}
 
-  // Return if less than one day has gone by
-  if (cfg.emailfreq==2 && mail->logged && epoch<(mail->lastsent+day))
-    return;
+void dev_state_store::close()
+{
+  if (m_map)
+    flush();
+  unmap_file();
+  if (m_fd >= 0) {
+    ::close(m_fd);
+    m_fd = -1;
+  }
+  m_num_slots = 0;
+  m_slots.clear();
+  m_dirty.clear();
+}
 
-  // Return if less than 2^(logged-1) days have gone by
-  if (cfg.emailfreq==3 && mail->logged) {
-    days=0x01<<(mail->logged-1);
-    days*=day;
-    if  (epoch<(mail->lastsent+days))
-      return;
+bool dev_state_store::flush()
+{
+  if (!m_map)
+    return false;
+  if (msync(m_map, m_size, MS_SYNC)) {
+    pout("%s: cannot write state store: %s\n", m_path.c_str(), strerror(errno));
+    return false;
   }
+  m_dirty.assign(m_num_slots, false);
+  return true;
+}
 
-#ifdef HAVE_LIBCAP_NG
-  if (enable_capabilities) {
-    PrintOut(LOG_ERR, "Sending a mail was supressed. "
-             "Mails can't be send when capabilites are enabled\n");
-    return;
-  }
-#endif
+#else // HAVE_MMAP
 
-  // record the time of this mail message, and the first mail message
-  if (!mail->logged)
-    mail->firstsent=epoch;
-  mail->lastsent=epoch;
-  
-  // get system host & domain names (not null terminated if length=MAX) 
+bool dev_state_store::open(const char * path)
+{
+  pout("%s: state store not supported on this platform\n", path);
+  return false;
+}
+
+void dev_state_store::close()
+{
+}
+
+bool dev_state_store::flush()
+{
+  return false;
+}
+
+#endif // HAVE_MMAP
+
+bool dev_state_store::read(const char * key, persistent_dev_state & state) const
+{
+  std::map<std::string, unsigned>::const_iterator it = m_slots.find(key);
+  if (it == m_slots.end())
+    return false;
+  const unsigned char * slot = get_slot(it->second);
+  uint64_t seq;
+  int c = get_current_copy(slot, seq);
+  if (c < 0)
+    return false;
+  const unsigned char * cp = slot + STORE_KEYLEN + c * STORE_COPYSIZE;
+  if (!unpack_dev_state(cp + 16, (unsigned)get_le_uint(cp + 8, 4), state)) {
+    pout("%s: invalid record for %s\n", m_path.c_str(), key);
+    return false;
+  }
+  return true;
+}
+
+bool dev_state_store::write(const char * key, const persistent_dev_state & state)
+{
+  if (!m_map || !*key || strlen(key) >= STORE_KEYLEN)
+    return false;
+
+  unsigned i;
+  std::map<std::string, unsigned>::const_iterator it = m_slots.find(key);
+  if (it != m_slots.end())
+    i = it->second;
+  else {
+    // Find free slot
+    for (i = 0; i < m_num_slots; i++) {
+      uint64_t seq;
+      if (get_current_copy(get_slot(i), seq) < 0)
+        break;
+    }
+#ifdef HAVE_MMAP
+    if (i >= m_num_slots) {
+      // Grow file, keep old mapping until new one succeeded
+      if (!flush())
+        return false;
+      unsigned char * old_map = m_map; unsigned old_size = m_size;
+      unsigned old_num_slots = m_num_slots;
+      if (!map_file(2 * old_num_slots, true)) {
+        m_map = old_map; m_size = old_size; m_num_slots = old_num_slots;
+        return false;
+      }
+      munmap(old_map, old_size);
+      // Make new size and slots persistent before the header refers to them
+      if (!flush() || fsync(m_fd)) {
+        pout("%s: cannot write state store: %s\n", m_path.c_str(), strerror(errno));
+        return false;
+      }
+      write_header();
+      if (!flush())
+        return false;
+    }
+#endif
+    unsigned char * slot = get_slot(i);
+    memset(slot, 0, STORE_SLOTSIZE);
+    strcpy((char *)slot, key);
+    m_slots[key] = i;
+  }
+
+  // Each slot must be changed at most once between flush() calls,
+  // otherwise both copies may be lost in a crash.
+  if (m_dirty[i] && !flush())
+    return false;
+
+  // Overwrite the older copy
+  unsigned char * slot = get_slot(i);
+  uint64_t seq;
+  int c = get_current_copy(slot, seq);
+  unsigned char * cp = slot + STORE_KEYLEN + (c == 0 ? 1 : 0) * STORE_COPYSIZE;
+  unsigned char data[STORE_DATALEN];
+  unsigned len = pack_dev_state(state, data);
+  unsigned char chdr[12];
+  put_le_uint(chdr, seq + 1, 8);
+  put_le_uint(chdr + 8, len, 4);
+  memcpy(cp + 16, data, len);
+  memcpy(cp, chdr, sizeof(chdr));
+  put_le_uint(cp + 12, calc_crc32(data, len, calc_crc32(chdr, sizeof(chdr))), 4);
+  m_dirty[i] = true;
+  return true;
+}
+
+/// The binary state store, if '-S' is specified.
+static dev_state_store state_store;
+
+// Write all state files. If write_always is false, don't write
+// unless the device was checked in the last pass and must_write is set.
+// If the state store is used, state files are only written (exported)
+// if write_always is set.
+static void write_all_dev_states(const dev_config_vector & configs,
+                                 dev_state_vector & states,
+                                 bool write_always = true,
+                                 dev_state_store & state_store = ::state_store)
+{
+  for (unsigned i = 0; i < states.size(); i++) {
+    const dev_config & cfg = configs.at(i);
+    if (cfg.state_key.empty())
+      continue;
+    dev_state & state = states[i];
+    if (!write_always && !(state.checked && state.must_write))
+      continue;
+    bool written = false;
+    if (state_store.is_open()) {
+      if (!state_store.write(cfg.state_key.c_str(), state))
+        continue;
+      written = true;
+      if (write_always || debugmode)
+        PrintOut(LOG_INFO, "Device: %s, state written to %s\n",
+                 cfg.name.c_str(), state_store.get_path());
+    }
+    if (!cfg.state_file.empty() && (write_always || !state_store.is_open())) {
+      if (write_dev_state(cfg.state_file.c_str(), state)) {
+        written = true;
+        if (write_always || debugmode)
+          PrintOut(LOG_INFO, "Device: %s, state written to %s\n",
+                   cfg.name.c_str(), cfg.state_file.c_str());
+      }
+    }
+    if (written)
+      state.must_write = false;
+  }
+
+  // Commit all records of this cycle
+  if (state_store.is_open())
+    state_store.flush();
+}
+
+// Write to attrlog files of devices checked in the last pass
+static void write_all_dev_attrlogs(const dev_config_vector & configs,
+                                   dev_state_vector & states)
+{
+  for (unsigned i = 0; i < states.size(); i++) {
+    const dev_config & cfg = configs.at(i);
+    if (cfg.attrlog_file.empty())
+      continue;
+    dev_state & state = states[i];
+    if (!state.checked)
+      continue;
+    if (!attrlog_columnar) {
+      write_dev_attrlog(cfg.attrlog_file.c_str(), state);
+      continue;
+    }
+
+    // Compact on first write and then once a day
+    time_t now = time(0);
+    if (!state.attrlog_compacted || now - state.attrlog_compacted >= 24*60*60) {
+      if (attrlog_compact(cfg.attrlog_file.c_str(), attrlog_keep, now) && debugmode)
+        PrintOut(LOG_INFO, "Device: %s, attribute log %s compacted\n",
+                 cfg.name.c_str(), cfg.attrlog_file.c_str());
+      state.attrlog_compacted = now;
+    }
+
+    // ATA ONLY
+    attrlog_value values[NUMBER_ATA_SMART_ATTRIBUTES];
+    unsigned num_values = 0;
+    for (int j = 0; j < NUMBER_ATA_SMART_ATTRIBUTES; j++) {
+      const persistent_dev_state::ata_attribute & pa = state.ata_attributes[j];
+      if (!pa.id)
+        continue;
+      attrlog_value & v = values[num_values++];
+      v.id = pa.id; v.val = pa.val; v.raw = pa.raw;
+    }
+    // SCSI ONLY
+    for (int j = 0; j < SCSI_NUM_COUNTERS && num_values < NUMBER_ATA_SMART_ATTRIBUTES; j++) {
+      if (state.scsi_counters[j] < 0)
+        continue;
+      attrlog_value & v = values[num_values++];
+      v.id = SCSI_CNT_ATTRLOG_ID(j); v.val = 0; v.raw = state.scsi_counters[j];
+    }
+    attrlog_append(cfg.attrlog_file.c_str(), now, values, num_values);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Capability cache
+
+// Capability bits of dev_capabilities
+#define CAP_SMARTSTATUS      0x0001  // SMART RETURN STATUS
+#define CAP_SMARTVALUES      0x0002  // SMART READ DATA
+#define CAP_THRESHOLDS       0x0004  // SMART READ THRESHOLDS
+#define CAP_SELFTESTLOG      0x0008  // Self-test log
+#define CAP_ERRORLOG         0x0010  // Summary SMART error log
+#define CAP_XERRORLOG        0x0020  // Extended Comprehensive SMART error log
+#define CAP_POWERMODE        0x0040  // CHECK POWER MODE
+#define CAP_MODESENSE10      0x0080  // SCSI: MODE SENSE(10) (probed: length known)
+#define CAP_TEST_OFFLINE     0x0100  // Self-tests, see DoATASelfTest()
+#define CAP_TEST_CONVEYANCE  0x0200
+#define CAP_TEST_SHORT       0x0400
+#define CAP_TEST_LONG        0x0800
+#define CAP_TEST_SELECTIVE   0x1000
+#define CAP_PERMISSIVE       0x8000  // Probed with '-T permissive' (probed only)
+
+// Cached capabilities of an ATA or SCSI device, see '-K' option.
+struct dev_capabilities
+{
+  std::string dev_type;                   // Autodetected device type ("ata", "sat", "scsi"), empty if none
+  std::string key;                        // "MODEL-SERIAL-FIRMWARE" or "VENDOR_PRODUCT-REVISION"
+  unsigned probed;                        // CAP_* bits which were checked
+  unsigned supported;                     // CAP_* bits which are supported
+  ata_smart_thresholds_pvt thresholds;    // SMART thresholds if CAP_THRESHOLDS supported
+
+  dev_capabilities()
+    : probed(0), supported(0)
+    { memset(&thresholds, 0, sizeof(thresholds)); }
+
+  bool is_probed(unsigned cap) const
+    { return !!(probed & cap); }
+  bool is_supported(unsigned cap) const
+    { return !!(supported & cap); }
+  void set(unsigned cap, bool ok)
+    { probed |= cap; if (ok) supported |= cap; else supported &= ~cap; }
+};
+
+// Cached capabilities by device name
+typedef std::map<std::string, dev_capabilities> dev_capabilities_map;
+static dev_capabilities_map capcache;
+// true if capcache was changed since last write
+static bool capcache_dirty = false;
+
+// Parse a line from the capability cache:
+// NAME TYPE|- KEY PROBED SUPPORTED [ID:THRESHOLD ...]
+static bool parse_capcache_line(const char * line, dev_capabilities_map & caps)
+{
+  char name[256+1], type[32+1], key[100+1];
+  unsigned probed = 0, supported = 0;
+  int n = -1;
+  if (!(sscanf(line, "%256s %32s %100s %x %x%n", name, type, key,
+               &probed, &supported, &n) == 5 && n > 0))
+    return false;
+
+  dev_capabilities cap;
+  if (strcmp(type, "-"))
+    cap.dev_type = type;
+  cap.key = key;
+  cap.probed = probed; cap.supported = supported;
+
+  const char * p = line + n;
+  for (int i = 0; ; i++) {
+    unsigned id = 0, thres = 0; int n1 = -1;
+    if (sscanf(p, " %u:%u%n", &id, &thres, &n1) != 2 || n1 <= 0)
+      break;
+    if (!(i < NUMBER_ATA_SMART_ATTRIBUTES && 0 < id && id <= 255 && thres <= 255))
+      return false;
+    cap.thresholds.thres_entries[i].id = (unsigned char)id;
+    cap.thresholds.thres_entries[i].threshold = (unsigned char)thres;
+    p += n1;
+  }
+  if (p[strspn(p, " \t\r\n")])
+    return false;
+
+  caps[name] = cap;
+  return true;
+}
+
+// Read the capability cache.
+static bool read_capability_cache(const char * path, dev_capabilities_map & caps)
+{
+  stdio_file f(path, "r");
+  if (!f) {
+    if (errno != ENOENT)
+      pout("Cannot read capability cache \"%s\"\n", path);
+    return false;
+  }
+#ifdef __CYGWIN__
+  setmode(fileno(f), O_TEXT); // Allow files with \r\n
+#endif
+
+  int bad = 0;
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    const char * s = line + strspn(line, " \t");
+    if (!*s || *s == '#' || *s == '\n')
+      continue;
+    if (!parse_capcache_line(s, caps))
+      bad++;
+  }
+  if (bad)
+    pout("%s: %d invalid line(s) ignored\n", path, bad);
+  return true;
+}
+
+// Write the capability cache to a temporary file, then replace
+// the old file.  The cache is never left in a partially written state.
+static bool write_capability_cache(const char * path, const dev_capabilities_map & caps)
+{
+  std::string tmppath = path; tmppath += ".tmp";
+  {
+    stdio_file f(tmppath.c_str(), "w");
+    if (!f) {
+      pout("Cannot create capability cache \"%s\"\n", tmppath.c_str());
+      return false;
+    }
+
+    fprintf(f, "# smartd capability cache, see '-K' option\n"
+               "# NAME TYPE KEY PROBED SUPPORTED [ID:THRESHOLD ...]\n");
+    for (dev_capabilities_map::const_iterator it = caps.begin(); it != caps.end(); ++it) {
+      const dev_capabilities & cap = it->second;
+      fprintf(f, "%s %s %s %04x %04x", it->first.c_str(),
+              (!cap.dev_type.empty() ? cap.dev_type.c_str() : "-"),
+              cap.key.c_str(), cap.probed, cap.supported);
+      for (int i = 0; i < NUMBER_ATA_SMART_ATTRIBUTES; i++) {
+        const ata_smart_threshold_entry & te = cap.thresholds.thres_entries[i];
+        if (te.id)
+          fprintf(f, " %u:%u", te.id, te.threshold);
+      }
+      fprintf(f, "\n");
+    }
+    if (ferror(f)) {
+      pout("Write error on capability cache \"%s\"\n", tmppath.c_str());
+      f.close();
+      unlink(tmppath.c_str());
+      return false;
+    }
+    if (!f.close()) {
+      unlink(tmppath.c_str());
+      return false;
+    }
+  }
+
+#ifdef _WIN32
+  unlink(path); // rename() does not replace existing file
+#endif
+  if (rename(tmppath.c_str(), path)) {
+    pout("Cannot rename \"%s\" to \"%s\": %s\n", tmppath.c_str(), path, strerror(errno));
+    unlink(tmppath.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Copy self-test capabilities learned during checks to the
+// capability cache, write the cache if changed.
+static void write_capability_cache_if_changed(const dev_config_vector & configs,
+                                              const dev_state_vector & states)
+{
+  // '-q benchmark' must not change the cache of the real devices
+  if (capcache_path.empty() || quit == 6)
+    return;
+  for (unsigned i = 0; i < configs.size(); i++) {
+    const dev_config & cfg = configs.at(i);
+    dev_capabilities_map::iterator it = capcache.find(cfg.regname);
+    if (it == capcache.end())
+      continue;
+    const dev_state & state = states.at(i);
+    dev_capabilities & cap = it->second;
+    unsigned old_probed = cap.probed, old_supported = cap.supported;
+    if (state.not_cap_offline)    cap.set(CAP_TEST_OFFLINE, false);
+    if (state.not_cap_conveyance) cap.set(CAP_TEST_CONVEYANCE, false);
+    if (state.not_cap_short)      cap.set(CAP_TEST_SHORT, false);
+    if (state.not_cap_long)       cap.set(CAP_TEST_LONG, false);
+    if (state.not_cap_selective)  cap.set(CAP_TEST_SELECTIVE, false);
+    if (cap.probed != old_probed || cap.supported != old_supported)
+      capcache_dirty = true;
+  }
+  if (!capcache_dirty)
+    return;
+  if (write_capability_cache(capcache_path.c_str(), capcache)) {
+    if (debugmode)
+      PrintOut(LOG_INFO, "Capability cache written to %s\n", capcache_path.c_str());
+    capcache_dirty = false;
+  }
+}
+
+// remove the PID file
+void RemovePidFile(){
+  if (!pid_file.empty()) {
+    if (unlink(pid_file.c_str()))
+      PrintOut(LOG_CRIT,"Can't unlink PID file %s (%s).\n", 
+               pid_file.c_str(), strerror(errno));
+    pid_file.clear();
+  }
+  return;
+}
+
+extern "C" { // signal handlers require C-linkage
+
+//  Note if we catch a SIGUSR1
+void USR1handler(int sig){
+  if (SIGUSR1==sig)
+    caughtsigUSR1=1;
+  return;
+}
+
+//  Note if we catch a SIGUSR2
+void USR2handler(int sig){
+  if (SIGUSR2==sig)
+    caughtsigUSR2=1;
+  return;
+}
+
+// Note if we catch a HUP (or INT in debug mode)
+void HUPhandler(int sig){
+  if (sig==SIGHUP)
+    caughtsigHUP=1;
+  else
+    caughtsigHUP=2;
+  return;
+}
+
+// signal handler for TERM, QUIT, and INT (if not in debug mode)
+void sighandler(int sig){
+  if (!caughtsigEXIT)
+    caughtsigEXIT=sig;
+  return;
+}
+
+} // extern "C"
+
+#ifndef _WIN32
+static bool query_open();
+static void query_close();
+#endif
+
+// Cleanup, print Goodbye message and remove pidfile
+static int Goodbye(int status)
+{
+  // delete PID file, if one was created
+  RemovePidFile();
+
+#ifndef _WIN32
+  // close query socket, if one was created
+  query_close();
+#endif
+
+  // if we are exiting because of a code bug, tell user
+  if (status==EXIT_BADCODE)
+        PrintOut(LOG_CRIT, "Please inform " PACKAGE_BUGREPORT ", including output of smartd -V.\n");
+
+  // and this should be the final output from smartd before it exits
+  PrintOut(status?LOG_CRIT:LOG_INFO, "smartd is exiting (exit status %d)\n", status);
+
+  return status;
+}
+
+char* dnsdomain(const char* hostname) {
+  char *p = NULL;
+#ifdef HAVE_GETADDRINFO
+  static char canon_name[NI_MAXHOST];
+  struct addrinfo *info = NULL;
+  struct addrinfo hints;
+  int err;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = AI_CANONNAME;
+  if ((err = getaddrinfo(hostname, NULL, &hints, &info)) || (!info)) {
+    PrintOut(LOG_CRIT, "Error retrieving getaddrinfo(%s): %s\n", hostname, gai_strerror(err));
+    return NULL;
+  }
+  if (info->ai_canonname) {
+    strncpy(canon_name, info->ai_canonname, sizeof(canon_name));
+    canon_name[NI_MAXHOST - 1] = '\0';
+    p = canon_name;
+    if ((p = strchr(canon_name, '.')))
+      p++;
+  }
+  freeaddrinfo(info);
+#elif HAVE_GETHOSTBYNAME
+  struct hostent *hp;
+  if ((hp = gethostbyname(hostname))) {
+    // Does this work if gethostbyname() returns an IPv6 name in
+    // colon/dot notation?  [BA]
+    if ((p = strchr(hp->h_name, '.')))
+      p++; // skip "."
+  }
+#else
+  ARGUSED(hostname);
+#endif
+  return p;
+}
+
+// Output of a device check running in a worker thread.
+// Replayed in device order after all checks are finished.
+struct deferred_output
+{
+  enum output_type { PRINT_OUT, POUT, MAIL_WARNING };
+  output_type type;
+  int arg;          // PrintOut() priority or MailWarning() type
+  std::string text;
+};
+
+typedef std::vector<deferred_output> deferred_output_vector;
+
+// Deferred output of each device, set during parallel checks.
+static std::vector<deferred_output_vector> * deferred_outputs = 0;
+
+// Save output if called from a parallel device check.
+// Returns false (and leaves 'ap' untouched) otherwise.
+static bool defer_output(deferred_output::output_type type, int arg,
+                         const char * fmt, va_list ap)
+{
+  if (!deferred_outputs)
+    return false;
+  int i = parallel_jobs::current_job();
+  if (i < 0)
+    return false;
+  deferred_output out;
+  out.type = type; out.arg = arg; out.text = vstrprintf(fmt, ap);
+  (*deferred_outputs)[i].push_back(out);
+  return true;
+}
+
+#define EBUFLEN 1024
+
+// Max time in seconds to wait for the mailer or '-M exec' executable
+#define MAILTIMEOUT 120
+// Number of retries of a failed delivery and delay in seconds between
+#define MAILRETRIES 2
+#define MAILRETRYDELAY 300
+// Max number of warnings queued for delivery
+#define MAILQUEUEMAX 100
+
+// Serializes output of main thread and mail delivery thread
+static thread_mutex output_mutex;
+
+// Names of warning types, used in subject and $SMARTD_FAILTYPE
+static const char * const whichfail[]={
+  "EmailTest",                  // 0
+  "Health",                     // 1
+  "Usage",                      // 2
+  "SelfTest",                   // 3
+  "ErrorCount",                 // 4
+  "FailedHealthCheck",          // 5
+  "FailedReadSmartData",        // 6
+  "FailedReadSmartErrorLog",    // 7
+  "FailedReadSmartSelfTestLog", // 8
+  "FailedOpenDevice",           // 9
+  "CurrentPendingSector",       // 10
+  "OfflineUncorrectableSector", // 11
+  "Temperature"                 // 12
+};
+
+// Warning email or run of '-M exec' executable, queued for delivery.
+struct mail_job
+{
+  int which;                  // type of warning, index into whichfail[]
+  std::string executable;     // mailer or '-M exec' executable
+  std::string address;        // recipients, empty for <nomailer>
+  std::string device;         // $SMARTD_DEVICE
+  std::string dev_type;       // $SMARTD_DEVICETYPE
+  std::string message;        // warning message
+  std::string further, original, additional; // additional lines of mail body
+  std::string tfirst, tfirstepoch; // $SMARTD_TFIRST, $SMARTD_TFIRSTEPOCH
+  std::vector<std::string> environment; // environment of smartd, no SMARTD_*
+
+  time_t queued;              // time the first warning was queued
+  time_t next_try;            // earliest time of next delivery attempt
+  int tries;                  // number of failed delivery attempts
+  int coalesced;              // number of warnings merged into this one
+
+  mail_job()
+    : which(0), queued(0), next_try(0), tries(0), coalesced(0) { }
+
+  // Return true if delivery of same warning type to same recipient
+  bool same_warning(const mail_job & x) const
+    { return (   which == x.which && device == x.device
+              && executable == x.executable && address == x.address); }
+};
+
+#ifndef _WIN32
+extern char ** environ;
+
+// Run 'command' via /bin/sh with environment 'env'.  Standard output and
+// error are read from a pipe, the process group is killed after MAILTIMEOUT
+// seconds.  Returns true if the command succeeded.
+static bool run_mail_command(const char * command, const std::vector<std::string> & env,
+                             const char * newwarn, const char * executable,
+                             const char * newadd)
+{
+  // Prepare arguments before fork()
+  std::vector<char *> envp;
+  for (unsigned i = 0; i < env.size(); i++)
+    envp.push_back(const_cast<char *>(env[i].c_str()));
+  envp.push_back((char *)0);
+  char * argv[] = { (char *)"sh", (char *)"-c", const_cast<char *>(command), (char *)0 };
+
+  int fds[2] = { -1, -1 };
+  pid_t pid = -1;
+  errno = 0;
+  if (!pipe(fds)) {
+    if ((pid = fork()) == 0) {
+      // Child: Signals were blocked in delivery thread
+      sigset_t none; sigemptyset(&none);
+      sigprocmask(SIG_SETMASK, &none, (sigset_t *)0);
+      // New process group to kill subprocesses on timeout
+      setpgid(0, 0);
+      int fd = open("/dev/null", O_RDONLY);
+      if (fd >= 0 && fd != 0) {
+        dup2(fd, 0); close(fd);
+      }
+      dup2(fds[1], 1); dup2(fds[1], 2);
+      close(fds[0]);
+      if (fds[1] > 2)
+        close(fds[1]);
+      execve("/bin/sh", argv, &envp[0]);
+      _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0)
+      close(fds[0]);
+  }
+  if (pid < 0) {
+    // failed to fork() mail process
+    PrintOut(LOG_CRIT,"%s %s to %s: failed (fork or pipe failed, or no memory) %s\n",
+             newwarn, executable, newadd, errno?strerror(errno):"");
+    return false;
+  }
+
+  // Read STDOUT/STDERR until EOF or timeout
+  time_t deadline = time(NULL) + MAILTIMEOUT;
+  char buffer[EBUFLEN];
+  int len = 0, count = 0;
+  bool timeout = false;
+  for (;;) {
+    time_t now = time(NULL);
+    if (now >= deadline) {
+      timeout = true;
+      break;
+    }
+    struct pollfd pfd;
+    pfd.fd = fds[0]; pfd.events = POLLIN; pfd.revents = 0;
+    int rc = poll(&pfd, 1, (int)(deadline - now) * 1000);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0)
+      continue; // check deadline
+    char * p = (len < EBUFLEN ? buffer + len : buffer);
+    int n = read(fds[0], p, (len < EBUFLEN ? EBUFLEN - len : EBUFLEN));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break; // EOF
+    if (len < EBUFLEN)
+      len += n;
+    // flush pipe if needed, break pipe after 1 MB
+    else if (++count >= EBUFLEN)
+      break;
+  }
+  close(fds[0]);
+
+  // if unexpected output on stdout/stderr, null terminate, print, and flush
+  if (len) {
+    int newlen = len<EBUFLEN ? len : EBUFLEN-1;
+    buffer[newlen]='\0';
+    PrintOut(LOG_CRIT,"%s %s to %s produced unexpected output (%s%d bytes) to STDOUT/STDERR: \n%s\n",
+             newwarn, executable, newadd, len!=newlen?"here truncated to ":"", newlen, buffer);
+
+    // tell user that pipe was flushed, or that something is really wrong
+    if (count && count<EBUFLEN)
+      PrintOut(LOG_CRIT,"%s %s to %s: flushed remaining STDOUT/STDERR\n",
+               newwarn, executable, newadd);
+    else if (count)
+      PrintOut(LOG_CRIT,"%s %s to %s: more than 1 MB STDOUT/STDERR flushed, breaking pipe\n",
+               newwarn, executable, newadd);
+  }
+
+  // Wait for process, kill process group on timeout
+  int status = 0;
+  for (;;) {
+    pid_t rc = waitpid(pid, &status, WNOHANG);
+    if (rc == pid)
+      break;
+    if (rc < 0 && errno != EINTR) {
+      PrintOut(LOG_CRIT,"%s %s to %s: waitpid(2) failed %s\n", newwarn, executable, newadd,
+               strerror(errno));
+      return false;
+    }
+    if (timeout || time(NULL) >= deadline) {
+      kill(-pid, SIGKILL);
+      waitpid(pid, &status, 0);
+      PrintOut(LOG_CRIT,"%s %s to %s: no completion after %d seconds, killed\n",
+               newwarn, executable, newadd, MAILTIMEOUT);
+      return false;
+    }
+    poll((struct pollfd *)0, 0, 100);
+  }
+
+  // mail process apparently succeeded. Check and report exit status
+  bool ok = false;
+  if (WIFEXITED(status)) {
+    // exited 'normally' (but perhaps with nonzero status)
+    int status8=WEXITSTATUS(status);
+
+    if (status8>128)
+      PrintOut(LOG_CRIT,"%s %s to %s: failed (32-bit/8-bit exit status: %d/%d) perhaps caught signal %d [%s]\n",
+               newwarn, executable, newadd, status, status8, status8-128, strsignal(status8-128));
+    else if (status8)
+      PrintOut(LOG_CRIT,"%s %s to %s: failed (32-bit/8-bit exit status: %d/%d)\n",
+               newwarn, executable, newadd, status, status8);
+    else {
+      PrintOut(LOG_INFO,"%s %s to %s: successful\n", newwarn, executable, newadd);
+      ok = true;
+    }
+  }
+
+  if (WIFSIGNALED(status))
+    PrintOut(LOG_INFO,"%s %s to %s: exited because of uncaught signal %d [%s]\n",
+             newwarn, executable, newadd, WTERMSIG(status), strsignal(WTERMSIG(status)));
+
+  return ok;
+}
+#endif // _WIN32
+
+// Send a queued warning email, or run executable.
+// Returns false if delivery failed.
+static bool deliver_mail(const mail_job & job)
+{
+  char hostname[256], domainname[256], fullmessage[1024];
+  char nisdomain[256], subject[256];
+  const char *unknown="[Unknown]";
+  const char * executable = job.executable.c_str();
+  std::string address = job.address;
+
+  // get system host & domain names (not null terminated if length=MAX) 
 #ifdef HAVE_GETHOSTNAME
   if (gethostname(hostname, 256))
     strcpy(hostname, unknown);
@@ -961,14 +1916,368 @@ static void MailWarning(const dev_config & cfg, dev_state & state, int which, co
   strcpy(domainname, unknown);
 #endif
   
-#ifdef HAVE_GETDOMAINNAME
-  if (getdomainname(nisdomain, 256))
-    strcpy(nisdomain, unknown);
+#ifdef HAVE_GETDOMAINNAME
+  if (getdomainname(nisdomain, 256))
+    strcpy(nisdomain, unknown);
+  else
+    nisdomain[255]='\0';
+#else
+  strcpy(nisdomain, unknown);
+#endif
+
+  const char * message = job.message.c_str();
+  const char * further = job.further.c_str();
+  const char * original = job.original.c_str();
+  const char * additional = job.additional.c_str();
+  int which = job.which;
+
+  snprintf(subject, 256,"SMART error (%s) detected on host: %s", whichfail[which], hostname);
+
+#ifndef _WIN32 // blat mailer needs comma
+  // replace commas by spaces to separate recipients
+  std::replace(address.begin(), address.end(), ',', ' ');
+#endif
+  // Export information in environment variables that will be useful
+  // for user scripts
+  std::vector<std::string> env = job.environment;
+  env.push_back(std::string("SMARTD_MAILER=") + executable);
+  env.push_back(std::string("SMARTD_MESSAGE=") + message);
+  env.push_back(std::string("SMARTD_SUBJECT=") + subject);
+  env.push_back("SMARTD_TFIRST=" + job.tfirst);
+  env.push_back("SMARTD_TFIRSTEPOCH=" + job.tfirstepoch);
+  env.push_back(std::string("SMARTD_FAILTYPE=") + whichfail[which]);
+  if (!address.empty())
+    env.push_back("SMARTD_ADDRESS=" + address);
+  env.push_back("SMARTD_DEVICESTRING=" + job.device);
+
+  env.push_back("SMARTD_DEVICETYPE=" + job.dev_type);
+  env.push_back("SMARTD_DEVICE=" + job.device);
+
+  snprintf(fullmessage, 1024,
+             "This email was generated by the smartd daemon running on:\n\n"
+             "   host name: %s\n"
+             "  DNS domain: %s\n"
+             "  NIS domain: %s\n\n"
+             "The following warning/error was logged by the smartd daemon:\n\n"
+             "%s\n\n"
+             "For details see host's SYSLOG (default: /var/log/messages).\n\n"
+             "%s%s%s",
+	     hostname, domainname, nisdomain, message, further, original, additional);
+  env.push_back(std::string("SMARTD_FULLMESSAGE=") + fullmessage);
+
+  // now construct a command to send this as EMAIL
+#ifndef _WIN32
+  char command[2048];
+  if (!address.empty())
+    snprintf(command, 2048, 
+             "$SMARTD_MAILER -s '%s' %s 2>&1 << \"ENDMAIL\"\n"
+	     "%sENDMAIL\n", subject, address.c_str(), fullmessage);
+  else
+    snprintf(command, 2048, "%s 2>&1", executable);
+  
+  // tell SYSLOG what we are about to do...
+  const char * newadd = (!address.empty()? address.c_str() : "<nomailer>");
+  const char * newwarn = (which? "Warning via" : "Test of");
+
+  PrintOut(LOG_INFO,"%s %s to %s ...\n",
+           which?"Sending warning via":"Executing test of", executable, newadd);
+  
+  // issue the command to send mail or to run the user's executable
+  return run_mail_command(command, env, newwarn, executable, newadd);
+
+#else // _WIN32
+
+  // The environment variables must exist until the command is run
+  for (unsigned i = job.environment.size(); i < env.size(); i++)
+    putenv(const_cast<char *>(env[i].c_str()));
+
+  // No "here-documents" on Windows, so must use separate commandline and stdin
+  char command[2048], stdinbuf[1024];
+  command[0] = stdinbuf[0] = 0;
+  int boxtype = -1, boxmsgoffs = 0;
+  const char * newadd = "<nomailer>";
+  if (!address.empty()) {
+    // address "[sys]msgbox ..." => show warning (also) as [system modal ]messagebox
+    char addr1[9+1+13] = ""; int n1 = -1, n2 = -1;
+    if (sscanf(address.c_str(), "%9[a-z]%n,%n", addr1, &n1, &n2) == 1 && (n1 == (int)address.size() || n2 > 0)) {
+      if (!strcmp(addr1, "msgbox"))
+        boxtype = 0;
+      else if (!strcmp(addr1, "sysmsgbox"))
+        boxtype = 1;
+      if (boxtype >= 0)
+        address.erase(0, (n2 > n1 ? n2 : n1));
+    }
+
+    if (!address.empty()) {
+      // Use "blat" parameter syntax (TODO: configure via -M for other mailers)
+      snprintf(command, sizeof(command),
+               "%s - -q -subject \"%s\" -to \"%s\"",
+               executable, subject, address.c_str());
+      newadd = address.c_str();
+    }
+
+#ifdef _MSC_VER
+    _set_printf_count_output(1); // "%n" disabled by default
+#endif
+    // Message for mail [0...] and messagebox [boxmsgoffs...]
+    snprintf(stdinbuf, sizeof(stdinbuf),
+             "This email was generated by the smartd daemon running on:\n\n"
+             "   host name: %s\n"
+             "  DNS domain: %s\n"
+//           "  NIS domain: %s\n"
+             "\n%n"
+             "The following warning/error was logged by the smartd daemon:\n\n"
+             "%s\n\n"
+             "For details see the event log or log file of smartd.\n\n"
+             "%s%s%s"
+             "\n",
+             hostname, /*domainname, */ nisdomain, &boxmsgoffs, message, further, original, additional);
+  }
   else
-    nisdomain[255]='\0';
-#else
-  strcpy(nisdomain, unknown);
+    snprintf(command, sizeof(command), "%s", executable);
+
+  const char * newwarn = (which ? "Warning via" : "Test of");
+  bool ok = true;
+  if (boxtype >= 0) {
+    // show message box
+    daemon_messagebox(boxtype, subject, stdinbuf+boxmsgoffs);
+    PrintOut(LOG_INFO,"%s message box\n", newwarn);
+  }
+  if (command[0]) {
+    char stdoutbuf[800]; // < buffer in syslog_win32::vsyslog()
+    int rc;
+    // run command
+    PrintOut(LOG_INFO,"%s %s to %s ...\n",
+             (which?"Sending warning via":"Executing test of"), executable, newadd);
+    rc = daemon_spawn(command, stdinbuf, strlen(stdinbuf), stdoutbuf, sizeof(stdoutbuf));
+    if (rc >= 0 && stdoutbuf[0])
+      PrintOut(LOG_CRIT,"%s %s to %s produced unexpected output (%d bytes) to STDOUT/STDERR:\n%s\n",
+        newwarn, executable, newadd, strlen(stdoutbuf), stdoutbuf);
+    if (rc != 0) {
+      PrintOut(LOG_CRIT,"%s %s to %s: failed, exit status %d\n",
+        newwarn, executable, newadd, rc);
+      ok = false;
+    }
+    else
+      PrintOut(LOG_INFO,"%s %s to %s: successful\n", newwarn, executable, newadd);
+  }
+  return ok;
+
+#endif // _WIN32
+}
+
+// Queue of warnings delivered by a background thread, so that device
+// checks never wait for the mailer.  Failed deliveries are retried,
+// repeated warnings of same type for same device are coalesced.
+class mail_queue : public worker_thread
+{
+public:
+  mail_queue()
+    : m_stop(false) { }
+
+  /// Queue warning for delivery.  Delivers in the calling
+  /// thread if the delivery thread could not be started.
+  void push(const mail_job & job);
+
+  /// Deliver remaining warnings without retries and stop thread.
+  void flush();
+
+  virtual void run();
+
+private:
+  std::deque<mail_job> m_queue;
+  bool m_stop;
+};
+
+void mail_queue::push(const mail_job & job)
+{
+  if (!is_running() && !start()) {
+    deliver_mail(job);
+    return;
+  }
+
+  lock();
+  bool coalesced = false;
+  for (unsigned i = 0; i < m_queue.size(); i++) {
+    mail_job & qj = m_queue[i];
+    if (!qj.same_warning(job))
+      continue;
+    // Replace older message, keep time queued and retry state
+    time_t queued = qj.queued, next_try = qj.next_try;
+    int tries = qj.tries, cnt = qj.coalesced + 1;
+    qj = job;
+    qj.queued = queued; qj.next_try = next_try;
+    qj.tries = tries; qj.coalesced = cnt;
+    coalesced = true;
+    break;
+  }
+  mail_job dropped;
+  if (!coalesced) {
+    if (m_queue.size() >= MAILQUEUEMAX) {
+      dropped = m_queue.front();
+      m_queue.pop_front();
+    }
+    m_queue.push_back(job);
+  }
+  unsigned depth = m_queue.size();
+  notify();
+  unlock();
+
+  if (!dropped.device.empty())
+    PrintOut(LOG_CRIT, "Mail queue full, %s warning for %s dropped\n",
+             whichfail[dropped.which], dropped.device.c_str());
+  if (debugmode)
+    PrintOut(LOG_INFO, "Mail queue: %s warning for %s %s, queue depth %u\n",
+             whichfail[job.which], job.device.c_str(),
+             (coalesced ? "coalesced" : "queued"), depth);
+}
+
+void mail_queue::flush()
+{
+  if (!is_running())
+    return;
+  lock();
+  m_stop = true;
+  notify();
+  unlock();
+  join();
+  m_stop = false;
+}
+
+void mail_queue::run()
+{
+  lock();
+  for (;;) {
+    if (m_queue.empty()) {
+      if (m_stop)
+        break;
+      wait();
+      continue;
+    }
+
+    // Find first warning ready for delivery
+    time_t now = time(NULL), next_try = 0;
+    unsigned i;
+    for (i = 0; i < m_queue.size(); i++) {
+      if (m_stop || m_queue[i].next_try <= now)
+        break;
+      if (!next_try || m_queue[i].next_try < next_try)
+        next_try = m_queue[i].next_try;
+    }
+    if (i >= m_queue.size()) {
+      wait(next_try - now);
+      continue;
+    }
+
+    mail_job job = m_queue[i];
+    m_queue.erase(m_queue.begin() + i);
+    bool stop = m_stop;
+    unlock();
+
+    time_t start = time(NULL);
+    bool ok = deliver_mail(job);
+    time_t end = time(NULL);
+
+    bool retry = (!ok && !stop && job.tries < MAILRETRIES);
+    lock();
+    if (retry) {
+      job.tries++;
+      job.next_try = end + MAILRETRYDELAY;
+      m_queue.push_back(job);
+    }
+    unsigned depth = m_queue.size();
+    unlock();
+
+    if (retry)
+      PrintOut(LOG_INFO, "%s warning for %s: retry %d of %d in %d seconds\n",
+               whichfail[job.which], job.device.c_str(), job.tries, MAILRETRIES,
+               MAILRETRYDELAY);
+    if (debugmode)
+      PrintOut(LOG_INFO, "Mail queue: %s warning for %s %s after %d seconds,"
+               " latency %d seconds (%d coalesced), queue depth %u\n",
+               whichfail[job.which], job.device.c_str(), (ok ? "delivered" : "failed"),
+               (int)(end - start), (int)(end - job.queued), job.coalesced, depth);
+    lock();
+  }
+  unlock();
+}
+
+// Warnings queued for delivery
+static mail_queue mail_delivery;
+
+static void MailWarning(const dev_config & cfg, dev_state & state, int which, const char *fmt, ...)
+                        __attribute__ ((format (printf, 4, 5)));
+
+// If either address or executable path is non-null then queue
+// a warning email, or execution of executable
+static void MailWarning(const dev_config & cfg, dev_state & state, int which, const char *fmt, ...){
+  char message[256], additional[256];
+  char original[256], further[256], dates[DATEANDEPOCHLEN];
+  time_t epoch;
+  va_list ap;
+  const int day=24*3600;
+  int days=0;
+
+  // See if user wants us to send mail
+  if (cfg.emailaddress.empty() && cfg.emailcmdline.empty())
+    return;
+
+  // Send later if called from a parallel device check
+  va_start(ap, fmt);
+  bool deferred = defer_output(deferred_output::MAIL_WARNING, which, fmt, ap);
+  va_end(ap);
+  if (deferred)
+    return;
+
+  // which type of mail are we sending?
+  mailinfo * mail=(state.maillog)+which;
+
+  // checks for sanity
+  if (cfg.emailfreq<1 || cfg.emailfreq>3) {
+    PrintOut(LOG_CRIT,"internal error in MailWarning(): cfg.mailwarn->emailfreq=%d\n",cfg.emailfreq);
+    return;
+  }
+  if (which<0 || which>=SMARTD_NMAIL || sizeof(whichfail)!=SMARTD_NMAIL*sizeof(char *)) {
+    PrintOut(LOG_CRIT,"Contact " PACKAGE_BUGREPORT "; internal error in MailWarning(): which=%d, size=%d\n",
+             which, (int)sizeof(whichfail));
+    return;
+  }
+  
+  // Return if a single warning mail has been sent.
+  if ((cfg.emailfreq==1) && mail->logged)
+    return;
+
+  // Return if this is an email test and one has already been sent.
+  if (which == 0 && mail->logged)
+    return;
+  
+  // To decide if to send mail, we need to know what time it is.
+  epoch=time(NULL);
+
+  // Return if less than one day has gone by
+  if (cfg.emailfreq==2 && mail->logged && epoch<(mail->lastsent+day))
+    return;
+
+  // Return if less than 2^(logged-1) days have gone by
+  if (cfg.emailfreq==3 && mail->logged) {
+    days=0x01<<(mail->logged-1);
+    days*=day;
+    if  (epoch<(mail->lastsent+days))
+      return;
+  }
+
+#ifdef HAVE_LIBCAP_NG
+  if (enable_capabilities) {
+    PrintOut(LOG_ERR, "Sending a mail was supressed. "
+             "Mails can't be send when capabilites are enabled\n");
+    return;
+  }
 #endif
+
+  // record the time of this mail message, and the first mail message
+  if (!mail->logged)
+    mail->firstsent=epoch;
+  mail->lastsent=epoch;
   
   // print warning string into message
   va_start(ap, fmt);
@@ -998,212 +2307,278 @@ static void MailWarning(const dev_config & cfg, dev_state & state, int which, co
     }
   }
   
-  snprintf(subject, 256,"SMART error (%s) detected on host: %s", whichfail[which], hostname);
+  mail_job job;
+  job.which = which;
+  job.executable = cfg.emailcmdline;
+  job.address = cfg.emailaddress;
+  job.device = cfg.name;
+  job.dev_type = cfg.dev_type;
+  job.message = message;
+  job.further = further;
+  job.original = original;
+  job.additional = additional;
+  dateandtimezoneepoch(dates, mail->firstsent);
+  job.tfirst = dates;
+  snprintf(dates, DATEANDEPOCHLEN,"%d", (int)mail->firstsent);
+  job.tfirstepoch = dates;
+  job.queued = job.next_try = epoch;
 
   // If the user has set cfg.emailcmdline, use that as mailer, else "mail" or "mailx".
-  if (!*executable)
+  if (job.executable.empty())
 #ifdef DEFAULT_MAILER
-    executable = DEFAULT_MAILER ;
+    job.executable = DEFAULT_MAILER ;
 #else
 #ifndef _WIN32
-    executable = "mail";
+    job.executable = "mail";
 #else
-    executable = "blat"; // http://blat.sourceforge.net/
+    job.executable = "blat"; // http://blat.sourceforge.net/
 #endif
 #endif
 
-#ifndef _WIN32 // blat mailer needs comma
-  // replace commas by spaces to separate recipients
-  std::replace(address.begin(), address.end(), ',', ' ');
+#ifndef _WIN32
+  // Copy environment, the delivery thread must not access it
+  for (char ** e = environ; *e; e++) {
+    if (strncmp(*e, "SMARTD_", 7))
+      job.environment.push_back(*e);
+  }
 #endif
-  // Export information in environment variables that will be useful
-  // for user scripts
-  exportenv(environ_strings[0], "SMARTD_MAILER", executable);
-  exportenv(environ_strings[1], "SMARTD_MESSAGE", message);
-  exportenv(environ_strings[2], "SMARTD_SUBJECT", subject);
-  dateandtimezoneepoch(dates, mail->firstsent);
-  exportenv(environ_strings[3], "SMARTD_TFIRST", dates);
-  snprintf(dates, DATEANDEPOCHLEN,"%d", (int)mail->firstsent);
-  exportenv(environ_strings[4], "SMARTD_TFIRSTEPOCH", dates);
-  exportenv(environ_strings[5], "SMARTD_FAILTYPE", whichfail[which]);
-  if (!address.empty())
-    exportenv(environ_strings[6], "SMARTD_ADDRESS", address.c_str());
-  exportenv(environ_strings[7], "SMARTD_DEVICESTRING", cfg.name.c_str());
 
-  exportenv(environ_strings[8], "SMARTD_DEVICETYPE", cfg.dev_type.c_str());
-  exportenv(environ_strings[9], "SMARTD_DEVICE", cfg.name.c_str());
+  // queue the warning, delivery does not block the device checks
+  mail_delivery.push(job);
 
-  snprintf(fullmessage, 1024,
-             "This email was generated by the smartd daemon running on:\n\n"
-             "   host name: %s\n"
-             "  DNS domain: %s\n"
-             "  NIS domain: %s\n\n"
-             "The following warning/error was logged by the smartd daemon:\n\n"
-             "%s\n\n"
-             "For details see host's SYSLOG (default: /var/log/messages).\n\n"
-             "%s%s%s",
-	     hostname, domainname, nisdomain, message, further, original, additional);
-  exportenv(environ_strings[10], "SMARTD_FULLMESSAGE", fullmessage);
+  // increment mail sent counter
+  mail->logged++;
+}
 
-  // now construct a command to send this as EMAIL
+// Logging backend of PrintOut() and pout().
+// Syslog (or the '-L' log target) is opened once and kept open.
+// Messages are formatted into a reusable buffer.  While batching is
+// enabled (during a check cycle), messages are queued and written by
+// log_flush(), critical messages flush the queue immediately.
+// All functions must be called with output_mutex locked.
+
+// Message queued while batching
+struct log_record
+{
+  int priority;
+  std::string text;
+};
+
+static std::vector<log_record> log_queue; // entries are reused
+static unsigned log_queue_used = 0;
+static bool log_batching = false;
+static bool log_muted = false; // drop all output, set during '-q benchmark' loops
+static bool log_is_open = false;
+static FILE * log_file = 0;
 #ifndef _WIN32
-  if (!address.empty())
-    snprintf(command, 2048, 
-             "$SMARTD_MAILER -s '%s' %s 2>&1 << \"ENDMAIL\"\n"
-	     "%sENDMAIL\n", subject, address.c_str(), fullmessage);
-  else
-    snprintf(command, 2048, "%s 2>&1", executable);
-  
-  // tell SYSLOG what we are about to do...
-  const char * newadd = (!address.empty()? address.c_str() : "<nomailer>");
-  const char * newwarn = (which? "Warning via" : "Test of");
+static int log_socket = -1;
+#endif
 
-  PrintOut(LOG_INFO,"%s %s to %s ...\n",
-           which?"Sending warning via":"Executing test of", executable, newadd);
-  
-  // issue the command to send mail or to run the user's executable
-  errno=0;
-  FILE * pfp;
-  if (!(pfp=popen(command, "r")))
-    // failed to popen() mail process
-    PrintOut(LOG_CRIT,"%s %s to %s: failed (fork or pipe failed, or no memory) %s\n", 
-	     newwarn,  executable, newadd, errno?strerror(errno):"");
-  else {
-    // pipe suceeded!
-    int len, status;
-    char buffer[EBUFLEN];
-
-    // if unexpected output on stdout/stderr, null terminate, print, and flush
-    if ((len=fread(buffer, 1, EBUFLEN, pfp))) {
-      int count=0;
-      int newlen = len<EBUFLEN ? len : EBUFLEN-1;
-      buffer[newlen]='\0';
-      PrintOut(LOG_CRIT,"%s %s to %s produced unexpected output (%s%d bytes) to STDOUT/STDERR: \n%s\n", 
-	       newwarn, executable, newadd, len!=newlen?"here truncated to ":"", newlen, buffer);
-      
-      // flush pipe if needed
-      while (fread(buffer, 1, EBUFLEN, pfp) && count<EBUFLEN)
-	count++;
-
-      // tell user that pipe was flushed, or that something is really wrong
-      if (count && count<EBUFLEN)
-	PrintOut(LOG_CRIT,"%s %s to %s: flushed remaining STDOUT/STDERR\n", 
-		 newwarn, executable, newadd);
-      else if (count)
-	PrintOut(LOG_CRIT,"%s %s to %s: more than 1 MB STDOUT/STDERR flushed, breaking pipe\n", 
-		 newwarn, executable, newadd);
-    }
-    
-    // if something went wrong with mail process, print warning
-    errno=0;
-    if (-1==(status=pclose(pfp)))
-      PrintOut(LOG_CRIT,"%s %s to %s: pclose(3) failed %s\n", newwarn, executable, newadd,
-	       errno?strerror(errno):"");
-    else {
-      // mail process apparently succeeded. Check and report exit status
-      int status8;
-
-      if (WIFEXITED(status)) {
-	// exited 'normally' (but perhaps with nonzero status)
-	status8=WEXITSTATUS(status);
-	
-	if (status8>128)  
-	  PrintOut(LOG_CRIT,"%s %s to %s: failed (32-bit/8-bit exit status: %d/%d) perhaps caught signal %d [%s]\n", 
-		   newwarn, executable, newadd, status, status8, status8-128, strsignal(status8-128));
-	else if (status8)  
-	  PrintOut(LOG_CRIT,"%s %s to %s: failed (32-bit/8-bit exit status: %d/%d)\n", 
-		   newwarn, executable, newadd, status, status8);
-	else
-	  PrintOut(LOG_INFO,"%s %s to %s: successful\n", newwarn, executable, newadd);
-      }
-      
-      if (WIFSIGNALED(status))
-	PrintOut(LOG_INFO,"%s %s to %s: exited because of uncaught signal %d [%s]\n", 
-		 newwarn, executable, newadd, WTERMSIG(status), strsignal(WTERMSIG(status)));
-      
-      // this branch is probably not possible. If subprocess is
-      // stopped then pclose() should not return.
-      if (WIFSTOPPED(status)) 
-      	PrintOut(LOG_CRIT,"%s %s to %s: process STOPPED because it caught signal %d [%s]\n",
-		 newwarn, executable, newadd, WSTOPSIG(status), strsignal(WSTOPSIG(status)));
-      
+// Call vsyslog(), syslog() is not available on all platforms
+static void log_syslog(int priority, const char * fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+
+static void log_syslog(int priority, const char * fmt, ...)
+{
+  va_list ap; va_start(ap, fmt);
+  vsyslog(priority, fmt, ap);
+  va_end(ap);
+}
+
+// Open syslog and log target.  If the log target cannot be opened,
+// syslog is used until the next log_close().
+static void log_open()
+{
+  if (log_is_open)
+    return;
+  log_is_open = true;
+  // get the correct time in syslog() and log_target
+  FixGlibcTimeZoneBug();
+  openlog("smartd", LOG_PID, facility);
+
+  if (!strncmp(log_target.c_str(), "file:", 5)) {
+    if (!(log_file = fopen(log_target.c_str()+5, "a")))
+      log_syslog(LOG_CRIT, "Unable to open log file %s: %s, using syslog\n",
+                 log_target.c_str()+5, strerror(errno));
+#ifndef _WIN32
+    else
+      fcntl(fileno(log_file), F_SETFD, FD_CLOEXEC);
+#endif
+  }
+#ifndef _WIN32
+  else if (!strncmp(log_target.c_str(), "socket:", 7)) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, log_target.c_str()+7, sizeof(addr.sun_path)-1);
+    log_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (log_socket >= 0) {
+      fcntl(log_socket, F_SETFD, FD_CLOEXEC);
+      if (connect(log_socket, (struct sockaddr *)&addr, sizeof(addr))) {
+        int err = errno;
+        close(log_socket);
+        log_socket = -1;
+        errno = err;
+      }
     }
+    if (log_socket < 0)
+      log_syslog(LOG_CRIT, "Unable to connect log socket %s: %s, using syslog\n",
+                 log_target.c_str()+7, strerror(errno));
   }
-  
-#else // _WIN32
+#endif
+}
 
-  // No "here-documents" on Windows, so must use separate commandline and stdin
-  char stdinbuf[1024];
-  command[0] = stdinbuf[0] = 0;
-  int boxtype = -1, boxmsgoffs = 0;
-  const char * newadd = "<nomailer>";
-  if (!address.empty()) {
-    // address "[sys]msgbox ..." => show warning (also) as [system modal ]messagebox
-    char addr1[9+1+13] = ""; int n1 = -1, n2 = -1;
-    if (sscanf(address.c_str(), "%9[a-z]%n,%n", addr1, &n1, &n2) == 1 && (n1 == (int)address.size() || n2 > 0)) {
-      if (!strcmp(addr1, "msgbox"))
-        boxtype = 0;
-      else if (!strcmp(addr1, "sysmsgbox"))
-        boxtype = 1;
-      if (boxtype >= 0)
-        address.erase(0, (n2 > n1 ? n2 : n1));
-    }
+// Close syslog and log target, reopened on next output
+static void log_close()
+{
+  if (log_file) {
+    fclose(log_file);
+    log_file = 0;
+  }
+#ifndef _WIN32
+  if (log_socket >= 0) {
+    close(log_socket);
+    log_socket = -1;
+  }
+#endif
+  closelog();
+  log_is_open = false;
+}
 
-    if (!address.empty()) {
-      // Use "blat" parameter syntax (TODO: configure via -M for other mailers)
-      snprintf(command, sizeof(command),
-               "%s - -q -subject \"%s\" -to \"%s\"",
-               executable, subject, address.c_str());
-      newadd = address.c_str();
+// Write each line of message as one "TIME smartd[PID] PRIORITY: LINE"
+// record to log file or socket, return false on error
+static bool log_write_target(int priority, const char * text)
+{
+  static const char * const prionames[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+  };
+  time_t now = time(0);
+  char tbuf[32];
+  strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+  const char * prioname = prionames[LOG_PRI(priority) & 7];
+
+  for (const char * p = text; *p; ) {
+    const char * nl = strchr(p, '\n');
+    int len = (nl ? (int)(nl - p) : (int)strlen(p));
+    if (len > 0) {
+      char rec[1100];
+      int n = snprintf(rec, sizeof(rec), "%s smartd[%d] %s: %.*s\n",
+                       tbuf, (int)getpid(), prioname, len, p);
+      if (n < 0 || n >= (int)sizeof(rec)) {
+        n = sizeof(rec) - 1;
+        rec[n-1] = '\n';
+      }
+      if (log_file) {
+        if (fwrite(rec, 1, n, log_file) != (size_t)n)
+          return false;
+      }
+#ifndef _WIN32
+      else if (log_socket >= 0) {
+        // Never block, drop record if receiver is busy
+        if (send(log_socket, rec, n, MSG_DONTWAIT) < 0 && errno != EAGAIN)
+          return false;
+      }
+#endif
     }
+    if (!nl)
+      break;
+    p = nl + 1;
+  }
+  return true;
+}
 
-#ifdef _MSC_VER
-    _set_printf_count_output(1); // "%n" disabled by default
+// Write message to syslog or log target
+static void log_write(int priority, const char * text)
+{
+  log_open();
+#ifndef _WIN32
+  if (log_file || log_socket >= 0) {
+#else
+  if (log_file) {
 #endif
-    // Message for mail [0...] and messagebox [boxmsgoffs...]
-    snprintf(stdinbuf, sizeof(stdinbuf),
-             "This email was generated by the smartd daemon running on:\n\n"
-             "   host name: %s\n"
-             "  DNS domain: %s\n"
-//           "  NIS domain: %s\n"
-             "\n%n"
-             "The following warning/error was logged by the smartd daemon:\n\n"
-             "%s\n\n"
-             "For details see the event log or log file of smartd.\n\n"
-             "%s%s%s"
-             "\n",
-             hostname, /*domainname, */ nisdomain, &boxmsgoffs, message, further, original, additional);
+    if (log_write_target(priority, text))
+      return;
+    // Reopen on next output, use syslog for this message
+    log_close();
+    log_open();
   }
-  else
-    snprintf(command, sizeof(command), "%s", executable);
+  log_syslog(priority, "%s", text);
+}
 
-  const char * newwarn = (which ? "Warning via" : "Test of");
-  if (boxtype >= 0) {
-    // show message box
-    daemon_messagebox(boxtype, subject, stdinbuf+boxmsgoffs);
-    PrintOut(LOG_INFO,"%s message box\n", newwarn);
+// Write queued messages
+static void log_write_queue()
+{
+  for (unsigned i = 0; i < log_queue_used; i++)
+    log_write(log_queue[i].priority, log_queue[i].text.c_str());
+  log_queue_used = 0;
+}
+
+// Write queued messages, flush stdout and log file, end batching
+static void log_flush()
+{
+  log_write_queue();
+  if (log_file)
+    fflush(log_file);
+  fflush(stdout);
+  log_batching = false;
+}
+
+// Output message to console or syslog/log target.
+static void log_vprintf(int priority, bool console, const char * fmt, va_list ap)
+{
+  std::string text = vstrprintf(fmt, ap);
+  const char * buf = text.c_str();
+
+  if (console) {
+    // '-q benchmark' prints results to stdout, messages to stderr
+    FILE * out = (quit == 6 ? stderr : stdout);
+#ifdef _WIN32
+    if (facility == LOG_LOCAL1) // logging to stdout
+      out = stderr;
+#endif
+    fputs(buf, out);
+    if (!log_batching)
+      fflush(out);
+    return;
   }
-  if (command[0]) {
-    char stdoutbuf[800]; // < buffer in syslog_win32::vsyslog()
-    int rc;
-    // run command
-    PrintOut(LOG_INFO,"%s %s to %s ...\n",
-             (which?"Sending warning via":"Executing test of"), executable, newadd);
-    rc = daemon_spawn(command, stdinbuf, strlen(stdinbuf), stdoutbuf, sizeof(stdoutbuf));
-    if (rc >= 0 && stdoutbuf[0])
-      PrintOut(LOG_CRIT,"%s %s to %s produced unexpected output (%d bytes) to STDOUT/STDERR:\n%s\n",
-        newwarn, executable, newadd, strlen(stdoutbuf), stdoutbuf);
-    if (rc != 0)
-      PrintOut(LOG_CRIT,"%s %s to %s: failed, exit status %d\n",
-        newwarn, executable, newadd, rc);
-    else
-      PrintOut(LOG_INFO,"%s %s to %s: successful\n", newwarn, executable, newadd);
+
+  if (!log_batching || priority <= LOG_CRIT) {
+    // Keep order of messages
+    log_write_queue();
+    log_write(priority, buf);
+    if (!log_batching && log_file)
+      fflush(log_file);
+    return;
   }
 
-#endif // _WIN32
+  if (log_queue_used >= log_queue.size())
+    log_queue.resize(log_queue_used + 1);
+  log_record & rec = log_queue[log_queue_used++];
+  rec.priority = priority;
+  rec.text.assign(buf);
+}
 
-  // increment mail sent counter
-  mail->logged++;
+// Enable batching of log output, or write batched output
+static void log_batch(bool enable)
+{
+  output_mutex.lock();
+  if (enable) {
+    // get the correct time in syslog() once per batch
+    FixGlibcTimeZoneBug();
+    log_batching = true;
+  }
+  else
+    log_flush();
+  output_mutex.unlock();
+}
+
+// Write batched output and close syslog and log target (before fork)
+static void log_shutdown()
+{
+  output_mutex.lock();
+  log_flush();
+  log_close();
+  output_mutex.unlock();
 }
 
 // Printing function for watching ataprint commands, or losing them
@@ -1215,51 +2590,49 @@ static void MailWarning(const dev_config & cfg, dev_state & state, int which, co
 // appropriate.]
 void pout(const char *fmt, ...){
   va_list ap;
+  if (log_muted)
+    return;
 
-  // get the correct time in syslog()
-  FixGlibcTimeZoneBug();
+  // print later if called from a parallel device check
+  va_start(ap,fmt);
+  bool deferred = defer_output(deferred_output::POUT, 0, fmt, ap);
+  va_end(ap);
+  if (deferred)
+    return;
+
+  output_mutex.lock();
   // initialize variable argument list 
   va_start(ap,fmt);
   // in debug==1 mode we will print the output from the ataprint.o functions!
   if (debugmode && debugmode!=2)
-#ifdef _WIN32
-   if (facility == LOG_LOCAL1) // logging to stdout
-    vfprintf(stderr,fmt,ap);
-   else   
-#endif
-    vprintf(fmt,ap);
+    log_vprintf(LOG_INFO, true, fmt, ap);
   // in debug==2 mode we print output from knowndrives.o functions
-  else if (debugmode==2 || con->reportataioctl || con->reportscsiioctl /*|| con->controller_port???*/) {
-    openlog("smartd", LOG_PID, facility);
-    vsyslog(LOG_INFO, fmt, ap);
-    closelog();
-  }
+  else if (debugmode==2 || con->reportataioctl || con->reportscsiioctl /*|| con->controller_port???*/)
+    log_vprintf(LOG_INFO, false, fmt, ap);
   va_end(ap);
-  fflush(NULL);
+  output_mutex.unlock();
   return;
 }
 
 // This function prints either to stdout or to the syslog as needed.
 static void PrintOut(int priority, const char *fmt, ...){
   va_list ap;
-  
-  // get the correct time in syslog()
-  FixGlibcTimeZoneBug();
+  if (log_muted)
+    return;
+
+  // print later if called from a parallel device check
+  va_start(ap,fmt);
+  bool deferred = defer_output(deferred_output::PRINT_OUT, priority, fmt, ap);
+  va_end(ap);
+  if (deferred)
+    return;
+
+  output_mutex.lock();
   // initialize variable argument list 
   va_start(ap,fmt);
-  if (debugmode) 
-#ifdef _WIN32
-   if (facility == LOG_LOCAL1) // logging to stdout
-    vfprintf(stderr,fmt,ap);
-   else   
-#endif
-    vprintf(fmt,ap);
-  else {
-    openlog("smartd", LOG_PID, facility);
-    vsyslog(priority,fmt,ap);
-    closelog();
-  }
+  log_vprintf(priority, !!debugmode, fmt, ap);
   va_end(ap);
+  output_mutex.unlock();
   return;
 }
 
@@ -1300,6 +2673,7 @@ void DaemonInit(){
 
   // flush all buffered streams.  Else we might get two copies of open
   // streams since both parent and child get copies of the buffers.
+  log_shutdown();
   fflush(NULL);
 
   if (do_fork) {
@@ -1333,7 +2707,8 @@ void DaemonInit(){
     // Now we are the child's child...
   }
 
-  // close any open file descriptors
+  // close any open file descriptors, syslog is reopened on next output
+  log_shutdown();
   for (i=getdtablesize();i>=0;--i)
     close(i);
   
@@ -1362,6 +2737,7 @@ void DaemonInit(){
 
   // No fork() on native Win32
   // Detach this process from console
+  log_shutdown();
   fflush(NULL);
   if (daemon_detach("smartd")) {
     PrintOut(LOG_CRIT,"smartd unable to detach from console!\n");
@@ -1411,6 +2787,7 @@ void Directives() {
            "  -o VAL  Enable/disable automatic offline tests (on/off)\n"
            "  -S VAL  Enable/disable attribute autosave (on/off)\n"
            "  -n MODE No check if: never, sleep[,N][,q], standby[,N][,q], idle[,N][,q]\n"
+           "  -c ARG  Check interval: i=N, interval=N, adaptive[=MIN,MAX] (seconds)\n"
            "  -H      Monitor SMART Health Status, report if failed\n"
            "  -s REG  Do Self-Test at time(s) given by regular expression REG\n"
            "  -l TYPE Monitor SMART log.  Type is one of: error, selftest, xerror\n"
@@ -1452,14 +2829,29 @@ const char *GetValidArgList(char opt) {
   case 'l':
     return "daemon, local0, local1, local2, local3, local4, local5, local6, local7";
   case 'q':
-    return "nodev, errors, nodevstartup, never, onecheck, showtests";
+    return "nodev, errors, nodevstartup, never, onecheck, showtests, benchmark";
   case 'r':
     return "ioctl[,N], ataioctl[,N], scsiioctl[,N]";
   case 'B':
   case 'p':
+  case 'S':
+  case 'K':
+  case 'Q':
     return "<FILE_NAME>";
   case 'i':
     return "<INTEGER_SECONDS>";
+  case 'j':
+    return "<N>[,<N_PER_CONTROLLER>]";
+  case 'k':
+    return "<N>";
+  case 'f':
+    return "csv, columnar[,<RAW_DAYS>[,<HOURLY_DAYS>[,<DAILY_DAYS>]]]";
+  case 'L':
+#ifndef _WIN32
+    return "syslog, file:<FILE_NAME>, socket:<SOCKET_NAME>";
+#else
+    return "syslog, file:<FILE_NAME>";
+#endif
   default:
     return NULL;
   }
@@ -1494,16 +2886,31 @@ void Usage (void){
   PrintOut(LOG_INFO,"        Start smartd in debug mode\n\n");
   PrintOut(LOG_INFO,"  -D, --showdirectives\n");
   PrintOut(LOG_INFO,"        Print the configuration file Directives and exit\n\n");
+  PrintOut(LOG_INFO,"  -f FORMAT, --attrlogformat=FORMAT\n");
+  PrintOut(LOG_INFO,"        Attribute log format: csv, columnar[,RAW[,HOURLY[,DAILY]]]\n");
+  PrintOut(LOG_INFO,"        Columnar log keeps samples/rollups for RAW/HOURLY/DAILY days\n");
+  PrintOut(LOG_INFO,"        [default is csv, columnar default is columnar,30,365,0]\n\n");
   PrintOut(LOG_INFO,"  -h, --help, --usage\n");
   PrintOut(LOG_INFO,"        Display this help and exit\n\n");
   PrintOut(LOG_INFO,"  -i N, --interval=N\n");
   PrintOut(LOG_INFO,"        Set interval between disk checks to N seconds, where N >= 10\n\n");
+  PrintOut(LOG_INFO,"  -j N[,M], --jobs=N[,M]\n");
+  PrintOut(LOG_INFO,"        Check up to N devices in parallel, at most M per controller\n\n");
+  PrintOut(LOG_INFO,"  -k N, --keepopen=N\n");
+  PrintOut(LOG_INFO,"        Keep up to N devices open between checks [default is 0]\n\n");
   PrintOut(LOG_INFO,"  -l local[0-7], --logfacility=local[0-7]\n");
 #ifndef _WIN32
   PrintOut(LOG_INFO,"        Use syslog facility local0 - local7 or daemon [default]\n\n");
 #else
   PrintOut(LOG_INFO,"        Log to \"./smartd.log\", stdout, stderr [default is event log]\n\n");
 #endif
+#ifndef _WIN32
+  PrintOut(LOG_INFO,"  -L TARGET, --logtarget=TARGET\n");
+  PrintOut(LOG_INFO,"        Log to syslog [default], file:FILE or socket:SOCKET\n\n");
+#else
+  PrintOut(LOG_INFO,"  -L TARGET, --logtarget=TARGET\n");
+  PrintOut(LOG_INFO,"        Log to syslog [default] or file:FILE\n\n");
+#endif
 #ifndef _WIN32
   PrintOut(LOG_INFO,"  -n, --no-fork\n");
   PrintOut(LOG_INFO,"        Do not fork into background\n\n");
@@ -1512,6 +2919,10 @@ void Usage (void){
   PrintOut(LOG_INFO,"        Write PID file NAME\n\n");
   PrintOut(LOG_INFO,"  -q WHEN, --quit=WHEN\n");
   PrintOut(LOG_INFO,"        Quit on one of: %s\n\n", GetValidArgList('q'));
+#ifndef _WIN32
+  PrintOut(LOG_INFO,"  -Q SOCKET, --querysocket=SOCKET\n");
+  PrintOut(LOG_INFO,"        Serve device states to local clients on UNIX socket SOCKET\n\n");
+#endif
   PrintOut(LOG_INFO,"  -r, --report=TYPE\n");
   PrintOut(LOG_INFO,"        Report transactions for one of: %s\n\n", GetValidArgList('r'));
   PrintOut(LOG_INFO,"  -s PREFIX, --savestates=PREFIX\n");
@@ -1520,6 +2931,12 @@ void Usage (void){
   PrintOut(LOG_INFO,"        [default is "SMARTMONTOOLS_SAVESTATES"MODEL-SERIAL.TYPE.state]\n");
 #endif
   PrintOut(LOG_INFO,"\n");
+  PrintOut(LOG_INFO,"  -S FILE, --statestore=FILE\n");
+  PrintOut(LOG_INFO,"        Save disk states to binary state store FILE, import and\n");
+  PrintOut(LOG_INFO,"        export state files if also -s is specified\n\n");
+  PrintOut(LOG_INFO,"  -K FILE, --capcache=FILE\n");
+  PrintOut(LOG_INFO,"        Cache ATA device types and capabilities in FILE to skip\n");
+  PrintOut(LOG_INFO,"        probing on startup\n\n");
 #ifdef _WIN32
   PrintOut(LOG_INFO,"  --service\n");
   PrintOut(LOG_INFO,"        Running as windows service (see man page), install with:\n");
@@ -1541,6 +2958,122 @@ static int CloseDevice(smart_device * device, const char * name)
   return 0;
 }
 
+// Devices kept open between checks ('-k N'), least recently used first.
+// Devices are removed while checked, so only idle devices are closed.
+static std::vector<smart_device *> keepopen_devs;
+static thread_mutex keepopen_mutex;
+
+// Forget kept open devices which are no longer registered, called
+// before unused old devices are deleted.  Devices kept registered on
+// reload stay open and keep their LRU position.
+static void UpdateKeptOpenDevices(const smart_device_list & devices)
+{
+  keepopen_mutex.lock();
+  std::vector<smart_device *> kept;
+  for (unsigned i = 0; i < keepopen_devs.size(); i++) {
+    for (unsigned j = 0; j < devices.size(); j++) {
+      if (devices.at(j) == keepopen_devs[i]) {
+        kept.push_back(keepopen_devs[i]);
+        break;
+      }
+    }
+  }
+  keepopen_devs.swap(kept);
+  keepopen_mutex.unlock();
+}
+
+// Read identity of device to revalidate kept open device.
+static bool GetDeviceIdentity(smart_device * device, std::string & id)
+{
+  if (device->is_ata()) {
+    ata_identify_device drive;
+    if (ataReadHDIdentity(device->to_ata(), &drive) < 0)
+      return false;
+    id.assign((const char *)drive.model, sizeof(drive.model));
+    id.append((const char *)drive.serial_no, sizeof(drive.serial_no));
+    return true;
+  }
+  if (device->is_scsi()) {
+    UINT8 buf[36];
+    if (scsiStdInquiry(device->to_scsi(), buf, sizeof(buf)))
+      return false;
+    id.assign((const char *)buf + 8, sizeof(buf) - 8);
+    return true;
+  }
+  return false;
+}
+
+// Open device for check, reuse device kept open from last check.
+// Its identity is checked later by ValidateDeviceIdentity().
+static bool OpenDeviceForCheck(dev_state & state, smart_device * device, bool & reused)
+{
+  reused = false;
+  if (keepopen_max) {
+    keepopen_mutex.lock();
+    std::vector<smart_device *>::iterator it =
+      std::find(keepopen_devs.begin(), keepopen_devs.end(), device);
+    if (it != keepopen_devs.end())
+      keepopen_devs.erase(it);
+    keepopen_mutex.unlock();
+  }
+
+  if (device->is_open()) {
+    if (!state.keepopen_id.empty()) {
+      reused = true;
+      return true;
+    }
+    device->close();
+  }
+
+  return device->open();
+}
+
+// Check identity of a device reused by OpenDeviceForCheck(), reopen if
+// changed or removed.  Read identity of a device which should be kept
+// open ('-k N').  Must not be called before the power mode check ('-n'),
+// the commands would spin up the disk.
+static bool ValidateDeviceIdentity(dev_state & state, smart_device * device, const char * name,
+                                   bool reused)
+{
+  if (!keepopen_max)
+    return true;
+  std::string id;
+  if (reused) {
+    if (GetDeviceIdentity(device, id) && id == state.keepopen_id)
+      return true;
+    PrintOut(LOG_INFO, "Device: %s, kept open device changed or removed, reopening\n", name);
+    device->close();
+    if (!device->open()) {
+      state.keepopen_id.erase();
+      return false;
+    }
+  }
+  if (!GetDeviceIdentity(device, state.keepopen_id))
+    state.keepopen_id.erase();
+  return true;
+}
+
+// Close device after check or keep it open ('-k N') if its identity
+// is known.  No command is sent, the device may be in standby mode.
+// The least recently used device is closed if the limit is reached.
+static void ReleaseDevice(dev_state & state, smart_device * device, const char * name)
+{
+  if (!keepopen_max || state.keepopen_id.empty()) {
+    CloseDevice(device, name);
+    return;
+  }
+
+  keepopen_mutex.lock();
+  keepopen_devs.push_back(device);
+  if (keepopen_devs.size() > keepopen_max) {
+    // Close while locked, OpenDeviceForCheck() waits
+    smart_device * lru = keepopen_devs.front();
+    keepopen_devs.erase(keepopen_devs.begin());
+    CloseDevice(lru, lru->get_info_name());
+  }
+  keepopen_mutex.unlock();
+}
+
 // return true if a char is not allowed in a state file name
 static bool not_allowed_in_filename(char c)
 {
@@ -1549,26 +3082,35 @@ static bool not_allowed_in_filename(char c)
            || ('a' <= c && c <= 'z'));
 }
 
-// Read error count from Summary or Extended Comprehensive SMART error log
-// Return -1 on error
+// Read error count from Summary or Extended Comprehensive SMART error log,
+// return -1 on error.  If 'log_index' is specified, it is set to the index
+// of the most recent log entry.  Callers compare count and index with the
+// values of the last read to skip reading an unchanged Summary log.
 static int read_ata_error_count(ata_device * device, const char * name,
-                                unsigned char fix_firmwarebug, bool extended)
+                                unsigned char fix_firmwarebug, bool extended,
+                                int * log_index = 0)
 {
   if (!extended) {
-    ata_smart_errorlog log;
+    ata_device::io_buffer buf(device, sizeof(ata_smart_errorlog));
+    ata_smart_errorlog & log = *(ata_smart_errorlog *)buf.data();
     if (ataReadErrorLog(device, &log, fix_firmwarebug)){
       PrintOut(LOG_INFO,"Device: %s, Read Summary SMART Error Log failed\n",name);
       return -1;
     }
+    if (log_index)
+      *log_index = log.error_log_pointer;
     return (log.error_log_pointer ? log.ata_error_count : 0);
   }
   else {
-    ata_smart_exterrlog logx;
+    ata_device::io_buffer buf(device, sizeof(ata_smart_exterrlog));
+    ata_smart_exterrlog & logx = *(ata_smart_exterrlog *)buf.data();
     if (!ataReadExtErrorLog(device, &logx, 1 /*first sector only*/)) {
       PrintOut(LOG_INFO,"Device: %s, Read Extended Comprehensive SMART Error Log failed\n",name);
       return -1;
     }
     // Some disks use the reserved byte as index, see ataprint.cpp.
+    if (log_index)
+      *log_index = (logx.error_log_index ? logx.error_log_index : logx.reserved1);
     return (logx.error_log_index || logx.reserved1 ? logx.device_error_count : 0);
   }
 }
@@ -1578,7 +3120,8 @@ static int read_ata_error_count(ata_device * device, const char * name,
 static int SelfTestErrorCount(ata_device * device, const char * name,
                               unsigned char fix_firmwarebug)
 {
-  struct ata_smart_selftestlog log;
+  ata_device::io_buffer buf(device, sizeof(ata_smart_selftestlog));
+  ata_smart_selftestlog & log = *(ata_smart_selftestlog *)buf.data();
 
   if (ataReadSelfTestLog(device, &log, fix_firmwarebug)){
     PrintOut(LOG_INFO,"Device: %s, Read SMART Self Test Log Failed\n",name);
@@ -1648,6 +3191,53 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
   // Store drive size (for selective self-test only)
   state.num_sectors = get_num_sectors(&drive);
 
+  // Format identity for file names and capability cache
+  char model[40+1], serial[20+1], firmware[8+1];
+  format_ata_string(model, drive.model, sizeof(model)-1, fix_swapped_id);
+  format_ata_string(serial, drive.serial_no, sizeof(serial)-1, fix_swapped_id);
+  format_ata_string(firmware, drive.fw_rev, sizeof(firmware)-1, fix_swapped_id);
+  std::replace_if(model, model+strlen(model), not_allowed_in_filename, '_');
+  std::replace_if(serial, serial+strlen(serial), not_allowed_in_filename, '_');
+  std::replace_if(firmware, firmware+strlen(firmware), not_allowed_in_filename, '_');
+
+  // Read previous state from store, import state file if not found.
+  // The state is applied after the capability checks below.
+  persistent_dev_state saved_state;
+  bool state_read = false, state_imported = false;
+  if (!state_path_prefix.empty() || state_store.is_open()) {
+    cfg.state_key = strprintf("%s-%s.ata", model, serial);
+    if (!state_path_prefix.empty())
+      cfg.state_file = strprintf("%s%s.state", state_path_prefix.c_str(), cfg.state_key.c_str());
+    if (state_store.is_open() && state_store.read(cfg.state_key.c_str(), saved_state)) {
+      PrintOut(LOG_INFO, "Device: %s, state read from %s\n", name, state_store.get_path());
+      state_read = true;
+    }
+    else if (!cfg.state_file.empty() && read_dev_state(cfg.state_file.c_str(), saved_state)) {
+      PrintOut(LOG_INFO, "Device: %s, state read from %s\n", name, cfg.state_file.c_str());
+      state_read = state_imported = true;
+    }
+  }
+
+  // Get cached capabilities if identity and '-T' setting are unchanged
+  dev_capabilities cap;
+  bool cap_valid = false;
+  if (!capcache_path.empty()) {
+    std::string capkey = strprintf("%s-%s-%s", model, serial, firmware);
+    dev_capabilities_map::const_iterator it = capcache.find(cfg.regname);
+    if (   it != capcache.end() && it->second.key == capkey
+        && it->second.is_probed(CAP_PERMISSIVE) == cfg.permissive) {
+      cap = it->second;
+      if (debugmode)
+        PrintOut(LOG_INFO, "Device: %s, using cached capabilities\n", name);
+    }
+    else {
+      cap.key = capkey;
+      if (cfg.permissive)
+        cap.probed |= CAP_PERMISSIVE;
+    }
+    cap_valid = true;
+  }
+
   // Show if device in database, and use preset vendor attribute
   // options unless user has requested otherwise.
   if (cfg.ignorepresets)
@@ -1667,6 +3257,9 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
   if (!cfg.offl_pending_set)
     cfg.offl_pending_id = get_unc_attr_id(true, cfg.attribute_defs, cfg.offl_pending_incr);
 
+  // Resolve raw value byte orders once
+  cfg.attribute_decoder.init(cfg.attribute_defs);
+
   // If requested, show which presets would be used for this drive
   if (cfg.showpresets) {
     int savedebugmode=debugmode;
@@ -1722,9 +3315,18 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
   }
 
   // capability check: SMART status
-  if (cfg.smartcheck && ataSmartStatus2(atadev) == -1) {
-    PrintOut(LOG_INFO,"Device: %s, not capable of SMART Health Status check\n",name);
-    cfg.smartcheck = false;
+  if (cfg.smartcheck) {
+    bool ok;
+    if (cap.is_probed(CAP_SMARTSTATUS))
+      ok = cap.is_supported(CAP_SMARTSTATUS);
+    else {
+      ok = (ataSmartStatus2(atadev) != -1);
+      cap.set(CAP_SMARTSTATUS, ok);
+    }
+    if (!ok) {
+      PrintOut(LOG_INFO,"Device: %s, not capable of SMART Health Status check\n",name);
+      cfg.smartcheck = false;
+    }
   }
   
   // capability check: Read smart values and thresholds.  Note that
@@ -1741,15 +3343,42 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
       || cfg.tempdiff        || cfg.tempinfo || cfg.tempcrit
       || cfg.curr_pending_id || cfg.offl_pending_id         ) {
 
-    if (ataReadSmartValues(atadev, &state.smartval)) {
+    // Attribute values are also available from the previous state.
+    // Skip reading if all log capabilities are cached.
+    unsigned needed = CAP_SMARTVALUES | (cfg.selftest  ? CAP_SELFTESTLOG : 0)
+                    | (cfg.errorlog ? CAP_ERRORLOG  : 0) | (cfg.xerrorlog ? CAP_XERRORLOG   : 0);
+    if (   state_read && saved_state.ata_attributes[0].id && !cfg.autoofflinetest
+        && (cap.probed & needed) == needed && cap.is_supported(CAP_SMARTVALUES)) {
+      static_cast<persistent_dev_state &>(state) = saved_state;
+      state.update_temp_state();
+      smart_val_ok = true;
+    }
+    else if (ataReadSmartValues(atadev, &state.smartval)) {
       PrintOut(LOG_INFO, "Device: %s, Read SMART Values failed\n", name);
+      cap.set(CAP_SMARTVALUES, false);
       cfg.usagefailed = cfg.prefail = cfg.usage = false;
       cfg.tempdiff = cfg.tempinfo = cfg.tempcrit = 0;
       cfg.curr_pending_id = cfg.offl_pending_id = 0;
     }
     else {
+      cap.set(CAP_SMARTVALUES, true);
       smart_val_ok = true;
-      if (ataReadSmartThresholds(atadev, &state.smartthres)) {
+    }
+
+    if (smart_val_ok) {
+      bool ok;
+      if (cap.is_probed(CAP_THRESHOLDS)) {
+        ok = cap.is_supported(CAP_THRESHOLDS);
+        if (ok)
+          state.smartthres = cap.thresholds;
+      }
+      else {
+        ok = !ataReadSmartThresholds(atadev, &state.smartthres);
+        cap.set(CAP_THRESHOLDS, ok);
+        if (ok)
+          cap.thresholds = state.smartthres;
+      }
+      if (!ok) {
         PrintOut(LOG_INFO, "Device: %s, Read SMART Thresholds failed%s\n",
                  name, (cfg.usagefailed ? ", ignoring -f Directive" : ""));
         cfg.usagefailed = false;
@@ -1808,11 +3437,23 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
 
     if (!smart_val_ok)
       PrintOut(LOG_INFO, "Device: %s, no SMART Self-Test log (SMART READ DATA failed); disabling -l selftest\n", name);
-    else if (!cfg.permissive && !isSmartTestLogCapable(&state.smartval, &drive))
+    else if (state_read && cap.is_probed(CAP_SELFTESTLOG)) {
+      // Error count is restored from previous state below
+      if (cap.is_supported(CAP_SELFTESTLOG))
+        cfg.selftest = true;
+      else
+        PrintOut(LOG_INFO, "Device: %s, no SMART Self-Test log (cached); disabling -l selftest\n", name);
+    }
+    else if (!cfg.permissive && !isSmartTestLogCapable(&state.smartval, &drive)) {
       PrintOut(LOG_INFO, "Device: %s, appears to lack SMART Self-Test log; disabling -l selftest (override with -T permissive Directive)\n", name);
-    else if ((retval = SelfTestErrorCount(atadev, name, cfg.fix_firmwarebug)) < 0)
+      cap.set(CAP_SELFTESTLOG, false);
+    }
+    else if ((retval = SelfTestErrorCount(atadev, name, cfg.fix_firmwarebug)) < 0) {
       PrintOut(LOG_INFO, "Device: %s, no SMART Self-Test log; remove -l selftest Directive from smartd.conf\n", name);
+      cap.set(CAP_SELFTESTLOG, false);
+    }
     else {
+      cap.set(CAP_SELFTESTLOG, true);
       cfg.selftest = true;
       state.selflogcount=SELFTEST_ERRORCOUNT(retval);
       state.selfloghour =SELFTEST_ERRORHOURS(retval);
@@ -1823,20 +3464,42 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
   if (cfg.errorlog || cfg.xerrorlog) {
 
     state.ataerrorcount=0;
-    if (!(cfg.permissive || (smart_val_ok && isSmartErrorLogCapable(&state.smartval, &drive)))) {
+    unsigned logcaps = (cfg.errorlog ? CAP_ERRORLOG : 0) | (cfg.xerrorlog ? CAP_XERRORLOG : 0);
+    if (smart_val_ok && state_read && (cap.probed & logcaps) == logcaps) {
+      // Error count is restored from previous state below
+      if (cfg.errorlog && !cap.is_supported(CAP_ERRORLOG)) {
+        PrintOut(LOG_INFO, "Device: %s, no Summary SMART Error Log (cached), ignoring -l error\n", name);
+        cfg.errorlog = false;
+      }
+      if (cfg.xerrorlog && !cap.is_supported(CAP_XERRORLOG)) {
+        PrintOut(LOG_INFO, "Device: %s, no Extended Comprehensive SMART Error Log (cached), ignoring -l xerror\n", name);
+        cfg.xerrorlog = false;
+      }
+    }
+    else if (!(cfg.permissive || (smart_val_ok && isSmartErrorLogCapable(&state.smartval, &drive)))) {
       PrintOut(LOG_INFO, "Device: %s, no SMART Error Log (%s), ignoring -l [x]error (override with -T permissive)\n",
                name, (!smart_val_ok ? "SMART READ DATA failed" : "capability missing"));
+      if (smart_val_ok)
+        cap.set(logcaps, false);
       cfg.errorlog = cfg.xerrorlog = false;
     }
     else {
       int errcnt1 = -1, errcnt2 = -1;
-      if (cfg.errorlog && (errcnt1 = read_ata_error_count(atadev, name, cfg.fix_firmwarebug, false)) < 0) {
-        PrintOut(LOG_INFO, "Device: %s, no Summary SMART Error Log, ignoring -l error\n", name);
-        cfg.errorlog = false;
+      if (cfg.errorlog) {
+        errcnt1 = read_ata_error_count(atadev, name, cfg.fix_firmwarebug, false);
+        cap.set(CAP_ERRORLOG, errcnt1 >= 0);
+        if (errcnt1 < 0) {
+          PrintOut(LOG_INFO, "Device: %s, no Summary SMART Error Log, ignoring -l error\n", name);
+          cfg.errorlog = false;
+        }
       }
-      if (cfg.xerrorlog && (errcnt2 = read_ata_error_count(atadev, name, cfg.fix_firmwarebug, true)) < 0) {
-        PrintOut(LOG_INFO, "Device: %s, no Extended Comprehensive SMART Error Log, ignoring -l xerror\n", name);
-        cfg.xerrorlog = false;
+      if (cfg.xerrorlog) {
+        errcnt2 = read_ata_error_count(atadev, name, cfg.fix_firmwarebug, true);
+        cap.set(CAP_XERRORLOG, errcnt2 >= 0);
+        if (errcnt2 < 0) {
+          PrintOut(LOG_INFO, "Device: %s, no Extended Comprehensive SMART Error Log, ignoring -l xerror\n", name);
+          cfg.xerrorlog = false;
+        }
       }
       if (cfg.errorlog || cfg.xerrorlog) {
         if (cfg.errorlog && cfg.xerrorlog && errcnt1 != errcnt2) {
@@ -1850,7 +3513,13 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
   }
   
   // capabilities check -- does it support powermode?
-  if (cfg.powermode) {
+  if (cfg.powermode && cap.is_probed(CAP_POWERMODE)) {
+    if (!cap.is_supported(CAP_POWERMODE)) {
+      PrintOut(LOG_CRIT, "Device: %s, no ATA CHECK POWER STATUS support (cached), ignoring -n Directive\n", name);
+      cfg.powermode=0;
+    }
+  }
+  else if (cfg.powermode) {
     int powermode = ataCheckPowerMode(atadev);
     
     if (-1 == powermode) {
@@ -1862,6 +3531,7 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
 	       name, powermode);
       cfg.powermode=0;
     }
+    cap.set(CAP_POWERMODE, !!cfg.powermode);
   }
 
   // If no tests available or selected, return
@@ -1883,24 +3553,39 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
   // close file descriptor
   CloseDevice(atadev, name);
 
-  if (!state_path_prefix.empty() || !attrlog_path_prefix.empty()) {
-    // Build file name for state file
-    char model[40+1], serial[20+1];
-    format_ata_string(model, drive.model, sizeof(model)-1, fix_swapped_id);
-    format_ata_string(serial, drive.serial_no, sizeof(serial)-1, fix_swapped_id);
-    std::replace_if(model, model+strlen(model), not_allowed_in_filename, '_');
-    std::replace_if(serial, serial+strlen(serial), not_allowed_in_filename, '_');
-    if (!state_path_prefix.empty()) {
-      cfg.state_file = strprintf("%s%s-%s.ata.state", state_path_prefix.c_str(), model, serial);
-      // Read previous state
-      if (read_dev_state(cfg.state_file.c_str(), state)) {
-        PrintOut(LOG_INFO, "Device: %s, state read from %s\n", name, cfg.state_file.c_str());
-        // Copy ATA attribute values to temp state
-        state.update_temp_state();
-      }
+  // Apply previous state
+  if (state_read) {
+    static_cast<persistent_dev_state &>(state) = saved_state;
+    if (state_imported && state_store.is_open())
+      state.must_write = true;
+    // Copy ATA attribute values to temp state
+    state.update_temp_state();
+  }
+
+  // Build file name for attribute log file
+  if (!attrlog_path_prefix.empty())
+    cfg.attrlog_file = strprintf("%s%s-%s.ata.%s", attrlog_path_prefix.c_str(), model, serial,
+                                 (attrlog_columnar ? "attrlog" : "csv"));
+
+  // Restore self-test capabilities, update capability cache
+  if (cap_valid) {
+    state.not_cap_offline    = (cap.is_probed(CAP_TEST_OFFLINE)    && !cap.is_supported(CAP_TEST_OFFLINE));
+    state.not_cap_conveyance = (cap.is_probed(CAP_TEST_CONVEYANCE) && !cap.is_supported(CAP_TEST_CONVEYANCE));
+    state.not_cap_short      = (cap.is_probed(CAP_TEST_SHORT)      && !cap.is_supported(CAP_TEST_SHORT));
+    state.not_cap_long       = (cap.is_probed(CAP_TEST_LONG)       && !cap.is_supported(CAP_TEST_LONG));
+    state.not_cap_selective  = (cap.is_probed(CAP_TEST_SELECTIVE)  && !cap.is_supported(CAP_TEST_SELECTIVE));
+
+    // Device type is only needed to skip autodetection
+    const char * type = atadev->get_dev_type();
+    cap.dev_type = (cfg.regtype.empty() && (!strcmp(type, "ata") || !strcmp(type, "sat")) ? type : "");
+
+    dev_capabilities & oldcap = capcache[cfg.regname];
+    if (!(   oldcap.dev_type == cap.dev_type && oldcap.key == cap.key
+          && oldcap.probed == cap.probed && oldcap.supported == cap.supported
+          && !memcmp(&oldcap.thresholds, &cap.thresholds, sizeof(cap.thresholds)))) {
+      oldcap = cap;
+      capcache_dirty = true;
     }
-    if (!attrlog_path_prefix.empty())
-      cfg.attrlog_file = strprintf("%s%s-%s.ata.csv", attrlog_path_prefix.c_str(), model, serial);
   }
 
   // Start self-test regex check now if time was not read from state file
@@ -1910,6 +3595,46 @@ static int ATADeviceScan(dev_config & cfg, dev_state & state, ata_device * atade
   return 0;
 }
 
+// Format SCSI INQUIRY or VPD string for file names.
+static void format_scsi_string(char * out, const UINT8 * in, int n)
+{
+  while (n > 0 && (in[n-1] == ' ' || !in[n-1]))
+    n--;
+  while (n > 0 && in[0] == ' ') {
+    in++; n--;
+  }
+  memcpy(out, in, n);
+  out[n] = 0;
+  std::replace_if(out, out+n, not_allowed_in_filename, '_');
+}
+
+// Read SCSI error counter SCSI_CNT_*, return -1 on error.
+static int64_t ReadSCSICounter(scsi_device * scsidev, int i)
+{
+  switch (i) {
+    case SCSI_CNT_GROWN_DEFECTS:
+      return scsiCountGrownDefects(scsidev);
+    case SCSI_CNT_BMS_RESULTS:
+      return scsiCountBackgroundScanResults(scsidev);
+    default: {
+      scsi_device::io_buffer iobuf(scsidev, 252);
+      UINT8 * buf = iobuf.data();
+      if (scsiLogSense(scsidev, scsi_counters_info[i].lpage, 0, buf, iobuf.size(), 0))
+        return -1;
+      // Decode only what was fetched
+      if ((buf[2] << 8) + buf[3] + 4 > (int)iobuf.size()) {
+        buf[2] = 0; buf[3] = iobuf.size() - 4;
+      }
+      scsiErrorCounter ecnt;
+      scsiDecodeErrCounterPage(buf, &ecnt);
+      if (!ecnt.gotPC[6])
+        return -1;
+      // Total uncorrected errors
+      return (int64_t)ecnt.counter[6];
+    }
+  }
+}
+
 // on success, return 0. On failure, return >0.  Never return <0,
 // please.
 static int SCSIDeviceScan(dev_config & cfg, dev_state & state, scsi_device * scsidev)
@@ -1935,14 +3660,53 @@ static int SCSIDeviceScan(dev_config & cfg, dev_state & state, scsi_device * scs
     CloseDevice(scsidev, device);
     return 2; 
   }
-  
+
+  // Get cached capabilities if INQUIRY identity is unchanged
+  dev_capabilities cap;
+  bool cap_valid = false;
+  if (!capcache_path.empty()) {
+    UINT8 inq[36];
+    if (!scsiStdInquiry(scsidev, inq, sizeof(inq))) {
+      char vendor[8+1], product[16+1], revision[4+1];
+      format_scsi_string(vendor, inq + 8, 8);
+      format_scsi_string(product, inq + 16, 16);
+      format_scsi_string(revision, inq + 32, 4);
+      std::string capkey = strprintf("%s_%s-%s", vendor, product, revision);
+      dev_capabilities_map::const_iterator it = capcache.find(cfg.regname);
+      if (it != capcache.end() && it->second.key == capkey) {
+        cap = it->second;
+        if (debugmode)
+          PrintOut(LOG_INFO, "Device: %s, using cached capabilities\n", device);
+      }
+      else if (it != capcache.end() && !it->second.dev_type.empty() && cfg.regtype.empty()) {
+        // Device type was taken from cache, let caller retry with autodetection
+        PrintOut(LOG_INFO, "Device: %s, identity differs from capability cache\n", device);
+        CloseDevice(scsidev, device);
+        return 2;
+      }
+      else
+        cap.key = capkey;
+      cap_valid = true;
+    }
+  }
+
+  // Use cached MODE SENSE command length
+  if (cap_valid && cap.is_probed(CAP_MODESENSE10))
+    state.modese_len = (cap.is_supported(CAP_MODESENSE10) ? 10 : 6);
+
   // Badly-conforming USB storage devices may fail this check.
   // The response to the following IE mode page fetch (current and
   // changeable values) is carefully examined. It has been found
   // that various USB devices that malform the response will lock up
   // if asked for a log page (e.g. temperature) so it is best to
   // bail out now.
-  if (!(err = scsiFetchIECmpage(scsidev, &iec, state.modese_len)))
+  err = scsiFetchIECmpage(scsidev, &iec, state.modese_len);
+  if (err && err != SIMPLE_ERR_BAD_FIELD && state.modese_len) {
+    // Cached length failed, probe again
+    state.modese_len = 0;
+    err = scsiFetchIECmpage(scsidev, &iec, state.modese_len);
+  }
+  if (!err)
     state.modese_len = iec.modese_len;
   else if (SIMPLE_ERR_BAD_FIELD == err)
     ;  /* continue since it is reasonable not to support IE mpage */
@@ -1976,6 +3740,10 @@ static int SCSIDeviceScan(dev_config & cfg, dev_state & state, scsi_device * scs
         state.SmartPageSupported = 1;
         break;
       default:
+        for (int i = 0; i < SCSI_NUM_COUNTERS; i++) {
+          if (tBuf[k] == scsi_counters_info[i].lpage)
+            state.scsi_counters_supported |= (1 << i);
+        }
         break;
       }
     }   
@@ -2013,12 +3781,37 @@ static int SCSIDeviceScan(dev_config & cfg, dev_state & state, scsi_device * scs
       state.selflogcount = 0;
       state.selfloghour = 0;
     }
-    else {
-      // register starting values to watch for changes
-      state.selflogcount=SELFTEST_ERRORCOUNT(retval);
-      state.selfloghour =SELFTEST_ERRORHOURS(retval);
+    else {
+      // register starting values to watch for changes
+      state.selflogcount=SELFTEST_ERRORCOUNT(retval);
+      state.selfloghour =SELFTEST_ERRORHOURS(retval);
+    }
+  }
+
+  // capability check: error counters
+  if (cfg.errorlog) {
+    // Grown defect list has no log page, try to read it below
+    state.scsi_counters_supported |= (1 << SCSI_CNT_GROWN_DEFECTS);
+    // register starting values to watch for changes
+    for (int i = 0; i < SCSI_NUM_COUNTERS; i++) {
+      if (!(state.scsi_counters_supported & (1 << i)))
+        continue;
+      int64_t cnt = ReadSCSICounter(scsidev, i);
+      if (cnt < 0) {
+        state.scsi_counters_supported &= ~(1 << i);
+        continue;
+      }
+      state.scsi_counters[i] = cnt;
+      if (debugmode)
+        PrintOut(LOG_INFO, "Device: %s, %s: %"PRId64"\n", device, scsi_counters_info[i].desc, cnt);
+    }
+    if (!state.scsi_counters_supported) {
+      PrintOut(LOG_INFO, "Device: %s, does not support SCSI error counters.\n", device);
+      cfg.errorlog = false;
     }
   }
+  else
+    state.scsi_counters_supported = 0;
   
   // disable autosave (set GLTSD bit)
   if (cfg.autosave==1){
@@ -2039,18 +3832,79 @@ static int SCSIDeviceScan(dev_config & cfg, dev_state & state, scsi_device * scs
   // tell user we are registering device
   PrintOut(LOG_INFO, "Device: %s, is SMART capable. Adding to \"monitor\" list.\n", device);
 
-  // TODO: Build file name for state file
-  if (!state_path_prefix.empty()) {
-    PrintOut(LOG_INFO, "Device: %s, persistence not yet supported for SCSI; ignoring -s option.\n", device);
+  // Update capability cache
+  if (cap_valid) {
+    if (state.modese_len)
+      cap.set(CAP_MODESENSE10, state.modese_len == 10);
+    // Device type is only needed to skip autodetection
+    const char * type = scsidev->get_dev_type();
+    cap.dev_type = (cfg.regtype.empty() && !strcmp(type, "scsi") ? type : "");
+
+    dev_capabilities & oldcap = capcache[cfg.regname];
+    if (!(   oldcap.dev_type == cap.dev_type && oldcap.key == cap.key
+          && oldcap.probed == cap.probed && oldcap.supported == cap.supported)) {
+      oldcap = cap;
+      capcache_dirty = true;
+    }
   }
-  // TODO: Build file name for attribute log file
-  if (!attrlog_path_prefix.empty()) {
-    PrintOut(LOG_INFO, "Device: %s, attribute log not yet supported for SCSI; ignoring -A option.\n", device);
+  else if (!capcache_path.empty() && capcache.erase(cfg.regname))
+    capcache_dirty = true;
+
+  // Format identity for file names: VENDOR_PRODUCT-SERIAL
+  char model[8+1+16+1] = "", serial[64+1] = "";
+  if (!state_path_prefix.empty() || state_store.is_open() || !attrlog_path_prefix.empty()) {
+    UINT8 inq[36];
+    if (!scsiStdInquiry(scsidev, inq, sizeof(inq))) {
+      format_scsi_string(model, inq + 8, 8);
+      int n = strlen(model);
+      model[n] = '_';
+      format_scsi_string(model + n + 1, inq + 16, 16);
+    }
+    UINT8 vpd[4+64];
+    if (!scsiInquiryVpd(scsidev, 0x80, vpd, sizeof(vpd)))
+      format_scsi_string(serial, vpd + 4, (vpd[3] < sizeof(vpd) - 4 ? vpd[3] : sizeof(vpd) - 4));
+    if (!*model || !*serial) {
+      PrintOut(LOG_INFO, "Device: %s, no serial number, state and attribute log files not supported.\n", device);
+      *model = 0;
+    }
   }
 
   // close file descriptor
   CloseDevice(scsidev, device);
 
+  // Read previous state from store, import state file if not found
+  if (*model && (!state_path_prefix.empty() || state_store.is_open())) {
+    persistent_dev_state saved_state;
+    bool state_read = false, state_imported = false;
+    cfg.state_key = strprintf("%s-%s.scsi", model, serial);
+    if (!state_path_prefix.empty())
+      cfg.state_file = strprintf("%s%s.state", state_path_prefix.c_str(), cfg.state_key.c_str());
+    if (state_store.is_open() && state_store.read(cfg.state_key.c_str(), saved_state)) {
+      PrintOut(LOG_INFO, "Device: %s, state read from %s\n", device, state_store.get_path());
+      state_read = true;
+    }
+    else if (!cfg.state_file.empty() && read_dev_state(cfg.state_file.c_str(), saved_state)) {
+      PrintOut(LOG_INFO, "Device: %s, state read from %s\n", device, cfg.state_file.c_str());
+      state_read = state_imported = true;
+    }
+
+    // Apply previous state, keep starting values of counters not saved
+    if (state_read) {
+      for (int i = 0; i < SCSI_NUM_COUNTERS; i++) {
+        if (saved_state.scsi_counters[i] < 0)
+          saved_state.scsi_counters[i] = state.scsi_counters[i];
+      }
+      static_cast<persistent_dev_state &>(state) = saved_state;
+      if (state_imported && state_store.is_open())
+        state.must_write = true;
+    }
+  }
+
+  // Build file name for attribute log file
+  if (*model && !attrlog_path_prefix.empty())
+    cfg.attrlog_file = strprintf("%s%s-%s.scsi.%s", attrlog_path_prefix.c_str(), model, serial,
+                                 (attrlog_columnar ? "attrlog" : "csv"));
+
   // Start self-test regex check now if time was not read from state file
   if (!cfg.test_regex.empty() && !state.scheduled_test_next_check)
     state.scheduled_test_next_check = time(0);
@@ -2083,6 +3937,7 @@ static void CheckSelfTestLogs(const dev_config & cfg, dev_state & state, int new
       MailWarning(cfg, state, 3, "Device: %s, Self-Test Log error count increased from %d to %d",
                    name, oldc, newc);
       state.must_write = true;
+      state.degrading = true;
     }
     else if (newc > 0 && oldh != newh) {
       // more recent error
@@ -2213,7 +4068,7 @@ static void PrintTestSchedule(const dev_config_vector & configs, dev_state_vecto
 
   PrintOut(LOG_INFO, "\nNext scheduled self tests (at most 5 of each type per device):\n");
 
-  // FixGlibcTimeZoneBug(); // done in PrintOut()
+  // FixGlibcTimeZoneBug(); // done in dateandtimezoneepoch()
   time_t now = time(0);
   char datenow[DATEANDEPOCHLEN], date[DATEANDEPOCHLEN];
   dateandtimezoneepoch(datenow, now);
@@ -2418,9 +4273,12 @@ static int DoATASelfTest(const dev_config & cfg, dev_state & state, ata_device *
     return retval;
   }
 
-  if (testtype != 'O')
+  if (testtype != 'O') {
     // Log next self-test execution status
     state.smartval.self_test_exec_status = 0xff;
+    // Read Self-Test Log on next check
+    state.selflog_exec_status = -1;
+  }
 
   PrintOut(LOG_INFO, "Device: %s, starting scheduled %sTest.\n", name, testname);
   return 0;
@@ -2438,15 +4296,18 @@ static void check_pending(const dev_config & cfg, dev_state & state,
     return;
 
   // No report if no sectors pending.
-  uint64_t rawval = ata_get_attr_raw_value(smartval.vendor_attributes[i], cfg.attribute_defs);
+  uint64_t rawval = cfg.attribute_decoder.get_raw_value(smartval.vendor_attributes[i]);
   if (rawval == 0)
     return;
 
   // If attribute is not reset, report only sector count increases.
-  uint64_t prev_rawval = ata_get_attr_raw_value(state.smartval.vendor_attributes[i], cfg.attribute_defs);
+  uint64_t prev_rawval = cfg.attribute_decoder.get_raw_value(state.smartval.vendor_attributes[i]);
   if (!(!increase_only || prev_rawval < rawval))
     return;
 
+  if (prev_rawval < rawval)
+    state.degrading = true;
+
   // Format message.
   std::string s = strprintf("Device: %s, %"PRId64" %s", cfg.name.c_str(), rawval, msg);
   if (prev_rawval > 0 && rawval != prev_rawval)
@@ -2529,6 +4390,7 @@ static void CheckTemperature(const dev_config & cfg, dev_state & state, unsigned
       cfg.name.c_str(), currtemp, cfg.tempcrit, fmt_temp(state.tempmin, buf), minchg, state.tempmax, maxchg);
     MailWarning(cfg, state, 12, "Device: %s, Temperature %d Celsius reached critical limit of %u Celsius (Min/Max %s%s/%u%s)\n",
       cfg.name.c_str(), currtemp, cfg.tempcrit, fmt_temp(state.tempmin, buf), minchg, state.tempmax, maxchg);
+    state.degrading = true;
   }
   else if (cfg.tempinfo && currtemp >= cfg.tempinfo) {
     PrintOut(LOG_INFO, "Device: %s, Temperature %u Celsius reached limit of %u Celsius (Min/Max %s%s/%u%s)\n",
@@ -2541,13 +4403,24 @@ static void check_attribute(const dev_config & cfg, dev_state & state,
                             const ata_smart_attribute & attr,
                             const ata_smart_attribute & prev,
                             int attridx,
-                            const ata_smart_threshold_entry * thresholds)
+                            const ata_smart_threshold_entry * thresholds,
+                            bool unchanged)
 {
   // Check attribute and threshold
-  ata_attr_state attrstate = ata_get_attr_state(attr, attridx, thresholds, cfg.attribute_defs);
+  unsigned char threshold = 0;
+  ata_attr_state attrstate = ata_get_attr_state(attr, attridx, thresholds, cfg.attribute_defs, &threshold);
   if (attrstate == ATTRSTATE_NON_EXISTING)
     return;
 
+  // Note degradation for adaptive check interval: Attribute failed or
+  // would reach threshold within 10 further decreases of the same size.
+  if (attrstate == ATTRSTATE_FAILED_NOW)
+    state.degrading = true;
+  else if (   attrstate >= ATTRSTATE_OK && threshold
+           && attr.id == prev.id && attr.current < prev.current
+           && attr.current - threshold <= 10 * (prev.current - attr.current))
+    state.degrading = true;
+
   // If requested, check for usage attributes that have failed.
   if (   cfg.usagefailed && attrstate == ATTRSTATE_FAILED_NOW
       && !cfg.monitor_attr_flags.is_set(attr.id, MONITOR_IGN_FAILUSE)) {
@@ -2557,6 +4430,10 @@ static void check_attribute(const dev_config & cfg, dev_state & state,
     state.must_write = true;
   }
 
+  // Return if attribute is byte-identical to previous value
+  if (unchanged)
+    return;
+
   // Return if we're not tracking this type of attribute
   bool prefail = !!ATTRIBUTE_FLAGS_PREFAILURE(attr.flags);
   if (!(   ( prefail && cfg.prefail)
@@ -2584,8 +4461,8 @@ static void check_attribute(const dev_config & cfg, dev_state & state,
   // Compare raw values if requested.
   bool rawchanged = false;
   if (cfg.monitor_attr_flags.is_set(attr.id, MONITOR_RAW)) {
-    if (   ata_get_attr_raw_value(attr, cfg.attribute_defs)
-        != ata_get_attr_raw_value(prev, cfg.attribute_defs))
+    if (   cfg.attribute_decoder.get_raw_value(attr)
+        != cfg.attribute_decoder.get_raw_value(prev)      )
       rawchanged = true;
   }
 
@@ -2634,6 +4511,94 @@ static void check_attribute(const dev_config & cfg, dev_state & state,
 }
 
 
+// Data read from an ATA device during one check cycle
+struct ata_check_snapshot
+{
+  int smart_status;                // ataSmartStatus2() result
+  bool smartval_read;              // true if SMART data was requested
+  bool smartval_ok;                // true if SMART data is valid
+  ata_device::io_buffer smartval_buf; // I/O buffer for SMART data
+  ata_smart_values & smartval;     // SMART data, read into smartval_buf
+  bool selflog_read;               // true if Self-Test Log was read
+  int selflog_errcnt;              // SelfTestErrorCount() result
+  int ata_error_count;             // Max of summary and extended error count
+
+  explicit ata_check_snapshot(ata_device * atadev)
+    : smart_status(-1), smartval_read(false), smartval_ok(false),
+      smartval_buf(atadev, sizeof(ata_smart_values)),
+      smartval(*(ata_smart_values *)smartval_buf.data()),
+      selflog_read(false), selflog_errcnt(-1), ata_error_count(-1)
+    { }
+};
+
+// Re-read the Self-Test Log at least this often even if the self-test
+// execution status did not change (test failed and another one passed
+// between two checks).
+const time_t SELFLOG_MAXAGE = 24*60*60;
+
+// Issue all commands needed by the configured checks back to back.
+// The Self-Test Log is only read if the self-test execution status
+// from the SMART data has changed since the last read.
+static void ReadATASnapshot(const dev_config & cfg, dev_state & state,
+                            ata_device * atadev, ata_check_snapshot & snap)
+{
+  const char * name = cfg.name.c_str();
+
+  if (cfg.smartcheck)
+    snap.smart_status = ataSmartStatus2(atadev);
+
+  if (   cfg.usagefailed || cfg.prefail || cfg.usage
+      || cfg.curr_pending_id || cfg.offl_pending_id
+      || cfg.tempdiff || cfg.tempinfo || cfg.tempcrit || cfg.selftest) {
+    snap.smartval_read = true;
+    snap.smartval_ok = !ataReadSmartValues(atadev, &snap.smartval);
+  }
+
+  if (cfg.selftest) {
+    time_t now = time(0);
+    if (!(   snap.smartval_ok
+          && state.selflog_exec_status == snap.smartval.self_test_exec_status
+          && (snap.smartval.self_test_exec_status >> 4) != 0xf
+          && now - state.selflog_read_time < SELFLOG_MAXAGE
+          && now >= state.selflog_read_time                          )) {
+      snap.selflog_read = true;
+      snap.selflog_errcnt = SelfTestErrorCount(atadev, name, cfg.fix_firmwarebug);
+      if (snap.selflog_errcnt >= 0 && snap.smartval_ok) {
+        state.selflog_exec_status = snap.smartval.self_test_exec_status;
+        state.selflog_read_time = now;
+      }
+      else
+        state.selflog_exec_status = -1;
+    }
+    else if (debugmode)
+      PrintOut(LOG_INFO, "Device: %s, self-test execution status unchanged, Self-Test Log not read\n", name);
+  }
+
+  if (cfg.errorlog || cfg.xerrorlog) {
+    int errcnt1 = -1, errcnt2 = -1;
+    if (cfg.xerrorlog) {
+      // Both logs use the same device error counter.  If count and index
+      // of the extended log are unchanged, so is the summary log.
+      int index = -1;
+      errcnt2 = read_ata_error_count(atadev, name, cfg.fix_firmwarebug, true, &index);
+      if (errcnt2 < 0)
+        index = -1;
+      if (   cfg.errorlog && state.errlog_count >= 0 && index >= 0
+          && errcnt2 == state.xerrlog_count && index == state.xerrlog_index) {
+        errcnt1 = state.errlog_count;
+        if (debugmode)
+          PrintOut(LOG_INFO, "Device: %s, Extended Comprehensive SMART Error Log unchanged, "
+                   "Summary SMART Error Log not read\n", name);
+      }
+      state.xerrlog_count = errcnt2;
+      state.xerrlog_index = index;
+    }
+    if (cfg.errorlog && errcnt1 < 0)
+      errcnt1 = state.errlog_count = read_ata_error_count(atadev, name, cfg.fix_firmwarebug, false);
+    snap.ata_error_count = (errcnt1 >= errcnt2 ? errcnt1 : errcnt2);
+  }
+}
+
 static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device * atadev, bool allow_selftests)
 {
   const char * name = cfg.name.c_str();
@@ -2646,29 +4611,33 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
   // perhaps the next time around we'll be able to open it.  ATAPI
   // cd/dvd devices will hang awaiting media if O_NONBLOCK is not
   // given (see linux cdrom driver).
-  if (!atadev->open()) {
+  bool reused;
+  if (!OpenDeviceForCheck(state, atadev, reused)) {
     PrintOut(LOG_INFO, "Device: %s, open() failed: %s\n", name, atadev->get_errmsg());
     MailWarning(cfg, state, 9, "Device: %s, unable to open device", name);
     return 1;
   } else if (debugmode)
-    PrintOut(LOG_INFO,"Device: %s, opened ATA device\n", name);
+    PrintOut(LOG_INFO,"Device: %s, %s ATA device\n", name, (reused ? "reusing open" : "opened"));
 
   // user may have requested (with the -n Directive) to leave the disk
   // alone if it is in idle or sleeping mode.  In this case check the
   // power mode and exit without check if needed
   if (cfg.powermode && !state.powermodefail) {
     int dontcheck=0, powermode=ataCheckPowerMode(atadev);
+    if (powermode == -1 && reused) {
+      // Command also fails if the kept open device was removed,
+      // reopen and retry before SLEEP mode is assumed
+      atadev->close();
+      reused = false;
+      if (!atadev->open()) {
+        state.keepopen_id.erase();
+        PrintOut(LOG_INFO, "Device: %s, open() failed: %s\n", name, atadev->get_errmsg());
+        MailWarning(cfg, state, 9, "Device: %s, unable to open device", name);
+        return 1;
+      }
+      powermode = ataCheckPowerMode(atadev);
+    }
     const char * mode = 0;
-    if (0 <= powermode && powermode < 0xff) {
-      // wait for possible spin up and check again
-      int powermode2;
-      sleep(5);
-      powermode2 = ataCheckPowerMode(atadev);
-      if (powermode2 > powermode)
-        PrintOut(LOG_INFO, "Device: %s, CHECK POWER STATUS spins up disk (0x%02x -> 0x%02x)\n", name, powermode, powermode2);
-      powermode = powermode2;
-    }
-        
     switch (powermode){
     case -1:
       // SLEEP
@@ -2704,7 +4673,7 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
     if (dontcheck){
       // skip at most powerskipmax checks
       if (!cfg.powerskipmax || state.powerskipcnt<cfg.powerskipmax) {
-        CloseDevice(atadev, name);
+        ReleaseDevice(state, atadev, name);
         if (!state.powerskipcnt && !cfg.powerquiet) // report first only and avoid waking up system disk
           PrintOut(LOG_INFO, "Device: %s, is in %s mode, suspending checks\n", name, mode);
         state.powerskipcnt++;
@@ -2725,9 +4694,22 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
     }
   }
 
+  // Disk is not in standby mode (or '-n' limit reached), check identity
+  // of kept open device
+  if (!ValidateDeviceIdentity(state, atadev, name, reused)) {
+    PrintOut(LOG_INFO, "Device: %s, open() failed: %s\n", name, atadev->get_errmsg());
+    MailWarning(cfg, state, 9, "Device: %s, unable to open device", name);
+    return 1;
+  }
+
+  // Read everything needed for this check in one go
+  ata_check_snapshot snap(atadev);
+  ReadATASnapshot(cfg, state, atadev, snap);
+
   // check smart status
   if (cfg.smartcheck) {
-    int status=ataSmartStatus2(atadev);
+    int status = snap.smart_status;
+    state.smart_status = (status==0 ? 1 : status==1 ? 0 : -1);
     if (status==-1){
       PrintOut(LOG_INFO,"Device: %s, not capable of SMART self-check\n",name);
       MailWarning(cfg, state, 5, "Device: %s, not capable of SMART self-check", name);
@@ -2736,23 +4718,20 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
     else if (status==1){
       PrintOut(LOG_CRIT, "Device: %s, FAILED SMART self-check. BACK UP DATA NOW!\n", name);
       MailWarning(cfg, state, 1, "Device: %s, FAILED SMART self-check. BACK UP DATA NOW!", name);
+      state.degrading = true;
       state.must_write = true;
     }
   }
   
   // Check everything that depends upon SMART Data (eg, Attribute values)
-  if (   cfg.usagefailed || cfg.prefail || cfg.usage
-      || cfg.curr_pending_id || cfg.offl_pending_id
-      || cfg.tempdiff || cfg.tempinfo || cfg.tempcrit || cfg.selftest) {
-
-    // Read current attribute values.
-    ata_smart_values curval;
-    if (ataReadSmartValues(atadev, &curval)){
+  if (snap.smartval_read) {
+    if (!snap.smartval_ok) {
       PrintOut(LOG_CRIT, "Device: %s, failed to read SMART Attribute Data\n", name);
       MailWarning(cfg, state, 6, "Device: %s, failed to read SMART Attribute Data", name);
       state.must_write = true;
     }
     else {
+      const ata_smart_values & curval = snap.smartval;
       // look for current or offline pending sectors
       if (cfg.curr_pending_id)
         check_pending(cfg, state, cfg.curr_pending_id, cfg.curr_pending_incr, curval, 10,
@@ -2770,12 +4749,16 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
 
       if (cfg.usagefailed || cfg.prefail || cfg.usage) {
 
+        // Compare whole table first, usually nothing has changed
+        bool allsame = !memcmp(curval.vendor_attributes, state.smartval.vendor_attributes,
+                               sizeof(curval.vendor_attributes));
+
         // look for failed usage attributes, or track usage or prefail attributes
         for (int i = 0; i < NUMBER_ATA_SMART_ATTRIBUTES; i++) {
-          check_attribute(cfg, state,
-                          curval.vendor_attributes[i],
-                          state.smartval.vendor_attributes[i],
-                          i, state.smartthres.thres_entries);
+          const ata_smart_attribute & attr = curval.vendor_attributes[i];
+          const ata_smart_attribute & prev = state.smartval.vendor_attributes[i];
+          check_attribute(cfg, state, attr, prev, i, state.smartthres.thres_entries,
+                          (allsame || !memcmp(&attr, &prev, sizeof(attr))));
         }
 
         if (cfg.selftest) {
@@ -2792,20 +4775,14 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
   }
   
   // check if number of selftest errors has increased (note: may also DECREASE)
-  if (cfg.selftest)
-    CheckSelfTestLogs(cfg, state, SelfTestErrorCount(atadev, name, cfg.fix_firmwarebug));
+  if (snap.selflog_read)
+    CheckSelfTestLogs(cfg, state, snap.selflog_errcnt);
 
   // check if number of ATA errors has increased
   if (cfg.errorlog || cfg.xerrorlog) {
 
-    int errcnt1 = -1, errcnt2 = -1;
-    if (cfg.errorlog)
-      errcnt1 = read_ata_error_count(atadev, name, cfg.fix_firmwarebug, false);
-    if (cfg.xerrorlog)
-      errcnt2 = read_ata_error_count(atadev, name, cfg.fix_firmwarebug, true);
-
     // new number of errors is max of both logs
-    int newc = (errcnt1 >= errcnt2 ? errcnt1 : errcnt2);
+    int newc = snap.ata_error_count;
 
     // did command fail?
     if (newc<0)
@@ -2820,6 +4797,7 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
       MailWarning(cfg, state, 4, "Device: %s, ATA error count increased from %d to %d",
                    name, oldc, newc);
       state.must_write = true;
+      state.degrading = true;
     }
 
     if (newc>=0)
@@ -2829,14 +4807,17 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
   // if the user has asked, and device is capable (or we're not yet
   // sure) check whether a self test should be done now.
   if (allow_selftests && !cfg.test_regex.empty()) {
+    // localtime() and TZ handling are not reentrant
+    parallel_jobs::lock();
     char testtype = next_scheduled_test(cfg, state, false/*!scsi*/);
+    parallel_jobs::unlock();
     if (testtype)
       DoATASelfTest(cfg, state, atadev, testtype);
   }
 
   // Don't leave device open -- the OS/user may want to access it
-  // before the next smartd cycle!
-  CloseDevice(atadev, name);
+  // before the next smartd cycle!  Unless requested by '-k N'.
+  ReleaseDevice(state, atadev, name);
 
   // Copy ATA attribute values to persistent state
   state.update_persistent_state();
@@ -2844,6 +4825,44 @@ static int ATACheckDevice(const dev_config & cfg, dev_state & state, ata_device
   return 0;
 }
 
+// Read the next supported SCSI error counter and report an increase.
+// Only one counter is read per check cycle to keep the cost of a
+// check flat.
+static void CheckSCSICounters(const dev_config & cfg, dev_state & state, scsi_device * scsidev)
+{
+  const char * name = cfg.name.c_str();
+  int i = state.scsi_counter_next;
+  while (!(state.scsi_counters_supported & (1 << i)))
+    i = (i + 1) % SCSI_NUM_COUNTERS;
+  state.scsi_counter_next = (i + 1) % SCSI_NUM_COUNTERS;
+
+  const scsi_counter_info & ci = scsi_counters_info[i];
+  int64_t newc = ReadSCSICounter(scsidev, i);
+  if (newc < 0) {
+    PrintOut(LOG_INFO, "Device: %s, %s read failed\n", name, ci.desc);
+    return;
+  }
+  if (debugmode)
+    PrintOut(LOG_INFO, "Device: %s, %s: %"PRId64"\n", name, ci.desc, newc);
+
+  int64_t oldc = state.scsi_counters[i];
+  if (newc == oldc)
+    return;
+  if (0 <= oldc && oldc < newc) {
+    PrintOut(LOG_CRIT, "Device: %s, %s increased from %"PRId64" to %"PRId64"\n",
+             name, ci.desc, oldc, newc);
+    MailWarning(cfg, state, ci.mailtype, "Device: %s, %s increased from %"PRId64" to %"PRId64,
+                name, ci.desc, oldc, newc);
+    state.degrading = true;
+  }
+  else if (0 <= oldc)
+    // Log page or defect list may have been reset
+    PrintOut(LOG_INFO, "Device: %s, %s decreased from %"PRId64" to %"PRId64"\n",
+             name, ci.desc, oldc, newc);
+  state.scsi_counters[i] = newc;
+  state.must_write = true;
+}
+
 static int SCSICheckDevice(const dev_config & cfg, dev_state & state, scsi_device * scsidev, bool allow_selftests)
 {
     UINT8 asc, ascq;
@@ -2858,12 +4877,14 @@ static int SCSICheckDevice(const dev_config & cfg, dev_state & state, scsi_devic
 
     // if we can't open device, fail gracefully rather than hard --
     // perhaps the next time around we'll be able to open it
-    if (!scsidev->open()) {
+    bool reused;
+    if (!(   OpenDeviceForCheck(state, scsidev, reused)
+          && ValidateDeviceIdentity(state, scsidev, name, reused))) {
       PrintOut(LOG_INFO, "Device: %s, open() failed: %s\n", name, scsidev->get_errmsg());
       MailWarning(cfg, state, 9, "Device: %s, unable to open device", name);
       return 1;
     } else if (debugmode)
-        PrintOut(LOG_INFO,"Device: %s, opened SCSI device\n", name);
+        PrintOut(LOG_INFO,"Device: %s, %s SCSI device\n", name, (reused ? "reusing open" : "opened"));
     currenttemp = 0;
     asc = 0;
     ascq = 0;
@@ -2874,13 +4895,17 @@ static int SCSICheckDevice(const dev_config & cfg, dev_state & state, scsi_devic
                       name);
             MailWarning(cfg, state, 6, "Device: %s, failed to read SMART values", name);
             state.SuppressReport = 1;
+            state.smart_status = -1;
         }
+        else
+            state.smart_status = (scsiGetIEString(asc, ascq) ? 0 : 1);
     }
     if (asc > 0) {
         cp = scsiGetIEString(asc, ascq);
         if (cp) {
             PrintOut(LOG_CRIT, "Device: %s, SMART Failure: %s\n", name, cp);
             MailWarning(cfg, state, 1,"Device: %s, SMART Failure: %s", name, cp);
+            state.degrading = true;
         } else if (debugmode)
             PrintOut(LOG_INFO,"Device: %s, non-SMART asc,ascq: %d,%d\n",
                      name, (int)asc, (int)ascq);  
@@ -2894,29 +4919,306 @@ static int SCSICheckDevice(const dev_config & cfg, dev_state & state, scsi_devic
     // check if number of selftest errors has increased (note: may also DECREASE)
     if (cfg.selftest)
       CheckSelfTestLogs(cfg, state, scsiCountFailedSelfTests(scsidev, 0));
+
+    // check if grown defects or uncorrected errors have increased
+    if (cfg.errorlog && state.scsi_counters_supported)
+      CheckSCSICounters(cfg, state, scsidev);
     
     if (allow_selftests && !cfg.test_regex.empty()) {
+      parallel_jobs::lock();
       char testtype = next_scheduled_test(cfg, state, true/*scsi*/);
+      parallel_jobs::unlock();
       if (testtype)
         DoSCSISelfTest(cfg, state, scsidev, testtype);
     }
-    CloseDevice(scsidev, name);
+    ReleaseDevice(state, scsidev, name);
     return 0;
 }
 
-// Checks the SMART status of all ATA and SCSI devices
+// Checks the SMART status of one ATA or SCSI device
+static void CheckDevice(const dev_config & cfg, dev_state & state,
+                        smart_device * dev, bool allow_selftests)
+{
+  state.degrading = false;
+  if (dev->is_ata())
+    ATACheckDevice(cfg, state, dev->to_ata(), allow_selftests);
+  else if (dev->is_scsi())
+    SCSICheckDevice(cfg, state, dev->to_scsi(), allow_selftests);
+  state.last_check = time(0);
+}
+
+// Return a name which identifies the controller or HBA of a device.
+// Devices behind the same RAID controller ('-d TYPE,N') share the
+// device name, on Linux the SCSI host is obtained from sysfs.
+static std::string get_controller_key(const smart_device * dev)
+{
+  std::string key = dev->get_dev_name();
+#ifdef __linux__
+  char path[PATH_MAX+1];
+  if (!realpath(key.c_str(), path))
+    return key;
+  const char * base = strrchr(path, '/');
+  if (!base || strncmp(path, "/dev/", 5))
+    return key;
+  std::string sysdev = strprintf("/sys/block/%s/device", base+1);
+  if (!realpath(sysdev.c_str(), path))
+    return key;
+  // "/sys/devices/.../hostN/targetN:N:N/N:N:N:N"
+  const char * host = strstr(path, "/host");
+  if (!host)
+    return key;
+  int n1 = -1;
+  unsigned hostno = 0;
+  sscanf(host, "/host%u/%n", &hostno, &n1);
+  if (n1 < 0)
+    return key;
+  key.assign(path, host + n1 - path);
+#endif
+  return key;
+}
+
+// Assign a number to the controller of each device, for use as job
+// group in parallel_jobs::run().  Missing devices get a number of their own.
+static void get_controller_numbers(const smart_device_list & devices,
+                                   std::vector<int> & ctrlnums)
+{
+  unsigned numdev = devices.size();
+  ctrlnums.assign(numdev, 0);
+  std::map<std::string, int> ctrls;
+  for (unsigned i = 0; i < numdev; i++) {
+    const smart_device * dev = devices.at(i);
+    std::string key = (dev ? get_controller_key(dev) : strprintf("[%u]", i));
+    std::map<std::string, int>::const_iterator it = ctrls.find(key);
+    if (it == ctrls.end()) {
+      int n = ctrls.size();
+      ctrls[key] = n;
+      ctrlnums[i] = n;
+    }
+    else
+      ctrlnums[i] = it->second;
+  }
+}
+
+// Print deferred output of one device, send mail warnings if
+// device config and state are specified.
+static void print_deferred_output(const deferred_output_vector & devout,
+                                  const dev_config * cfg, dev_state * state)
+{
+  for (unsigned j = 0; j < devout.size(); j++) {
+    const deferred_output & out = devout[j];
+    switch (out.type) {
+      case deferred_output::PRINT_OUT:
+        PrintOut(out.arg, "%s", out.text.c_str());
+        break;
+      case deferred_output::POUT:
+        pout("%s", out.text.c_str());
+        break;
+      case deferred_output::MAIL_WARNING:
+        if (cfg)
+          MailWarning(*cfg, *state, out.arg, "%s", out.text.c_str());
+        break;
+    }
+  }
+}
+
+// Runs device checks in worker threads
+class check_devices_jobs
+: public parallel_jobs
+{
+public:
+  check_devices_jobs(const dev_config_vector & configs, dev_state_vector & states,
+                     smart_device_list & devices, const std::vector<unsigned> & due,
+                     bool allow_selftests)
+    : m_configs(configs), m_states(states), m_devices(devices),
+      m_due(due), m_allow_selftests(allow_selftests)
+    { }
+
+  virtual void job(unsigned index)
+    {
+      unsigned i = m_due.at(index);
+      CheckDevice(m_configs.at(i), m_states.at(i),
+                  m_devices.at(i), m_allow_selftests);
+    }
+
+private:
+  const dev_config_vector & m_configs;
+  dev_state_vector & m_states;
+  smart_device_list & m_devices;
+  const std::vector<unsigned> & m_due;
+  bool m_allow_selftests;
+};
+
+// Set time of next check of a device.  An adaptive check interval is
+// set to its minimum if the device shows signs of degradation, it is
+// doubled up to its maximum while checks are skipped due to idle or
+// standby mode ('-n'), and it returns to the '-i' interval otherwise.
+static void schedule_next_check(const dev_config & cfg, dev_state & state, time_t now)
+{
+  int base = (cfg.checktime ? cfg.checktime : checktime);
+  int interval = base;
+
+  if (cfg.checktime_max) {
+    int min = cfg.checktime_min, max = cfg.checktime_max;
+    if (min < 0) {
+      // Default range
+      min = (base / 4 >= 10 ? base / 4 : 10);
+      max = (base <= INT_MAX / 4 ? base * 4 : INT_MAX);
+    }
+    // Scheduled self-tests are found only once per check
+    if (!cfg.test_regex.empty() && max > 3600)
+      max = (base > 3600 ? base : 3600);
+    if (max < min)
+      max = min;
+
+    int cur = (state.cur_checktime ? state.cur_checktime : base);
+    const char * reason;
+    if (state.degrading) {
+      interval = min; reason = "signs of degradation";
+    }
+    else if (state.powerskipcnt) {
+      interval = (cur <= max / 2 ? cur * 2 : max); reason = "idle or standby mode";
+    }
+    else if (cur < base) {
+      interval = (cur <= base / 2 ? cur * 2 : base); reason = "no signs of degradation";
+    }
+    else {
+      interval = base; reason = "device active";
+    }
+    if (interval < min)
+      interval = min;
+    else if (interval > max)
+      interval = max;
+
+    if (state.cur_checktime && interval != state.cur_checktime)
+      PrintOut(LOG_INFO, "Device: %s, check interval changed from %d to %d seconds (%s)\n",
+               cfg.name.c_str(), state.cur_checktime, interval, reason);
+  }
+  state.cur_checktime = interval;
+
+  // Keep checks aligned to the schedule unless checked early
+  time_t next = (state.next_check && state.next_check <= now ? state.next_check : now);
+  next += interval;
+  if (next <= now)
+    next += ((now - next) / interval + 1) * interval;
+  state.next_check = next;
+}
+
+// Return time of next check of any device.  Resets check times
+// which are in the far future due to a system clock adjustment.
+static time_t get_next_check_time(dev_state_vector & states)
+{
+  time_t now = time(0), next = now + checktime;
+  bool reset = false;
+  for (unsigned i = 0; i < states.size(); i++) {
+    dev_state & state = states[i];
+    if (state.next_check > now + state.cur_checktime) {
+      state.next_check = now + state.cur_checktime;
+      reset = true;
+    }
+    if (i == 0 || state.next_check < next)
+      next = state.next_check;
+  }
+  if (reset)
+    PrintOut(LOG_CRIT, "System clock time adjusted to the past. Resetting next wakeup time.\n");
+  return next;
+}
+
+// Checks the SMART status of all ATA and SCSI devices which are due,
+// or of all devices if 'check_all' is set.  Schedules next checks.
 static void CheckDevicesOnce(const dev_config_vector & configs, dev_state_vector & states,
-                             smart_device_list & devices, bool allow_selftests)
+                             smart_device_list & devices, bool allow_selftests, bool check_all)
 {
-  for (unsigned i = 0; i < configs.size(); i++) {
-    const dev_config & cfg = configs.at(i);
-    dev_state & state = states.at(i);
-    smart_device * dev = devices.at(i);
-    if (dev->is_ata())
-      ATACheckDevice(cfg, state, dev->to_ata(), allow_selftests);
-    else if (dev->is_scsi())
-      SCSICheckDevice(cfg, state, dev->to_scsi(), allow_selftests);
+  time_t now = time(0);
+  std::vector<unsigned> due;
+  unsigned i;
+  for (i = 0; i < configs.size(); i++) {
+    states[i].checked = (check_all || states[i].next_check <= now);
+    if (states[i].checked)
+      due.push_back(i);
+  }
+  unsigned numdue = due.size();
+
+  if (max_check_jobs <= 1 || numdue <= 1) {
+    for (i = 0; i < numdue; i++)
+      CheckDevice(configs.at(due[i]), states.at(due[i]), devices.at(due[i]), allow_selftests);
+  }
+  else {
+    // Assign devices to controllers
+    std::vector<int> allctrlnums, ctrlnums(numdue);
+    get_controller_numbers(devices, allctrlnums);
+    for (i = 0; i < numdue; i++)
+      ctrlnums[i] = allctrlnums[due[i]];
+
+    // Check devices in parallel, keep output of each device
+    std::vector<deferred_output_vector> outputs(numdue);
+    deferred_outputs = &outputs;
+    try {
+      check_devices_jobs jobs(configs, states, devices, due, allow_selftests);
+      jobs.run(numdue, max_check_jobs, &ctrlnums[0], max_check_jobs_per_ctrl);
+    }
+    catch (...) {
+      deferred_outputs = 0;
+      throw;
+    }
+    deferred_outputs = 0;
+
+    // Print output and send mail warnings in device order
+    for (i = 0; i < numdue; i++)
+      print_deferred_output(outputs[i], &configs.at(due[i]), &states.at(due[i]));
+  }
+
+  for (i = 0; i < numdue; i++)
+    schedule_next_check(configs.at(due[i]), states.at(due[i]), now);
+}
+
+// Opens devices with autodetection in worker threads
+class open_devices_jobs
+: public parallel_jobs
+{
+public:
+  open_devices_jobs(smart_device_list & devices, std::vector<smart_device *> & opened)
+    : m_devices(devices), m_opened(opened)
+    { }
+
+  virtual void job(unsigned index)
+    {
+      // autodetect_open() may delete the device or return a new
+      // device which takes ownership
+      smart_device * dev = m_devices.release(index);
+      if (dev)
+        m_opened[index] = dev->autodetect_open();
+    }
+
+private:
+  smart_device_list & m_devices;
+  std::vector<smart_device *> & m_opened;
+};
+
+// Open devices with autodetect support, may return 'better' devices.
+// Devices are moved from 'devices' to 'opened'.  Devices are opened
+// in parallel if '-j N' is specified, output is printed in device order.
+static void OpenDevices(smart_device_list & devices, std::vector<smart_device *> & opened)
+{
+  unsigned numdev = devices.size();
+  opened.assign(numdev, (smart_device *)0);
+
+  std::vector<int> ctrlnums;
+  get_controller_numbers(devices, ctrlnums);
+
+  std::vector<deferred_output_vector> outputs(numdev);
+  deferred_outputs = &outputs;
+  try {
+    open_devices_jobs jobs(devices, opened);
+    jobs.run(numdev, max_check_jobs, (numdev ? &ctrlnums[0] : 0), max_check_jobs_per_ctrl);
   }
+  catch (...) {
+    deferred_outputs = 0;
+    throw;
+  }
+  deferred_outputs = 0;
+
+  for (unsigned i = 0; i < numdev; i++)
+    print_deferred_output(outputs[i], 0, 0);
 }
 
 // Set if Initialize() was called
@@ -2931,6 +5233,12 @@ void Initialize(time_t *wakeuptime){
   // write PID file
   if (!debugmode)
     WritePidFile();
+
+#ifndef _WIN32
+  // open query socket, not inherited from parent due to DaemonInit()
+  if (!query_socket_path.empty() && !query_open())
+    EXIT(EXIT_BADCMD);
+#endif
   
   // install signal handlers.  On Solaris, can't use signal() because
   // it resets the handler to SIG_DFL after each call.  So use sigset()
@@ -2951,10 +5259,8 @@ void Initialize(time_t *wakeuptime){
     SIGNALFN(SIGHUP, SIG_IGN);
   if (SIGNALFN(SIGUSR1, USR1handler)==SIG_IGN)
     SIGNALFN(SIGUSR1, SIG_IGN);
-#ifdef _WIN32
   if (SIGNALFN(SIGUSR2, USR2handler)==SIG_IGN)
     SIGNALFN(SIGUSR2, SIG_IGN);
-#endif
 
   // initialize wakeup time to CURRENT time
   *wakeuptime=time(NULL);
@@ -2962,60 +5268,429 @@ void Initialize(time_t *wakeuptime){
   return;
 }
 
-#ifdef _WIN32
-// Toggle debug mode implemented for native windows only
-// (there is no easy way to reopen tty on *nix)
-static void ToggleDebugMode()
+#ifdef _WIN32
+// Toggle debug mode implemented for native windows only
+// (there is no easy way to reopen tty on *nix)
+static void ToggleDebugMode()
+{
+  if (!debugmode) {
+    PrintOut(LOG_INFO,"Signal USR2 - enabling debug mode\n");
+    if (!daemon_enable_console("smartd [Debug]")) {
+      debugmode = 1;
+      daemon_signal(SIGINT, HUPhandler);
+      PrintOut(LOG_INFO,"smartd debug mode enabled, PID=%d\n", getpid());
+    }
+    else
+      PrintOut(LOG_INFO,"enable console failed\n");
+  }
+  else if (debugmode == 1) {
+    daemon_disable_console();
+    debugmode = 0;
+    daemon_signal(SIGINT, sighandler);
+    PrintOut(LOG_INFO,"Signal USR2 - debug mode disabled\n");
+  }
+  else
+    PrintOut(LOG_INFO,"Signal USR2 - debug mode %d not changed\n", debugmode);
+}
+#endif
+
+#ifndef _WIN32
+// Log command statistics of all devices (SIGUSR2)
+static void log_cmd_stats(const dev_config_vector & configs,
+                          const smart_device_list & devices)
+{
+  typedef smart_device::cmd_stats_entry entry;
+  std::string limits;
+  for (int i = 0; i < entry::num_buckets - 1; i++)
+    limits += strprintf("%s%g", (i ? "/" : ""), entry::bucket_limit(i) / 1000.0);
+  PrintOut(LOG_INFO, "Signal USR2 - logging command statistics "
+           "(histogram limits %s ms)\n", limits.c_str());
+
+  for (unsigned i = 0; i < devices.size(); i++) {
+    const smart_device * dev = devices.at(i);
+    const smart_device::cmd_stats_map & stats = dev->get_cmd_stats();
+    for (smart_device::cmd_stats_map::const_iterator it = stats.begin();
+         it != stats.end(); ++it) {
+      const entry & e = it->second;
+      std::string opcode = strprintf("%02x", it->first >> 8);
+      if (it->first & 0xff)
+        opcode += strprintf("/%02x", it->first & 0xff);
+      std::string hist;
+      for (int j = 0; j < entry::num_buckets; j++)
+        hist += strprintf("%s%u", (j ? "/" : ""), e.hist[j]);
+      PrintOut(LOG_INFO, "Device: %s, command %s %s: count %u, errors %u, timeouts %u, "
+               "bytes %"PRIu64", avg %.2f ms, max %.2f ms, histogram %s\n",
+               configs.at(i).name.c_str(), opcode.c_str(), dev->get_cmd_name(it->first).c_str(),
+               e.count, e.errors, e.timeouts, e.bytes,
+               e.total_us / 1000.0 / e.count, e.max_us / 1000.0, hist.c_str());
+    }
+  }
+}
+#endif
+
+#ifndef _WIN32
+/////////////////////////////////////////////////////////////////////////////
+// Query socket ('-Q PATH')
+//
+// Local clients connect to a UNIX stream socket and send a single line:
+//   list          - names and types of monitored devices
+//   status [NAME] - state of all or one device as recorded by the last check
+//   check NAME    - check device now, reply after the check is finished
+// Each request is answered by one line of JSON, then the connection is
+// closed.  Requests are served while smartd sleeps between checks, so
+// served data never causes additional device I/O except for 'check'.
+
+// Listening socket, -1 if not open
+static int query_socket = -1;
+
+// Clients waiting for the result of a 'check' request
+struct query_client
+{
+  int fd;               // Connection
+  std::string name;     // Device name
+};
+
+static std::vector<query_client> query_pending;
+
+// Create listening socket, an old socket file is replaced.
+// Any other file is left alone.
+static bool query_open()
+{
+  sockaddr_un addr; memset(&addr, 0, sizeof(addr));
+  if (query_socket_path.size() >= sizeof(addr.sun_path)) {
+    PrintOut(LOG_CRIT, "Query socket path %s too long\n", query_socket_path.c_str());
+    return false;
+  }
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, query_socket_path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    PrintOut(LOG_CRIT, "Query socket: socket(): %s\n", strerror(errno));
+    return false;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  struct stat st;
+  if (!lstat(addr.sun_path, &st)) {
+    if (!S_ISSOCK(st.st_mode)) {
+      PrintOut(LOG_CRIT, "Query socket %s: exists and is not a socket\n", addr.sun_path);
+      close(fd);
+      return false;
+    }
+    unlink(addr.sun_path);
+  }
+  if (bind(fd, (sockaddr *)&addr, sizeof(addr)) || listen(fd, 16)) {
+    PrintOut(LOG_CRIT, "Query socket %s: %s\n", addr.sun_path, strerror(errno));
+    close(fd);
+    return false;
+  }
+  query_socket = fd;
+  PrintOut(LOG_INFO, "Listening for queries on %s\n", addr.sun_path);
+  return true;
+}
+
+// Send reply and close connection.  Wait at most one second until
+// the client has read the reply, then drop the client.
+static void query_reply(int fd, const json & reply)
+{
+  std::string text;
+  reply.format(text, false);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef MSG_NOSIGNAL
+  const int flags = MSG_NOSIGNAL;
+#else
+  const int flags = 0;
+  void (*oldpipe)(int) = signal(SIGPIPE, SIG_IGN);
+#endif
+
+  uint64_t deadline = get_timer_usec() + 1000000;
+  for (unsigned sent = 0; sent < text.size(); ) {
+    int n = send(fd, text.data() + sent, text.size() - sent, flags);
+    if (n > 0) {
+      sent += n;
+      continue;
+    }
+    if (!(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)))
+      break;
+    uint64_t now = get_timer_usec();
+    pollfd pfd; pfd.fd = fd; pfd.events = POLLOUT; pfd.revents = 0;
+    if (now >= deadline || poll(&pfd, 1, (int)((deadline - now + 999) / 1000)) == 0) {
+      if (debugmode)
+        PrintOut(LOG_INFO, "Query client too slow, %u of %u bytes sent, dropped\n",
+                 sent, (unsigned)text.size());
+      break;
+    }
+  }
+
+#ifndef MSG_NOSIGNAL
+  signal(SIGPIPE, oldpipe);
+#endif
+  close(fd);
+}
+
+static void query_error(int fd, const char * msg)
+{
+  json reply;
+  reply["error"] = msg;
+  query_reply(fd, reply);
+}
+
+// Close socket, answer pending requests, remove socket file
+static void query_close()
+{
+  if (query_socket < 0)
+    return;
+  for (unsigned i = 0; i < query_pending.size(); i++)
+    query_error(query_pending[i].fd, "smartd is exiting");
+  query_pending.clear();
+  close(query_socket);
+  query_socket = -1;
+  unlink(query_socket_path.c_str());
+}
+
+// Add state of device recorded by the last check
+static void query_device_status(json & j, const dev_config & cfg, const dev_state & state,
+                                const smart_device * dev)
+{
+  j["name"] = cfg.name;
+  j["type"] = dev->get_dev_type();
+  j["protocol"] = (dev->is_ata() ? "ATA" : "SCSI");
+  if (state.last_check)
+    j["last_check"] = (int64_t)state.last_check;
+  if (state.next_check)
+    j["next_check"] = (int64_t)state.next_check;
+  if (state.powerskipcnt)
+    j["skipped_checks"] = state.powerskipcnt;
+
+  if (state.smart_status >= 0)
+    j["smart_status"]["passed"] = !!state.smart_status;
+  if (state.temperature && state.temperature != 255) {
+    j["temperature"]["current"] = state.temperature;
+    if (state.tempmin)
+      j["temperature"]["min"] = state.tempmin;
+    if (state.tempmax)
+      j["temperature"]["max"] = state.tempmax;
+  }
+  if (cfg.selftest) {
+    j["self_test"]["error_count"] = state.selflogcount;
+    if (state.selflogcount)
+      j["self_test"]["last_error_hours"] = state.selfloghour;
+  }
+  if (!dev->is_ata()) {
+    if (cfg.errorlog) {
+      for (int i = 0; i < SCSI_NUM_COUNTERS; i++) {
+        if (state.scsi_counters[i] >= 0)
+          j["scsi_error_counters"][scsi_counters_info[i].name] = state.scsi_counters[i];
+      }
+    }
+    return;
+  }
+
+  if (cfg.selftest)
+    j["self_test"]["status"] = state.smartval.self_test_exec_status;
+  if (cfg.errorlog || cfg.xerrorlog)
+    j["ata_error_count"] = state.ataerrorcount;
+
+  json & jt = j["ata_smart_attributes"];
+  jt.set_type(json::nt_array);
+  for (int i = 0; i < NUMBER_ATA_SMART_ATTRIBUTES; i++) {
+    const ata_smart_attribute & attr = state.smartval.vendor_attributes[i];
+    if (!attr.id)
+      continue;
+    json & ja = jt[jt.size()];
+    ja["id"] = attr.id;
+    ja["value"] = attr.current;
+    ja["worst"] = attr.worst;
+    if (state.smartthres.thres_entries[i].id == attr.id)
+      ja["thresh"] = state.smartthres.thres_entries[i].threshold;
+    ja["raw"] = cfg.attribute_decoder.get_raw_value(attr);
+  }
+}
+
+static int query_find_device(const dev_config_vector & configs, const std::string & name)
+{
+  for (unsigned i = 0; i < configs.size(); i++) {
+    if (configs[i].name == name)
+      return i;
+  }
+  return -1;
+}
+
+// Read request line, wait at most one second for the whole line,
+// a slow client must not block the device checks
+static bool query_read_line(int fd, std::string & line)
 {
-  if (!debugmode) {
-    PrintOut(LOG_INFO,"Signal USR2 - enabling debug mode\n");
-    if (!daemon_enable_console("smartd [Debug]")) {
-      debugmode = 1;
-      daemon_signal(SIGINT, HUPhandler);
-      PrintOut(LOG_INFO,"smartd debug mode enabled, PID=%d\n", getpid());
+  uint64_t deadline = get_timer_usec() + 1000000;
+  for (;;) {
+    uint64_t now = get_timer_usec();
+    if (now >= deadline)
+      return false;
+    pollfd pfd; pfd.fd = fd; pfd.events = POLLIN; pfd.revents = 0;
+    if (poll(&pfd, 1, (int)((deadline - now + 999) / 1000)) <= 0)
+      return false;
+    char buf[256];
+    int n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+      return !line.empty();
+    line.append(buf, n);
+    std::string::size_type nl = line.find('\n');
+    if (nl != std::string::npos) {
+      line.erase(nl);
+      if (!line.empty() && line[line.size()-1] == '\r')
+        line.erase(line.size()-1);
+      return true;
     }
-    else
-      PrintOut(LOG_INFO,"enable console failed\n");
+    if (line.size() > 1024)
+      return false;
   }
-  else if (debugmode == 1) {
-    daemon_disable_console();
-    debugmode = 0;
-    daemon_signal(SIGINT, sighandler);
-    PrintOut(LOG_INFO,"Signal USR2 - debug mode disabled\n");
+}
+
+// Accept and serve one request.  Returns true if a device check
+// was requested.
+static bool query_serve(const dev_config_vector & configs, dev_state_vector & states,
+                        const smart_device_list & devices)
+{
+  int fd = accept(query_socket, 0, 0);
+  if (fd < 0)
+    return false;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  std::string line;
+  if (!query_read_line(fd, line)) {
+    close(fd);
+    return false;
+  }
+  std::string cmd = line.substr(0, line.find(' '));
+  std::string arg = (line.size() > cmd.size() ? line.substr(cmd.size() + 1) : "");
+
+  if (cmd == "list" && arg.empty()) {
+    json reply;
+    json & jd = reply["devices"];
+    jd.set_type(json::nt_array);
+    for (unsigned i = 0; i < configs.size(); i++) {
+      jd[i]["name"] = configs[i].name;
+      jd[i]["type"] = devices.at(i)->get_dev_type();
+    }
+    query_reply(fd, reply);
+  }
+  else if (cmd == "status") {
+    json reply;
+    if (arg.empty()) {
+      json & jd = reply["devices"];
+      jd.set_type(json::nt_array);
+      for (unsigned i = 0; i < configs.size(); i++)
+        query_device_status(jd[i], configs[i], states[i], devices.at(i));
+    }
+    else {
+      int i = query_find_device(configs, arg);
+      if (i < 0) {
+        query_error(fd, "unknown device");
+        return false;
+      }
+      query_device_status(reply, configs[i], states[i], devices.at(i));
+    }
+    query_reply(fd, reply);
+  }
+  else if (cmd == "check" && !arg.empty()) {
+    int i = query_find_device(configs, arg);
+    if (i < 0) {
+      query_error(fd, "unknown device");
+      return false;
+    }
+    if (debugmode)
+      PrintOut(LOG_INFO, "Device: %s, check requested by query\n", arg.c_str());
+    states[i].next_check = 0;
+    query_client client; client.fd = fd; client.name = arg;
+    query_pending.push_back(client);
+    return true;
   }
   else
-    PrintOut(LOG_INFO,"Signal USR2 - debug mode %d not changed\n", debugmode);
+    query_error(fd, "invalid request");
+  return false;
 }
-#endif
 
-static time_t dosleep(time_t wakeuptime, bool & sigwakeup)
+// Answer pending 'check' requests after devices were checked
+static void query_answer_pending(const dev_config_vector & configs, const dev_state_vector & states,
+                                 const smart_device_list & devices)
 {
-  // If past wake-up-time, compute next wake-up-time
-  time_t timenow=time(NULL);
-  while (wakeuptime<=timenow){
-    int intervals=1+(timenow-wakeuptime)/checktime;
-    wakeuptime+=intervals*checktime;
+  for (unsigned k = 0; k < query_pending.size(); k++) {
+    const query_client & client = query_pending[k];
+    int i = query_find_device(configs, client.name);
+    if (i < 0) {
+      query_error(client.fd, "unknown device");
+      continue;
+    }
+    json reply;
+    query_device_status(reply, configs[i], states[i], devices.at(i));
+    query_reply(client.fd, reply);
+  }
+  query_pending.clear();
+}
+
+// Sleep 'seconds' or until a signal arrives, serve queries meanwhile.
+// Returns true if a device check was requested.
+static bool query_sleep(int seconds, const dev_config_vector & configs,
+                        dev_state_vector & states, const smart_device_list & devices)
+{
+  time_t end = time(0) + seconds;
+  for (;;) {
+    time_t now = time(0);
+    if (now >= end)
+      return false;
+    pollfd pfd; pfd.fd = query_socket; pfd.events = POLLIN; pfd.revents = 0;
+    int n = poll(&pfd, 1, (int)(end - now < 3600 ? end - now : 3600) * 1000);
+    if (n < 0) {
+      // Interrupted by signal
+      if (errno != EINTR)
+        sleep(end - now);
+      return false;
+    }
+    if (n > 0 && query_serve(configs, states, devices))
+      return true;
   }
+}
+#endif // _WIN32
+
+static time_t dosleep(time_t wakeuptime, bool & sigwakeup,
+                      const dev_config_vector & configs,
+                      dev_state_vector & states,
+                      const smart_device_list & devices)
+{
+  // Wake-up-time is the next check time of any device
+  time_t timenow=time(NULL);
+  int maxsleep = (wakeuptime > timenow ? (int)(wakeuptime - timenow) : 0);
   
   // sleep until we catch SIGUSR1 or have completed sleeping
   while (timenow<wakeuptime && !caughtsigUSR1 && !caughtsigHUP && !caughtsigEXIT){
     
-    // protect user again system clock being adjusted backwards
-    if (wakeuptime>timenow+checktime){
-      PrintOut(LOG_CRIT, "System clock time adjusted to the past. Resetting next wakeup time.\n");
-      wakeuptime=timenow+checktime;
-    }
+    // protect user again system clock being adjusted backwards,
+    // check times of devices are reset by get_next_check_time()
+    if (wakeuptime>timenow+maxsleep)
+      wakeuptime=timenow+maxsleep;
     
     // Exit sleep when time interval has expired or a signal is received
-    sleep(wakeuptime-timenow);
+#ifndef _WIN32
+    if (query_socket >= 0) {
+      // Exit sleep also if a device check is requested by a query
+      if (query_sleep(wakeuptime-timenow, configs, states, devices)) {
+        wakeuptime = time(NULL);
+        break;
+      }
+    }
+    else
+#endif
+      sleep(wakeuptime-timenow);
 
-#ifdef _WIN32
-    // toggle debug mode?
     if (caughtsigUSR2) {
+#ifdef _WIN32
+      // toggle debug mode
       ToggleDebugMode();
+#else
+      // log command statistics
+      log_cmd_stats(configs, devices);
+#endif
       caughtsigUSR2 = 0;
     }
-#endif
 
     timenow=time(NULL);
   }
@@ -3039,6 +5714,9 @@ void printoutvaliddirectiveargs(int priority, char d) {
   case 'n':
     PrintOut(priority, "never[,N][,q], sleep[,N][,q], standby[,N][,q], idle[,N][,q]");
     break;
+  case 'c':
+    PrintOut(priority, "i=N, interval=N, adaptive, adaptive=MIN,MAX");
+    break;
   case 's':
     PrintOut(priority, "valid_regular_expression");
     break;
@@ -3218,6 +5896,29 @@ static int ParseToken(char * token, dev_config & cfg)
       badarg = 1;
     }
     break;
+  case 'c':
+    // set check interval of this device
+    if (!(arg = strtok(NULL, delim)))
+      missingarg = 1;
+    else {
+      unsigned v1 = 0, v2 = 0; int n1 = -1, len = strlen(arg);
+      if (   (   sscanf(arg, "i=%u%n", &v1, &n1) == 1
+              || sscanf(arg, "interval=%u%n", &v1, &n1) == 1)
+          && n1 == len && 10 <= v1 && v1 <= (unsigned)INT_MAX) {
+        cfg.checktime = (int)v1;
+      }
+      else if (!strcmp(arg, "adaptive")) {
+        // range is derived from check interval
+        cfg.checktime_min = cfg.checktime_max = -1;
+      }
+      else if (   sscanf(arg, "adaptive=%u,%u%n", &v1, &v2, &n1) == 2
+               && n1 == len && 10 <= v1 && v1 <= v2 && v2 <= (unsigned)INT_MAX) {
+        cfg.checktime_min = (int)v1; cfg.checktime_max = (int)v2;
+      }
+      else
+        badarg = 1;
+    }
+    break;
   case 'H':
     // check SMART status
     cfg.smartcheck = true;
@@ -3501,6 +6202,23 @@ static int ParseConfigLine(dev_config_vector & conf_entries, int /*entry*/, int
   const char *delim = " \n\t";
   int devscan=0;
 
+  // Save directives in normalized form before strtok() modifies the line
+  std::string directives;
+  {
+    const char * p = line;
+    p += strspn(p, delim); p += strcspn(p, delim); // skip device name
+    for (;;) {
+      p += strspn(p, delim);
+      if (!*p || *p == '#')
+        break;
+      int len = strcspn(p, delim);
+      if (!directives.empty())
+        directives += ' ';
+      directives.append(p, len);
+      p += len;
+    }
+  }
+
   // get first token: device name. If a comment, skip line
   if (!(name=strtok(line,delim)) || *name=='#') {
     return 0;
@@ -3516,6 +6234,7 @@ static int ParseConfigLine(dev_config_vector & conf_entries, int /*entry*/, int
   dev_config & cfg = conf_entries.back();
 
   cfg.name = name;
+  cfg.directives = directives;
 
   // Store line number, and by default check for both device types.
   cfg.lineno=lineno;
@@ -3771,27 +6490,39 @@ void ParseOpts(int argc, char **argv)
 #endif
 
   // Please update GetValidArgList() if you edit shortopts
-  static const char shortopts[] = "c:l:q:dDni:p:r:s:A:B:Vh?"
+  static const char shortopts[] = "c:l:L:q:dDni:j:k:p:r:s:S:K:A:f:B:Vh?"
+#ifndef _WIN32
+                                                            "Q:"
+#endif
 #ifdef HAVE_LIBCAP_NG
-                                                          "C"
+                                                            "C"
 #endif
-                                                             ;
+                                                               ;
   // Please update GetValidArgList() if you edit longopts
   struct option longopts[] = {
     { "configfile",     required_argument, 0, 'c' },
     { "logfacility",    required_argument, 0, 'l' },
+    { "logtarget",      required_argument, 0, 'L' },
     { "quit",           required_argument, 0, 'q' },
     { "debug",          no_argument,       0, 'd' },
     { "showdirectives", no_argument,       0, 'D' },
     { "interval",       required_argument, 0, 'i' },
+    { "jobs",           required_argument, 0, 'j' },
+    { "keepopen",       required_argument, 0, 'k' },
 #ifndef _WIN32
     { "no-fork",        no_argument,       0, 'n' },
 #endif
     { "pidfile",        required_argument, 0, 'p' },
     { "report",         required_argument, 0, 'r' },
     { "savestates",     required_argument, 0, 's' },
+    { "statestore",     required_argument, 0, 'S' },
+    { "capcache",       required_argument, 0, 'K' },
     { "attributelog",   required_argument, 0, 'A' },
+    { "attrlogformat",  required_argument, 0, 'f' },
     { "drivedb",        required_argument, 0, 'B' },
+#ifndef _WIN32
+    { "querysocket",    required_argument, 0, 'Q' },
+#endif
 #if defined(_WIN32) || defined(__CYGWIN__)
     { "service",        no_argument,       0, 'n' },
 #endif
@@ -3834,6 +6565,9 @@ void ParseOpts(int argc, char **argv)
         debugmode=1;
       } else if (!(strcmp(optarg,"errors"))) {
         quit=5;
+      } else if (!(strcmp(optarg,"benchmark"))) {
+        quit=6;
+        debugmode=1;
       } else {
         badarg = true;
       }
@@ -3861,6 +6595,19 @@ void ParseOpts(int argc, char **argv)
       else
         badarg = true;
       break;
+    case 'L':
+      // log to file or socket instead of syslog
+      if (!strcmp(optarg, "syslog"))
+        log_target.clear();
+      else if (   (!strncmp(optarg, "file:", 5) && optarg[5])
+#ifndef _WIN32
+               || (!strncmp(optarg, "socket:", 7) && optarg[7])
+#endif
+              )
+        log_target = optarg;
+      else
+        badarg = true;
+      break;
     case 'd':
       // enable debug mode
       debugmode = 1;
@@ -3892,6 +6639,43 @@ void ParseOpts(int argc, char **argv)
       }
       checktime = (int)lchecktime;
       break;
+    case 'j':
+      // Number of parallel device checks
+      {
+        int n1 = -1, n2 = -1, len = -1;
+        unsigned j1 = 0, j2 = 0;
+        sscanf(optarg, "%u%n,%u%n", &j1, &n1, &j2, &n2);
+        if (n2 > 0)
+          len = n2;
+        else
+          len = n1, j2 = 0;
+        if (!(len == (int)strlen(optarg) && 1 <= j1 && j1 <= 1024 && j2 <= j1)) {
+          badarg = true;
+          break;
+        }
+        if (j1 > 1 && !parallel_jobs::is_supported()) {
+          debugmode=1;
+          PrintHead();
+          PrintOut(LOG_CRIT, "======> PARALLEL CHECKS (-j %s) NOT SUPPORTED ON THIS PLATFORM <=======\n", optarg);
+          EXIT(EXIT_BADCMD);
+        }
+        max_check_jobs = j1;
+        max_check_jobs_per_ctrl = j2;
+      }
+      break;
+    case 'k':
+      // Number of devices kept open
+      {
+        int n = -1;
+        unsigned k = 0;
+        sscanf(optarg, "%u%n", &k, &n);
+        if (!(n == (int)strlen(optarg) && k <= 1024)) {
+          badarg = true;
+          break;
+        }
+        keepopen_max = k;
+      }
+      break;
     case 'r':
       // report IOCTL transactions
       {
@@ -3939,10 +6723,46 @@ void ParseOpts(int argc, char **argv)
       // path prefix of persistent state file
       state_path_prefix = optarg;
       break;
+    case 'S':
+      // path of binary state store
+      state_store_path = optarg;
+      break;
+    case 'K':
+      // path of capability cache
+      capcache_path = optarg;
+      break;
+#ifndef _WIN32
+    case 'Q':
+      // path of query socket
+      query_socket_path = optarg;
+      break;
+#endif
     case 'A':
       // path prefix of attribute log file
       attrlog_path_prefix = optarg;
       break;
+    case 'f':
+      // format of attribute log file
+      if (!strcmp(optarg, "csv"))
+        attrlog_columnar = false;
+      else if (!strncmp(optarg, "columnar", 8) && (!optarg[8] || optarg[8] == ',')) {
+        attrlog_retention keep;
+        int n1 = -1, n2 = -1, n3 = -1, len = 8;
+        if (optarg[8]) {
+          sscanf(optarg+8, ",%u%n,%u%n,%u%n", &keep.days[ATTRLOG_RAW], &n1,
+                 &keep.days[ATTRLOG_HOURLY], &n2, &keep.days[ATTRLOG_DAILY], &n3);
+          len += (n3 > 0 ? n3 : n2 > 0 ? n2 : n1);
+        }
+        if (len != (int)strlen(optarg)) {
+          badarg = true;
+          break;
+        }
+        attrlog_columnar = true;
+        attrlog_keep = keep;
+      }
+      else
+        badarg = true;
+      break;
     case 'B':
       {
         const char * path = optarg;
@@ -4051,6 +6871,16 @@ void ParseOpts(int argc, char **argv)
     EXIT(EXIT_BADCMD);
   }
 
+  // absolute path is required due to chdir('/') after fork().
+  if (!state_store_path.empty() && !debugmode && !is_abs_path(state_store_path.c_str())) {
+    debugmode=1;
+    PrintHead();
+    PrintOut(LOG_CRIT, "=======> INVALID CHOICE OF OPTIONS: -S <======= \n\n");
+    PrintOut(LOG_CRIT, "Error: relative path %s is only allowed in debug (-d) mode\n\n",
+      state_store_path.c_str());
+    EXIT(EXIT_BADCMD);
+  }
+
   // absolute path is required due to chdir('/') after fork().
   if (!attrlog_path_prefix.empty() && !debugmode && !is_abs_path(attrlog_path_prefix.c_str())) {
     debugmode=1;
@@ -4061,6 +6891,48 @@ void ParseOpts(int argc, char **argv)
     EXIT(EXIT_BADCMD);
   }
 
+  // absolute path is required due to chdir('/') after fork().
+  if (!capcache_path.empty() && !debugmode && !is_abs_path(capcache_path.c_str())) {
+    debugmode=1;
+    PrintHead();
+    PrintOut(LOG_CRIT, "=======> INVALID CHOICE OF OPTIONS: -K <======= \n\n");
+    PrintOut(LOG_CRIT, "Error: relative path %s is only allowed in debug (-d) mode\n\n",
+      capcache_path.c_str());
+    EXIT(EXIT_BADCMD);
+  }
+
+  // absolute path is required due to chdir('/') after fork().
+  if (!log_target.empty() && !debugmode
+      && !is_abs_path(log_target.c_str() + log_target.find(':') + 1)) {
+    debugmode=1;
+    PrintHead();
+    PrintOut(LOG_CRIT, "=======> INVALID CHOICE OF OPTIONS: -L <======= \n\n");
+    PrintOut(LOG_CRIT, "Error: relative path %s is only allowed in debug (-d) mode\n\n",
+      log_target.c_str() + log_target.find(':') + 1);
+    EXIT(EXIT_BADCMD);
+  }
+
+#ifndef _WIN32
+  // absolute path is required due to chdir('/') after fork().
+  if (!query_socket_path.empty() && !debugmode && !is_abs_path(query_socket_path.c_str())) {
+    debugmode=1;
+    PrintHead();
+    PrintOut(LOG_CRIT, "=======> INVALID CHOICE OF OPTIONS: -Q <======= \n\n");
+    PrintOut(LOG_CRIT, "Error: relative path %s is only allowed in debug (-d) mode\n\n",
+      query_socket_path.c_str());
+    EXIT(EXIT_BADCMD);
+  }
+#endif
+
+  // Open binary state store
+  if (!state_store_path.empty() && !state_store.open(state_store_path.c_str()))
+    EXIT(EXIT_BADCMD);
+
+  // Read capability cache, missing file is not an error
+  if (!capcache_path.empty() && read_capability_cache(capcache_path.c_str(), capcache))
+    PrintOut(LOG_INFO, "Capability cache read from %s (%u entries)\n",
+             capcache_path.c_str(), (unsigned)capcache.size());
+
   // Read or init drive database
   if (!no_defaultdb) {
     unsigned char savedebug = debugmode; debugmode = 1;
@@ -4168,31 +7040,126 @@ static int ReadOrMakeConfigEntries(dev_config_vector & conf_entries, smart_devic
 }
 
 
+// Return true if config entry is unchanged since device was registered.
+// Entry name and type are compared with the original values saved
+// in 'regname' and 'regtype' because registration updates them.
+static bool same_config_entry(const dev_config & entry, const dev_config & cfg)
+{
+  return (   entry.regname == cfg.regname
+          && entry.regtype == cfg.regtype
+          && entry.directives == cfg.directives);
+}
+
+// Register one opened device.  Returns 0 if registered, 1 if device
+// was not opened, 2 if device was opened but could not be registered.
+static int RegisterDevice(dev_config & cfg, dev_state & state, smart_device_auto_ptr & dev,
+                          const char * oldtype, bool scanning)
+{
+  if (!dev)
+    return 1;
+
+  // Report if type has changed
+  if (strcmp(oldtype, dev->get_dev_type()))
+    PrintOut(LOG_INFO,"Device: %s, type changed from '%s' to '%s'\n",
+      cfg.name.c_str(), oldtype, dev->get_dev_type());
+
+  if (!dev->is_open()) {
+    // For linux+devfs, a nonexistent device gives a strange error
+    // message.  This makes the error message a bit more sensible.
+    // If no debug and scanning - don't print errors
+    if (debugmode || !scanning)
+      PrintOut(LOG_INFO, "Device: %s, open() failed: %s\n", dev->get_info_name(), dev->get_errmsg());
+    return 1;
+  }
+
+  // Update informal name
+  cfg.name = dev->get_info().info_name;
+  PrintOut(LOG_INFO, "Device: %s, opened\n", cfg.name.c_str());
+
+  // register ATA devices
+  if (dev->is_ata()){
+    if (ATADeviceScan(cfg, state, dev->to_ata())) {
+      CanNotRegister(cfg.name.c_str(), "ATA", cfg.lineno, scanning);
+      dev.reset();
+    }
+  }
+  // or register SCSI devices
+  else if (dev->is_scsi()){
+    if (SCSIDeviceScan(cfg, state, dev->to_scsi())) {
+      CanNotRegister(cfg.name.c_str(), "SCSI", cfg.lineno, scanning);
+      dev.reset();
+    }
+  }
+  else {
+    PrintOut(LOG_INFO, "Device: %s, neither ATA nor SCSI device\n", cfg.name.c_str());
+    dev.reset();
+  }
+
+  return (dev ? 0 : 2);
+}
+
 // This function tries devices from conf_entries.  Each one that can be
 // registered is moved onto the [ata|scsi]devices lists and removed
-// from the conf_entries list.
-static void RegisterDevices(const dev_config_vector & conf_entries, smart_device_list & scanned_devs,
+// from the conf_entries list.  On reload, devices with unchanged
+// config entries are kept open and keep their state.
+static void RegisterDevices(dev_config_vector & conf_entries, smart_device_list & scanned_devs,
                             dev_config_vector & configs, dev_state_vector & states, smart_device_list & devices)
 {
-  // start by clearing lists/memory of ALL existing devices
-  configs.clear();
+  // Move ALL existing devices to the old lists
+  dev_config_vector oldconfigs; oldconfigs.swap(configs);
+  dev_state_vector oldstates; oldstates.swap(states);
+  smart_device_list olddevices;
+  unsigned i;
+  for (i = 0; i < devices.size(); i++)
+    olddevices.push_back(devices.release(i));
   devices.clear();
-  states.clear();
-
-  // Register entries
-  for (unsigned i = 0; i < conf_entries.size(); i++){
-
-    dev_config cfg = conf_entries[i];
 
-    // get device of appropriate type
-    smart_device_auto_ptr dev;
-    bool scanning = false;
+  // Get devices of appropriate type
+  unsigned numdev = conf_entries.size();
+  smart_device_list devs;
+  std::vector<char> scanning_flags(numdev, false);
+  std::vector<std::string> oldtypes(numdev);
+  std::vector<int> reused(numdev, -1);
+  std::vector<char> cachedtypes(numdev, false);
+  std::vector<bool> old_used(oldconfigs.size(), false); // Each old device is kept once
+  for (i = 0; i < numdev; i++) {
+    dev_config & cfg = conf_entries[i];
+    cfg.regname = cfg.name; cfg.regtype = cfg.dev_type;
+    smart_device * dev = 0;
 
     // Device may already be detected during devicescan
     if (i < scanned_devs.size()) {
       dev = scanned_devs.release(i);
       if (dev)
-        scanning = true;
+        scanning_flags[i] = true;
+    }
+
+    // Keep device if entry is unchanged
+    unsigned j;
+    for (j = 0; j < oldconfigs.size(); j++) {
+      if (!old_used[j] && olddevices.at(j) && same_config_entry(cfg, oldconfigs[j]))
+        break;
+    }
+    if (j < oldconfigs.size()) {
+      reused[i] = j;
+      old_used[j] = true;
+      delete dev;
+      devs.push_back((smart_device *)0);
+      continue;
+    }
+
+    // Skip autodetection if device type is cached, ATADeviceScan()
+    // checks the identity of the device
+    if (cfg.dev_type.empty() && !capcache_path.empty()) {
+      dev_capabilities_map::const_iterator it = capcache.find(cfg.name);
+      if (it != capcache.end() && !it->second.dev_type.empty()) {
+        smart_device * cacheddev = smi()->get_smart_device(cfg.name.c_str(), it->second.dev_type.c_str());
+        if (cacheddev) {
+          delete dev;
+          dev = cacheddev;
+          cachedtypes[i] = true;
+        }
+      }
     }
 
     if (!dev) {
@@ -4202,57 +7169,61 @@ static void RegisterDevices(const dev_config_vector & conf_entries, smart_device
           PrintOut(LOG_INFO,"Device: %s, unable to autodetect device type\n", cfg.name.c_str());
         else
           PrintOut(LOG_INFO,"Device: %s, unsupported device type '%s'\n", cfg.name.c_str(), cfg.dev_type.c_str());
-        continue;
       }
     }
 
-    // Save old info
-    smart_device::device_info oldinfo = dev->get_info();
-
-    // Open with autodetect support, may return 'better' device
-    dev.replace( dev->autodetect_open() );
+    // Save old type
+    if (dev)
+      oldtypes[i] = dev->get_dev_type();
+    devs.push_back(dev);
+  }
 
-    // Report if type has changed
-    if (oldinfo.dev_type != dev->get_dev_type())
-      PrintOut(LOG_INFO,"Device: %s, type changed from '%s' to '%s'\n",
-        cfg.name.c_str(), oldinfo.dev_type.c_str(), dev->get_dev_type());
+  // Open with autodetect support, may return 'better' devices
+  std::vector<smart_device *> opened;
+  OpenDevices(devs, opened);
 
-    if (!dev->is_open()) {
-      // For linux+devfs, a nonexistent device gives a strange error
-      // message.  This makes the error message a bit more sensible.
-      // If no debug and scanning - don't print errors
-      if (debugmode || !scanning)
-        PrintOut(LOG_INFO, "Device: %s, open() failed: %s\n", dev->get_info_name(), dev->get_errmsg());
+  // Register entries
+  for (i = 0; i < numdev; i++){
+
+    if (reused[i] >= 0) {
+      // Move unchanged device, keep state
+      int j = reused[i];
+      dev_config & cfg = oldconfigs[j];
+      cfg.lineno = conf_entries[i].lineno;
+      PrintOut(LOG_INFO, "Device: %s, configuration unchanged, kept registered\n", cfg.name.c_str());
+      configs.push_back(cfg);
+      states.push_back(oldstates[j]);
+      devices.push_back(olddevices.release(j));
       continue;
     }
 
-    // Update informal name
-    cfg.name = dev->get_info().info_name;
-    PrintOut(LOG_INFO, "Device: %s, opened\n", cfg.name.c_str());
-
-    // Prepare initial state
+    dev_config cfg = conf_entries[i];
     dev_state state;
-
-    // register ATA devices
-    if (dev->is_ata()){
-      if (ATADeviceScan(cfg, state, dev->to_ata())) {
-        CanNotRegister(cfg.name.c_str(), "ATA", cfg.lineno, scanning);
-        dev.reset();
-      }
-    }
-    // or register SCSI devices
-    else if (dev->is_scsi()){
-      if (SCSIDeviceScan(cfg, state, dev->to_scsi())) {
-        CanNotRegister(cfg.name.c_str(), "SCSI", cfg.lineno, scanning);
-        dev.reset();
-      }
-    }
-    else {
-      PrintOut(LOG_INFO, "Device: %s, neither ATA nor SCSI device\n", cfg.name.c_str());
+    smart_device_auto_ptr dev(opened[i]);
+    opened[i] = 0;
+    bool scanning = !!scanning_flags[i];
+    int status = RegisterDevice(cfg, state, dev, oldtypes[i].c_str(), scanning);
+
+    if (status && cachedtypes[i]) {
+      // Cached type is no longer valid, retry with autodetection
+      PrintOut(LOG_INFO, "Device: %s, cached device type '%s' failed, trying autodetection\n",
+               conf_entries[i].name.c_str(), oldtypes[i].c_str());
+      capcache.erase(conf_entries[i].name);
+      capcache_dirty = true;
+      cfg = conf_entries[i];
+      state = dev_state();
       dev.reset();
+      smart_device * newdev = smi()->get_smart_device(cfg.name.c_str(), cfg.dev_type.c_str());
+      if (newdev) {
+        std::string newtype = newdev->get_dev_type();
+        dev = newdev->autodetect_open();
+        status = RegisterDevice(cfg, state, dev, newtype.c_str(), scanning);
+      }
     }
 
-    if (dev) {
+    if (status == 1)
+      continue;
+    if (!status) {
       // move onto the list of devices
       configs.push_back(cfg);
       states.push_back(state);
@@ -4269,6 +7240,158 @@ static void RegisterDevices(const dev_config_vector & conf_entries, smart_device
       }
     }
   }
+
+  // Unused old devices are deleted on return
+  UpdateKeptOpenDevices(devices);
+}
+
+
+// Timer for one item of '-q benchmark'.  Output is muted while running.
+class bench_timer
+{
+public:
+  bench_timer()
+    : m_start(get_timer_usec()), m_count(0), m_usec(0)
+    { log_muted = true; }
+
+  ~bench_timer()
+    { log_muted = false; }
+
+  // Count one iteration, return false if minimum run time has elapsed.
+  bool next()
+    {
+      m_count++;
+      m_usec = get_timer_usec() - m_start;
+      return (m_usec < 1000000);
+    }
+
+  // Stop timer, add result to JSON array and print it.
+  void add_result(json & jres, const char * name, const char * device = 0);
+
+private:
+  uint64_t m_start;
+  uint64_t m_count;
+  uint64_t m_usec;
+};
+
+void bench_timer::add_result(json & jres, const char * name, const char * device /* = 0 */)
+{
+  log_muted = false;
+  json & j = jres[jres.size()];
+  j["name"] = name;
+  if (device)
+    j["device"] = device;
+  j["iterations"] = m_count;
+  j["total_usec"] = m_usec;
+  j["nsec_per_iteration"] = m_usec * 1000 / (m_count ? m_count : 1);
+  PrintOut(LOG_INFO, "%-26s %-16s %12.3f us (%"PRIu64" in %.2f s)\n", name, (device ? device : ""),
+           (double)m_usec / (m_count ? m_count : 1), m_count, m_usec / 1000000.0);
+}
+
+// Run benchmark of startup and check cycle costs for '-q benchmark'.
+// Devices are checked repeatedly, use '-d replay,FILE' for simulated
+// devices.  Results are printed to stdout in JSON format.
+static void RunBenchmark(const dev_config_vector & configs, const dev_state_vector & states,
+                         smart_device_list & devices)
+{
+  json jout;
+  json & jb = jout["smartd_benchmark"];
+  jb["version"] = PACKAGE_VERSION;
+  json & jres = jb["results"];
+  jres.set_type(json::nt_array);
+
+  // Drive database
+  PrintOut(LOG_INFO, "\n");
+  benchmark_drive_database(&jb["drive_database"]);
+  PrintOut(LOG_INFO, "\n");
+
+  // Configuration file
+  if (configfile != configfile_stdin) {
+    bench_timer t;
+    do {
+      dev_config_vector conf_entries;
+      ParseConfigFile(conf_entries);
+    } while (t.next());
+    t.add_result(jres, "ParseConfigFile");
+  }
+
+  // Copies of configs without mail and states, checks must not change the originals
+  dev_config_vector bench_configs(configs);
+  dev_state_vector bench_states(states);
+  for (unsigned i = 0; i < bench_configs.size(); i++) {
+    dev_config & cfg = bench_configs[i];
+    cfg.emailaddress.clear(); cfg.emailcmdline.clear(); cfg.emailtest = false;
+  }
+
+  // Attribute raw value formatting with attributes from last check
+  for (unsigned i = 0; i < devices.size(); i++) {
+    if (!devices.at(i)->is_ata())
+      continue;
+    const dev_config & cfg = bench_configs[i];
+    const ata_smart_values & smartval = bench_states[i].smartval;
+    bench_timer t;
+    do {
+      for (int k = 0; k < NUMBER_ATA_SMART_ATTRIBUTES; k++) {
+        if (smartval.vendor_attributes[k].id)
+          ata_format_attr_raw_value(smartval.vendor_attributes[k], cfg.attribute_defs);
+      }
+    } while (t.next());
+    t.add_result(jres, "ata_format_attr_raw_value", cfg.name.c_str());
+  }
+
+  // Check cycle of each device, self-tests are not started
+  for (unsigned i = 0; i < devices.size(); i++) {
+    smart_device * dev = devices.at(i);
+    const dev_config & cfg = bench_configs[i];
+    bench_timer t;
+    do
+      CheckDevice(cfg, bench_states[i], dev, false);
+    while (t.next());
+    t.add_result(jres, (dev->is_ata() ? "ATACheckDevice" : "SCSICheckDevice"), cfg.name.c_str());
+  }
+
+  // State files, written to "FILE.benchmark" files which are removed
+  // afterwards, the real state files and store are not changed
+  dev_state_store bench_store;
+  std::string bench_store_path;
+  if (state_store.is_open()) {
+    bench_store_path = state_store_path + ".benchmark";
+    unlink(bench_store_path.c_str());
+  }
+  if (state_path_prefix.empty() && bench_store_path.empty())
+    PrintOut(LOG_INFO, "write_all_dev_states skipped, no '-s' or '-S' option\n");
+  else if (!bench_store_path.empty() && !bench_store.open(bench_store_path.c_str())) {
+    PrintOut(LOG_CRIT, "write_all_dev_states skipped, cannot create state store %s\n",
+             bench_store_path.c_str());
+    unlink(bench_store_path.c_str());
+  }
+  else {
+    for (unsigned i = 0; i < bench_configs.size(); i++) {
+      dev_config & cfg = bench_configs[i];
+      if (!cfg.state_file.empty())
+        cfg.state_file += ".benchmark";
+    }
+
+    bench_timer t;
+    do
+      write_all_dev_states(bench_configs, bench_states, true, bench_store);
+    while (t.next());
+    t.add_result(jres, "write_all_dev_states");
+
+    bench_store.close();
+    if (!bench_store_path.empty())
+      unlink(bench_store_path.c_str());
+    for (unsigned i = 0; i < bench_configs.size(); i++) {
+      const dev_config & cfg = bench_configs[i];
+      if (cfg.state_file.empty())
+        continue;
+      unlink(cfg.state_file.c_str());
+      unlink((cfg.state_file + '~').c_str());
+    }
+  }
+
+  log_batch(false);
+  jout.print(stdout, true);
 }
 
 
@@ -4309,6 +7432,9 @@ int main_worker(int argc, char **argv)
 
   bool write_states_always = true;
 
+  // Check all devices regardless of their check times (SIGUSR1)
+  bool check_all = false;
+
 #ifdef HAVE_LIBCAP_NG
   // Drop capabilities
   if (enable_capabilities) {
@@ -4322,6 +7448,9 @@ int main_worker(int argc, char **argv)
   // the main loop of the code
   for (;;) {
 
+    // batch log output until sleep
+    log_batch(true);
+
     // are we exiting from a signal?
     if (caughtsigEXIT) {
       // are we exiting with SIGTERM?
@@ -4336,7 +7465,7 @@ int main_worker(int argc, char **argv)
         return EXIT_SIGNAL;
 
       // Write state files
-      if (!state_path_prefix.empty())
+      if (!state_path_prefix.empty() || state_store.is_open())
         write_all_dev_states(configs, states);
 
       return 0;
@@ -4359,9 +7488,12 @@ int main_worker(int argc, char **argv)
         }
 #endif
         // Write state files
-        if (!state_path_prefix.empty())
+        if (!state_path_prefix.empty() || state_store.is_open())
           write_all_dev_states(configs, states);
 
+        // Reopen log target (rotated log file, socket not available before)
+        log_shutdown();
+
         PrintOut(LOG_INFO,
                  caughtsigHUP==1?
                  "Signal HUP - rereading configuration file %s\n":
@@ -4380,6 +7512,7 @@ int main_worker(int argc, char **argv)
           RegisterDevices(conf_entries, scanned_devs, configs, states, devices);
           if (!(configs.size() == devices.size() && configs.size() == states.size()))
             throw std::logic_error("Invalid result from RegisterDevices");
+          write_capability_cache_if_changed(configs, states);
         }
         else if (quit==2 || ((quit==0 || quit==1) && !firstpass)) {
           // user has asked to continue on error in configuration file
@@ -4413,6 +7546,12 @@ int main_worker(int argc, char **argv)
         return 0;
       }
 
+      if (quit==6) {
+        // user has asked to run benchmark
+        RunBenchmark(configs, states, devices);
+        return 0;
+      }
+
 #ifdef HAVE_LIBCAP_NG
       if (enable_capabilities) {
         for (unsigned i = 0; i < configs.size(); i++) {
@@ -4431,12 +7570,19 @@ int main_worker(int argc, char **argv)
       write_states_always = true;
     }
 
-    // check all devices once,
+    // check all devices once in first pass, then devices which are due,
     // self tests are not started in first pass unless '-q onecheck' is specified
-    CheckDevicesOnce(configs, states, devices, (!firstpass || quit==3));
+    CheckDevicesOnce(configs, states, devices, (!firstpass || quit==3), (firstpass || check_all));
+    check_all = false;
+
+#ifndef _WIN32
+    // Reply to queries waiting for a device check
+    if (!query_pending.empty())
+      query_answer_pending(configs, states, devices);
+#endif
 
      // Write state files
-    if (!state_path_prefix.empty())
+    if (!state_path_prefix.empty() || state_store.is_open())
       write_all_dev_states(configs, states, write_states_always);
     write_states_always = false;
 
@@ -4444,6 +7590,9 @@ int main_worker(int argc, char **argv)
     if (!attrlog_path_prefix.empty())
       write_all_dev_attrlogs(configs, states);
 
+    // Write capability cache if self-test capabilities have changed
+    write_capability_cache_if_changed(configs, states);
+
     // user has asked us to exit after first check
     if (quit==3) {
       PrintOut(LOG_INFO,"Started with '-q onecheck' option. All devices sucessfully checked once.\n"
@@ -4453,6 +7602,8 @@ int main_worker(int argc, char **argv)
     
     // fork into background if needed
     if (firstpass && !debugmode) {
+      // delivery thread does not survive fork()
+      mail_delivery.flush();
       DaemonInit();
     }
 
@@ -4462,8 +7613,15 @@ int main_worker(int argc, char **argv)
       firstpass = false;
     }
     
-    // sleep until next check time, or a signal arrives
-    wakeuptime = dosleep(wakeuptime, write_states_always);
+    // write batched log output
+    log_batch(false);
+
+    // sleep until next check time of any device, or a signal arrives
+    wakeuptime = get_next_check_time(states);
+    bool sigwakeup = false;
+    wakeuptime = dosleep(wakeuptime, sigwakeup, configs, states, devices);
+    if (sigwakeup)
+      write_states_always = check_all = true;
   }
 }
 
@@ -4496,9 +7654,15 @@ static int smartd_main(int argc, char **argv)
     status = EXIT_BADCODE;
   }
 
+  // Deliver queued warnings
+  mail_delivery.flush();
+
   if (is_initialized)
     status = Goodbye(status);
 
+  // Write batched output
+  log_shutdown();
+
 #ifdef _WIN32
   daemon_winsvc_exitcode = status;
 #endif
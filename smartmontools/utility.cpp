@@ -38,15 +38,26 @@
 #include <sys/stat.h>
 #ifdef _WIN32
 #include <mbstring.h> // _mbsinc()
+#include <windows.h> // GetTickCount()
+#else
+#include <sys/time.h> // gettimeofday()
 #endif
 
 #include <stdexcept>
+#include <map>
+#include <vector>
 
 #include "config.h"
 #include "svnversion.h"
 #include "int64.h"
 #include "utility.h"
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
 #include "atacmds.h"
 #include "dev_interface.h"
 
@@ -283,6 +294,31 @@ void check_endianness()
     throw std::logic_error("CPU endianness does not match compile time test");
 }
 
+// Calculate CRC-32 (IEEE 802.3) of SIZE bytes, continue from CRC.
+unsigned calc_crc32(const void * data, unsigned size, unsigned crc /* = 0 */)
+{
+  const unsigned char * p = (const unsigned char *)data;
+  crc = ~crc;
+  for (unsigned i = 0; i < size; i++) {
+    crc ^= p[i];
+    for (int b = 0; b < 8; b++)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+// Return time in microseconds for latency measurements and benchmarks.
+uint64_t get_timer_usec()
+{
+#ifdef _WIN32
+  return (uint64_t)GetTickCount() * 1000;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
 // Utility function prints date and time and timezone into a character
 // buffer of length>=64.  All the fuss is needed to get the right
 // timezone info (sigh).
@@ -471,6 +507,382 @@ bool regular_expression::compile()
   return true;
 }
 
+
+/////////////////////////////////////////////////////////////////////////////
+// parallel_jobs
+
+parallel_jobs::~parallel_jobs()
+{
+}
+
+#ifdef HAVE_PTHREAD_H
+
+// Global mutex for parallel_jobs::lock()
+static pthread_mutex_t jobs_global_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Thread specific data: index+1 of current job, 0 if none
+static pthread_key_t jobs_index_key;
+static pthread_once_t jobs_index_key_once = PTHREAD_ONCE_INIT;
+
+extern "C" void jobs_create_index_key()
+{
+  pthread_key_create(&jobs_index_key, 0);
+}
+
+namespace {
+
+// State shared by the worker threads of one parallel_jobs::run()
+struct jobs_context
+{
+  parallel_jobs * jobs;
+  unsigned num_jobs;
+  const int * groups;
+  unsigned max_per_group;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::vector<bool> started;      // true if job was started
+  unsigned next;                  // first job not yet started
+  std::map<int, unsigned> active; // number of running jobs per group
+  bool failed;                    // true if a job has thrown
+
+  // Return next job which can be started, -1 if none, -2 if all started.
+  int select_job();
+};
+
+int jobs_context::select_job()
+{
+  bool remaining = false;
+  for (unsigned i = next; i < num_jobs; i++) {
+    if (started[i])
+      continue;
+    remaining = true;
+    if (!groups || active[groups[i]] < max_per_group)
+      return i;
+  }
+  return (remaining ? -1 : -2);
+}
+
+} // namespace
+
+// Worker thread: Run jobs until all are started.
+extern "C" void * jobs_worker_thread(void * arg)
+{
+  jobs_context & ctx = *(jobs_context *)arg;
+  pthread_mutex_lock(&ctx.mutex);
+  for (;;) {
+    int i = ctx.select_job();
+    if (i == -2)
+      break;
+    if (i < 0) {
+      // Wait until a job of a busy group has finished
+      pthread_cond_wait(&ctx.cond, &ctx.mutex);
+      continue;
+    }
+
+    ctx.started[i] = true;
+    while (ctx.next < ctx.num_jobs && ctx.started[ctx.next])
+      ctx.next++;
+    if (ctx.groups)
+      ctx.active[ctx.groups[i]]++;
+    pthread_mutex_unlock(&ctx.mutex);
+
+    pthread_setspecific(jobs_index_key, (void *)(long)(i + 1));
+    bool ok = true;
+    try {
+      ctx.jobs->job(i);
+    }
+    catch (...) {
+      ok = false;
+    }
+    pthread_setspecific(jobs_index_key, 0);
+
+    pthread_mutex_lock(&ctx.mutex);
+    if (!ok)
+      ctx.failed = true;
+    if (ctx.groups)
+      ctx.active[ctx.groups[i]]--;
+    pthread_cond_broadcast(&ctx.cond);
+  }
+  pthread_mutex_unlock(&ctx.mutex);
+  return 0;
+}
+
+void parallel_jobs::run(unsigned num_jobs, unsigned max_threads,
+                        const int * groups /* = 0 */, unsigned max_per_group /* = 0 */)
+{
+  if (max_per_group < 1)
+    groups = 0;
+  if (max_threads > num_jobs)
+    max_threads = num_jobs;
+
+  std::vector<pthread_t> threads;
+  jobs_context ctx;
+  if (max_threads > 1) {
+    pthread_once(&jobs_index_key_once, jobs_create_index_key);
+    ctx.jobs = this;
+    ctx.num_jobs = num_jobs;
+    ctx.groups = groups;
+    ctx.max_per_group = max_per_group;
+    pthread_mutex_init(&ctx.mutex, 0);
+    pthread_cond_init(&ctx.cond, 0);
+    ctx.started.assign(num_jobs, false);
+    ctx.next = 0;
+    ctx.failed = false;
+
+    for (unsigned i = 0; i < max_threads; i++) {
+      pthread_t t;
+      if (pthread_create(&t, 0, jobs_worker_thread, &ctx))
+        break; // Continue with fewer threads
+      threads.push_back(t);
+    }
+  }
+
+  if (threads.empty()) {
+    // Run serially
+    for (unsigned i = 0; i < num_jobs; i++)
+      job(i);
+    if (max_threads > 1) {
+      pthread_cond_destroy(&ctx.cond);
+      pthread_mutex_destroy(&ctx.mutex);
+    }
+    return;
+  }
+
+  for (unsigned i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], 0);
+  pthread_cond_destroy(&ctx.cond);
+  pthread_mutex_destroy(&ctx.mutex);
+
+  if (ctx.failed)
+    throw std::runtime_error("parallel_jobs: job in worker thread failed");
+}
+
+int parallel_jobs::current_job()
+{
+  pthread_once(&jobs_index_key_once, jobs_create_index_key);
+  return (int)(long)pthread_getspecific(jobs_index_key) - 1;
+}
+
+bool parallel_jobs::is_supported()
+{
+  return true;
+}
+
+void parallel_jobs::lock()
+{
+  pthread_mutex_lock(&jobs_global_mutex);
+}
+
+void parallel_jobs::unlock()
+{
+  pthread_mutex_unlock(&jobs_global_mutex);
+}
+
+#else // HAVE_PTHREAD_H
+
+void parallel_jobs::run(unsigned num_jobs, unsigned /*max_threads*/,
+                        const int * /*groups = 0*/, unsigned /*max_per_group = 0*/)
+{
+  for (unsigned i = 0; i < num_jobs; i++)
+    job(i);
+}
+
+int parallel_jobs::current_job()
+{
+  return -1;
+}
+
+bool parallel_jobs::is_supported()
+{
+  return false;
+}
+
+void parallel_jobs::lock()
+{
+}
+
+void parallel_jobs::unlock()
+{
+}
+
+#endif // HAVE_PTHREAD_H
+
+
+/////////////////////////////////////////////////////////////////////////////
+// thread_mutex
+
+#ifdef HAVE_PTHREAD_H
+
+thread_mutex::thread_mutex()
+: m_mutex(new pthread_mutex_t)
+{
+  pthread_mutex_init((pthread_mutex_t *)m_mutex, 0);
+}
+
+thread_mutex::~thread_mutex()
+{
+  pthread_mutex_destroy((pthread_mutex_t *)m_mutex);
+  delete (pthread_mutex_t *)m_mutex;
+}
+
+void thread_mutex::lock()
+{
+  pthread_mutex_lock((pthread_mutex_t *)m_mutex);
+}
+
+void thread_mutex::unlock()
+{
+  pthread_mutex_unlock((pthread_mutex_t *)m_mutex);
+}
+
+#else // HAVE_PTHREAD_H
+
+thread_mutex::thread_mutex()
+: m_mutex(0)
+{
+}
+
+thread_mutex::~thread_mutex()
+{
+}
+
+void thread_mutex::lock()
+{
+}
+
+void thread_mutex::unlock()
+{
+}
+
+#endif // HAVE_PTHREAD_H
+
+
+/////////////////////////////////////////////////////////////////////////////
+// worker_thread
+
+#ifdef HAVE_PTHREAD_H
+
+struct worker_thread::thread_data
+{
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+worker_thread::worker_thread()
+: m_data(new thread_data), m_running(false)
+{
+  pthread_mutex_init(&m_data->mutex, 0);
+  pthread_cond_init(&m_data->cond, 0);
+}
+
+worker_thread::~worker_thread()
+{
+  pthread_cond_destroy(&m_data->cond);
+  pthread_mutex_destroy(&m_data->mutex);
+  delete m_data;
+}
+
+extern "C" void * worker_thread_func(void * arg)
+{
+  ((worker_thread *)arg)->run();
+  return 0;
+}
+
+bool worker_thread::start()
+{
+  if (m_running)
+    return true;
+  // Block all signals in the new thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  bool ok = !pthread_create(&m_data->thread, 0, worker_thread_func, this);
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+  m_running = ok;
+  return ok;
+}
+
+void worker_thread::join()
+{
+  if (!m_running)
+    return;
+  pthread_join(m_data->thread, 0);
+  m_running = false;
+}
+
+void worker_thread::lock()
+{
+  pthread_mutex_lock(&m_data->mutex);
+}
+
+void worker_thread::unlock()
+{
+  pthread_mutex_unlock(&m_data->mutex);
+}
+
+void worker_thread::wait(unsigned seconds /* = 0 */)
+{
+  if (!seconds) {
+    pthread_cond_wait(&m_data->cond, &m_data->mutex);
+    return;
+  }
+  struct timeval now;
+  gettimeofday(&now, 0);
+  struct timespec abstime;
+  abstime.tv_sec = now.tv_sec + seconds;
+  abstime.tv_nsec = now.tv_usec * 1000;
+  pthread_cond_timedwait(&m_data->cond, &m_data->mutex, &abstime);
+}
+
+void worker_thread::notify()
+{
+  pthread_cond_broadcast(&m_data->cond);
+}
+
+#else // HAVE_PTHREAD_H
+
+struct worker_thread::thread_data
+{
+};
+
+worker_thread::worker_thread()
+: m_data(0), m_running(false)
+{
+}
+
+worker_thread::~worker_thread()
+{
+}
+
+bool worker_thread::start()
+{
+  return false;
+}
+
+void worker_thread::join()
+{
+}
+
+void worker_thread::lock()
+{
+}
+
+void worker_thread::unlock()
+{
+}
+
+void worker_thread::wait(unsigned /*seconds = 0*/)
+{
+}
+
+void worker_thread::notify()
+{
+}
+
+#endif // HAVE_PTHREAD_H
+
 // Splits an argument to the -r option into a name part and an (optional) 
 // positive integer part.  s is a pointer to a string containing the
 // argument.  After the call, s will point to the name part and *i the
@@ -699,6 +1111,24 @@ bool nonempty(const void * data, int size)
   return false;
 }
 
+// Allocate aligned memory.  The pointer returned by malloc() is saved
+// just below the aligned block.
+void * malloc_aligned(size_t size, size_t align)
+{
+  void * p = malloc(size + align - 1 + sizeof(void *));
+  if (!p)
+    return 0;
+  size_t a = ((size_t)p + sizeof(void *) + align - 1) & ~(align - 1);
+  ((void **)a)[-1] = p;
+  return (void *)a;
+}
+
+void free_aligned(void * ptr)
+{
+  if (ptr)
+    free(((void **)ptr)[-1]);
+}
+
 
 // This routine converts an integer number of milliseconds into a test
 // string of the form Xd+Yh+Zm+Ts.msec.  The resulting text string is
@@ -730,12 +1160,27 @@ void MsecToText(unsigned int msec, char *txt){
 
 // return (v)sprintf() formatted std::string
 
+#ifndef va_copy
+#define va_copy(dst, src) ((dst) = (src))
+#endif
+
 std::string vstrprintf(const char * fmt, va_list ap)
 {
-  char buf[512];
-  vsnprintf(buf, sizeof(buf), fmt, ap);
-  buf[sizeof(buf)-1] = 0;
-  return buf;
+  // Grow buffer until the result fits, a non C99 vsnprintf()
+  // returns -1 if the output was truncated
+  std::vector<char> buf(512);
+  for (;;) {
+    va_list aq; va_copy(aq, ap);
+    int n = vsnprintf(&buf[0], buf.size(), fmt, aq);
+    va_end(aq);
+    if (0 <= n && n < (int)buf.size())
+      return std::string(&buf[0], n);
+    if (buf.size() >= 0x100000) {
+      buf[buf.size()-1] = 0;
+      return &buf[0];
+    }
+    buf.resize(n >= 0 ? n + 1 : 2 * buf.size());
+  }
 }
 
 std::string strprintf(const char * fmt, ...)
@@ -34,6 +34,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <new>
 #include <string>
 
 #if !defined(__GNUC__) && !defined(__attribute__)
@@ -148,6 +149,29 @@ inline bool isbigendian()
 // Runtime check of byte ordering, throws if different from isbigendian().
 void check_endianness();
 
+// Store unsigned integer as SIZE bytes in little endian byte order.
+inline void put_le_uint(unsigned char * p, uint64_t val, int size)
+{
+  for (int i = 0; i < size; i++)
+    p[i] = (unsigned char)(val >> (8*i));
+}
+
+// Load unsigned integer from SIZE bytes in little endian byte order.
+inline uint64_t get_le_uint(const unsigned char * p, int size)
+{
+  uint64_t val = 0;
+  for (int i = size-1; i >= 0; i--)
+    val = (val << 8) | p[i];
+  return val;
+}
+
+// Calculate CRC-32 (IEEE 802.3) of SIZE bytes, continue from CRC.
+unsigned calc_crc32(const void * data, unsigned size, unsigned crc = 0);
+
+// Return time in microseconds for latency measurements and benchmarks.
+// The origin is unspecified, resolution is 1ms on Windows.
+uint64_t get_timer_usec();
+
 // This value follows the peripheral device type value as defined in
 // SCSI Primary Commands, ANSI INCITS 301:1997.  It is also used in
 // the ATA standard for packet devices to define the device type.
@@ -173,17 +197,30 @@ void FixGlibcTimeZoneBug();
 // convert time in msec to a text string
 void MsecToText(unsigned int msec, char *txt);
 
-// Wrapper class for a raw data buffer
+// Alignment of I/O buffers.  A page aligned buffer can be mapped
+// by the OS for DMA instead of being copied to a bounce buffer.
+const unsigned IO_BUFFER_ALIGN = 4096;
+
+// Allocate 'size' bytes aligned to 'align' (a power of 2).
+// Returns 0 if out of memory.  Must be freed by free_aligned().
+void * malloc_aligned(size_t size, size_t align);
+void free_aligned(void * ptr);
+
+// Wrapper class for a raw data buffer, page aligned for I/O.
 class raw_buffer
 {
 public:
   explicit raw_buffer(unsigned sz, unsigned char val = 0)
-    : m_data(new unsigned char[sz]),
+    : m_data((unsigned char *)malloc_aligned(sz, IO_BUFFER_ALIGN)),
       m_size(sz)
-    { memset(m_data, val, m_size); }
+    {
+      if (!m_data)
+        throw std::bad_alloc();
+      memset(m_data, val, m_size);
+    }
 
   ~raw_buffer()
-    { delete [] m_data; }
+    { free_aligned(m_data); }
 
   unsigned size() const
     { return m_size; }
@@ -313,6 +350,99 @@ private:
   bool compile();
 };
 
+/// Base class to run jobs in a bounded number of worker threads.
+/// Jobs are run serially in the calling thread if threads are not
+/// supported or only one thread is requested.
+class parallel_jobs
+{
+public:
+  virtual ~parallel_jobs();
+
+  /// Run job(0) ... job(num_jobs-1) in at most max_threads worker threads.
+  /// Jobs are started in index order.  If 'groups' is specified, at most
+  /// max_per_group jobs with same value groups[index] run concurrently.
+  /// Returns after all jobs are finished.
+  void run(unsigned num_jobs, unsigned max_threads,
+           const int * groups = 0, unsigned max_per_group = 0);
+
+  /// Called from run() to execute one job.
+  virtual void job(unsigned index) = 0;
+
+  /// Return index of job executed by the current worker thread,
+  /// -1 if not called from a worker thread.
+  static int current_job();
+
+  /// Return true if jobs can run in parallel on this platform.
+  static bool is_supported();
+
+  /// Lock/unlock global mutex to protect non-reentrant code in jobs.
+  static void lock();
+  static void unlock();
+};
+
+/// Mutex to protect data shared with worker threads.
+/// Does nothing if threads are not supported.
+class thread_mutex
+{
+public:
+  thread_mutex();
+  ~thread_mutex();
+
+  void lock();
+  void unlock();
+
+private:
+  void * m_mutex;
+
+  thread_mutex(const thread_mutex &);
+  void operator=(const thread_mutex &);
+};
+
+/// Base class for a single background worker thread.
+/// All signals are blocked in the thread, so they are still
+/// delivered to the main thread.
+class worker_thread
+{
+public:
+  worker_thread();
+
+  /// Thread must not be running.
+  virtual ~worker_thread();
+
+  /// Start thread, return false if not supported or failed.
+  bool start();
+
+  /// Wait until run() has returned.
+  void join();
+
+  /// Return true if thread was started and not yet joined.
+  bool is_running() const
+    { return m_running; }
+
+  /// Thread function, called in the worker thread.
+  virtual void run() = 0;
+
+protected:
+  /// Lock/unlock mutex of this object.
+  void lock();
+  void unlock();
+
+  /// Wait for notify(), at most 'seconds' if nonzero.
+  /// Mutex must be locked.
+  void wait(unsigned seconds = 0);
+
+  /// Wake up threads blocked in wait().
+  void notify();
+
+private:
+  struct thread_data;
+  thread_data * m_data;
+  bool m_running;
+
+  worker_thread(const worker_thread &);
+  void operator=(const worker_thread &);
+};
+
 // macros to control printing
 #define PRINT_ON(control)  {if (control->printing_switchable) control->dont_print=false;}
 #define PRINT_OFF(control) {if (control->printing_switchable) control->dont_print=true;}